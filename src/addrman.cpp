@@ -8,6 +8,51 @@
 
 using namespace std;
 
+void CAddrStats::Update(AddrStat stat, int64_t nValue, int64_t nNow)
+{
+    int64_t* pnAverage = NULL;
+
+    switch (stat)
+    {
+        case ADDRSTAT_HANDSHAKE: pnAverage = &nHandshakeUsec; break;
+        case ADDRSTAT_PING:      pnAverage = &nPingUsec;      break;
+        case ADDRSTAT_DELIVERY:  pnAverage = &nBytesPerSec;   break;
+        case ADDRSTAT_BLOCKLAG:  pnAverage = &nBlockLagUsec;  break;
+    }
+
+    if (!pnAverage || nValue < 0)
+        return;
+
+    // Zero means "not measured yet", so a measured zero is stored as one
+    if (*pnAverage == 0)
+        *pnAverage = max(nValue, (int64_t)1);
+    else
+        *pnAverage = max((*pnAverage * (ADDRMAN_STATS_SMOOTHING - 1) + nValue) / ADDRMAN_STATS_SMOOTHING, (int64_t)1);
+
+    nLastUpdate = nNow;
+}
+
+double CAddrStats::GetPerformanceFactor() const
+{
+    double fFactor = 1.0;
+
+    // Each second of round-trip or handshake time and each ten seconds of block lag halve the weight
+    if (nPingUsec)
+        fFactor /= 1.0 + nPingUsec / 1000000.0;
+
+    if (nHandshakeUsec)
+        fFactor /= 1.0 + nHandshakeUsec / 1000000.0;
+
+    if (nBlockLagUsec)
+        fFactor /= 1.0 + nBlockLagUsec / 10000000.0;
+
+    // Delivering ADDRMAN_STATS_REF_DELIVERY bytes per second halves it too, and faster peers lose less
+    if (nBytesPerSec)
+        fFactor /= 1.0 + (double)ADDRMAN_STATS_REF_DELIVERY / nBytesPerSec;
+
+    return max(fFactor, ADDRMAN_MIN_PERF_FACTOR);
+}
+
 int CAddrInfo::GetTriedBucket(const std::vector<unsigned char> &nKey) const
 {
     CDataStream ss1(SER_GETHASH, 0);
@@ -62,7 +107,7 @@ bool CAddrInfo::IsTerrible(int64_t nNow) const
     return false;
 }
 
-double CAddrInfo::GetChance(int64_t nNow) const
+double CAddrInfo::GetChance(double fUnmeasuredFactor, int64_t nNow) const
 {
     double fChance = 1.0;
     int64_t nSinceLastSeen = nNow - nTime;
@@ -84,6 +129,9 @@ double CAddrInfo::GetChance(int64_t nNow) const
     for (int n=0; n < nAttempts; n++)
         fChance /= 1.5;
 
+    // Deprioritize peers we measured as slow
+    fChance *= stats.IsMeasured() ? stats.GetPerformanceFactor() : fUnmeasuredFactor;
+
     return fChance;
 }
 
@@ -412,6 +460,31 @@ void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
     info.nAttempts++;
 }
 
+double CAddrMan::GetMedianPerfFactor_()
+{
+    if (!fMedianPerfFactorStale)
+        return fMedianPerfFactor;
+
+    std::vector<double> vFactors;
+
+    for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    {
+        if (it->second.stats.IsMeasured())
+            vFactors.push_back(it->second.stats.GetPerformanceFactor());
+    }
+
+    fMedianPerfFactor = 1.0;
+
+    if (!vFactors.empty())
+    {
+        std::nth_element(vFactors.begin(), vFactors.begin() + vFactors.size() / 2, vFactors.end());
+        fMedianPerfFactor = vFactors[vFactors.size() / 2];
+    }
+
+    fMedianPerfFactorStale = false;
+    return fMedianPerfFactor;
+}
+
 CAddress CAddrMan::Select_(int nUnkBias)
 {
     if (size() == 0)
@@ -419,6 +492,7 @@ CAddress CAddrMan::Select_(int nUnkBias)
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
+    double fUnmeasuredFactor = GetMedianPerfFactor_();
 
     // Use a tried node
     if ((nCorTried + nCorNew) * GetRandInt(1 << 30) / (1 << 30) < nCorTried)
@@ -438,7 +512,7 @@ CAddress CAddrMan::Select_(int nUnkBias)
             assert(mapInfo.count(vTried[nPos]) == 1);
             CAddrInfo &info = mapInfo[vTried[nPos]];
 
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance()*(1 << 30))
+            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance(fUnmeasuredFactor)*(1 << 30))
                 return info;
 
             fChanceFactor *= 1.2;
@@ -465,7 +539,7 @@ CAddress CAddrMan::Select_(int nUnkBias)
             assert(mapInfo.count(*it) == 1);
             CAddrInfo &info = mapInfo[*it];
 
-            if (GetRandInt(1 << 30) < fChanceFactor*info.GetChance() * (1 << 30))
+            if (GetRandInt(1 << 30) < fChanceFactor*info.GetChance(fUnmeasuredFactor) * (1 << 30))
                 return info;
 
             fChanceFactor *= 1.2;
@@ -607,3 +681,31 @@ void CAddrMan::Connected_(const CService &addr, int64_t nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+void CAddrMan::RecordStat_(const CService &addr, AddrStat stat, int64_t nValue)
+{
+    CAddrInfo *pinfo = Find(addr);
+
+    if (!pinfo)
+        return;
+
+    CAddrInfo &info = *pinfo;
+
+    // Only update the entry for the exact service, not another port on the same host
+    if (info != addr)
+        return;
+
+    info.stats.Update(stat, nValue, GetAdjustedTime());
+    fMedianPerfFactorStale = true;
+}
+
+void CAddrMan::GetStats_(std::vector<std::pair<CAddress, CAddrStats> > &vStats)
+{
+    for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    {
+        const CAddrInfo &info = (*it).second;
+
+        if (info.stats.IsMeasured())
+            vStats.push_back(std::make_pair((const CAddress&)info, info.stats));
+    }
+}
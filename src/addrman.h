@@ -16,6 +16,54 @@
 #include <vector>
 #include <openssl/rand.h>
 
+// Measurements of a peer that are tracked per address
+enum AddrStat
+{
+    ADDRSTAT_HANDSHAKE,           // Time from starting the connection until the version handshake completed
+    ADDRSTAT_PING,                // Ping round-trip time
+    ADDRSTAT_DELIVERY,            // Bytes per second received from the peer while a block asked for was in flight
+    ADDRSTAT_BLOCKLAG,            // Delay of its block announcements behind the first one we saw
+};
+
+// Measured performance of the peer at an address, smoothed over connections. Zero means not measured.
+class CAddrStats
+{
+public:
+    int64_t nHandshakeUsec;
+    int64_t nPingUsec;
+    int64_t nBytesPerSec;
+    int64_t nBlockLagUsec;
+    int64_t nLastUpdate;
+
+    CAddrStats()
+    {
+        nHandshakeUsec = 0;
+        nPingUsec = 0;
+        nBytesPerSec = 0;
+        nBlockLagUsec = 0;
+        nLastUpdate = 0;
+    }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nHandshakeUsec);
+        READWRITE(nPingUsec);
+        READWRITE(nBytesPerSec);
+        READWRITE(nBlockLagUsec);
+        READWRITE(nLastUpdate);
+    )
+
+    bool IsMeasured() const
+    {
+        return nLastUpdate != 0;
+    }
+
+    // Fold a new sample into the moving average of the given statistic
+    void Update(AddrStat stat, int64_t nValue, int64_t nNow);
+
+    // Relative preference for connecting to this peer, between ADDRMAN_MIN_PERF_FACTOR and 1.0
+    double GetPerformanceFactor() const;
+};
+
 // Extended statistics about a CAddress
 class CAddrInfo : public CAddress
 {
@@ -27,6 +75,7 @@ private:
     int nRefCount;                // Reference count in new sets (memory only)
     bool fInTried;                // In tried set? (memory only)
     int nRandomPos;               // Position in vRandom
+    CAddrStats stats;             // Measured performance (serialized separately by CAddrMan)
 
     friend class CAddrMan;
 
@@ -48,6 +97,7 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        stats = CAddrStats();
     }
 
     CAddrInfo(const CAddress &addrIn, const CNetAddr &addrSource) : CAddress(addrIn), source(addrSource)
@@ -75,9 +125,14 @@ public:
     // Determine whether the statistics about this entry are bad enough so that it can just be deleted
     bool IsTerrible(int64_t nNow = GetAdjustedTime()) const;
 
-    // Calculate the relative chance this entry should be given when selecting nodes to connect to
-    double GetChance(int64_t nNow = GetAdjustedTime()) const;
+    // Calculate the relative chance this entry should be given when selecting nodes to connect to. Entries without
+    // measurements get fUnmeasuredFactor for their performance.
+    double GetChance(double fUnmeasuredFactor = 1.0, int64_t nNow = GetAdjustedTime()) const;
 
+    const CAddrStats& GetStats() const
+    {
+        return stats;
+    }
 };
 
 // Stochastic address manager
@@ -105,6 +160,8 @@ public:
 //      be observable by adversaries.
 //    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
 //      consistency checks for the entire data structure.
+//  * Measured peer performance (CAddrStats) only scales the chance of an entry once its bucket has been picked
+//    at random, and never by more than ADDRMAN_MIN_PERF_FACTOR, so it does not weaken the bucketing above.
 
 #define ADDRMAN_TRIED_BUCKET_COUNT 64            // Total number of buckets for tried addresses
 #define ADDRMAN_TRIED_BUCKET_SIZE 64             // Maximum allowed number of entries in buckets for tried addresses
@@ -120,6 +177,9 @@ public:
 #define ADDRMAN_MIN_FAIL_DAYS 7                  // ... in at least this many days
 #define ADDRMAN_GETADDR_MAX_PCT 23               // The maximum percentage of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500                 // The maximum number of nodes to return in a getaddr call
+#define ADDRMAN_MIN_PERF_FACTOR 0.1              // Lowest selection weight given to a measured slow peer
+#define ADDRMAN_STATS_SMOOTHING 4                // Weight of the previous average against a new sample
+#define ADDRMAN_STATS_REF_DELIVERY 65536         // Delivery rate in bytes per second that halves the weight
 
 // Stochastical (IP) address manager
 class CAddrMan
@@ -142,6 +202,11 @@ private:
     // List of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // Performance factor of entries not measured yet, the median of the measured ones, so that an unknown peer is
+    // neither preferred over nor put behind those we know
+    double fMedianPerfFactor;
+    bool fMedianPerfFactorStale;      // Measurements changed since fMedianPerfFactor was worked out
+
 protected:
 
     // Find an entry.
@@ -175,6 +240,9 @@ protected:
     // Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64_t nTime);
 
+    // Return fMedianPerfFactor, working it out again if measurements changed since.
+    double GetMedianPerfFactor_();
+
     // Select an address to connect to.
     // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
     CAddress Select_(int nUnkBias);
@@ -190,9 +258,15 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // Record a performance measurement of an entry.
+    void RecordStat_(const CService &addr, AddrStat stat, int64_t nValue);
+
+    // Return all entries with performance measurements.
+    void GetStats_(std::vector<std::pair<CAddress, CAddrStats> > &vStats);
+
 public:
     // Serialized format:
-    // * version byte (currently 0)
+    // * version byte (currently 1)
     // * nKey
     // * nNew
     // * nTried
@@ -202,6 +276,10 @@ public:
     // * for each bucket:
     //   * number of elements
     //   * for each element: index
+    // * (version 1) the CAddrStats of all nNew and then all nTried addrinfos, in the order above
+    //
+    // The statistics come last so that older versions, which stop reading after the buckets,
+    // can still load the file.
     //
     // Notice that vvTried, mapAddr and vVector are never encoded explicitly;
     // they are instead reconstructed from the other information.
@@ -217,7 +295,7 @@ public:
     template<typename Stream> void Serialize(Stream &s, int nType, int nVersionDummy) const
     {
         LOCK(cs);
-        unsigned char nVersion = 0;
+        unsigned char nVersion = 1;
 
         s << nVersion;
         s << nKey;
@@ -228,6 +306,7 @@ public:
         s << nUBuckets;
 
         std::map<int, int> mapUnkIds;
+        std::vector<const CAddrStats*> vStats;
         int nIds = 0;
 
         for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
@@ -241,6 +320,7 @@ public:
             if (info.nRefCount)
             {
                 s << info;
+                vStats.push_back(&info.stats);
                 nIds++;
             }
         }
@@ -257,6 +337,7 @@ public:
             if (info.fInTried)
             {
                 s << info;
+                vStats.push_back(&info.stats);
                 nIds++;
             }
         }
@@ -274,6 +355,9 @@ public:
                 s << nIndex;
             }
         }
+
+        for (std::vector<const CAddrStats*>::const_iterator it = vStats.begin(); it != vStats.end(); it++)
+            s << *(*it);
     }
 
     template<typename Stream> void Unserialize(Stream& s, int nType, int nVersionDummy)
@@ -293,6 +377,7 @@ public:
         mapInfo.clear();
         mapAddr.clear();
         vRandom.clear();
+        fMedianPerfFactorStale = true;
 
         vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
         vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
@@ -315,6 +400,9 @@ public:
         nIdCount = nNew;
         int nLost = 0;
 
+        // Ids of the tried entries in file order, -1 for entries that did not fit
+        std::vector<int> vTriedIds;
+
         for (int n = 0; n < nTried; n++)
         {
             CAddrInfo info;
@@ -329,10 +417,14 @@ public:
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
                 vTried.push_back(nIdCount);
+                vTriedIds.push_back(nIdCount);
                 nIdCount++;
             }
             else
+            {
+                vTriedIds.push_back(-1);
                 nLost++;
+            }
         }
 
         nTried -= nLost;
@@ -356,6 +448,21 @@ public:
                 }
             }
         }
+
+        if (nVersion >= 1)
+        {
+            for (int n = 0; n < nNew; n++)
+                s >> mapInfo[n].stats;
+
+            for (std::vector<int>::const_iterator it = vTriedIds.begin(); it != vTriedIds.end(); it++)
+            {
+                CAddrStats stats;
+                s >> stats;
+
+                if (*it >= 0)
+                    mapInfo[*it].stats = stats;
+            }
+        }
     }
 
     unsigned int GetSerializeSize(int nType, int nVersion) const
@@ -371,6 +478,8 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         fMedianPerfFactor = 1.0;
+         fMedianPerfFactorStale = false;
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -504,6 +613,40 @@ public:
             Check();
         }
     }
+
+    // Record a performance measurement of the peer at an address.
+    void RecordStat(const CService &addr, AddrStat stat, int64_t nValue)
+    {
+        {
+            LOCK(cs);
+            RecordStat_(addr, stat, nValue);
+        }
+    }
+
+    // Return the performance measurements of an address, or empty statistics if it is unknown.
+    CAddrStats GetStats(const CNetAddr &addr)
+    {
+        LOCK(cs);
+        CAddrInfo *pinfo = Find(addr);
+
+        if (!pinfo)
+            return CAddrStats();
+
+        return pinfo->stats;
+    }
+
+    // Return all addresses with performance measurements.
+    std::vector<std::pair<CAddress, CAddrStats> > GetStats()
+    {
+        std::vector<std::pair<CAddress, CAddrStats> > vStats;
+
+        {
+            LOCK(cs);
+            GetStats_(vStats);
+        }
+
+        return vStats;
+    }
 };
 
 #endif
@@ -254,6 +254,44 @@ template<typename T> struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+// Allocator for serialization buffers. Clears its contents before deletion unless it was
+// constructed for public data such as network payloads, where the cleanse is pure overhead.
+// All instances allocate from the same heap, so they compare equal and buffers may be swapped
+// freely between containers; the zeroing policy always follows the container doing the free.
+template<typename T> struct optional_zero_after_free_allocator : public std::allocator<T>
+{
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+
+    explicit optional_zero_after_free_allocator(bool fZeroIn = true) throw() : fZero(fZeroIn) { }
+    optional_zero_after_free_allocator(const optional_zero_after_free_allocator& a) throw() : base(a), fZero(a.fZero) { }
+    template <typename U> optional_zero_after_free_allocator(const optional_zero_after_free_allocator<U>& a) throw() :
+        base(a), fZero(a.fZero) { }
+    ~optional_zero_after_free_allocator() throw() { }
+
+    template<typename _Other> struct rebind
+    {
+        typedef optional_zero_after_free_allocator<_Other> other;
+    };
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (p != NULL && fZero)
+            OPENSSL_cleanse(p, sizeof(T) * n);
+
+        std::allocator<T>::deallocate(p, n);
+    }
+
+    bool fZero;
+};
+
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
 #endif
@@ -31,6 +31,17 @@ nFlags(nFlagsIn)
 {
 }
 
+// Private constructor used by CRollingBloomFilter
+CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn) :
+vData((unsigned int)(-1  / LN2SQUARED * nElements * log(nFPRate)) / 8),
+isFull(false),
+isEmpty(true),
+nHashFuncs((unsigned int)(vData.size() * 8 / nElements * LN2)),
+nTweak(nTweakIn),
+nFlags(BLOOM_UPDATE_NONE)
+{
+}
+
 inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
@@ -94,6 +105,13 @@ bool CBloomFilter::contains(const uint256& hash) const
     return contains(data);
 }
 
+void CBloomFilter::clear()
+{
+    vData.assign(vData.size(), 0);
+    isFull = false;
+    isEmpty = true;
+}
+
 bool CBloomFilter::IsWithinSizeConstraints() const
 {
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
@@ -180,3 +198,74 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate, unsigned int nTweak) :
+b1(nElements * 2, fpRate, nTweak), b2(nElements * 2, fpRate, nTweak)
+{
+    // Implemented using two bloom filters of 2 * nElements each.
+    // We fill them up, and clear them, staggered, every nElements
+    // inserted, so at least one always contains the last nElements
+    // inserted.
+    nBloomSize = nElements * 2;
+    nInsertions = 0;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    if (nInsertions == 0)
+        b1.clear();
+    else if (nInsertions == nBloomSize / 2)
+        b2.clear();
+
+    b1.insert(vKey);
+    b2.insert(vKey);
+
+    if (++nInsertions == nBloomSize)
+        nInsertions = 0;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    insert(data);
+}
+
+// The inventory type is part of the key, as a transaction and its lock request share a hash
+static vector<unsigned char> InvKey(const CInv& inv)
+{
+    vector<unsigned char> data(sizeof(inv.type) + sizeof(inv.hash));
+    memcpy(&data[0], &inv.type, sizeof(inv.type));
+    memcpy(&data[sizeof(inv.type)], inv.hash.begin(), sizeof(inv.hash));
+    return data;
+}
+
+void CRollingBloomFilter::insert(const CInv& inv)
+{
+    insert(InvKey(inv));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    if (nInsertions < nBloomSize / 2)
+        return b2.contains(vKey);
+
+    return b1.contains(vKey);
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    return contains(data);
+}
+
+bool CRollingBloomFilter::contains(const CInv& inv) const
+{
+    return contains(InvKey(inv));
+}
+
+void CRollingBloomFilter::clear()
+{
+    nInsertions = 0;
+    b1.clear();
+    b2.clear();
+}
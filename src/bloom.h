@@ -11,6 +11,7 @@
 
 class COutPoint;
 class CTransaction;
+class CInv;
 
 // 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -50,6 +51,10 @@ private:
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
 
+    // Private constructor for CRollingBloomFilter, no restrictions on size
+    CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
+    friend class CRollingBloomFilter;
+
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
     // Note that if the given parameters will result in a filter outside the bounds of the protocol limits,
@@ -77,6 +82,8 @@ public:
     bool contains(const COutPoint& outpoint) const;
     bool contains(const uint256& hash) const;
 
+    void clear();
+
     // True if the size is <= MAX_BLOOM_FILTER_SIZE and the number of hash functions is <= MAX_HASH_FUNCS
     // (catch a filter which was just deserialized which was too big)
     bool IsWithinSizeConstraints() const;
@@ -86,6 +93,41 @@ public:
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
+
+    // Approximate heap memory used by the filter
+    size_t DynamicMemoryUsage() const { return vData.capacity(); }
+};
+
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive rate.
+ *
+ * contains(item) will always return true if item was one of the last N things
+ * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * Unlike mruset it needs no per-item allocations, so it is used to track inventory
+ * known to each peer and recently rejected transactions.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    void insert(const CInv& inv);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    void clear();
+
+    size_t DynamicMemoryUsage() const { return b1.DynamicMemoryUsage() + b2.DynamicMemoryUsage(); }
+
+private:
+    unsigned int nBloomSize;
+    unsigned int nInsertions;
+    CBloomFilter b1, b2;
 };
 
 #endif /* BITCOIN_BLOOM_H */
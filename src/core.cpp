@@ -32,7 +32,7 @@ CInPoint::CInPoint() {
     SetNull();
 }
 
-CInPoint::CInPoint(CTransaction* ptxIn, unsigned int nIn) {
+CInPoint::CInPoint(const CTransaction* ptxIn, unsigned int nIn) {
     ptx = ptxIn; n = nIn;
 }
 
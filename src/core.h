@@ -45,11 +45,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint();
-    CInPoint(CTransaction* ptxIn, unsigned int nIn);
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn);
 
     void SetNull();
     bool IsNull() const;
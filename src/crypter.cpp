@@ -6,6 +6,7 @@
 
 #include "script.h"
 #include "scrypt.h"
+#include "util.h"
 
 #include <string>
 #include <vector>
@@ -142,6 +143,37 @@ bool DecryptSecret(const CKeyingMaterial& vMasterKey, const std::vector<unsigned
     return cKeyCrypter.Decrypt(vchCiphertext, *((CKeyingMaterial*)&vchPlaintext));
 }
 
+unsigned int CalibrateDeriveIterations(const SecureString& strKeyData, const std::vector<unsigned char>& chSalt,
+                                       const unsigned int nDerivationMethod, int64_t nTargetMs)
+{
+    CCrypter crypter;
+    uint64_t nRounds = WALLET_MIN_DERIVE_ITERATIONS;
+    int64_t nElapsed = 0;
+
+    // Time enough rounds for the clock to tell, fast machines do the minimum in no time
+    while (true)
+    {
+        int64_t nStartTime = GetTimeMillis();
+        crypter.SetKeyFromPassphrase(strKeyData, chSalt, nRounds, nDerivationMethod);
+        nElapsed = GetTimeMillis() - nStartTime;
+
+        if (nElapsed >= 10 || nRounds * 2 > std::numeric_limits<unsigned int>::max())
+            break;
+
+        nRounds *= 2;
+    }
+
+    nRounds = std::min<uint64_t>(nRounds * nTargetMs / std::max<int64_t>(nElapsed, 1), std::numeric_limits<unsigned int>::max());
+
+    // Then refine the estimate at about the target
+    int64_t nStartTime = GetTimeMillis();
+    crypter.SetKeyFromPassphrase(strKeyData, chSalt, nRounds, nDerivationMethod);
+    nElapsed = std::max<int64_t>(GetTimeMillis() - nStartTime, 1);
+    nRounds = std::min<uint64_t>((nRounds + nRounds * nTargetMs / nElapsed) / 2, std::numeric_limits<unsigned int>::max());
+
+    return std::max<uint64_t>(nRounds, WALLET_MIN_DERIVE_ITERATIONS);
+}
+
 // General secure AES 256 CBC encryption routine
 bool EncryptAES256(const SecureString& sKey, const SecureString& sPlaintext, const std::string& sIV, std::string& sCiphertext)
 {
@@ -228,12 +260,29 @@ bool CCryptoKeyStore::LockKeyStore()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        setVerifiedKeys.clear();
     }
 
     NotifyStatusChanged(this);
     return true;
 }
 
+// Decrypt a crypted key and, unless it was found good before, check it against its public key
+static bool DecryptKey(const CKeyingMaterial& vMasterKey, const CPubKey& vchPubKey,
+                       const std::vector<unsigned char>& vchCryptedSecret, bool fVerify, CKey& keyOut)
+{
+    CKeyingMaterial vchSecret;
+
+    if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+        return false;
+
+    if (vchSecret.size() != 32)
+        return false;
+
+    keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    return !fVerify || keyOut.GetPubKey() == vchPubKey;
+}
+
 bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
 {
     {
@@ -241,22 +290,29 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (!SetCrypted())
             return false;
 
-        CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
+        // A wrong master key fails on the first key already. The rest of the sample is spread over the wallet to
+        // catch a damaged one early, without decrypting every key before the wallet can be used.
+        setVerifiedKeys.clear();
+        unsigned int nStep = std::max<unsigned int>(mapCryptedKeys.size() / WALLET_UNLOCK_KEY_SAMPLE, 1);
+        unsigned int i = 0;
+
+        for (CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
+             mi != mapCryptedKeys.end() && setVerifiedKeys.size() < WALLET_UNLOCK_KEY_SAMPLE; ++mi, ++i)
         {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if(!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-                return false;
-            if (vchSecret.size() != 32)
-                return false;
+            // Keys paid to stealth addresses have no secret until it is worked out after unlocking
+            if (i % nStep != 0 || (*mi).second.second.empty())
+                continue;
+
             CKey key;
-            key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
-            if (key.GetPubKey() == vchPubKey)
-                break;
-            return false;
+            if (!DecryptKey(vMasterKeyIn, (*mi).second.first, (*mi).second.second, true, key))
+            {
+                setVerifiedKeys.clear();
+                return false;
+            }
+
+            setVerifiedKeys.insert((*mi).first);
         }
+
         vMasterKey = vMasterKeyIn;
     }
     NotifyStatusChanged(this);
@@ -307,14 +363,20 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
         {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+            if ((*mi).second.second.empty())
                 return false;
-            if (vchSecret.size() != 32)
+
+            bool fVerify = !setVerifiedKeys.count(address);
+
+            if (!DecryptKey(vMasterKey, (*mi).second.first, (*mi).second.second, fVerify, keyOut))
+            {
+                LogPrintf("CCryptoKeyStore::GetKey : key %s does not decrypt to its public key\n", address.ToString());
                 return false;
-            keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+            }
+
+            if (fVerify)
+                setVerifiedKeys.insert(address);
+
             return true;
         }
     }
@@ -12,6 +12,13 @@
 const unsigned int WALLET_CRYPTO_KEY_SIZE = 32;
 const unsigned int WALLET_CRYPTO_SALT_SIZE = 8;
 
+/** Fewest rounds of key derivation a master key is encrypted with */
+const unsigned int WALLET_MIN_DERIVE_ITERATIONS = 25000;
+/** Time deriving the master key from the passphrase is calibrated to take, in milliseconds */
+const int64_t WALLET_DERIVE_TARGET_MS = 100;
+/** Crypted keys checked against their public key on unlock, the others are checked when first used */
+const unsigned int WALLET_UNLOCK_KEY_SAMPLE = 16;
+
 /*
 Private key encryption is done based on a CMasterKey,
 which holds a salt and random encryption key.
@@ -125,6 +132,10 @@ public:
 bool EncryptSecret(const CKeyingMaterial& vMasterKey, const CKeyingMaterial &vchPlaintext, const uint256& nIV, std::vector<unsigned char> &vchCiphertext);
 bool DecryptSecret(const CKeyingMaterial& vMasterKey, const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext);
 
+// Rounds of key derivation from a passphrase that take about nTargetMs on this machine
+unsigned int CalibrateDeriveIterations(const SecureString& strKeyData, const std::vector<unsigned char>& chSalt,
+                                       const unsigned int nDerivationMethod, int64_t nTargetMs);
+
 bool EncryptAES256(const SecureString& sKey, const SecureString& sPlaintext, const std::string& sIV, std::string& sCiphertext);
 bool DecryptAES256(const SecureString& sKey, const std::string& sCiphertext, const std::string& sIV, SecureString& sPlaintext);
 
@@ -142,6 +153,9 @@ protected:
     CryptedKeyMap mapCryptedKeys;
     CKeyingMaterial vMasterKey;
 
+    // Keys found to decrypt to their public key since the wallet was unlocked
+    mutable std::set<CKeyID> setVerifiedKeys;
+
     bool SetCrypted();
 
     // will encrypt previously unencrypted keys
@@ -480,59 +480,10 @@ int randomizeList (int i)
     return std::rand() % i;
 }
 
-// Recursively determine the rounds of a given input (How deep is the darksend chain for a given input)
+// Determine the rounds of a given input (How deep is the darksend chain for a given input)
 int GetInputDarksendRounds(CTxIn in, int rounds)
 {
-    if (rounds >= 17)
-        return rounds;
-
-    std::string padding = "";
-    padding.insert(0, ((rounds + 1) * 5) + 3, ' ');
-    CWalletTx tx;
-
-    if (pwalletMain->GetTransaction(in.prevout.hash, tx))
-    {
-        // Bounds check
-        if (in.prevout.n >= tx.vout.size())
-            return -4;
-
-        if (tx.vout[in.prevout.n].nValue == DARKSEND_FEE)
-            return -3;
-
-        // Make sure the final output is non-denominate
-        if (rounds == 0 && !pwalletMain->IsDenominatedAmount(tx.vout[in.prevout.n].nValue))
-            return -2;
-
-        bool found = false;
-
-        BOOST_FOREACH(CTxOut out, tx.vout)
-        {
-            found = pwalletMain->IsDenominatedAmount(out.nValue);
-
-            if (found)
-                break;
-        }
-
-        if (!found)
-            return rounds - 1;
-
-        // Find my vin and look that up
-        BOOST_FOREACH(CTxIn in2, tx.vin)
-        {
-            if (pwalletMain->IsMine(in2))
-            {
-                if (fDebug)
-                    LogPrintf("rounds :: %s %s %d NEXT\n", padding.c_str(), in.ToString().c_str(), rounds);
-
-                int n = GetInputDarksendRounds(in2, rounds + 1);
-
-                if (n != -3)
-                    return n;
-            }
-        }
-    }
-
-    return rounds - 1;
+    return pwalletMain->GetInputDarksendRounds(in.prevout, rounds);
 }
 
 void CDarkSendPool::Reset()
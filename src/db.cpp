@@ -15,6 +15,8 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/version.hpp>
+#include <leveldb/env.h>
+#include <memenv/memenv.h>
 #include <openssl/rand.h>
 
 using namespace std;
@@ -30,6 +32,17 @@ void CDBEnv::EnvShutdown()
         return;
 
     fDbEnvInit = false;
+
+    for (map<string, leveldb::DB*>::iterator it = mapLogDb.begin(); it != mapLogDb.end(); ++it)
+    {
+        SyncLogStore((*it).first);
+        delete (*it).second;
+    }
+
+    mapLogDb.clear();
+    delete penvLogMock;
+    penvLogMock = NULL;
+
     int ret = dbenv.close(0);
 
     if (ret != 0)
@@ -43,6 +56,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    penvLogMock = NULL;
 }
 
 CDBEnv::~CDBEnv()
@@ -214,13 +228,14 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
 
-    if (fMockDb)
+    if (fMockDb || IsLogStore(strFile))
         return;
 
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL), plog(NULL),
+                                                                 activeBatch(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -241,6 +256,30 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
+
+        if (bitdb.IsLogStore(strFile))
+        {
+            plog = bitdb.OpenLogStore(strFile, fCreate);
+
+            if (plog == NULL)
+            {
+                --bitdb.mapFileUseCount[strFile];
+                strFile = "";
+
+                throw runtime_error(strprintf("CDB : can't open log store for %s", strFilename));
+            }
+
+            if (fCreate && !Exists(string("version")))
+            {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+
+            return;
+        }
+
         pdb = bitdb.mapDb[strFile];
 
         if (pdb == NULL)
@@ -287,6 +326,18 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
 void CDB::Close()
 {
+    if (plog)
+    {
+        if (activeBatch)
+            TxnAbort();
+
+        plog = NULL;
+
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return;
+    }
+
     if (!pdb)
         return;
 
@@ -314,6 +365,15 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        map<string, leveldb::DB*>::iterator mi = mapLogDb.find(strFile);
+
+        if (mi != mapLogDb.end())
+        {
+            SyncLogStore(strFile);
+            delete (*mi).second;
+            mapLogDb.erase(mi);
+            return;
+        }
 
         if (mapDb[strFile] != NULL)
         {
@@ -327,13 +387,433 @@ void CDBEnv::CloseDb(const string& strFile)
 
 bool CDBEnv::RemoveDb(const string& strFile)
 {
+    bool fLogStore = IsLogStore(strFile);
     this->CloseDb(strFile);
     LOCK(cs_db);
+
+    if (fLogStore)
+    {
+        if (fMockDb)
+        {
+            leveldb::Options options;
+            options.env = penvLogMock;
+            return leveldb::DestroyDB(strFile, options).ok();
+        }
+
+        boost::system::error_code ec;
+        filesystem::remove_all(GetLogStorePath(strFile), ec);
+        return !ec;
+    }
+
     int rc = dbenv.dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
 
     return rc == 0;
 }
 
+boost::filesystem::path CDBEnv::GetLogStorePath(const std::string& strFile) const
+{
+    return pathEnv / (strFile + ".logdb");
+}
+
+bool CDBEnv::IsLogStore(const std::string& strFile)
+{
+    LOCK(cs_db);
+
+    if (mapLogDb.count(strFile))
+        return true;
+
+    if (fMockDb)
+        return false;
+
+    return filesystem::is_directory(GetLogStorePath(strFile));
+}
+
+leveldb::DB* CDBEnv::OpenLogStore(const std::string& strFile, bool fCreate)
+{
+    LOCK(cs_db);
+    map<string, leveldb::DB*>::iterator mi = mapLogDb.find(strFile);
+
+    if (mi != mapLogDb.end())
+        return (*mi).second;
+
+    leveldb::Options options;
+    options.create_if_missing = fCreate;
+    options.paranoid_checks = true;
+
+    if (fMockDb)
+    {
+        if (!penvLogMock)
+            penvLogMock = leveldb::NewMemEnv(leveldb::Env::Default());
+
+        options.env = penvLogMock;
+    }
+
+    leveldb::DB* plog = NULL;
+    leveldb::Status status = leveldb::DB::Open(options, fMockDb ? strFile : GetLogStorePath(strFile).string(), &plog);
+
+    if (!status.ok())
+    {
+        LogPrintf("CDBEnv::OpenLogStore() : error opening %s: %s\n", strFile, status.ToString());
+        return NULL;
+    }
+
+    mapLogDb[strFile] = plog;
+    return plog;
+}
+
+// Writes are not synced as they are made, as with DB_TXN_WRITE_NOSYNC on Berkeley DB. This commits all of them
+// to disk at once.
+bool CDBEnv::SyncLogStore(const std::string& strFile)
+{
+    LOCK(cs_db);
+    map<string, leveldb::DB*>::iterator mi = mapLogDb.find(strFile);
+
+    if (mi == mapLogDb.end())
+        return false;
+
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::WriteBatch batch;
+    leveldb::Status status = (*mi).second->Write(options, &batch);
+
+    if (!status.ok())
+        return error("CDBEnv::SyncLogStore() : %s", status.ToString());
+
+    return true;
+}
+
+class CLogBatchScanner : public leveldb::WriteBatch::Handler
+{
+public:
+    std::string needle;
+    std::string* foundValue;
+    bool foundEntry;
+
+    CLogBatchScanner() : foundEntry(false) { }
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        if (key.ToString() == needle)
+        {
+            foundEntry = true;
+            *foundValue = value.ToString();
+        }
+    }
+
+    virtual void Delete(const leveldb::Slice& key)
+    {
+        if (key.ToString() == needle)
+            foundEntry = false;
+    }
+};
+
+bool CDB::ReadLog(const CDataStream& ssKey, std::string& strValue)
+{
+    std::string strKey = ssKey.str();
+
+    // Reads within a transaction see its own writes, as they do on Berkeley DB
+    if (activeBatch)
+    {
+        std::map<std::string, bool>::const_iterator mi = mapBatchKeys.find(strKey);
+
+        if (mi != mapBatchKeys.end())
+        {
+            if ((*mi).second)
+                return false;
+
+            CLogBatchScanner scanner;
+            scanner.needle = strKey;
+            scanner.foundValue = &strValue;
+
+            return activeBatch->Iterate(&scanner).ok() && scanner.foundEntry;
+        }
+    }
+
+    leveldb::ReadOptions options;
+    options.verify_checksums = true;
+    leveldb::Status status = plog->Get(options, strKey, &strValue);
+
+    if (!status.ok())
+    {
+        if (!status.IsNotFound())
+            LogPrintf("CDB::ReadLog() : %s\n", status.ToString());
+
+        return false;
+    }
+
+    return true;
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    std::string strUnused;
+
+    if (!fOverwrite && ReadLog(ssKey, strUnused))
+        return false;
+
+    if (activeBatch)
+    {
+        activeBatch->Put(ssKey.str(), ssValue.str());
+        mapBatchKeys[ssKey.str()] = false;
+        return true;
+    }
+
+    leveldb::Status status = plog->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
+
+    if (!status.ok())
+        return error("CDB::WriteLog() : %s", status.ToString());
+
+    return true;
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    if (activeBatch)
+    {
+        activeBatch->Delete(ssKey.str());
+        mapBatchKeys[ssKey.str()] = true;
+        return true;
+    }
+
+    leveldb::Status status = plog->Delete(leveldb::WriteOptions(), ssKey.str());
+
+    if (!status.ok())
+        return error("CDB::EraseLog() : %s", status.ToString());
+
+    return true;
+}
+
+int CDB::ReadAtLogCursor(CDBCursor& cursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    leveldb::Iterator* piter = cursor.piter;
+
+    if (fFlags == DB_SET_RANGE)
+        piter->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+    else if (fFlags != DB_NEXT)
+        return 99999;
+    else if (cursor.fStarted)
+        piter->Next();
+    else
+        piter->SeekToFirst();
+
+    cursor.fStarted = true;
+
+    if (!piter->Valid())
+        return piter->status().ok() ? DB_NOTFOUND : 99999;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(piter->key().data(), piter->key().size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(piter->value().data(), piter->value().size());
+
+    return 0;
+}
+
+bool CDB::TxnCommit()
+{
+    if (plog)
+    {
+        if (!activeBatch)
+            return false;
+
+        leveldb::Status status = plog->Write(leveldb::WriteOptions(), activeBatch);
+        delete activeBatch;
+        activeBatch = NULL;
+        mapBatchKeys.clear();
+
+        if (!status.ok())
+            return error("CDB::TxnCommit() : %s", status.ToString());
+
+        return true;
+    }
+
+    if (!pdb || !activeTxn)
+        return false;
+
+    int ret = activeTxn->commit(0);
+    activeTxn = NULL;
+
+    return ret == 0;
+}
+
+// The log store compacts itself as it goes, so a rewrite only has to drop the records to skip
+bool CDB::RewriteLogStore(const string& strFile, const char* pszSkip)
+{
+    LOCK(bitdb.cs_db);
+    leveldb::DB* plog = bitdb.OpenLogStore(strFile, false);
+
+    if (!plog)
+        return false;
+
+    LogPrintf("Rewriting %s...\n", strFile);
+    leveldb::WriteBatch batch;
+    leveldb::Iterator* piter = plog->NewIterator(leveldb::ReadOptions());
+
+    if (pszSkip)
+    {
+        for (piter->Seek(pszSkip); piter->Valid() && piter->key().starts_with(pszSkip); piter->Next())
+            batch.Delete(piter->key());
+    }
+
+    bool fSuccess = piter->status().ok();
+    delete piter;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssKey << string("version");
+    ssValue << CLIENT_VERSION;
+    batch.Put(ssKey.str(), ssValue.str());
+
+    leveldb::WriteOptions options;
+    options.sync = true;
+
+    if (fSuccess)
+        fSuccess = plog->Write(options, &batch).ok();
+
+    if (fSuccess)
+        plog->CompactRange(NULL, NULL);
+    else
+        LogPrintf("Rewriting of %s FAILED!\n", strFile);
+
+    return fSuccess;
+}
+
+// Copies every record of a Berkeley DB file into a new log store, and puts the old file aside once the copy is
+// complete. The store is built under a temporary name, so an interrupted migration leaves the old file in use.
+bool CDB::MigrateToLogStore(const string& strFile)
+{
+    while (true)
+    {
+        {
+            LOCK(bitdb.cs_db);
+
+            if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0)
+            {
+                if (bitdb.IsLogStore(strFile))
+                    return true;
+
+                if (bitdb.IsMock())
+                    return false;
+
+                LogPrintf("Migrating %s to the log store...\n", strFile);
+                int64_t nStart = GetTimeMillis();
+                filesystem::path pathStore = bitdb.GetLogStorePath(strFile);
+                filesystem::path pathTmp(pathStore.string() + ".tmp");
+                filesystem::remove_all(pathTmp);
+
+                leveldb::Options options;
+                options.create_if_missing = true;
+                options.error_if_exists = true;
+                options.paranoid_checks = true;
+                leveldb::DB* plog = NULL;
+                leveldb::Status status = leveldb::DB::Open(options, pathTmp.string(), &plog);
+
+                if (!status.ok())
+                    return error("CDB::MigrateToLogStore() : error creating %s: %s", pathTmp.string(), status.ToString());
+
+                bool fSuccess = true;
+                unsigned int nRecords = 0;
+
+                {
+                    CDB db(strFile.c_str(), "r");
+                    CDBCursor cursor;
+                    leveldb::WriteBatch batch;
+                    fSuccess = db.GetCursor(cursor);
+
+                    while (fSuccess)
+                    {
+                        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                        int ret = db.ReadAtCursor(cursor, ssKey, ssValue, DB_NEXT);
+
+                        if (ret == DB_NOTFOUND)
+                            break;
+                        else if (ret != 0)
+                        {
+                            fSuccess = false;
+                            break;
+                        }
+
+                        batch.Put(ssKey.str(), ssValue.str());
+
+                        if (++nRecords % LOG_STORE_MIGRATE_BATCH == 0)
+                        {
+                            fSuccess = plog->Write(leveldb::WriteOptions(), &batch).ok();
+                            batch.Clear();
+                        }
+                    }
+
+                    cursor.close();
+                    leveldb::WriteOptions writeOptions;
+                    writeOptions.sync = true;
+
+                    if (fSuccess)
+                        fSuccess = plog->Write(writeOptions, &batch).ok();
+                }
+
+                // Read everything back before the old file is put aside
+                if (fSuccess)
+                {
+                    leveldb::ReadOptions readOptions;
+                    readOptions.verify_checksums = true;
+                    leveldb::Iterator* piter = plog->NewIterator(readOptions);
+                    unsigned int nRead = 0;
+
+                    for (piter->SeekToFirst(); piter->Valid(); piter->Next())
+                        nRead++;
+
+                    fSuccess = piter->status().ok() && nRead == nRecords;
+                    delete piter;
+                }
+
+                delete plog;
+
+                if (fSuccess)
+                {
+                    bitdb.CloseDb(strFile);
+                    bitdb.CheckpointLSN(strFile);
+                    bitdb.mapFileUseCount.erase(strFile);
+
+                    try
+                    {
+                        filesystem::rename(pathTmp, pathStore);
+                    }
+                    catch (const filesystem::filesystem_error& e)
+                    {
+                        LogPrintf("CDB::MigrateToLogStore() : %s\n", e.what());
+                        fSuccess = false;
+                    }
+                }
+
+                if (!fSuccess)
+                {
+                    filesystem::remove_all(pathTmp);
+                    LogPrintf("Migration of %s FAILED!\n", strFile);
+                    return false;
+                }
+
+                // The log store is used from now on whether or not this works, the old file is only kept as a backup
+                std::string strBackup = strprintf("%s.%d.bdb", strFile, GetTime());
+
+                if (bitdb.dbenv.dbrename(NULL, strFile.c_str(), NULL, strBackup.c_str(), DB_AUTO_COMMIT) == 0)
+                    LogPrintf("Renamed %s to %s\n", strFile, strBackup);
+                else
+                    LogPrintf("Failed to rename %s to %s\n", strFile, strBackup);
+
+                LogPrintf("Migrated %u records of %s in %dms\n", nRecords, strFile, GetTimeMillis() - nStart);
+                return true;
+            }
+        }
+
+        MilliSleep(100);
+    }
+
+    return false;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (true)
@@ -343,6 +823,9 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 
             if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0)
             {
+                if (bitdb.IsLogStore(strFile))
+                    return RewriteLogStore(strFile, pszSkip);
+
                 // Flush log data to the dat file
                 bitdb.CloseDb(strFile);
                 bitdb.CheckpointLSN(strFile);
@@ -356,7 +839,8 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                     CDB db(strFile.c_str(), "r");
                     Db* pdbCopy = new Db(&bitdb.dbenv, 0);
                     int ret = pdbCopy->open(NULL,  strFileRes.c_str(), "main", DB_BTREE, DB_CREATE, 0);
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor cursor;
+                    bool fCursor = db.GetCursor(cursor);
 
                     if (ret > 0)
                     {
@@ -364,22 +848,22 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    if (pcursor)
+                    if (fCursor)
                     {
                         while (fSuccess)
                         {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
                             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-                            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+                            int ret = db.ReadAtCursor(cursor, ssKey, ssValue, DB_NEXT);
 
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                cursor.close();
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                cursor.close();
                                 fSuccess = false;
                                 break;
                             }
@@ -467,7 +951,7 @@ void CDBEnv::Flush(bool fShutdown)
                 dbenv.txn_checkpoint(0, 0, 0);
                 LogPrint("db", "%s detach\n", strFile);
 
-                if (!fMockDb)
+                if (!fMockDb && !IsLogStore(strFile))
                     dbenv.lsn_reset(strFile.c_str(), 0);
 
                 LogPrint("db", "%s closed\n", strFile);
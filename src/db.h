@@ -16,6 +16,8 @@
 #include <vector>
 #include <boost/filesystem/path.hpp>
 #include <db_cxx.h>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
 
 class CAddrMan;
 class CBlockLocator;
@@ -26,6 +28,11 @@ class CTxIndex;
 
 extern unsigned int nWalletDBUpdated;
 
+/** Default store for new wallet files, "bdb" or "log" */
+static const char* const DEFAULT_WALLET_STORE = "bdb";
+/** Records copied per batch when migrating a wallet to the log store */
+static const unsigned int LOG_STORE_MIGRATE_BATCH = 1000;
+
 void ThreadFlushWalletDB(const std::string& strWalletFile);
 
 class CDBEnv
@@ -35,6 +42,7 @@ private:
     bool fMockDb;
     boost::filesystem::path pathEnv;
     std::string strPath;
+    leveldb::Env* penvLogMock;
 
     void EnvShutdown();
 
@@ -44,6 +52,10 @@ public:
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
 
+    // Files kept in the log store instead: a LevelDB directory named after the file, whose log is checksummed
+    // and written in batches. They stay open for as long as the environment does, and flushing only syncs them.
+    std::map<std::string, leveldb::DB*> mapLogDb;
+
     CDBEnv();
     ~CDBEnv();
     void MakeMock();
@@ -73,6 +85,11 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    boost::filesystem::path GetLogStorePath(const std::string& strFile) const;
+    bool IsLogStore(const std::string& strFile);
+    leveldb::DB* OpenLogStore(const std::string& strFile, bool fCreate);
+    bool SyncLogStore(const std::string& strFile);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -87,6 +104,37 @@ public:
 
 extern CDBEnv bitdb;
 
+// A cursor over the records of a database in key order, whichever store the database is kept in
+class CDBCursor
+{
+public:
+    Dbc* pcursor;
+    leveldb::Iterator* piter;
+    bool fStarted;
+
+    CDBCursor() : pcursor(NULL), piter(NULL), fStarted(false) { }
+
+    ~CDBCursor()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if (pcursor)
+            pcursor->close();
+
+        delete piter;
+        pcursor = NULL;
+        piter = NULL;
+        fStarted = false;
+    }
+
+private:
+    CDBCursor(const CDBCursor&);
+    void operator=(const CDBCursor&);
+};
+
 class CDB
 {
 protected:
@@ -95,6 +143,16 @@ protected:
     DbTxn *activeTxn;
     bool fReadOnly;
 
+    // Set instead of pdb when the file is in the log store. A transaction collects its writes in activeBatch,
+    // and mapBatchKeys tells which keys it holds so reads of any other key need not scan it.
+    leveldb::DB* plog;
+    leveldb::WriteBatch* activeBatch;
+    std::map<std::string, bool> mapBatchKeys;
+
+    bool ReadLog(const CDataStream& ssKey, std::string& strValue);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
 
     ~CDB()
@@ -109,15 +167,38 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool static RewriteLogStore(const std::string& strFile, const char* pszSkip);
+
 protected:
     template<typename K, typename T> bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(get_serialization_reserve_count());
         ssKey << key;
+
+        if (plog)
+        {
+            std::string strValue;
+
+            if (!ReadLog(ssKey, strValue))
+                return false;
+
+            try
+            {
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            }
+            catch (std::exception &e)
+            {
+                return false;
+            }
+
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         Dbt datValue;
@@ -149,7 +230,7 @@ protected:
 
     template<typename K, typename T> bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         if (fReadOnly)
@@ -158,11 +239,15 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(get_serialization_reserve_count());
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(get_serialization_reserve_count() * 10);
         ssValue << value;
+
+        if (plog)
+            return WriteLog(ssKey, ssValue, fOverwrite);
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
@@ -174,7 +259,7 @@ protected:
 
     template<typename K> bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         if (fReadOnly)
@@ -183,6 +268,10 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(get_serialization_reserve_count());
         ssKey << key;
+
+        if (plog)
+            return EraseLog(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         int ret = pdb->del(activeTxn, &datKey, 0);
@@ -193,12 +282,19 @@ protected:
 
     template<typename K> bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(get_serialization_reserve_count());
         ssKey << key;
+
+        if (plog)
+        {
+            std::string strUnused;
+            return ReadLog(ssKey, strUnused);
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         int ret = pdb->exists(activeTxn, &datKey, 0);
@@ -207,22 +303,41 @@ protected:
         return ret == 0;
     }
 
-    Dbc* GetCursor()
+    bool GetCursor(CDBCursor& cursor)
     {
+        cursor.close();
+
+        if (plog)
+        {
+            leveldb::ReadOptions options;
+            options.verify_checksums = true;
+            cursor.piter = plog->NewIterator(options);
+            return true;
+        }
+
         if (!pdb)
-            return NULL;
+            return false;
 
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(NULL, &cursor.pcursor, 0);
 
         if (ret != 0)
-            return NULL;
+        {
+            cursor.pcursor = NULL;
+            return false;
+        }
 
-        return pcursor;
+        return true;
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    // Only DB_NEXT and DB_SET_RANGE are supported on the log store
+    int ReadAtLogCursor(CDBCursor& cursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
+    int ReadAtCursor(CDBCursor& cursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
+        if (cursor.piter)
+            return ReadAtLogCursor(cursor, ssKey, ssValue, fFlags);
+
+        Dbc* pcursor = cursor.pcursor;
         Dbt datKey;
 
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH ||
@@ -269,6 +384,15 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog)
+        {
+            if (activeBatch)
+                return false;
+
+            activeBatch = new leveldb::WriteBatch();
+            return true;
+        }
+
         if (!pdb || activeTxn)
             return false;
 
@@ -281,19 +405,21 @@ public:
         return true;
     }
 
-    bool TxnCommit()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-
-        int ret = activeTxn->commit(0);
-        activeTxn = NULL;
-
-        return ret == 0;
-    }
+    bool TxnCommit();
 
     bool TxnAbort()
     {
+        if (plog)
+        {
+            if (!activeBatch)
+                return false;
+
+            delete activeBatch;
+            activeBatch = NULL;
+            mapBatchKeys.clear();
+            return true;
+        }
+
         if (!pdb || !activeTxn)
             return false;
 
@@ -315,6 +441,7 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    bool static MigrateToLogStore(const std::string& strFile);
 };
 
 #endif // BITCOIN_DB_H
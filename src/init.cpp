@@ -109,10 +109,23 @@ void Shutdown()
 #endif
 
     StopNode();
+
+    boost::filesystem::path pathFeeEstimates = GetDataDir() / FEE_ESTIMATES_FILENAME;
+    CAutoFile estFileout = CAutoFile(fopen(pathFeeEstimates.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+
+    if (estFileout)
+        mempool.WriteFeeEstimates(estFileout);
+    else
+        LogPrintf("Shutdown : Failed to write fee estimates to %s\n", pathFeeEstimates.string());
+
+    DumpMempool();
+
     {
         LOCK(cs_main);
 
 #ifdef ENABLE_WALLET
+        FlushWalletNotifications();
+
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
@@ -212,6 +225,7 @@ std::string HelpMessage()
                                                 "(default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -msgstatsinterval=<n>  " + _("Log network traffic by message type every <n> seconds (default: 0 = off)") + "\n";
 
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -222,6 +236,12 @@ std::string HelpMessage()
 #endif
 
     strUsage += "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n";
+    strUsage += "  -txconfirmtarget=<n>   " + strprintf(_("Pay at least -paytxfee, more if the fee estimates say it takes more to "
+                                                            "confirm within <n> blocks (default: %u)"),
+                                                          DEFAULT_TX_CONFIRM_TARGET) + "\n";
+    strUsage += "  -maxtxfee=<amt>        " + strprintf(_("Never pay more than <amt> in fees for a transaction beyond what "
+                                                            "relaying it requires (default: %s)"),
+                                                          FormatMoney(DEFAULT_TRANSACTION_MAXFEE)) + "\n";
     strUsage += "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this "
                                                 "(default: 0.01)") + "\n";
     if (fHaveGUI)
@@ -265,6 +285,8 @@ std::string HelpMessage()
     }
 
     strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_WORK_QUEUE) + "\n";
+    strUsage += "  -rpcservertimeout=<n>  " + strprintf(_("Timeout in seconds for idle or slow RPC connections (default: %d)"), DEFAULT_RPC_SERVER_TIMEOUT) + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced "
                                                 "by block hash)") + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is "
@@ -275,13 +297,40 @@ std::string HelpMessage()
                                                 "replaced by message)") + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
+    strUsage += "  -keypoolthreads=<n>    " + strprintf(_("Number of threads new keys for the key pool are made on "
+                                                          "(default: %d)"), DEFAULT_KEYPOOL_THREADS) + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
+    strUsage += "  -walletstore=<store>   " + strprintf(_("Store new wallets in Berkeley DB (bdb) or in a log store "
+                                                          "(log) (default: %s)"), DEFAULT_WALLET_STORE) + "\n";
+    strUsage += "  -migratewallet         " + _("Move a Berkeley DB wallet into a log store on startup") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"),
                                                           DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -txverifythreads=<n>   " + strprintf(_("Check scripts of relayed transactions on <n> threads (default: %d, 0 = on "
+                                                            "the message thread)"), DEFAULT_TX_VERIFY_THREADS) + "\n";
+    strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> kilobytes of orphan transactions in memory (default: %u)"),
+                                                          DEFAULT_MAX_ORPHAN_TX_SIZE) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"),
+                                                          DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours "
+                                                            "(default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with more than <n> unconfirmed ancestors "
+                                                             "in the pool, counting themselves (default: %u)"),
+                                                           DEFAULT_ANCESTOR_LIMIT) + "\n";
+    strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose unconfirmed ancestors in the pool "
+                                                            "add up to more than <n> kilobytes (default: %u)"),
+                                                          DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+    strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give a pooled transaction "
+                                                               "more than <n> descendants (default: %u)"),
+                                                             DEFAULT_DESCENDANT_LIMIT) + "\n";
+    strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions that would give a pooled transaction "
+                                                              "more than <n> kilobytes of descendants (default: %u)"),
+                                                            DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
+    strUsage += "  -persistmempool        " + _("Save the mempool to mempool.dat on shutdown and load it again on startup "
+                                                "(default: 1)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>       "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -535,6 +584,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will "
                           "pay if you send a transaction."));
     }
+
+    nTxConfirmTarget = GetArg("-txconfirmtarget", DEFAULT_TX_CONFIRM_TARGET);
+
+    if (mapArgs.count("-maxtxfee"))
+    {
+        if (!ParseMoney(mapArgs["-maxtxfee"], nMaxTxFee))
+            return InitError(strprintf(_("Invalid amount for -maxtxfee=<amount>: '%s'"), mapArgs["-maxtxfee"]));
+    }
 #endif
 
     fConfChange = GetBoolArg("-confchange", false);
@@ -637,14 +694,17 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
-        if (GetBoolArg("-salvagewallet", false))
+        // Salvaging and verifying only apply to Berkeley DB. The log store checks its records as they are read.
+        bool fLogStore = bitdb.IsLogStore(strWalletFileName);
+
+        if (GetBoolArg("-salvagewallet", false) && !fLogStore)
         {
             // Recover readable keypairs:
             if (!CWalletDB::Recover(bitdb, strWalletFileName, true))
                 return false;
         }
 
-        if (filesystem::exists(GetDataDir() / strWalletFileName))
+        if (filesystem::exists(GetDataDir() / strWalletFileName) && !fLogStore)
         {
             CDBEnv::VerifyResult r = bitdb.Verify(strWalletFileName, CWalletDB::Recover);
 
@@ -659,6 +719,19 @@ bool AppInit2(boost::thread_group& threadGroup)
 
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
+
+            if (GetBoolArg("-migratewallet", false))
+            {
+                uiInterface.InitMessage(_("Migrating wallet..."));
+
+                if (!CDB::MigrateToLogStore(strWalletFileName))
+                    return InitError(_("Error migrating wallet.dat to a log store"));
+            }
+        }
+        else if (!fLogStore && GetArg("-walletstore", DEFAULT_WALLET_STORE) == "log")
+        {
+            if (!bitdb.OpenLogStore(strWalletFileName, true))
+                return InitError(_("Error creating wallet log store"));
         }
 
     }
@@ -819,6 +892,18 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    {
+        LOCK(cs_main);
+        PublishChainSnapshot();
+    }
+
+    boost::filesystem::path pathFeeEstimates = GetDataDir() / FEE_ESTIMATES_FILENAME;
+    CAutoFile estFilein = CAutoFile(fopen(pathFeeEstimates.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+
+    // Allowed to fail as this file IS missing on first startup.
+    if (estFilein)
+        mempool.ReadFeeEstimates(estFilein);
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -955,6 +1040,11 @@ bool AppInit2(boost::thread_group& threadGroup)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
             nWalletDBUpdated++;
         }
+
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            pwalletMain->TrimTransactions();
+        }
     }
 
 #else
@@ -1132,6 +1222,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    StartTxVerifyThreads(threadGroup);
+    StartMempoolPersist(threadGroup);
     StartNode(threadGroup);
 
 #ifdef ENABLE_WALLET
@@ -1163,6 +1255,17 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Run a thread to do the wallet work of new blocks and transactions
+        StartWalletNotifyThread(threadGroup);
+
+        // Run a thread to keep the key pool topped up
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "keypool",
+                                              boost::function<void()>(boost::bind(&ThreadKeyPoolRefill, pwalletMain))));
+
+        // Run a thread to do what waits for the wallet to be unlocked
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "unlock",
+                                              boost::function<void()>(boost::bind(&ThreadUnlockWork, pwalletMain))));
     }
 #endif
 
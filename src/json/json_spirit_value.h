@@ -50,10 +50,12 @@ namespace json_spirit
         Value_impl( double             value );
 
         Value_impl( const Value_impl& other );
+        Value_impl( Value_impl&& other ) noexcept;  // lets arrays and objects grow without deep copies
 
         bool operator==( const Value_impl& lhs ) const;
 
         Value_impl& operator=( const Value_impl& lhs );
+        Value_impl& operator=( Value_impl&& lhs ) noexcept;
 
         Value_type type() const;
 
@@ -295,14 +297,28 @@ namespace json_spirit
     {
     }
 
+    template< class Config >
+    Value_impl< Config >::Value_impl( Value_impl< Config >&& other ) noexcept
+    :   type_( other.type() )
+    ,   v_( std::move( other.v_ ) )
+    ,   is_uint64_( other.is_uint64_ )
+    {
+    }
+
     template< class Config >
     Value_impl< Config >& Value_impl< Config >::operator=( const Value_impl& lhs )
     {
         Value_impl tmp( lhs );
 
-        std::swap( type_, tmp.type_ );
-        std::swap( v_, tmp.v_ );
-        std::swap( is_uint64_, tmp.is_uint64_ );
+        return *this = std::move( tmp );
+    }
+
+    template< class Config >
+    Value_impl< Config >& Value_impl< Config >::operator=( Value_impl&& lhs ) noexcept
+    {
+        std::swap( type_, lhs.type_ );
+        v_.swap( lhs.v_ );
+        std::swap( is_uint64_, lhs.is_uint64_ );
 
         return *this;
     }
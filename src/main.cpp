@@ -69,8 +69,49 @@ multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 size_t nOrphanBlocksSize = 0;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+CTxOrphanPool orphanpool;
+
+// Parents whose orphans are waiting to be tried again by the orphan thread
+static boost::mutex csOrphanParentQueue;
+static boost::condition_variable condOrphanParentQueue;
+static vector<uint256> vOrphanParentQueue;
+static bool fOrphanThreadRunning = false;
+
+// Have the orphans spending outputs of these transactions tried again off the message thread
+void static QueueOrphanReprocess(const vector<uint256>& vParents)
+{
+    if (!fOrphanThreadRunning || vParents.empty())
+        return;
+
+    {
+        boost::unique_lock<boost::mutex> lock(csOrphanParentQueue);
+        vOrphanParentQueue.insert(vOrphanParentQueue.end(), vParents.begin(), vParents.end());
+    }
+
+    condOrphanParentQueue.notify_one();
+}
+
+void static QueueOrphanReprocess(const vector<CTransaction>& vtx)
+{
+    vector<uint256> vParents;
+    vParents.reserve(vtx.size());
+
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vParents.push_back(tx.GetHash());
+
+    QueueOrphanReprocess(vParents);
+}
+
+// Transactions recently rejected from the memory pool, so that peers announcing them again do not
+// make us fetch and validate them again. Reset on every new tip, as a rejection may depend on chain state.
+// Made on first use, as its random tweak must not be drawn before the RNG is seeded during startup.
+static CRollingBloomFilter& RecentRejects()
+{
+    static CRollingBloomFilter recentRejects(120000, 0.000001, GetRand(std::numeric_limits<unsigned int>::max()));
+    return recentRejects;
+}
+
+static uint256 hashRecentRejectsChainTip;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -86,6 +127,8 @@ namespace
     {
         // Notifies listeners of updated transaction data (passing hash, transaction, and optionally the block it is found in.
         boost::signals2::signal<void (const CTransaction &, const CBlock *, bool)> SyncTransaction;
+        // Notifies listeners of all the transactions of a block at once.
+        boost::signals2::signal<void (const CBlock &, bool)> SyncBlock;
         // Notifies listeners of an erased transaction (currently disabled, requires transaction replacement).
         boost::signals2::signal<void (const uint256 &)> EraseTransaction;
         // Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible).
@@ -102,6 +145,7 @@ namespace
 void RegisterWallet(CWalletInterface* pwalletIn)
 {
     g_signals.SyncTransaction.connect(boost::bind(&CWalletInterface::SyncTransaction, pwalletIn, _1, _2, _3));
+    g_signals.SyncBlock.connect(boost::bind(&CWalletInterface::SyncBlock, pwalletIn, _1, _2));
     g_signals.EraseTransaction.connect(boost::bind(&CWalletInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CWalletInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
@@ -116,6 +160,7 @@ void UnregisterWallet(CWalletInterface* pwalletIn)
     g_signals.SetBestChain.disconnect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CWalletInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.EraseTransaction.disconnect(boost::bind(&CWalletInterface::EraseFromWallet, pwalletIn, _1));
+    g_signals.SyncBlock.disconnect(boost::bind(&CWalletInterface::SyncBlock, pwalletIn, _1, _2));
     g_signals.SyncTransaction.disconnect(boost::bind(&CWalletInterface::SyncTransaction, pwalletIn, _1, _2, _3));
 }
 
@@ -126,117 +171,196 @@ void UnregisterAllWallets()
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
     g_signals.EraseTransaction.disconnect_all_slots();
+    g_signals.SyncBlock.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
 }
 
-void SyncWithWallets(const CTransaction &tx, const CBlock *pblock, bool fConnect)
+// A wallet notification from the block connect path or the memory pool, waiting for the wallet thread
+struct CWalletNotification
 {
-    g_signals.SyncTransaction(tx, pblock, fConnect);
-}
+    enum { SYNC_TRANSACTION, SYNC_BLOCK, SET_BEST_CHAIN } nType;
+    CTransaction tx;
+    boost::shared_ptr<const CBlock> pblock;
+    bool fConnect;
+    CBlockLocator locator;
+};
 
-void ResendWalletTransactions(bool fForce)
-{
-    g_signals.Broadcast(fForce);
-}
+static boost::mutex csWalletQueue;
+static deque<CWalletNotification> queueWallet;
+static CBackgroundWorker workerWalletNotify;
+static int nWalletDispatching = 0;                  // Notifications taken off the queue and not yet handed over
+static bool fWalletBestChainHeld = false;           // A best block held back until the queue before it is handed over
+static CWalletNotification notificationBestChain;
 
-void RegisterNodeSignals(CNodeSignals& nodeSignals)
+static void DispatchWalletNotification(const CWalletNotification& notification)
 {
-    nodeSignals.ProcessMessages.connect(&ProcessMessages);
-    nodeSignals.SendMessages.connect(&SendMessages);
+    if (notification.nType == CWalletNotification::SYNC_TRANSACTION)
+        g_signals.SyncTransaction(notification.tx, NULL, notification.fConnect);
+    else if (notification.nType == CWalletNotification::SYNC_BLOCK)
+        g_signals.SyncBlock(*notification.pblock, notification.fConnect);
+    else
+        g_signals.SetBestChain(notification.locator);
 }
 
-void UnregisterNodeSignals(CNodeSignals& nodeSignals)
+// Hand the queued notifications to the wallets, in the order they were queued. Each is taken off the queue and handed
+// over under cs_main, which keeps that order whoever does it, while leaving cs_main free in between. A best block is
+// held back while more is queued behind it, so that it is only written once, after the transactions it covers.
+// Returns right away, without cs_main, when everything queued so far was handed over.
+static void ProcessWalletQueue()
 {
-    nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
-    nodeSignals.SendMessages.disconnect(&SendMessages);
-}
+    {
+        boost::lock_guard<boost::mutex> lock(csWalletQueue);
 
-bool AbortNode(const std::string &strMessage, const std::string &userMessage)
-{
-    strMiscWarning = strMessage;
-    LogPrintf("*** %s\n", strMessage);
+        if (queueWallet.empty() && !fWalletBestChainHeld && nWalletDispatching == 0)
+            return;
+    }
 
-    uiInterface.ThreadSafeMessageBox(userMessage.empty() ?
-        _("Error: A fatal internal error occured, see debug.log for details") : userMessage, "", CClientUIInterface::MSG_ERROR);
+    while (true)
+    {
+        // Whoever took the last one off the queue holds cs_main until it was handed over
+        LOCK(cs_main);
+        CWalletNotification notification;
 
-    StartShutdown();
-    return false;
-}
+        {
+            boost::lock_guard<boost::mutex> lock(csWalletQueue);
 
-bool AddOrphanTx(const CTransaction& tx)
-{
-    uint256 hash = tx.GetHash();
+            if (!queueWallet.empty())
+            {
+                notification = std::move(queueWallet.front());
+                queueWallet.pop_front();
 
-    if (mapOrphanTransactions.count(hash))
-        return false;
+                if (notification.nType == CWalletNotification::SET_BEST_CHAIN && !queueWallet.empty())
+                {
+                    notificationBestChain = std::move(notification);
+                    fWalletBestChainHeld = true;
+                    continue;
+                }
+            }
+            else if (fWalletBestChainHeld)
+            {
+                notification = std::move(notificationBestChain);
+                fWalletBestChainHeld = false;
+            }
+            else
+                return;
 
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+            nWalletDispatching++;
+        }
 
-    if (nSize > 5000)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString());
-        return false;
-    }
+        try
+        {
+            DispatchWalletNotification(notification);
+        }
+        catch (...)
+        {
+            boost::lock_guard<boost::mutex> lock(csWalletQueue);
+            nWalletDispatching--;
+            throw;
+        }
 
-    mapOrphanTransactions[hash] = tx;
+        boost::lock_guard<boost::mutex> lock(csWalletQueue);
+        nWalletDispatching--;
+    }
+}
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+// Queue a notification for the wallet thread, or hand it over right away if there is none
+static void QueueWalletNotification(const CWalletNotification& notification)
+{
+    bool fDrain;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size());
+    {
+        boost::lock_guard<boost::mutex> lock(csWalletQueue);
+        queueWallet.push_back(notification);
+        fDrain = queueWallet.size() > MAX_WALLET_QUEUE;
+    }
 
-    return true;
+    // Without a thread, or with more queued than it keeps up with, the caller hands over the queue in order
+    if (!workerWalletNotify.Wake() || fDrain)
+        ProcessWalletQueue();
 }
 
-void static EraseOrphanTx(uint256 hash)
+void SyncWithWallets(const CTransaction &tx, bool fConnect)
 {
-    map<uint256, CTransaction>::iterator it = mapOrphanTransactions.find(hash);
+    CWalletNotification notification;
+    notification.nType = CWalletNotification::SYNC_TRANSACTION;
+    notification.tx = tx;
+    notification.fConnect = fConnect;
+    QueueWalletNotification(notification);
+}
 
-    if (it == mapOrphanTransactions.end())
+void SyncBlockWithWallets(const CBlock& block, bool fConnect)
+{
+    // Copying the block is only worth it if someone is listening
+    if (g_signals.SyncTransaction.empty())
         return;
 
-    BOOST_FOREACH(const CTxIn& txin, it->second.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+    CWalletNotification notification;
+    notification.nType = CWalletNotification::SYNC_BLOCK;
+    notification.pblock.reset(new CBlock(block));
+    notification.fConnect = fConnect;
+    QueueWalletNotification(notification);
+}
 
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
+static void SetBestChainWithWallets(const CBlockLocator& locator)
+{
+    CWalletNotification notification;
+    notification.nType = CWalletNotification::SET_BEST_CHAIN;
+    notification.locator = locator;
+    QueueWalletNotification(notification);
+}
 
-        itPrev->second.erase(hash);
+// Must not be called holding cs_wallet without cs_main, which is taken here
+void SyncWithWalletQueue()
+{
+    ProcessWalletQueue();
+}
 
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
+// Runs the wallet work of connected blocks and accepted transactions, so that it does not hold up the block connect
+// path. It still takes cs_main, but only once the block is in, and for one notification at a time.
+void static ThreadWalletNotify()
+{
+    workerWalletNotify.Run(&ProcessWalletQueue, true);
+}
 
-    mapOrphanTransactions.erase(it);
+void StartWalletNotifyThread(boost::thread_group& threadGroup)
+{
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "walletnotify", &ThreadWalletNotify));
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+// From here on notifications are handed over right away, and those still queued are handed over now
+void FlushWalletNotifications()
 {
-    unsigned int nEvicted = 0;
+    workerWalletNotify.Stop();
+    ProcessWalletQueue();
+}
 
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+void ResendWalletTransactions(bool fForce)
+{
+    g_signals.Broadcast(fForce);
+}
 
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
+void RegisterNodeSignals(CNodeSignals& nodeSignals)
+{
+    nodeSignals.ProcessMessages.connect(&ProcessMessages);
+    nodeSignals.SendMessages.connect(&SendMessages);
+}
 
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
+void UnregisterNodeSignals(CNodeSignals& nodeSignals)
+{
+    nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
+    nodeSignals.SendMessages.disconnect(&SendMessages);
+}
 
-    return nEvicted;
+bool AbortNode(const std::string &strMessage, const std::string &userMessage)
+{
+    strMiscWarning = strMessage;
+    LogPrintf("*** %s\n", strMessage);
+
+    uiInterface.ThreadSafeMessageBox(userMessage.empty() ?
+        _("Error: A fatal internal error occured, see debug.log for details") : userMessage, "", CClientUIInterface::MSG_ERROR);
+
+    StartShutdown();
+    return false;
 }
 
 // Check transaction inputs to mitigate two
@@ -418,7 +542,70 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
     return nMinFee;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs)
+TxPreCheckResult PreCheckTransaction(const CTransaction& tx, int& nDoSRet, bool fCacheSigs)
+{
+    // Everything here only depends on the transaction and on the content of the transactions it spends,
+    // so it can run on any thread. Whether those outputs are still unspent is left to AcceptToMemoryPool.
+    nDoSRet = 0;
+
+    if (!tx.CheckTransaction() || tx.IsCoinBase() || tx.IsCoinStake())
+    {
+        nDoSRet = (tx.IsCoinBase() || tx.IsCoinStake()) ? 100 : tx.nDoS;
+        return TXPRECHECK_INVALID;
+    }
+
+    string reason;
+    if (!TestNet() && !IsStandardTx(tx, reason))
+        return TXPRECHECK_INVALID;
+
+    if (mempool.exists(tx.GetHash()))
+        return TXPRECHECK_UNKNOWN;
+
+    CTxDB txdb("r");
+    map<uint256, CTransaction> mapPrevTx;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const uint256& hashPrev = txin.prevout.hash;
+
+        if (!mapPrevTx.count(hashPrev) && !mempool.lookup(hashPrev, mapPrevTx[hashPrev]) &&
+            !txdb.ReadDiskTx(hashPrev, mapPrevTx[hashPrev]))
+            return TXPRECHECK_UNKNOWN;
+
+        if (txin.prevout.n >= mapPrevTx[hashPrev].vout.size())
+            return TXPRECHECK_UNKNOWN;
+    }
+
+    // The same checks, with the same outcome, as ConnectInputs() run by AcceptToMemoryPool
+    unsigned int nNoCache = fCacheSigs ? 0 : SCRIPT_VERIFY_NOCACHE;
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const CTransaction& txPrev = mapPrevTx[tx.vin[i].prevout.hash];
+
+        if (!VerifySignature(txPrev, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS | nNoCache, 0))
+        {
+            // Failing only a non-mandatory flag does not make the peer misbehaving
+            if (!VerifySignature(txPrev, tx, i, (STANDARD_SCRIPT_VERIFY_FLAGS & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS) | nNoCache, 0))
+                nDoSRet = 100;
+
+            LogPrint("mempool", "PreCheckTransaction : %s VerifySignature failed\n", tx.GetHash().ToString());
+            return TXPRECHECK_INVALID;
+        }
+
+        if (!VerifySignature(txPrev, tx, i, MANDATORY_SCRIPT_VERIFY_FLAGS | nNoCache, 0))
+        {
+            LogPrintf("PreCheckTransaction : BUG! PLEASE REPORT THIS! VerifySignature failed against MANDATORY "
+                      "but not STANDARD flags %s\n", tx.GetHash().ToString());
+            return TXPRECHECK_INVALID;
+        }
+    }
+
+    return TXPRECHECK_VALID;
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fScriptChecked,
+                        int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
 
@@ -460,6 +647,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
             }
         }
     }
+
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -507,6 +696,25 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
         if ((fLimitFree && nFees < txMinFee) || (!fLimitFree && nFees < MIN_TX_FEE))
             return error("AcceptToMemoryPool : not enough fees %s, %d < %d", hash.ToString(), nFees, txMinFee);
 
+        // After evictions, relayed transactions have to pay more than the ones that were pushed out
+        if (fLimitFree)
+        {
+            int64_t nMempoolMinFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+
+            if (nFees < nMempoolMinFee)
+                return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d", hash.ToString(), nFees,
+                             nMempoolMinFee);
+        }
+
+        // Keep unconfirmed chains short, the package totals are walked whenever one of them changes
+        string strLimitReason;
+
+        if (!pool.CheckPackageLimits(tx, nSize, GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                     GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                     GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                     GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000, strLimitReason))
+            return error("AcceptToMemoryPool : %s, %s", strLimitReason, hash.ToString());
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -534,7 +742,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
+        // Scripts already verified by PreCheckTransaction() are not verified again, the other checks are.
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false,
+                              STANDARD_SCRIPT_VERIFY_FLAGS, !fScriptChecked))
             return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
 
         // Check again against just the consensus-critical mandatory script
@@ -546,18 +756,56 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false,
-                              MANDATORY_SCRIPT_VERIFY_FLAGS))
+        if (!fScriptChecked && !tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false,
+                                                 MANDATORY_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY "
                          "but not STANDARD flags %s", hash.ToString());
         }
+
+        // Remember what block templates need to know about the transaction
+        entry = CTxMemPoolEntry(tx, nFees, nSize, nSigOps, nAcceptTime ? nAcceptTime : GetTime(), nBestHeight);
+
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const CTxIn& txin = tx.vin[i];
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+
+            // Inputs spending other pooled transactions count once their parent is mined
+            if (txindex.pos.IsNull())
+                continue;
+
+            entry.AddChainInput(i, mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue,
+                                nBestHeight + 1 - txindex.GetDepthInMainChain());
+        }
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
-    setValidatedTx.insert(hash);
-    SyncWithWallets(tx, NULL);
+    if (!pool.addUnchecked(hash, entry))
+        return false;
+
+    // Keep the pool within its limits. A transaction whose package is the cheapest one in a full pool
+    // is evicted right away and not relayed.
+    pool.Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    vector<uint256> vEvicted;
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, &vEvicted);
+
+    // Peers offering evicted transactions again are not listened to until the tip changes
+    if (&pool == &mempool)
+    {
+        BOOST_FOREACH(const uint256& hashEvicted, vEvicted)
+            RecentRejects().insert(hashEvicted);
+    }
+
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, %s rejected", hash.ToString());
+
+    // Only the node's own pool is of interest to the wallets, not the scratch pools used by benchaccept
+    if (&pool == &mempool)
+    {
+        setValidatedTx.insert(hash);
+        SyncWithWallets(tx);
+    }
 
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n", hash.ToString(), pool.mapTx.size());
     return true;
@@ -749,6 +997,9 @@ bool CMerkleTx::AcceptToMemoryPool(bool fLimitFree)
 
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb)
 {
+    if (!LoadSupportingData())
+        return false;
+
     {
         // Add previous supporting transactions first
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
@@ -838,6 +1089,176 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
+// Taken when inserting into mapBlockIndex, so that LookupBlockIndex() works without cs_main
+static CCriticalSection cs_mapBlockIndex;
+
+CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_mapBlockIndex);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+
+    if (mi == mapBlockIndex.end())
+        return NULL;
+
+    return mi->second;
+}
+
+// Block index entries of each block file by where the block is stored in it, so that a transaction index position
+// leads straight to the header fields of its block without reading the block file. This costs a pointer per block,
+// where a map keyed by position would cost a tree node of some 64 bytes. Blocks are added in order of position as they
+// are written, those loaded at startup come in hash order and are sorted on the first lookup.
+struct CBlockFilePositions
+{
+    vector<CBlockIndex*> vBlocks;
+    bool fSorted;
+
+    CBlockFilePositions() : fSorted(true) { }
+};
+
+static map<unsigned int, CBlockFilePositions> mapBlockFilePositions;
+
+static bool BlockPosLess(const CBlockIndex* pindexA, const CBlockIndex* pindexB)
+{
+    return pindexA->nBlockPos < pindexB->nBlockPos;
+}
+
+static bool BlockPosBefore(const CBlockIndex* pindex, unsigned int nBlockPos)
+{
+    return pindex->nBlockPos < nBlockPos;
+}
+
+void AddBlockIndexPos(CBlockIndex* pindex)
+{
+    LOCK(cs_mapBlockIndex);
+    CBlockFilePositions& positions = mapBlockFilePositions[pindex->nFile];
+
+    if (!positions.vBlocks.empty() && positions.vBlocks.back()->nBlockPos > pindex->nBlockPos)
+        positions.fSorted = false;
+
+    positions.vBlocks.push_back(pindex);
+}
+
+void RemoveBlockIndexPos(CBlockIndex* pindex)
+{
+    LOCK(cs_mapBlockIndex);
+    map<unsigned int, CBlockFilePositions>::iterator mi = mapBlockFilePositions.find(pindex->nFile);
+
+    if (mi == mapBlockFilePositions.end())
+        return;
+
+    vector<CBlockIndex*>& vBlocks = mi->second.vBlocks;
+    vBlocks.erase(remove(vBlocks.begin(), vBlocks.end(), pindex), vBlocks.end());
+
+    if (vBlocks.empty())
+        mapBlockFilePositions.erase(mi);
+}
+
+CBlockIndex* LookupBlockIndexByPos(unsigned int nFile, unsigned int nBlockPos)
+{
+    LOCK(cs_mapBlockIndex);
+    map<unsigned int, CBlockFilePositions>::iterator mi = mapBlockFilePositions.find(nFile);
+
+    if (mi == mapBlockFilePositions.end())
+        return NULL;
+
+    CBlockFilePositions& positions = mi->second;
+
+    if (!positions.fSorted)
+    {
+        sort(positions.vBlocks.begin(), positions.vBlocks.end(), BlockPosLess);
+        positions.fSorted = true;
+    }
+
+    vector<CBlockIndex*>::iterator it = lower_bound(positions.vBlocks.begin(), positions.vBlocks.end(), nBlockPos,
+                                                    BlockPosBefore);
+
+    if (it == positions.vBlocks.end() || (*it)->nBlockPos != nBlockPos)
+        return NULL;
+
+    return *it;
+}
+
+const CBlockIndex* CChainSnapshot::GetAncestor(int nHeightIn) const
+{
+    if (nHeightIn < 0 || nHeightIn > nHeight)
+        return NULL;
+
+    // Start from the nearest milestone at or above nHeightIn, pprev never changes
+    size_t nMilestone = (nHeightIn + CHAIN_SNAPSHOT_STRIDE - 1) / CHAIN_SNAPSHOT_STRIDE;
+    const CBlockIndex* pindex = nMilestone < vMilestones.size() ? vMilestones[nMilestone] : pindexBest;
+
+    while (pindex->nHeight > nHeightIn)
+        pindex = pindex->pprev;
+
+    return pindex;
+}
+
+// Extend a snapshot by the next block of its chain
+void static ConnectToSnapshot(CChainSnapshot& snapshot, const CBlockIndex* pindex)
+{
+    if (pindex->nHeight % CHAIN_SNAPSHOT_STRIDE == 0)
+        snapshot.vMilestones.push_back(pindex);
+
+    if (pindex->IsProofOfWork())
+    {
+        const CBlockIndex* pindexPrevWork = snapshot.pindexLastPoW ? snapshot.pindexLastPoW : pindex;
+        int64_t nActualSpacingWork = pindex->GetBlockTime() - pindexPrevWork->GetBlockTime();
+
+        snapshot.nTargetSpacingWork = ((POW_SPACING_INTERVAL - 1) * snapshot.nTargetSpacingWork + 2 * nActualSpacingWork) /
+                                      (POW_SPACING_INTERVAL + 1);
+        snapshot.nTargetSpacingWork = std::max(snapshot.nTargetSpacingWork, POW_TARGET_SPACING_MIN);
+        snapshot.pindexLastPoW = pindex;
+    }
+}
+
+static CChainSnapshotRef pChainSnapshot(new CChainSnapshot());
+
+CChainSnapshotRef GetChainSnapshot()
+{
+    return boost::atomic_load(&pChainSnapshot);
+}
+
+void PublishChainSnapshot()
+{
+    AssertLockHeld(cs_main);
+
+    if (!pindexBest)
+        return;
+
+    CChainSnapshotRef pOld = GetChainSnapshot();
+    CChainSnapshot* pNew = new CChainSnapshot();
+
+    // Carry the old snapshot over up to where the chains fork, unless a proof-of-work block was disconnected
+    const CBlockIndex* pindexFork = pOld->pindexBest;
+
+    while (pindexFork && !pindexFork->IsInMainChain())
+        pindexFork = pindexFork->pprev;
+
+    if (pindexFork && (!pOld->pindexLastPoW || pOld->pindexLastPoW->nHeight <= pindexFork->nHeight))
+    {
+        *pNew = *pOld;
+        pNew->vMilestones.resize(pindexFork->nHeight / CHAIN_SNAPSHOT_STRIDE + 1);
+    }
+    else
+        pindexFork = NULL;
+
+    vector<const CBlockIndex*> vConnect;
+
+    for (const CBlockIndex* pindex = pindexBest; pindex != pindexFork; pindex = pindex->pprev)
+        vConnect.push_back(pindex);
+
+    BOOST_REVERSE_FOREACH(const CBlockIndex* pindex, vConnect)
+        ConnectToSnapshot(*pNew, pindex);
+
+    pNew->pindexBest = pindexBest;
+    pNew->hashBest = hashBestChain;
+    pNew->nHeight = nBestHeight;
+    pNew->nMoneySupply = pindexBest->nMoneySupply;
+    pNew->pindexLastPoS = GetLastBlockIndex(pindexBest, true);
+
+    boost::atomic_store(&pChainSnapshot, CChainSnapshotRef(pNew));
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 {
     if (!fReadTransactions)
@@ -1181,8 +1602,7 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     }
 
     // ppcoin: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, false);
+    SyncBlockWithWallets(*this, false);
 
     return true;
 }
@@ -1341,6 +1761,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
     int64_t nStakeReward = 0;
+    uint64_t nCoinAge = 0;
     unsigned int nSigOps = 0;
     int nInputs = 0;
 
@@ -1408,8 +1829,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
             if (tx.IsCoinStake())
+            {
                 nStakeReward = nTxValueOut - nTxValueIn;
 
+                // The inputs are at hand already, so the coin age needs no further reads
+                if (!tx.GetCoinAge(mapInputs, nCoinAge))
+                    return error("ConnectBlock() : %s unable to get coin age for coinstake", hashTx.ToString());
+            }
+
             if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
                 return false;
         }
@@ -1435,11 +1862,6 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             pindexBest = pindex;
 
         // ppcoin: coin stake tx earns reward instead of paying fee
-        uint64_t nCoinAge;
-
-        if (!vtx[1].GetCoinAge(txdb, nCoinAge))
-            return error("ConnectBlock() : %s unable to get coin age for coinstake", vtx[1].GetHash().ToString());
-
         int64_t nCalculatedStakeReward = GetProofOfStakeReward(pindex->nHeight, nCoinAge, nFees);
 
         if (nStakeReward > nCalculatedStakeReward)
@@ -1528,8 +1950,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     // Watch for transactions paying to me
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this);
+    SyncBlockWithWallets(*this);
 
     return true;
 }
@@ -1595,6 +2016,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Connect longer branch
     vector<CTransaction> vDelete;
+    vector<vector<CTransaction> > vConnectTxs;
 
     for (unsigned int i = 0; i < vConnect.size(); i++)
     {
@@ -1613,6 +2035,8 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         // Queue memory transactions to delete
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             vDelete.push_back(tx);
+
+        vConnectTxs.push_back(block.vtx);
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -1635,12 +2059,15 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         AcceptToMemoryPool(mempool, tx, false, NULL);
 
-    // Delete redundant memory transactions that are in the connected branch
+    // Delete redundant memory transactions that are in the connected branch, block by block so that the fee
+    // estimates see the height each of them was mined at
+    for (unsigned int i = 0; i < vConnect.size(); i++)
+        mempool.removeForBlock(vConnectTxs[i], vConnect[i]->nHeight);
+
     BOOST_FOREACH(CTransaction& tx, vDelete)
-    {
-        mempool.remove(tx);
         mempool.removeConflicts(tx);
-    }
+
+    QueueOrphanReprocess(vDelete);
 
     LogPrintf("REORGANIZE: done\n");
 
@@ -1669,8 +2096,8 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         pindexNew->pprev->pnext = pindexNew;
 
     // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+    mempool.removeForBlock(vtx, pindexNew->nHeight);
+    QueueOrphanReprocess(vtx);
 
     return true;
 }
@@ -1748,7 +2175,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
         const CBlockLocator locator(pindexNew);
-        g_signals.SetBestChain(locator);
+        SetBestChainWithWallets(locator);
     }
 
     // New best block
@@ -1759,6 +2186,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    PublishChainSnapshot();
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) :
                                                          pindexBest->nChainTrust;
@@ -1840,7 +2268,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : ComputeNextStakeModifier() failed");
 
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    map<uint256, CBlockIndex*>::iterator mi;
+    {
+        LOCK(cs_mapBlockIndex);
+        mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    }
+
+    AddBlockIndexPos(pindexNew);
 
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
@@ -2542,6 +2976,9 @@ bool LoadBlockIndex(bool fAllowNew)
     if (!txdb.LoadBlockIndex())
         return false;
 
+    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        AddBlockIndexPos(mi->second);
+
     //
     // Init with genesis block
     //
@@ -2785,16 +3222,52 @@ string GetWarnings(string strFor)
     return "error";
 }
 
+// When each recent new block was first announced to us, to measure how far behind that each peer relays it
+static map<uint256, int64_t> mapBlockFirstSeen;
+static deque<uint256> vBlockFirstSeenOrder;
+static const unsigned int MAX_BLOCK_FIRST_SEEN = 64;
+
+// requires LOCK(cs_main)
+void static RecordBlockAnnouncement(CNode* pfrom, const uint256& hash)
+{
+    int64_t nNow = GetTimeMicros();
+    map<uint256, int64_t>::iterator it = mapBlockFirstSeen.find(hash);
+
+    if (it == mapBlockFirstSeen.end())
+    {
+        // Blocks we already had, or announcements while catching up, say nothing about relay speed
+        if (mapBlockIndex.count(hash) || IsInitialBlockDownload())
+            return;
+
+        it = mapBlockFirstSeen.insert(make_pair(hash, nNow)).first;
+        vBlockFirstSeenOrder.push_back(hash);
+
+        if (vBlockFirstSeenOrder.size() > MAX_BLOCK_FIRST_SEEN)
+        {
+            mapBlockFirstSeen.erase(vBlockFirstSeenOrder.front());
+            vBlockFirstSeenOrder.pop_front();
+        }
+    }
+
+    if (!pfrom->fInbound)
+        addrman.RecordStat(pfrom->addr, ADDRSTAT_BLOCKLAG, nNow - it->second);
+}
+
 bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
     {
         case MSG_TX:
         {
-            bool txInMap = false;
+            if (hashBestChain != hashRecentRejectsChainTip)
+            {
+                hashRecentRejectsChainTip = hashBestChain;
+                RecentRejects().clear();
+            }
 
-            txInMap = mempool.exists(inv.hash);
-            return txInMap || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
+            // Cheapest checks first, the transaction index lookup hits the disk
+            return RecentRejects().contains(inv.hash) || mempool.exists(inv.hash) ||
+                   orphanpool.exists(inv.hash) || txdb.ContainsTx(inv.hash);
         }
 
         case MSG_BLOCK:
@@ -2973,6 +3446,340 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+void static ThreadOrphanTx()
+{
+    while (true)
+    {
+        vector<uint256> vParents;
+        {
+            boost::unique_lock<boost::mutex> lock(csOrphanParentQueue);
+
+            while (vOrphanParentQueue.empty())
+                condOrphanParentQueue.wait(lock);
+
+            vParents.swap(vOrphanParentQueue);
+        }
+
+        vector<uint256> vWork;
+        orphanpool.GetDependents(vParents, vWork);
+
+        // Orphans accepted in a batch add their own dependents to the end of vWork. cs_main is released
+        // between batches, so a long chain of orphans does not hold up the message thread.
+        for (size_t i = 0; i < vWork.size(); )
+        {
+            LOCK(cs_main);
+
+            for (size_t nEnd = std::min(vWork.size(), i + ORPHAN_TX_BATCH_SIZE); i < nEnd; i++)
+            {
+                const uint256& orphanTxHash = vWork[i];
+                CTransaction orphanTx;
+                bool fMissingInputs = false;
+
+                if (!orphanpool.Get(orphanTxHash, orphanTx))
+                    continue;
+
+                if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
+                    RelayTransaction(orphanTx, orphanTxHash);
+                    orphanpool.Erase(orphanTxHash);
+                    orphanpool.GetDependents(vector<uint256>(1, orphanTxHash), vWork);
+                }
+                else if (!fMissingInputs)
+                {
+                    // invalid or too-little-fee orphan
+                    orphanpool.Erase(orphanTxHash);
+                    RecentRejects().insert(orphanTxHash);
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
+                }
+            }
+        }
+    }
+}
+
+// Accept a transaction relayed by pfrom, or keep it as an orphan. Requires cs_main.
+void static ProcessRelayedTx(CNode* pfrom, CTransaction& tx, bool fScriptChecked)
+{
+    AssertLockHeld(cs_main);
+
+    CInv inv(MSG_TX, tx.GetHash());
+    bool fMissingInputs = false;
+    mapAlreadyAskedFor.erase(inv);
+
+    if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs, fScriptChecked))
+    {
+        RelayTransaction(tx, inv.hash);
+        QueueOrphanReprocess(vector<uint256>(1, inv.hash));
+    }
+    else if (fMissingInputs)
+        orphanpool.Add(tx, pfrom->GetId(), GetTime());
+    else
+        RecentRejects().insert(inv.hash);
+
+    if (tx.nDoS)
+        pfrom->Misbehaving(tx.nDoS);
+}
+
+// Relayed transactions waiting for the verify threads. Each job holds a reference on its node.
+struct CTxVerifyJob
+{
+    CNode* pfrom;
+    CTransaction tx;
+};
+
+static boost::mutex csTxVerifyQueue;
+static boost::condition_variable condTxVerifyQueue;
+static deque<CTxVerifyJob> queueTxVerify;
+static int nTxVerifyThreads = 0;
+
+// Check the scripts of queued transactions in parallel, then accept them one at a time under cs_main
+void static ThreadTxVerify()
+{
+    while (true)
+    {
+        CTxVerifyJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(csTxVerifyQueue);
+
+            while (queueTxVerify.empty())
+                condTxVerifyQueue.wait(lock);
+
+            job = queueTxVerify.front();
+            queueTxVerify.pop_front();
+        }
+
+        int nDoS = 0;
+        TxPreCheckResult result = PreCheckTransaction(job.tx, nDoS);
+
+        {
+            LOCK(cs_main);
+
+            if (result == TXPRECHECK_INVALID)
+            {
+                RecentRejects().insert(job.tx.GetHash());
+                mapAlreadyAskedFor.erase(CInv(MSG_TX, job.tx.GetHash()));
+
+                if (nDoS)
+                    job.pfrom->Misbehaving(nDoS);
+            }
+            else
+                ProcessRelayedTx(job.pfrom, job.tx, result == TXPRECHECK_VALID);
+        }
+
+        job.pfrom->Release();
+    }
+}
+
+void StartTxVerifyThreads(boost::thread_group& threadGroup)
+{
+    nTxVerifyThreads = std::max(0, (int)GetArg("-txverifythreads", DEFAULT_TX_VERIFY_THREADS));
+
+    for (int i = 0; i < nTxVerifyThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "txverify", &ThreadTxVerify));
+
+    orphanpool.SetMaxSize(GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TX_SIZE) * 1000);
+    fOrphanThreadRunning = true;
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "orphantx", &ThreadOrphanTx));
+}
+
+// Hand a relayed transaction to the verify threads. Returns false if it has to be processed inline.
+bool static QueueRelayedTx(CNode* pfrom, const CTransaction& tx)
+{
+    if (nTxVerifyThreads == 0)
+        return false;
+
+    {
+        boost::unique_lock<boost::mutex> lock(csTxVerifyQueue);
+
+        if (queueTxVerify.size() >= MAX_TX_VERIFY_QUEUE)
+            return false;
+
+        CTxVerifyJob job;
+        job.pfrom = pfrom->AddRef();
+        job.tx = tx;
+        queueTxVerify.push_back(job);
+    }
+
+    condTxVerifyQueue.notify_one();
+    return true;
+}
+
+static CCriticalSection cs_mempoolLoad;
+static CMempoolLoadProgress mempoolLoadProgress = { false, false, 0, 0, 0, 0, 0 };
+
+CMempoolLoadProgress GetMempoolLoadProgress()
+{
+    LOCK(cs_mempoolLoad);
+    return mempoolLoadProgress;
+}
+
+// Check the scripts of every nStride'th transaction of a batch, starting at nStart
+void static PreCheckMempoolBatch(const vector<CMempoolDumpEntry>* pvBatch, vector<TxPreCheckResult>* pvResults,
+                                 size_t nStart, size_t nStride)
+{
+    for (size_t i = nStart; i < pvBatch->size(); i += nStride)
+    {
+        int nDoS = 0;
+        (*pvResults)[i] = PreCheckTransaction((*pvBatch)[i].tx, nDoS);
+    }
+}
+
+// Accept the transactions in mempool.dat again. The scripts of each batch are checked on as many threads as
+// -txverifythreads without holding cs_main, which is then taken only to accept the batch.
+void static LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathMempool = GetDataDir() / MEMPOOL_FILENAME;
+    CAutoFile filein = CAutoFile(fopen(pathMempool.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    CMempoolLoadProgress progress = GetMempoolLoadProgress();
+
+    if (!filein)
+        LogPrintf("LoadMempool() : no %s to load\n", MEMPOOL_FILENAME);
+    else
+    {
+        size_t nThreads = std::max(1, nTxVerifyThreads);
+        int64_t nExpireTime = GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+
+        try
+        {
+            uint64_t nVersion;
+            filein >> nVersion;
+
+            if (nVersion != MEMPOOL_DUMP_VERSION)
+                throw runtime_error(strprintf("unknown version %d", nVersion));
+
+            filein >> progress.nTotal;
+
+            while (progress.nRead < progress.nTotal)
+            {
+                vector<CMempoolDumpEntry> vBatch;
+
+                while (progress.nRead < progress.nTotal && vBatch.size() < MEMPOOL_LOAD_BATCH_SIZE)
+                {
+                    CMempoolDumpEntry entry;
+                    filein >> entry;
+                    progress.nRead++;
+
+                    // The fee recorded with the transaction saves checking one that pays too little now
+                    unsigned int nSize = ::GetSerializeSize(entry.tx, SER_NETWORK, PROTOCOL_VERSION);
+
+                    if ((int64_t)entry.nTime < nExpireTime)
+                        progress.nExpired++;
+                    else if ((int64_t)entry.nFee < GetMinFee(entry.tx, 1000, GMF_RELAY, nSize))
+                        progress.nFailed++;
+                    else
+                        vBatch.push_back(entry);
+                }
+
+                vector<TxPreCheckResult> vResults(vBatch.size(), TXPRECHECK_UNKNOWN);
+                {
+                    // The workers use vBatch and vResults, so they must be joined before either goes away
+                    boost::this_thread::disable_interruption di;
+                    boost::thread_group workers;
+
+                    for (size_t i = 1; i < nThreads && i < vBatch.size(); i++)
+                        workers.create_thread(boost::bind(&PreCheckMempoolBatch, &vBatch, &vResults, i, nThreads));
+
+                    PreCheckMempoolBatch(&vBatch, &vResults, 0, nThreads);
+                    workers.join_all();
+                }
+
+                {
+                    LOCK(cs_main);
+
+                    for (size_t i = 0; i < vBatch.size(); i++)
+                    {
+                        if (vResults[i] != TXPRECHECK_INVALID &&
+                            AcceptToMemoryPool(mempool, vBatch[i].tx, true, NULL, vResults[i] == TXPRECHECK_VALID,
+                                               vBatch[i].nTime))
+                            progress.nAccepted++;
+                        else
+                            progress.nFailed++;
+                    }
+                }
+
+                {
+                    LOCK(cs_mempoolLoad);
+                    mempoolLoadProgress = progress;
+                }
+
+                boost::this_thread::interruption_point();
+            }
+        }
+        catch (std::exception &e)
+        {
+            LogPrintf("LoadMempool() : unable to read %s (%s)\n", MEMPOOL_FILENAME, e.what());
+        }
+
+        LogPrintf("Loaded %u of %u transactions from %s, %u failed, %u expired  %dms\n",
+                  progress.nAccepted, progress.nTotal, MEMPOOL_FILENAME, progress.nFailed, progress.nExpired,
+                  GetTimeMillis() - nStart);
+    }
+
+    progress.fLoading = false;
+    progress.fLoaded = true;
+
+    LOCK(cs_mempoolLoad);
+    mempoolLoadProgress = progress;
+}
+
+// Write the pool to mempool.dat. Nothing is written before it was loaded, so that an interrupted or disabled
+// load does not replace the file with a partial pool.
+bool DumpMempool()
+{
+    // The persist thread may still be writing when the shutdown dump starts, and both use the same temporary file
+    static boost::mutex csDumpMempool;
+    boost::lock_guard<boost::mutex> lock(csDumpMempool);
+
+    if (!GetMempoolLoadProgress().fLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathMempool = GetDataDir() / MEMPOOL_FILENAME;
+    boost::filesystem::path pathTmp = GetDataDir() / (string(MEMPOOL_FILENAME) + ".new");
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    if (!mempool.Dump(fileout))
+        return false;
+
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    LogPrint("mempool", "Flushed %u transactions to %s  %dms\n", mempool.size(), MEMPOOL_FILENAME,
+             GetTimeMillis() - nStart);
+    return true;
+}
+
+void static ThreadMempoolPersist()
+{
+    LoadMempool();
+
+    while (true)
+    {
+        MilliSleep(DUMP_MEMPOOL_INTERVAL * 1000);
+        DumpMempool();
+    }
+}
+
+void StartMempoolPersist(boost::thread_group& threadGroup)
+{
+    if (!GetBoolArg("-persistmempool", true))
+        return;
+
+    {
+        LOCK(cs_mempoolLoad);
+        mempoolLoadProgress.fLoading = true;
+    }
+
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "mempoolpersist", &ThreadMempoolPersist));
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -3075,6 +3882,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
 
             addrman.Good(pfrom->addr);
+            addrman.RecordStat(pfrom->addr, ADDRSTAT_HANDSHAKE, GetTimeMicros() - pfrom->nConnectStartUsec);
         }
         else
         {
@@ -3234,6 +4042,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             boost::this_thread::interruption_point();
             pfrom->AddInventoryKnown(inv);
 
+            if (inv.type == MSG_BLOCK)
+                RecordBlockAnnouncement(pfrom, inv.hash);
+
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
@@ -3371,73 +4182,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-        bool fMissingInputs = false;
-        mapAlreadyAskedFor.erase(inv);
-
-        if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs))
+        // Scripts are checked on the verify threads, the message thread moves on to the next message
+        if (!QueueRelayedTx(pfrom, tx))
         {
-            RelayTransaction(tx, inv.hash);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            LOCK(cs_main);
+            ProcessRelayedTx(pfrom, tx, false);
         }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-
-        if (tx.nDoS)
-            pfrom->Misbehaving(tx.nDoS);
     }
     else if (strCommand == "block")
     {
+        unsigned int nBlockBytes = vRecv.size();
         CBlock block;
         vRecv >> block;
         uint256 hashBlock = block.GetHash();
@@ -3449,9 +4209,40 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
+        // The delivery rate is only sampled while a block asked for is in flight. The transfer starts when the previous
+        // block asked for came in, or else when this one was asked for, less the round trip of the request.
+        map<uint256, int64_t>::iterator mi = pfrom->mapBlocksAskedFor.find(hashBlock);
+
+        if (mi != pfrom->mapBlocksAskedFor.end())
+        {
+            int64_t nTransferUsec = mi->second < pfrom->nLastBlockUsec ? nTimeReceived - pfrom->nLastBlockUsec :
+                                    nTimeReceived - mi->second - pfrom->nPingUsecTime;
+
+            if (!pfrom->fInbound && nTransferUsec > 0)
+                addrman.RecordStat(pfrom->addr, ADDRSTAT_DELIVERY, nBlockBytes * 1000000LL / nTransferUsec);
+
+            pfrom->mapBlocksAskedFor.erase(mi);
+            pfrom->nLastBlockUsec = nTimeReceived;
+        }
+
+        // A block pushed without announcing it first counts as its announcement
+        if (!mapBlockFirstSeen.count(hashBlock))
+            RecordBlockAnnouncement(pfrom, hashBlock);
+
         if (ProcessBlock(pfrom, &block))
+        {
             mapAlreadyAskedFor.erase(inv);
 
+            // An orphan is only stored, so wait for a block that made it into the block index
+            static bool fFirstBlock = true;
+            if (fFirstBlock && LookupBlockIndex(hashBlock))
+            {
+                fFirstBlock = false;
+                LogPrintf("first block %s received from peer %s %dms after network start\n",
+                          hashBlock.ToString(), pfrom->addr.ToString(), GetTimeMillis() - nNetworkStartTime);
+            }
+        }
+
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
 
         if (fSecMsgEnabled)
@@ -3535,6 +4326,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     {
                         // Successful ping time measurement, replace previous
                         pfrom->nPingUsecTime = pingUsecTime;
+
+                        if (!pfrom->fInbound)
+                            addrman.RecordStat(pfrom->addr, ADDRSTAT_PING, pingUsecTime);
                     }
                     else
                     {
@@ -3701,6 +4495,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -3737,6 +4532,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordMessageProcessed(strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nProcessStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
 
@@ -3745,7 +4542,12 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        for (std::deque<CNetMessage>::iterator itMsg = pfrom->vRecvMsg.begin(); itMsg != it; ++itMsg)
+            pfrom->RecycleRecvBuffer(*itMsg);
+
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -3860,47 +4662,42 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
+
+            // Relayed tx invs were already sorted into the trickle list by FlushRelayInventory,
+            // so they are only looked at again on this peer's trickle turn
+            if (fSendTrickle)
+            {
+                pto->vInventoryToSend.insert(pto->vInventoryToSend.end(), pto->vInventoryToTrickle.begin(),
+                                             pto->vInventoryToTrickle.end());
+                pto->vInventoryToTrickle.clear();
+            }
+
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
 
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                if (inv.type == MSG_TX && !fSendTrickle && IsTrickleWait(inv))
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    pto->vInventoryToTrickle.push_back(inv);
+                    continue;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv);
+                vInv.push_back(inv);
+
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
         }
 
         if (!vInv.empty())
@@ -3923,6 +4720,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
                 vGetData.push_back(inv);
 
+                if (inv.type == MSG_BLOCK)
+                    pto->mapBlocksAskedFor[inv.hash] = GetTimeMicros();
+
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
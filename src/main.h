@@ -20,6 +20,8 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CValidationState;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1432907775
@@ -28,6 +30,8 @@ class CValidationState;
 static const int64_t DEFAULT_MASTERNODE_COLLATERAL = (30000 * COIN);
 static const int64_t DARKSEND_FEE = (0.002 * COIN);
 static const int64_t DARKSEND_POOL_MAX = (9999999.99 * COIN);
+/** How far back the darksend rounds of an input are followed */
+static const int DARKSEND_ROUNDS_LIMIT = 17;
 
 #define INSTANTX_SIGNATURES_REQUIRED           20
 #define INSTANTX_SIGNATURES_TOTAL              30
@@ -70,10 +74,26 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE / 50;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
-/** The maximum number of orphan transactions kept in memory */
-static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE / 100;
+/** Orphans tried again per cs_main hold after their parents arrived */
+static const unsigned int ORPHAN_TX_BATCH_SIZE = 100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Default for -txverifythreads, workers checking the scripts of relayed transactions (0 = check them inline) */
+static const int DEFAULT_TX_VERIFY_THREADS = 2;
+/** The maximum number of relayed transactions waiting for the verify threads, more are checked inline */
+static const unsigned int MAX_TX_VERIFY_QUEUE = 5000;
+/** Heights apart of the blocks a chain snapshot keeps direct pointers to, bounding the walk to any height */
+static const int CHAIN_SNAPSHOT_STRIDE = 1000;
+/** Proof-of-work blocks averaged over for the network hash rate */
+static const int POW_SPACING_INTERVAL = 72;
+/** Lower bound of that average, in seconds */
+static const int64_t POW_TARGET_SPACING_MIN = 30;
+/** Transactions read back from mempool.dat and accepted per cs_main hold */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 200;
+/** Seconds between writes of mempool.dat while running */
+static const int64_t DUMP_MEMPOOL_INTERVAL = 15 * 60;
+/** Wallet notifications waiting for the wallet thread beyond which the block connect path hands them over itself */
+static const unsigned int MAX_WALLET_QUEUE = 1000;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -104,6 +124,7 @@ inline unsigned int GetTargetSpacing(int nHeight) { return IsProtocolV2(nHeight)
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CTxOrphanPool orphanpool;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
@@ -140,7 +161,11 @@ class CWalletInterface;
 void RegisterWallet(CWalletInterface* pwalletIn); // Register a wallet to receive updates from core
 void UnregisterWallet(CWalletInterface* pwalletIn);
 void UnregisterAllWallets();
-void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fConnect = true);
+void SyncWithWallets(const CTransaction& tx, bool fConnect = true);
+void SyncBlockWithWallets(const CBlock& block, bool fConnect = true);
+void SyncWithWalletQueue(); // Hand everything queued so far to the wallets before going on
+void StartWalletNotifyThread(boost::thread_group& threadGroup);
+void FlushWalletNotifications();
 void ResendWalletTransactions(bool fForce = false); // Ask wallets to resend their transactions
 
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -151,9 +176,16 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+CBlockIndex* LookupBlockIndex(const uint256& hash);
+void AddBlockIndexPos(CBlockIndex* pindex);
+void RemoveBlockIndexPos(CBlockIndex* pindex);
+CBlockIndex* LookupBlockIndexByPos(unsigned int nFile, unsigned int nBlockPos);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+void StartTxVerifyThreads(boost::thread_group& threadGroup);
+void StartMempoolPersist(boost::thread_group& threadGroup);
+bool DumpMempool();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -168,7 +200,31 @@ uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs);
+/** Outcome of checking a transaction and its scripts without cs_main */
+enum TxPreCheckResult
+{
+    TXPRECHECK_VALID,   // Scripts verified, AcceptToMemoryPool may skip them
+    TXPRECHECK_UNKNOWN, // Inputs not found or already pooled, AcceptToMemoryPool decides
+    TXPRECHECK_INVALID  // Can never be accepted
+};
+
+/** How far reloading mempool.dat has got, for getmempoolinfo */
+struct CMempoolLoadProgress
+{
+    bool fLoading;
+    bool fLoaded;
+    uint64_t nTotal;    // Transactions in the file
+    uint64_t nRead;
+    uint64_t nAccepted;
+    uint64_t nFailed;   // Invalid, conflicting, already mined or now paying too little
+    uint64_t nExpired;  // Older than -mempoolexpiry
+};
+
+CMempoolLoadProgress GetMempoolLoadProgress();
+
+TxPreCheckResult PreCheckTransaction(const CTransaction& tx, int& nDoSRet, bool fCacheSigs = true);
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs,
+                        bool fScriptChecked = false, int64_t nAcceptTime = 0);
 bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree, bool* pfMissingInputs);
 
 bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
@@ -1027,6 +1083,41 @@ public:
     }
 };
 
+/** The best chain as of its last change, for readers that do not take cs_main. A snapshot is never modified once
+ *  published, and the block indexes it points to are never freed; only their pnext may change afterwards. */
+class CChainSnapshot
+{
+public:
+    const CBlockIndex* pindexBest;
+    uint256 hashBest;
+    int nHeight;
+    int64_t nMoneySupply;
+    const CBlockIndex* pindexLastPoW;   // Last proof-of-work block, for the difficulty
+    const CBlockIndex* pindexLastPoS;
+    int64_t nTargetSpacingWork;         // Moving average of the spacing of proof-of-work blocks
+    std::vector<const CBlockIndex*> vMilestones; // The ancestor at every CHAIN_SNAPSHOT_STRIDE'th height
+
+    CChainSnapshot()
+    {
+        pindexBest = NULL;
+        hashBest = 0;
+        nHeight = -1;
+        nMoneySupply = 0;
+        pindexLastPoW = NULL;
+        pindexLastPoS = NULL;
+        nTargetSpacingWork = POW_TARGET_SPACING_MIN;
+    }
+
+    // The main chain block at nHeight, or NULL if above the tip
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+};
+
+typedef boost::shared_ptr<const CChainSnapshot> CChainSnapshotRef;
+
+// Replace the published snapshot after the best chain changed. Requires cs_main.
+void PublishChainSnapshot();
+CChainSnapshotRef GetChainSnapshot();
+
 // Capture information about block/transaction validation
 class CValidationState {
 private:
@@ -1117,6 +1208,11 @@ public:
 class CWalletInterface {
 protected:
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock, bool fConnect) =0;
+    virtual void SyncBlock(const CBlock &block, bool fConnect)
+    {
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            SyncTransaction(tx, &block, fConnect);
+    }
     virtual void EraseFromWallet(const uint256 &hash) =0;
     virtual void SetBestChain(const CBlockLocator &locator) =0;
     virtual void UpdatedTransaction(const uint256 &hash) =0;
@@ -61,14 +61,16 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
+    const CTxMemPoolEntry* pentry;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTransaction* ptxIn, const CTxMemPoolEntry* pentryIn)
     {
         ptx = ptxIn;
+        pentry = pentryIn;
         dPriority = dFeePerKb = 0;
     }
 };
@@ -78,7 +80,12 @@ uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTransaction*, const CTxMemPoolEntry*> TxPriority;
+
+// Pooled transactions whose inputs already connected in a template on top of hashTemplateCheckedTip.
+// Later templates on the same tip skip FetchInputs/ConnectInputs for them. Protected by cs_main.
+static uint256 hashTemplateCheckedTip;
+static set<uint256> setTemplateChecked;
 
 class TxPriorityCompare
 {
@@ -105,6 +112,68 @@ public:
     }
 };
 
+// Pooled ancestors go into a block before their descendants
+class CompareEntryByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        return a->nCountWithAncestors < b->nCountWithAncestors;
+    }
+};
+
+// The entry and those of its pooled ancestors that are not in setInBlock yet, in an order valid for a block
+static void GetPackageToInclude(const CTxMemPoolEntry& entry, const set<uint256>& setInBlock,
+                                vector<const CTxMemPoolEntry*>& vPackage)
+{
+    set<uint256> setSeen;
+    vector<const CTxMemPoolEntry*> vWork(1, &entry);
+
+    while (!vWork.empty())
+    {
+        const CTxMemPoolEntry* pentry = vWork.back();
+        vWork.pop_back();
+
+        if (setInBlock.count(pentry->hash) || !setSeen.insert(pentry->hash).second)
+            continue;
+
+        vPackage.push_back(pentry);
+
+        BOOST_FOREACH(const uint256& hashParent, pentry->setParents)
+            vWork.push_back(&*mempool.mapTx.find(hashParent));
+    }
+
+    sort(vPackage.begin(), vPackage.end(), CompareEntryByAncestorCount());
+}
+
+// Check that a pooled transaction connects on top of the block so far and record its outputs in mapTestPool
+static bool TestTemplateTx(CTxDB& txdb, const CTxMemPoolEntry& entry, map<uint256, CTxIndex>& mapTestPool,
+                           CBlockIndex* pindexPrev)
+{
+    if (!setTemplateChecked.count(entry.hash))
+    {
+        CTransaction tx(entry.tx);
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+
+        if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard() policy here, but we still have to ensure
+        // that the block we create only contains transactions that are valid in new blocks.
+        if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev,
+            false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            return false;
+
+        swap(mapTestPool, mapTestPoolTmp);
+        setTemplateChecked.insert(entry.hash);
+    }
+
+    mapTestPool[entry.hash] = CTxIndex(CDiskTxPos(1,1,1), entry.tx.vout.size());
+    return true;
+}
+
 // Create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
 {
@@ -176,6 +245,12 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 
+        if (hashTemplateCheckedTip != pindexPrev->GetBlockHash())
+        {
+            hashTemplateCheckedTip = pindexPrev->GetBlockHash();
+            setTemplateChecked.clear();
+        }
+
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
@@ -184,82 +259,38 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
 
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // Fee, priority inputs and in-pool parents are cached in the pool entries, nothing is read from disk here
+        for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
-            CTransaction& tx = (*mi).second;
+            const CTxMemPoolEntry& entry = *mi;
+            const CTransaction& tx = entry.tx;
 
             if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
                 continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
+            double dPriority = entry.GetPriority(pindexPrev->nHeight);
+            double dFeePerKb = entry.GetFeePerKb();
 
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (entry.setParents.empty())
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory pool should connect to either
-                    // transactions in the chain or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-
-                    continue;
-                }
-
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-
-            if (fMissingInputs)
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &tx, &entry));
                 continue;
+            }
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            // Has to wait for dependencies
+            vOrphan.push_back(COrphan(&tx, &entry));
+            COrphan* porphan = &vOrphan.back();
+            porphan->setDependsOn = entry.setParents;
+            porphan->dPriority = dPriority;
+            porphan->dFeePerKb = dFeePerKb;
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                mapDependers[hashParent].push_back(porphan);
         }
 
         // Collect transactions into block
         map<uint256, CTxIndex> mapTestPool;
+        set<uint256> setInBlock;
         uint64_t nBlockSize = 1000;
         uint64_t nBlockTx = 0;
         int nBlockSigOps = 100;
@@ -268,24 +299,33 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         TxPriorityCompare comparer(fSortedByFee);
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-        while (!vecPriority.empty())
+        // First the high-priority area of the block, regardless of fees
+        while (!fSortedByFee && !vecPriority.empty())
         {
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTxMemPoolEntry& entry = *(vecPriority.front().get<3>());
+
+            // Prioritize by fee once past the priority size or we run out of high-priority transactions
+            if ((nBlockSize + entry.nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))
+            {
+                fSortedByFee = true;
+                break;
+            }
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = entry.nTxSize;
 
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+            // Legacy and P2SH limits on sigOps:
+            unsigned int nTxSigOps = entry.nSigOps;
 
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
@@ -296,60 +336,30 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
 
             // Transaction fee
             int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
+            int64_t nTxFees = entry.nFee;
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if (nTxFees < nMinFee)
                 continue;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority transactions
-            if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+            uint256 hash = entry.hash;
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            if (!TestTemplateTx(txdb, entry, mapTestPool, pindexPrev))
                 continue;
 
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard() policy here, but we still have to ensure
-            // that the block we create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev,
-                false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
             // Added
             pblock->vtx.push_back(tx);
+            setInBlock.insert(hash);
             nBlockSize += nTxSize;
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
 
             if (fDebug && GetBoolArg("-printpriority", false))
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n", dPriority, dFeePerKb, tx.GetHash().ToString());
+                LogPrintf("priority %.1f feeperkb %.1f txid %s\n", dPriority, dFeePerKb, hash.ToString());
 
             // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-
             if (mapDependers.count(hash))
             {
                 BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
@@ -360,7 +370,8 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
 
                         if (porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx,
+                                                             porphan->pentry));
                             std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                         }
                     }
@@ -368,6 +379,98 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             }
         }
 
+        // Then fill the rest of the block by fee rate. Every candidate is taken together with its pooled ancestors
+        // that are not in the block yet, so that a child can pay for its parents. The index is ordered by the fee
+        // rate of the whole ancestor package; the rate checked here only counts the part that is still missing.
+        typedef indexed_transaction_set::index<ancestor_score>::type::iterator ancestoriter;
+
+        for (ancestoriter mi = mempool.mapTx.get<ancestor_score>().begin();
+             mi != mempool.mapTx.get<ancestor_score>().end(); ++mi)
+        {
+            if (setInBlock.count(mi->hash))
+                continue;
+
+            // Past the minimum block size, the remaining packages are all below the minimum fee rate
+            if ((mi->GetAncestorFeePerKb() < nMinTxFee) && (nBlockSize >= nBlockMinSize))
+                break;
+
+            vector<const CTxMemPoolEntry*> vPackage;
+            GetPackageToInclude(*mi, setInBlock, vPackage);
+
+            uint64_t nPackageSize = 0;
+            unsigned int nPackageSigOps = 0;
+            int64_t nPackageFees = 0;
+            bool fAcceptable = true;
+
+            BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+            {
+                const CTransaction& tx = pentry->tx;
+
+                if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight) ||
+                    tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime) ||
+                    pentry->nFee < GetMinFee(tx, nBlockSize + nPackageSize, GMF_BLOCK))
+                {
+                    fAcceptable = false;
+                    break;
+                }
+
+                nPackageSize += pentry->nTxSize;
+                nPackageSigOps += pentry->nSigOps;
+                nPackageFees += pentry->nFee;
+            }
+
+            if (!fAcceptable)
+                continue;
+
+            // Size limits
+            if (nBlockSize + nPackageSize >= nBlockMaxSize)
+                continue;
+
+            // Legacy and P2SH limits on sigOps:
+            if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+                continue;
+
+            // Skip free transactions if we're past the minimum block size:
+            double dFeePerKb = double(nPackageFees) / (double(nPackageSize) / 1000.0);
+
+            if ((dFeePerKb < nMinTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+                continue;
+
+            // All of the package connects or none of it goes in
+            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+
+            BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+            {
+                if (!TestTemplateTx(txdb, *pentry, mapTestPoolTmp, pindexPrev))
+                {
+                    fAcceptable = false;
+                    break;
+                }
+            }
+
+            if (!fAcceptable)
+                continue;
+
+            swap(mapTestPool, mapTestPoolTmp);
+
+            // Added
+            BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+            {
+                pblock->vtx.push_back(pentry->tx);
+                setInBlock.insert(pentry->hash);
+                ++nBlockTx;
+
+                if (fDebug && GetBoolArg("-printpriority", false))
+                {
+                    LogPrintf("priority %.1f feeperkb %.1f txid %s\n", pentry->GetPriority(pindexPrev->nHeight),
+                              dFeePerKb, pentry->hash.ToString());
+                }
+            }
+
+            nBlockSize += nPackageSize;
+            nBlockSigOps += nPackageSigOps;
+            nFees += nPackageFees;
+        }
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
 
@@ -643,6 +746,9 @@ void ThreadStakeMiner(CWallet *pwallet)
             }
         }
 
+        // Stake with what the wallet knows of the latest blocks
+        SyncWithWalletQueue();
+
         // Create new block
         int64_t nFees;
         unique_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
@@ -25,6 +25,7 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#include <boost/shared_ptr.hpp>
 #include <curl/curl.h>
 #include <regex>
 
@@ -43,6 +44,15 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 76;
 static const int OPEN_ADDED_CONNECTION_RETRY_TIMEOUT_MS = 60000;
 
+// Minimum time (in seconds) between evictions of the slowest outbound peer while all slots are in use
+static const int OUTBOUND_EVICTION_INTERVAL = 10 * 60;
+// Outbound peers younger than this (in seconds) have too few measurements to be evicted
+static const int OUTBOUND_EVICTION_MIN_AGE = 10 * 60;
+// While fewer outbound peers than this are connected, connection attempts are raced in parallel
+static const int PARALLEL_CONNECT_THRESHOLD = 8;
+// Candidate addresses raced per free outbound slot in a parallel connection round
+static const int PARALLEL_CONNECT_FANOUT = 4;
+
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
 struct LocalServiceInfo {
@@ -61,6 +71,7 @@ static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
+int64_t nNetworkStartTime = 0;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -69,6 +80,10 @@ deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
 
+// Inventory queued by RelayInventory, handed out to all peers in one pass by ThreadMessageHandler
+static vector<CInv> vRelayInventory;
+static CCriticalSection cs_vRelayInventory;
+
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
 
@@ -361,6 +376,31 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+// Wrap a freshly connected non-blocking socket in a CNode and hand it to the socket handler
+static CNode* AddConnectedNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest, int64_t nConnectStartUsec)
+{
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    pnode->AddRef();
+
+    pnode->nTimeConnected = GetTime();
+    pnode->nConnectStartUsec = nConnectStartUsec;
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+
+        static bool fFirstConnection = true;
+        if (fFirstConnection)
+        {
+            fFirstConnection = false;
+            LogPrintf("first outbound connection to %s %dms after network start\n",
+                      pszDest ? pszDest : addrConnect.ToString(), GetTimeMillis() - nNetworkStartTime);
+        }
+    }
+
+    return pnode;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaster)
 {
     if (pszDest == NULL)
@@ -387,6 +427,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
     // Connect
     SOCKET hSocket;
     bool proxyConnectionFailed = false;
+    int64_t nConnectStartUsec = GetTimeMicros();
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
@@ -403,17 +444,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
             LogPrintf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
 #endif
 
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
-
-        pnode->nTimeConnected = GetTime();
-        return pnode;
+        return AddConnectedNode(hSocket, addrConnect, pszDest, nConnectStartUsec);
     }
     else if (!proxyConnectionFailed)
     {
@@ -546,9 +577,52 @@ void CNode::copyStats(CNodeStats &stats)
     
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+    stats.nMemoryUsage = GetMemoryUsage();
+
+    stats.vMessageTotals.resize(MSG_TYPE_COUNT);
+    for (int i = 0; i < MSG_TYPE_COUNT; i++)
+        stats.vMessageTotals[i] = vMessageStats[i].GetTotals();
 }
 #undef X
 
+size_t CNode::GetMemoryUsage()
+{
+    size_t nUsage = sizeof(CNode);
+
+    {
+        LOCK(cs_inventory);
+        nUsage += filterInventoryKnown.DynamicMemoryUsage();
+        nUsage += (vInventoryToSend.capacity() + vInventoryToTrickle.capacity()) * sizeof(CInv);
+    }
+
+    // Tree nodes carry three pointers and a color besides the element
+    nUsage += mapAskFor.size() * (sizeof(std::pair<int64_t, CInv>) + 4 * sizeof(void*));
+    nUsage += setAddrKnown.size() * (2 * sizeof(CAddress) + 4 * sizeof(void*));
+    nUsage += vAddrToSend.capacity() * sizeof(CAddress);
+
+    // The buffers may be busy, in which case they are left out of the estimate
+    {
+        TRY_LOCK(cs_vRecvMsg, lockRecv);
+
+        if (lockRecv)
+        {
+            BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
+                nUsage += msg.vRecv.capacity() + msg.hdrbuf.capacity();
+
+            BOOST_FOREACH(const CSerializeData &data, vRecvBufferPool)
+                nUsage += data.capacity();
+        }
+    }
+    {
+        TRY_LOCK(cs_vSend, lockSend);
+
+        if (lockSend)
+            nUsage += nSendSize + ssSend.capacity();
+    }
+
+    return nUsage;
+}
+
 // Requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -557,8 +631,17 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         // Get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
+        {
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
 
+            // Reuse the allocation of an already processed message if we have one
+            if (!vRecvBufferPool.empty())
+            {
+                vRecvMsg.back().vRecv.SwapBuffer(vRecvBufferPool.back());
+                vRecvBufferPool.pop_back();
+            }
+        }
+
         CNetMessage& msg = vRecvMsg.back();
 
         // Absorb network data
@@ -581,6 +664,17 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// Requires LOCK(cs_vRecvMsg)
+void CNode::RecycleRecvBuffer(CNetMessage& msg)
+{
+    if (vRecvBufferPool.size() >= RECV_BUFFER_POOL_SIZE || msg.vRecv.capacity() > MAX_POOLED_RECV_BUFFER)
+        return;
+
+    msg.vRecv.clear();
+    vRecvBufferPool.push_back(CSerializeData(PublicDataAllocator()));
+    msg.vRecv.SwapBuffer(vRecvBufferPool.back());
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // Copy data to temporary parsing buffer
@@ -608,6 +702,10 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // Size the payload buffer from the header, but bound the reservation so that a peer
+    // announcing a huge message cannot make us allocate memory it never sends
+    vRecv.reserve(std::min(hdr.nMessageSize, MAX_RECV_PREALLOC));
+
     // Switch state to reading message data
     in_data = true;
     return nCopy;
@@ -618,13 +716,8 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy)
-    {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
-
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Append rather than resize and copy, so the buffer is never zero-filled first
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
     return nCopy;
 }
@@ -1131,6 +1224,26 @@ void MapPort(bool)
 }
 #endif /* USE_UPNP */
 
+static void ResolveDNSSeed(const CDNSSeedData &seed, boost::shared_ptr<vector<int> > pvFound, unsigned int nSeed)
+{
+    vector<CNetAddr> vIPs;
+    vector<CAddress> vAdd;
+
+    if (LookupHost(seed.host.c_str(), vIPs))
+    {
+        BOOST_FOREACH(CNetAddr& ip, vIPs)
+        {
+            int nOneDay = 24*3600;
+            CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
+            addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+            vAdd.push_back(addr);
+        }
+    }
+
+    addrman.Add(vAdd, CNetAddr(seed.name, true));
+    (*pvFound)[nSeed] = vAdd.size();
+}
+
 void ThreadDNSAddressSeed()
 {
     // Only query DNS seeds if address need is acute
@@ -1152,32 +1265,23 @@ void ThreadDNSAddressSeed()
 
     LogPrintf("Loading addresses from DNS seeds (could take a while)\n");
 
-    BOOST_FOREACH(const CDNSSeedData &seed, vSeeds)
+    // Resolve all seeds at once so that one slow or dead seed does not hold up the others. The
+    // resolvers share ownership of the results as they outlive this thread if it is interrupted.
+    boost::shared_ptr<vector<int> > pvFound(new vector<int>(vSeeds.size(), 0));
+    boost::thread_group resolverGroup;
+
+    for (unsigned int i = 0; i < vSeeds.size(); i++)
     {
         if (HaveNameProxy())
-        {
-            AddOneShot(seed.host);
-        }
+            AddOneShot(vSeeds[i].host);
         else
-        {
-            vector<CNetAddr> vIPs;
-            vector<CAddress> vAdd;
+            resolverGroup.create_thread(boost::bind(&ResolveDNSSeed, boost::cref(vSeeds[i]), pvFound, i));
+    }
 
-            if (LookupHost(seed.host.c_str(), vIPs))
-            {
-                BOOST_FOREACH(CNetAddr& ip, vIPs)
-                {
-                    int nOneDay = 24*3600;
-                    CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
-                    addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
-            }
+    resolverGroup.join_all();
 
-            addrman.Add(vAdd, CNetAddr(seed.name, true));
-        }
-    }
+    BOOST_FOREACH(int n, *pvFound)
+        found += n;
 
     LogPrintf("%d addresses found from DNS seeds\n", found);
 }
@@ -1216,6 +1320,151 @@ void static ProcessOneShot()
     }
 }
 
+// Disconnect the outbound peer that measured worst, if it is clearly worse than the others,
+// so that ThreadOpenConnections can replace it. Returns true if a peer was disconnected.
+static bool EvictWorstOutboundPeer()
+{
+    vector<pair<double, CNode*> > vCandidates;
+    int64_t nNow = GetTime();
+
+    {
+        LOCK2(cs_setservAddNodeAddresses, cs_vNodes);
+
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            // Never evict inbound, manually added or special purpose peers, or our sync peer
+            if (pnode->fInbound || pnode->fOneShot || pnode->fDarkSendMaster || pnode->fDisconnect ||
+                !pnode->fSuccessfullyConnected || pnode == pnodeSync || nNow - pnode->nTimeConnected < OUTBOUND_EVICTION_MIN_AGE)
+                continue;
+
+            if (setservAddNodeAddresses.count(pnode->addr))
+                continue;
+
+            CAddrStats stats = addrman.GetStats(pnode->addr);
+
+            // Fold the current ping of this connection into a copy of the smoothed history, as a fresh sample
+            if (pnode->nPingUsecTime > 0)
+                stats.Update(ADDRSTAT_PING, pnode->nPingUsecTime, nNow);
+
+            vCandidates.push_back(make_pair(stats.GetPerformanceFactor(), pnode));
+        }
+
+        if (vCandidates.size() < 4)
+            return false;
+
+        sort(vCandidates.begin(), vCandidates.end());
+        double fMedian = vCandidates[vCandidates.size() / 2].first;
+        CNode* pnodeWorst = vCandidates.front().second;
+
+        // Leave well enough alone when the worst peer is only a bit slower than typical
+        if (vCandidates.front().first >= fMedian / 2)
+            return false;
+
+        LogPrint("net", "evicting slow outbound peer %s (score %.3f, median %.3f)\n",
+                 pnodeWorst->addrName, vCandidates.front().first, fMedian);
+        pnodeWorst->fDisconnect = true;
+    }
+
+    return true;
+}
+
+// Choose an address to connect to based on most recently seen, skipping the network groups in setConnected
+static CAddress SelectOutboundAddress(const set<vector<unsigned char> >& setConnected, int nOutbound)
+{
+    int64_t nANow = GetAdjustedTime();
+    int nTries = 0;
+
+    while (true)
+    {
+        // Use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
+        CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
+
+        // if we selected an invalid address, restart
+        if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+            break;
+
+        // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
+        // stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
+        // already-connected network ranges, ...) before trying new addrman addresses.
+        nTries++;
+
+        if (nTries > 100)
+            break;
+
+        if (IsLimited(addr))
+            continue;
+
+        // Only consider very recently tried nodes after 30 failed attempts
+        if (nANow - addr.nLastTry < 600 && nTries < 30)
+            continue;
+
+        // Do not allow non-default ports, unless after 50 invalid addresses selected already
+        if (addr.GetPort() != Params().GetDefaultPort() && nTries < 50)
+            continue;
+
+        return addr;
+    }
+
+    return CAddress();
+}
+
+// Parallel connects are made directly, connections through a proxy keep going one at a time
+static bool CanConnectInParallel()
+{
+    proxyType proxy;
+    return !HaveNameProxy() && !GetProxy(NET_IPV4, proxy) && !GetProxy(NET_IPV6, proxy);
+}
+
+// Race non-blocking connects to all of vAddrConnect and keep the first ones to complete, one for each of
+// the outbound grants in vGrants. Grants left unused are released when vGrants goes out of scope.
+static void OpenNetworkConnectionsParallel(const vector<CAddress>& vAddrConnect,
+                                           vector<boost::shared_ptr<CSemaphoreGrant> >& vGrants)
+{
+    vector<CAddress> vCandidates;
+    vector<CService> vService;
+
+    BOOST_FOREACH(const CAddress& addr, vAddrConnect)
+    {
+        if (IsLocal(addr) || FindNode((CNetAddr)addr) || CNode::IsBanned(addr) ||
+            FindNode(addr.ToStringIPPort().c_str()))
+            continue;
+
+        LogPrint("net", "trying connection %s lastseen=%.1fhrs\n",
+                 addr.ToString(), (double)(GetAdjustedTime() - addr.nTime)/3600.0);
+
+        vCandidates.push_back(addr);
+        vService.push_back(addr);
+    }
+
+    if (vCandidates.empty())
+        return;
+
+    int64_t nConnectStartUsec = GetTimeMicros();
+    vector<SOCKET> vSocket;
+    vector<bool> vfFinished;
+    int nConnected = ConnectSocketsParallel(vService, vSocket, vfFinished, nConnectTimeout, vGrants.size());
+
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
+    {
+        // Attempts cancelled before they got an answer say nothing about the address
+        if (vfFinished[i])
+            addrman.Attempt(vCandidates[i]);
+
+        if (vSocket[i] == INVALID_SOCKET)
+            continue;
+
+        LogPrint("net", "connected %s\n", vCandidates[i].ToString());
+
+        CNode* pnode = AddConnectedNode(vSocket[i], vCandidates[i], NULL, nConnectStartUsec);
+        vGrants.back()->MoveTo(pnode->grantOutbound);
+        vGrants.pop_back();
+        pnode->fNetworkNode = true;
+    }
+
+    LogPrint("net", "parallel connect: %d of %u candidates connected in %dms\n", nConnected, vCandidates.size(),
+             (GetTimeMicros() - nConnectStartUsec) / 1000);
+}
+
 void ThreadOpenConnections()
 {
     // Connect to specific addresses
@@ -1242,13 +1491,24 @@ void ThreadOpenConnections()
 
     // Initiate network connections
     int64_t nStart = GetTime();
+    int64_t nLastEviction = GetTime();
 
     while (true)
     {
         ProcessOneShot();
         MilliSleep(500);
 
-        CSemaphoreGrant grant(*semOutbound);
+        CSemaphoreGrant grant(*semOutbound, true);
+
+        if (!grant)
+        {
+            // All outbound slots are in use, now and then make room by dropping the slowest peer
+            if (GetTime() - nLastEviction > OUTBOUND_EVICTION_INTERVAL && EvictWorstOutboundPeer())
+                nLastEviction = GetTime();
+
+            grant.Acquire();
+        }
+
         boost::this_thread::interruption_point();
 
         // Add seed nodes if DNS seeds are all down (an infrastructure attack?).
@@ -1263,9 +1523,6 @@ void ThreadOpenConnections()
             }
         }
 
-        // Choose an address to connect to based on most recently seen
-        CAddress addrConnect;
-
         // Only connect out to one peer per network group (/16 for IPv4).
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
         int nOutbound = 0;
@@ -1282,41 +1539,47 @@ void ThreadOpenConnections()
             }
         }
 
-        int64_t nANow = GetAdjustedTime();
-        int nTries = 0;
-
-        while (true)
+        // Short of peers, e.g. right after startup: race connects to several candidates for every
+        // free slot instead of waiting out -timeout on each dead address in turn
+        if (nOutbound < PARALLEL_CONNECT_THRESHOLD && CanConnectInParallel())
         {
-            // Use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
-            CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
+            vector<boost::shared_ptr<CSemaphoreGrant> > vGrants;
+            vGrants.push_back(boost::shared_ptr<CSemaphoreGrant>(new CSemaphoreGrant()));
+            grant.MoveTo(*vGrants.back());
 
-            // if we selected an invalid address, restart
-            if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
-                break;
+            while ((int)vGrants.size() < PARALLEL_CONNECT_THRESHOLD - nOutbound)
+            {
+                boost::shared_ptr<CSemaphoreGrant> pgrant(new CSemaphoreGrant(*semOutbound, true));
 
-            // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
-            // stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
-            // already-connected network ranges, ...) before trying new addrman addresses.
-            nTries++;
+                if (!*pgrant)
+                    break;
 
-            if (nTries > 100)
-                break;
+                vGrants.push_back(pgrant);
+            }
 
-            if (IsLimited(addr))
-                continue;
+            vector<CAddress> vAddrConnect;
+            int nCandidates = min((int)vGrants.size() * PARALLEL_CONNECT_FANOUT, MAX_OUTBOUND_CONNECTIONS);
 
-            // Only consider very recently tried nodes after 30 failed attempts
-            if (nANow - addr.nLastTry < 600 && nTries < 30)
-                continue;
+            for (int i = 0; i < nCandidates; i++)
+            {
+                CAddress addr = SelectOutboundAddress(setConnected, nOutbound);
 
-            // Do not allow non-default ports, unless after 50 invalid addresses selected already
-            if (addr.GetPort() != Params().GetDefaultPort() && nTries < 50)
-                continue;
+                if (!addr.IsValid())
+                    break;
 
-            addrConnect = addr;
-            break;
+                setConnected.insert(addr.GetGroup());
+                vAddrConnect.push_back(addr);
+            }
+
+            if (!vAddrConnect.empty())
+                OpenNetworkConnectionsParallel(vAddrConnect, vGrants);
+
+            continue;
         }
 
+        // Choose an address to connect to based on most recently seen
+        CAddress addrConnect = SelectOutboundAddress(setConnected, nOutbound);
+
         if (addrConnect.IsValid())
             OpenNetworkConnection(addrConnect, &grant);
     }
@@ -1487,6 +1750,71 @@ void static StartSync(const vector<CNode*> &vNodes)
     }
 }
 
+// Tx invs are trickled out to protect privacy, except for a pseudo-random 1/4 of them that is blasted
+// to all peers immediately. The choice only depends on the inv, so it is the same for every peer.
+bool IsTrickleWait(const CInv& inv)
+{
+    static uint256 hashSalt;
+
+    if (hashSalt == 0)
+        hashSalt = GetRandHash();
+
+    uint256 hashRand = inv.hash ^ hashSalt;
+    hashRand = Hash(BEGIN(hashRand), END(hashRand));
+    return (hashRand & 3) != 0;
+}
+
+void RelayInventory(const CInv& inv)
+{
+    // Put on the list to offer to the other nodes on the next message handler pass
+    LOCK(cs_vRelayInventory);
+    vRelayInventory.push_back(inv);
+}
+
+void FlushRelayInventory(const vector<CNode*>& vNodesToRelay)
+{
+    vector<CInv> vBatch;
+    {
+        LOCK(cs_vRelayInventory);
+        vBatch.swap(vRelayInventory);
+    }
+
+    if (vBatch.empty())
+        return;
+
+    // Each inv is deduplicated and classified once for the batch instead of once per peer
+    set<CInv> setSeen;
+    vector<CInv> vImmediate;
+    vector<CInv> vTrickle;
+
+    BOOST_FOREACH(const CInv& inv, vBatch)
+    {
+        if (!setSeen.insert(inv).second)
+            continue;
+
+        if (inv.type == MSG_TX && IsTrickleWait(inv))
+            vTrickle.push_back(inv);
+        else
+            vImmediate.push_back(inv);
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodesToRelay)
+    {
+        if (pnode->fDisconnect)
+            continue;
+
+        LOCK(pnode->cs_inventory);
+
+        BOOST_FOREACH(const CInv& inv, vImmediate)
+            if (!pnode->filterInventoryKnown.contains(inv))
+                pnode->vInventoryToSend.push_back(inv);
+
+        BOOST_FOREACH(const CInv& inv, vTrickle)
+            if (!pnode->filterInventoryKnown.contains(inv))
+                pnode->vInventoryToTrickle.push_back(inv);
+    }
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
@@ -1513,6 +1841,8 @@ void ThreadMessageHandler()
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
+        FlushRelayInventory(vNodesCopy);
+
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
 
@@ -1741,6 +2071,8 @@ void static Discover(boost::thread_group& threadGroup)
 
 void StartNode(boost::thread_group& threadGroup)
 {
+    nNetworkStartTime = GetTimeMillis();
+
     if (semOutbound == NULL)
     {
         // Initialize semaphore
@@ -1780,6 +2112,11 @@ void StartNode(boost::thread_group& threadGroup)
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
 
+    // Log traffic by message type
+    int64_t nMsgStatsInterval = GetArg("-msgstatsinterval", DEFAULT_MSG_STATS_INTERVAL);
+    if (nMsgStatsInterval > 0)
+        threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "msgstats", &LogMessageStats, nMsgStatsInterval * 1000));
+
     // Find and check for releases
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "findreleases", &FindReleases, FIND_RELEASES_INTERVAL * 1000));
 }
@@ -1979,6 +2316,150 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+// Message types with their own counters, anything else is accounted under the trailing "other"
+static const char* const vMessageTypeNames[] = {
+    "version", "verack", "addr", "getaddr", "inv", "getdata", "notfound", "getblocks", "getheaders", "headers",
+    "tx", "block", "mempool", "ping", "pong", "alert", "spork", "getsporks",
+    "dsa", "dsc", "dsee", "dseep", "dseg", "dsf", "dsi", "dsq", "dss", "dssu", "dssub", "dstx",
+    "mnget", "mnw", "txlreq", "txlvote",
+    "smsgDisabled", "smsgHave", "smsgIgnore", "smsgInv", "smsgMatch", "smsgMsg", "smsgPing", "smsgPong",
+    "smsgShow", "smsgWant",
+    "other"
+};
+
+static_assert(sizeof(vMessageTypeNames) / sizeof(vMessageTypeNames[0]) == MSG_TYPE_COUNT,
+              "MSG_TYPE_COUNT does not match the message type table");
+
+// ProcessMessage latency histogram of one message type, counted like CMessageTypeStats
+class CMessageLatencyHistogram
+{
+private:
+    std::atomic<uint64_t> vBuckets[MSG_LATENCY_BUCKETS];
+
+public:
+    CMessageLatencyHistogram()
+    {
+        for (int i = 0; i < MSG_LATENCY_BUCKETS; i++)
+            vBuckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    void Record(uint64_t nUsec)
+    {
+        int nBucket = 0;
+        while (nBucket < MSG_LATENCY_BUCKETS - 1 && (nUsec >> nBucket) != 0)
+            nBucket++;
+
+        vBuckets[nBucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<uint64_t> Get() const
+    {
+        std::vector<uint64_t> vRet(MSG_LATENCY_BUCKETS);
+        for (int i = 0; i < MSG_LATENCY_BUCKETS; i++)
+            vRet[i] = vBuckets[i].load(std::memory_order_relaxed);
+
+        return vRet;
+    }
+};
+
+static CMessageTypeStats vTotalMessageStats[MSG_TYPE_COUNT];
+static CMessageLatencyHistogram vMessageLatency[MSG_TYPE_COUNT];
+
+static std::map<std::string, int> BuildMessageTypeMap()
+{
+    std::map<std::string, int> mapRet;
+    for (int i = 0; i < MSG_TYPE_COUNT - 1; i++)
+        mapRet[vMessageTypeNames[i]] = i;
+
+    return mapRet;
+}
+
+int GetMessageType(const std::string& strCommand)
+{
+    // Built once, read-only afterwards
+    static const std::map<std::string, int> mapTypes = BuildMessageTypeMap();
+
+    std::map<std::string, int>::const_iterator it = mapTypes.find(strCommand);
+    return it == mapTypes.end() ? MSG_TYPE_COUNT - 1 : it->second;
+}
+
+const char* GetMessageTypeName(int nType)
+{
+    assert(nType >= 0 && nType < MSG_TYPE_COUNT);
+    return vMessageTypeNames[nType];
+}
+
+void CNode::RecordMessageSent(int nType, uint64_t nBytes)
+{
+    vMessageStats[nType].RecordSent(nBytes);
+    vTotalMessageStats[nType].RecordSent(nBytes);
+}
+
+void CNode::RecordMessageProcessed(const std::string& strCommand, uint64_t nBytes, int64_t nProcessUsec)
+{
+    int nType = GetMessageType(strCommand);
+    uint64_t nUsec = std::max(nProcessUsec, (int64_t)0);
+
+    vMessageStats[nType].RecordRecv(nBytes, nUsec);
+    vTotalMessageStats[nType].RecordRecv(nBytes, nUsec);
+    vMessageLatency[nType].Record(nUsec);
+}
+
+CMessageTypeTotals GetMessageTypeTotals(int nType)
+{
+    assert(nType >= 0 && nType < MSG_TYPE_COUNT);
+    return vTotalMessageStats[nType].GetTotals();
+}
+
+std::vector<uint64_t> GetMessageLatency(int nType)
+{
+    assert(nType >= 0 && nType < MSG_TYPE_COUNT);
+    return vMessageLatency[nType].Get();
+}
+
+struct CompareMessageTraffic
+{
+    bool operator()(const std::pair<uint64_t, int>& a, const std::pair<uint64_t, int>& b) const
+    {
+        return a.first > b.first;
+    }
+};
+
+// Log the busiest message types since the previous call, run every -msgstatsinterval seconds
+void LogMessageStats()
+{
+    static CMessageTypeTotals vLast[MSG_TYPE_COUNT];
+    vector<pair<uint64_t, int> > vTraffic;
+    vector<CMessageTypeTotals> vDelta(MSG_TYPE_COUNT);
+
+    for (int i = 0; i < MSG_TYPE_COUNT; i++)
+    {
+        CMessageTypeTotals totals = vTotalMessageStats[i].GetTotals();
+        vDelta[i].nMsgsRecv = totals.nMsgsRecv - vLast[i].nMsgsRecv;
+        vDelta[i].nBytesRecv = totals.nBytesRecv - vLast[i].nBytesRecv;
+        vDelta[i].nMsgsSent = totals.nMsgsSent - vLast[i].nMsgsSent;
+        vDelta[i].nBytesSent = totals.nBytesSent - vLast[i].nBytesSent;
+        vDelta[i].nProcessUsec = totals.nProcessUsec - vLast[i].nProcessUsec;
+        vLast[i] = totals;
+
+        if (vDelta[i].nBytesRecv + vDelta[i].nBytesSent > 0)
+            vTraffic.push_back(make_pair(vDelta[i].nBytesRecv + vDelta[i].nBytesSent, i));
+    }
+
+    sort(vTraffic.begin(), vTraffic.end(), CompareMessageTraffic());
+
+    string strStats;
+    for (unsigned int i = 0; i < vTraffic.size() && i < 10; i++)
+    {
+        const CMessageTypeTotals& delta = vDelta[vTraffic[i].second];
+        strStats += strprintf(" %s=%u/%uB in %u/%uB out %dms", GetMessageTypeName(vTraffic[i].second),
+                              delta.nMsgsRecv, delta.nBytesRecv, delta.nMsgsSent, delta.nBytesSent,
+                              delta.nProcessUsec / 1000);
+    }
+
+    LogPrintf("msgstats:%s\n", strStats.empty() ? " idle" : strStats);
+}
+
 CAddrDB::CAddrDB()
 {
     pathAddr = GetDataDir() / "peers.dat";
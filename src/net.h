@@ -7,6 +7,7 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include <atomic>
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
@@ -18,6 +19,7 @@
 #include <arpa/inet.h>
 #endif
 
+#include "bloom.h"
 #include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -37,6 +39,13 @@ static const int PING_INTERVAL = 1 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
 
+/** Maximum payload buffer reserved up front from a message header, before its data has arrived. */
+static const unsigned int MAX_RECV_PREALLOC = 256 * 1024;
+/** Number of spare payload buffers kept per peer for reuse by later messages. */
+static const unsigned int RECV_BUFFER_POOL_SIZE = 4;
+/** Payload buffers with a larger capacity than this are freed instead of being pooled. */
+static const unsigned int MAX_POOLED_RECV_BUFFER = 2 * 1024 * 1024;
+
 inline unsigned int ReceiveFloodSize() { return 2000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 5000*GetArg("-maxsendbuffer", 1*1000); }
 
@@ -108,6 +117,8 @@ extern bool fDiscover;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
+/** GetTimeMillis() when StartNode() ran, for startup latency reporting */
+extern int64_t nNetworkStartTime;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -123,6 +134,72 @@ extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
 
+/** Number of message types with their own traffic counters, the last one collects all unknown commands */
+static const int MSG_TYPE_COUNT = 45;
+/** Buckets of the message processing latency histogram, bucket i counts runs of [2^(i-1), 2^i) microseconds */
+static const int MSG_LATENCY_BUCKETS = 24;
+/** Default for -msgstatsinterval, seconds between message statistics log lines (0 = off) */
+static const int DEFAULT_MSG_STATS_INTERVAL = 0;
+
+int GetMessageType(const std::string& strCommand);
+const char* GetMessageTypeName(int nType);
+
+/** Snapshot of the traffic counters of one message type */
+struct CMessageTypeTotals
+{
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nProcessUsec;
+
+    CMessageTypeTotals() : nMsgsRecv(0), nBytesRecv(0), nMsgsSent(0), nBytesSent(0), nProcessUsec(0) { }
+};
+
+/** Traffic counters of one message type. They are bumped with relaxed atomics from the socket and message
+ *  handler threads, readers see values that may lag slightly behind but never hold up the hot path. */
+class CMessageTypeStats
+{
+private:
+    std::atomic<uint64_t> nMsgsRecv;
+    std::atomic<uint64_t> nBytesRecv;
+    std::atomic<uint64_t> nMsgsSent;
+    std::atomic<uint64_t> nBytesSent;
+    std::atomic<uint64_t> nProcessUsec;
+
+public:
+    CMessageTypeStats() : nMsgsRecv(0), nBytesRecv(0), nMsgsSent(0), nBytesSent(0), nProcessUsec(0) { }
+
+    void RecordRecv(uint64_t nBytes, uint64_t nUsec)
+    {
+        nMsgsRecv.fetch_add(1, std::memory_order_relaxed);
+        nBytesRecv.fetch_add(nBytes, std::memory_order_relaxed);
+        nProcessUsec.fetch_add(nUsec, std::memory_order_relaxed);
+    }
+
+    void RecordSent(uint64_t nBytes)
+    {
+        nMsgsSent.fetch_add(1, std::memory_order_relaxed);
+        nBytesSent.fetch_add(nBytes, std::memory_order_relaxed);
+    }
+
+    CMessageTypeTotals GetTotals() const
+    {
+        CMessageTypeTotals totals;
+        totals.nMsgsRecv = nMsgsRecv.load(std::memory_order_relaxed);
+        totals.nBytesRecv = nBytesRecv.load(std::memory_order_relaxed);
+        totals.nMsgsSent = nMsgsSent.load(std::memory_order_relaxed);
+        totals.nBytesSent = nBytesSent.load(std::memory_order_relaxed);
+        totals.nProcessUsec = nProcessUsec.load(std::memory_order_relaxed);
+        return totals;
+    }
+};
+
+/** Node wide counters and ProcessMessage latency histogram of a message type */
+CMessageTypeTotals GetMessageTypeTotals(int nType);
+std::vector<uint64_t> GetMessageLatency(int nType);
+void LogMessageStats();
+
 class CNodeStats
 {
 public:
@@ -145,6 +222,8 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    uint64_t nMemoryUsage;
+    std::vector<CMessageTypeTotals> vMessageTotals;
 };
 
 
@@ -163,7 +242,9 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    // Network payloads are public, so their buffers are not cleansed on free
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn, PublicDataAllocator()),
+                                               vRecv(nTypeIn, nVersionIn, PublicDataAllocator())
     {
         hdrbuf.resize(24);
         in_data = false;
@@ -229,16 +310,22 @@ public:
     uint64_t nSendBytes;
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
+    int nSendMsgType;   // Message type being built in ssSend, protected by cs_vSend
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
+    std::vector<CSerializeData> vRecvBufferPool; // Spare payload buffers, protected by cs_vRecvMsg
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    CMessageTypeStats vMessageStats[MSG_TYPE_COUNT]; // Traffic with this peer by message type
 
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nTimeConnected;
+    int64_t nConnectStartUsec; // When connecting (outbound) or accepting (inbound) began, for handshake latency
+    std::map<uint256, int64_t> mapBlocksAskedFor; // Blocks asked for with getdata and when, for the delivery rate
+    int64_t nLastBlockUsec;    // When the last block asked for came in
     //int64_t nTimeOffset;
     CAddress addr;
     std::string addrName;
@@ -292,8 +379,9 @@ public:
     uint256 hashCheckpointKnown; // Known sent sync-checkpoint
 
     // Inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    std::vector<CInv> vInventoryToTrickle; // Transaction invs held back until this peer's trickle turn
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -313,7 +401,8 @@ public:
     bool fPingQueued;
 
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) :
-        ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+        ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000),
+        filterInventoryKnown(SendBufferSize() / 1000, 0.000001, GetRand(std::numeric_limits<unsigned int>::max()))
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -323,6 +412,8 @@ public:
         nSendBytes = 0;
         nRecvBytes = 0;
         nTimeConnected = GetTime();
+        nConnectStartUsec = GetTimeMicros();
+        nLastBlockUsec = 0;
 
         // nTimeOffset = 0;
 
@@ -339,6 +430,7 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        nSendMsgType = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -347,7 +439,6 @@ public:
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
@@ -407,6 +498,9 @@ public:
     // Requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Requires LOCK(cs_vRecvMsg)
+    void RecycleRecvBuffer(CNetMessage& msg);
+
     // Requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -445,7 +539,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -454,11 +548,14 @@ public:
         {
             LOCK(cs_inventory);
 
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    // Approximate memory held for this peer's buffers and relay state
+    size_t GetMemoryUsage();
+
     void AskFor(const CInv& inv)
     {
         // We're using mapAskFor as a priority queue,
@@ -485,6 +582,7 @@ public:
         ENTER_CRITICAL_SECTION(cs_vSend);
         assert(ssSend.size() == 0);
         ssSend << CMessageHeader(pszCommand, 0);
+        nSendMsgType = GetMessageType(pszCommand);
         LogPrint("net", "sending: %s ", pszCommand);
     }
 
@@ -521,6 +619,7 @@ public:
         memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
         LogPrint("net", "(%d bytes)\n", nSize);
+        RecordMessageSent(nSendMsgType, ssSend.size());
 
         std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
         ssSend.GetAndClear(*it);
@@ -749,6 +848,8 @@ template<typename T1, typename T2, typename T3, typename T4, typename T5, typena
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+    void RecordMessageSent(int nType, uint64_t nBytes);
+    void RecordMessageProcessed(const std::string& strCommand, uint64_t nBytes, int64_t nProcessUsec);
 
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
@@ -758,15 +859,9 @@ template<typename T1, typename T2, typename T3, typename T4, typename T5, typena
     static uint64_t GetTotalBytesSent();
 };
 
-inline void RelayInventory(const CInv& inv)
-{
-    // Put on lists to offer to the other nodes
-    {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH(CNode* pnode, vNodes)
-            pnode->PushInventory(inv);
-    }
-}
+bool IsTrickleWait(const CInv& inv);
+void RelayInventory(const CInv& inv);
+void FlushRelayInventory(const std::vector<CNode*>& vNodesToRelay);
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
@@ -309,9 +309,12 @@ bool static Socks5(string strDest, int port, SOCKET& hSocket)
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+// Create a non-blocking socket and begin connecting it to addrConnect. fPendingRet is set when the
+// connection is still in progress and has to be waited for with select().
+bool static StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet, bool& fPendingRet)
 {
     hSocketRet = INVALID_SOCKET;
+    fPendingRet = false;
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
 
@@ -350,57 +353,86 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
 
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-
-            if (nRet == 0)
-            {
-                LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
-                closesocket(hSocket);
-                return false;
-            }
+            fPendingRet = true;
+        }
+#ifdef WIN32
+        else if (nErr != WSAEISCONN)
+#else
+        else
+#endif
+        {
+            LogPrintf("connect() to %s failed: %i\n", addrConnect.ToString(), nErr);
+            closesocket(hSocket);
+            return false;
+        }
+    }
 
-            if (nRet == SOCKET_ERROR)
-            {
-                LogPrintf("select() for %s failed: %i\n", addrConnect.ToString(), WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
+    hSocketRet = hSocket;
+    return true;
+}
 
-            socklen_t nRetSize = sizeof(nRet);
+// Fetch the outcome of a non-blocking connect that select() reported as writable
+bool static FinishConnectSocket(const CService &addrConnect, SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
 
 #ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
 #else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
 #endif
-            {
-                LogPrintf("getsockopt() for %s failed: %i\n", addrConnect.ToString(), WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
+    {
+        LogPrintf("getsockopt() for %s failed: %i\n", addrConnect.ToString(), WSAGetLastError());
+        return false;
+    }
 
-            if (nRet != 0)
-            {
-                LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), strerror(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+    if (nRet != 0)
+    {
+        LogPrint("net", "connect() to %s failed after select(): %s\n", addrConnect.ToString(), strerror(nRet));
+        return false;
+    }
+
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+    SOCKET hSocket;
+    bool fPending;
+
+    if (!StartConnectSocket(addrConnect, hSocket, fPending))
+        return false;
+
+    if (fPending)
+    {
+        struct timeval timeout;
+        timeout.tv_sec  = nTimeout / 1000;
+        timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+
+        int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+
+        if (nRet == 0)
+        {
+            LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
+            closesocket(hSocket);
+            return false;
         }
-#ifdef WIN32
-        else if (WSAGetLastError() != WSAEISCONN)
-#else
-        else
-#endif
+
+        if (nRet == SOCKET_ERROR)
+        {
+            LogPrintf("select() for %s failed: %i\n", addrConnect.ToString(), WSAGetLastError());
+            closesocket(hSocket);
+            return false;
+        }
+
+        if (!FinishConnectSocket(addrConnect, hSocket))
         {
-            LogPrintf("connect() to %s failed: %i\n", addrConnect.ToString(), WSAGetLastError());
             closesocket(hSocket);
             return false;
         }
@@ -408,11 +440,11 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
 
     // We'll turn it back to blocking just in case
 #ifdef WIN32
-    fNonblock = 0;
+    u_long fNonblock = 0;
 
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
     if (fcntl(hSocket, F_SETFL, fFlags & !O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
@@ -424,6 +456,116 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     return true;
 }
 
+int ConnectSocketsParallel(const std::vector<CService> &vAddrConnect, std::vector<SOCKET>& vSocketRet,
+                           std::vector<bool>& vfFinishedRet, int nTimeout, int nWanted)
+{
+    size_t nAddr = vAddrConnect.size();
+    vSocketRet.assign(nAddr, INVALID_SOCKET);
+    vfFinishedRet.assign(nAddr, false);
+
+    std::vector<SOCKET> vPending(nAddr, INVALID_SOCKET);
+    int nPending = 0;
+    int nConnected = 0;
+
+    for (size_t i = 0; i < nAddr; i++)
+    {
+        SOCKET hSocket;
+        bool fPending;
+
+        if (!StartConnectSocket(vAddrConnect[i], hSocket, fPending))
+        {
+            vfFinishedRet[i] = true;
+            continue;
+        }
+
+        if (fPending)
+        {
+            vPending[i] = hSocket;
+            nPending++;
+        }
+        else
+        {
+            vSocketRet[i] = hSocket;
+            vfFinishedRet[i] = true;
+            nConnected++;
+        }
+    }
+
+    int64_t nDeadline = GetTimeMillis() + nTimeout;
+
+    while (nPending > 0 && nConnected < nWanted)
+    {
+        int64_t nRemaining = nDeadline - GetTimeMillis();
+
+        if (nRemaining <= 0)
+            break;
+
+        struct timeval timeout;
+        timeout.tv_sec  = nRemaining / 1000;
+        timeout.tv_usec = (nRemaining % 1000) * 1000;
+
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        SOCKET hSocketMax = 0;
+
+        for (size_t i = 0; i < nAddr; i++)
+        {
+            if (vPending[i] == INVALID_SOCKET)
+                continue;
+
+            FD_SET(vPending[i], &fdset);
+            hSocketMax = std::max(hSocketMax, vPending[i]);
+        }
+
+        int nRet = select(hSocketMax + 1, NULL, &fdset, NULL, &timeout);
+
+        if (nRet == SOCKET_ERROR)
+        {
+            LogPrintf("select() for parallel connect failed: %i\n", WSAGetLastError());
+            break;
+        }
+
+        for (size_t i = 0; i < nAddr && nRet > 0; i++)
+        {
+            SOCKET hSocket = vPending[i];
+
+            if (hSocket == INVALID_SOCKET || !FD_ISSET(hSocket, &fdset))
+                continue;
+
+            vPending[i] = INVALID_SOCKET;
+            vfFinishedRet[i] = true;
+            nPending--;
+
+            // Late successes beyond what the caller asked for are dropped like the cancelled ones
+            if (nConnected < nWanted && FinishConnectSocket(vAddrConnect[i], hSocket))
+            {
+                vSocketRet[i] = hSocket;
+                nConnected++;
+            }
+            else
+                closesocket(hSocket);
+        }
+    }
+
+    // Cancel the attempts that are still in flight
+    for (size_t i = 0; i < nAddr; i++)
+        if (vPending[i] != INVALID_SOCKET)
+            closesocket(vPending[i]);
+
+    // Immediate successes during setup may exceed nWanted too
+    for (size_t i = 0; i < nAddr && nConnected > nWanted; i++)
+    {
+        if (vSocketRet[i] != INVALID_SOCKET)
+        {
+            closesocket(vSocketRet[i]);
+            vSocketRet[i] = INVALID_SOCKET;
+            nConnected--;
+        }
+    }
+
+    return nConnected;
+}
+
 bool SetProxy(enum Network net, CService addrProxy)
 {
     assert(net >= 0 && net < NET_MAX);
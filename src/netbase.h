@@ -141,5 +141,11 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout, bool *outProxyConnectionFailed = 0);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault, int nTimeout, bool *outProxyConnectionFailed = 0);
+/** Start non-blocking direct connects to all of vAddrConnect at once and wait at most nTimeout ms for the
+ *  first nWanted of them to complete. Connected sockets are returned non-blocking in vSocketRet (INVALID_SOCKET
+ *  elsewhere), attempts still pending are cancelled, and vfFinishedRet flags the attempts that got an answer.
+ *  Returns the number of connected sockets. Proxies are not used. */
+int ConnectSocketsParallel(const std::vector<CService> &vAddrConnect, std::vector<SOCKET>& vSocketRet,
+                           std::vector<bool>& vfFinishedRet, int nTimeout, int nWanted);
 
 #endif
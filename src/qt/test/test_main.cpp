@@ -1,16 +1,25 @@
+#include <QCoreApplication>
 #include <QTest>
 #include <QObject>
 
 #include "uritests.h"
+#include "transactiontablemodeltests.h"
 
 // This is all you need to run all the tests
 int main(int argc, char *argv[])
 {
     bool fInvalid = false;
 
+    // The transaction table model hands work back to the event loop
+    QCoreApplication app(argc, argv);
+
     URITests test1;
     if (QTest::qExec(&test1) != 0)
         fInvalid = true;
 
+    TransactionTableModelTests test2;
+    if (QTest::qExec(&test2) != 0)
+        fInvalid = true;
+
     return fInvalid;
 }
@@ -0,0 +1,91 @@
+#include "transactiontablemodeltests.h"
+#include "../optionsmodel.h"
+#include "../transactiontablemodel.h"
+#include "../walletmodel.h"
+
+#include "wallet.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QSignalSpy>
+
+static const int BENCHMARK_TRANSACTIONS = 100000;
+
+// Wait for the loader thread to hand over the page that was asked for
+static void WaitForPage(TransactionTableModel *model)
+{
+    for(int i = 0; i < 60000 && !model->canFetchMore(QModelIndex()) &&
+                   model->rowCount(QModelIndex()) < BENCHMARK_TRANSACTIONS; i++)
+        QTest::qWait(1);
+}
+
+void TransactionTableModelTests::refreshBenchmark()
+{
+    CWallet wallet;
+    CKey key;
+    key.MakeNewKey(true);
+    wallet.AddKeyPubKey(key, key.GetPubKey());
+
+    {
+        LOCK(wallet.cs_wallet);
+
+        for(int i = 0; i < BENCHMARK_TRANSACTIONS; i++)
+        {
+            CTransaction tx;
+            tx.nTime = 1500000000 + i;
+            tx.vout.resize(1);
+            tx.vout[0].nValue = COIN;
+            tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+            CWalletTx& wtx = wallet.mapWallet[tx.GetHash()];
+            wtx = CWalletTx(&wallet, tx);
+            wtx.nOrderPos = i;
+            wtx.nTimeReceived = tx.nTime;
+        }
+    }
+
+    OptionsModel optionsModel;
+    QElapsedTimer timer;
+    timer.start();
+
+    WalletModel walletModel(&wallet, &optionsModel);
+    TransactionTableModel *model = walletModel.getTransactionTableModel();
+
+    // Only the first page is loaded up front
+    WaitForPage(model);
+    qDebug() << "First page of" << model->rowCount(QModelIndex()) << "records in" << timer.elapsed() << "ms";
+    QCOMPARE(model->rowCount(QModelIndex()), TRANSACTION_PAGE_SIZE);
+    QVERIFY(model->canFetchMore(QModelIndex()));
+
+    // The newest transaction comes first
+    QCOMPARE(model->index(0, 0).data(TransactionTableModel::TransactionOrderPosRole).toLongLong(),
+             (qint64)BENCHMARK_TRANSACTIONS - 1);
+
+    // Scroll through the whole wallet
+    timer.restart();
+
+    while(model->rowCount(QModelIndex()) < BENCHMARK_TRANSACTIONS)
+    {
+        int nRows = model->rowCount(QModelIndex());
+        model->fetchMore(QModelIndex());
+        WaitForPage(model);
+        QVERIFY(model->rowCount(QModelIndex()) > nRows);
+    }
+
+    qDebug() << "All" << model->rowCount(QModelIndex()) << "records in" << timer.elapsed() << "ms";
+    QVERIFY(!model->canFetchMore(QModelIndex()));
+
+    // None of the transactions is in a block, so a new block refreshes every record. The GUI thread only hands
+    // them over and takes the statuses back.
+    QSignalSpy spy(model, SIGNAL(dataChanged(QModelIndex,QModelIndex)));
+    timer.restart();
+    model->updateConfirmations();
+    qint64 nQueued = timer.elapsed();
+
+    for(int i = 0; i < 60000 && spy.isEmpty(); i++)
+        QTest::qWait(1);
+
+    qDebug() << "Status refresh of" << model->rowCount(QModelIndex()) << "records queued in" << nQueued << "ms, done in" <<
+                timer.elapsed() << "ms";
+    QCOMPARE(spy.count(), BENCHMARK_TRANSACTIONS);
+}
@@ -0,0 +1,15 @@
+#ifndef TRANSACTIONTABLEMODELTESTS_H
+#define TRANSACTIONTABLEMODELTESTS_H
+
+#include <QTest>
+#include <QObject>
+
+class TransactionTableModelTests : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void refreshBenchmark();
+};
+
+#endif // TRANSACTIONTABLEMODELTESTS_H
@@ -18,7 +18,10 @@
 #include "wallet.h"
 #include "ui_interface.h"
 
+#include <deque>
 #include <iterator>
+#include <limits>
+#include <boost/thread.hpp>
 #include <QList>
 #include <QColor>
 #include <QIcon>
@@ -35,148 +38,447 @@ static int column_alignments[] =
     Qt::AlignRight|Qt::AlignVCenter
 };
 
-// Comparison operator for sort/binary search of model tx list
-struct TxLessThan
+// Work handed to the loader thread, which sends it back done in the same order
+struct TransactionTableUpdate
 {
-    bool operator()(const TransactionRecord &a, const TransactionRecord &b) const
+    enum Type
     {
-        return a.hash < b.hash;
-    }
-
-    bool operator()(const TransactionRecord &a, const uint256 &b) const
-    {
-        return a.hash < b;
-    }
-
-    bool operator()(const uint256 &a, const TransactionRecord &b) const
-    {
-        return a < b.hash;
-    }
+        LOAD_PAGE,      // Decompose the next page of the wallet, newest transactions first
+        UPDATE_TX,      // A transaction was added, removed or changed
+        REFRESH_STATUS  // Update the status of records that can still change
+    };
+
+    Type type;
+    uint256 hash;
+    int status;
+    bool inWallet;
+    bool showTransaction;
+    bool fLast;
+
+    // Filled in by the loader thread, except for REFRESH_STATUS where it holds the records to update
+    QList<TransactionRecord> records;
+
+    TransactionTableUpdate(Type type) : type(type), hash(0), status(CT_UPDATED), inWallet(false), showTransaction(false),
+                                        fLast(false) { }
 };
 
 // Private implementation
 class TransactionTablePriv
 {
 public:
-    TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent) : wallet(wallet), parent(parent) { }
+    TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent) : wallet(wallet), parent(parent), fShutdown(false),
+                                                                           fPagePending(false), fLoadedAll(false),
+                                                                           pindexLastTip(NULL) { }
 
     CWallet *wallet;
     TransactionTableModel *parent;
 
-    // Local cache of wallet.
+    // Local cache of wallet, in the order the records came in. The records of a transaction are kept together.
     QList<TransactionRecord> cachedWallet;
 
-    // Query entire wallet anew from core.
+    // Row of the first record of each transaction in cachedWallet
+    std::map<uint256, int> mapRows;
+
+    // The wallet is decomposed on the loader thread, so that neither the locks nor the work are on the GUI thread
+    boost::thread loaderThread;
+    boost::mutex csUpdates;
+    boost::condition_variable condUpdates;
+    boost::condition_variable condResults;
+    std::deque<TransactionTableUpdate> queueJobs;
+    std::deque<TransactionTableUpdate> queueResults;
+    bool fShutdown;
+
+    // Only used on the GUI thread
+    bool fPagePending;
+    bool fLoadedAll;
+    const CBlockIndex *pindexLastTip; // Tip the confirmations were last updated for
+
+    // Query wallet anew from core. Only the first page is asked for, the rest follows as the view scrolls down.
     void refreshWallet()
     {
         qDebug() << "TransactionTablePriv::refreshWallet";
-        cachedWallet.clear();
+        pindexLastTip = GetChainSnapshot()->pindexBest;
+        loaderThread = boost::thread(boost::bind(&TransactionTablePriv::threadLoader, this));
+        requestPage();
+    }
+
+    void stop()
+    {
         {
-            LOCK2(cs_main, wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+            boost::lock_guard<boost::mutex> lock(csUpdates);
+            fShutdown = true;
+        }
+
+        condUpdates.notify_all();
+        loaderThread.join();
+    }
+
+    void post(const TransactionTableUpdate& job)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(csUpdates);
+            queueJobs.push_back(job);
+        }
+
+        condUpdates.notify_one();
+    }
+
+    bool canFetchMore() const
+    {
+        return !fLoadedAll && !fPagePending;
+    }
+
+    void requestPage()
+    {
+        fPagePending = true;
+        post(TransactionTableUpdate(TransactionTableUpdate::LOAD_PAGE));
+    }
+
+    // Take in every page that is left, waiting for the loader thread instead of the event loop
+    void loadAll()
+    {
+        while(!fLoadedAll)
+        {
+            if(!fPagePending)
+                requestPage();
+
             {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+                boost::unique_lock<boost::mutex> lock(csUpdates);
+
+                while(queueResults.empty())
+                    condResults.wait(lock);
             }
+
+            applyUpdates();
         }
     }
 
-    // Update our model of the wallet incrementally, to synchronize our model of the wallet
-    // with that of the core. Called with transaction that was added, removed or changed.
-    void updateWallet(const uint256 &hash, int status)
+    void threadLoader()
     {
-        qDebug() << "TransactionTablePriv::updateWallet : " + QString::fromStdString(hash.ToString()) + " " + QString::number(status);
+        RenameThread("Swipp-txtable");
+
+        // Transactions not loaded yet, oldest first so that pages are taken off the back
+        std::vector<uint256> vToLoad;
         {
             LOCK2(cs_main, wallet->cs_wallet);
+            std::vector<std::pair<int64_t, uint256> > vOrdered;
+            vOrdered.reserve(wallet->mapWallet.size());
 
-            // Find transaction in wallet
-            std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
-            bool inWallet = mi != wallet->mapWallet.end();
+            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+                vOrdered.push_back(std::make_pair(it->second.nOrderPos, it->first));
 
-            // Find bounds of this transaction in model
-            QList<TransactionRecord>::iterator lower = qLowerBound(
-                cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
-            QList<TransactionRecord>::iterator upper = qUpperBound(
-                cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
+            std::sort(vOrdered.begin(), vOrdered.end());
+            vToLoad.reserve(vOrdered.size());
 
-            int lowerIndex = (lower - cachedWallet.begin());
-            int upperIndex = (upper - cachedWallet.begin());
-            bool inModel = (lower != upper);
+            for(unsigned int i = 0; i < vOrdered.size(); i++)
+                vToLoad.push_back(vOrdered[i].second);
+        }
 
-            // Determine whether to show transaction or not
-            bool showTransaction = (inWallet && TransactionRecord::showTransaction(mi->second));
+        while(true)
+        {
+            boost::unique_lock<boost::mutex> lock(csUpdates);
 
-            if(status == CT_UPDATED)
-            {
-                if(showTransaction && !inModel)
-                    status = CT_NEW; /* Not in model, but want to show, treat as new */
+            while(!fShutdown && queueJobs.empty())
+                condUpdates.wait(lock);
 
-                if(!showTransaction && inModel)
-                    status = CT_DELETED; /* In model, but want to hide, treat as deleted */
-            }
+            if(fShutdown)
+                return;
 
-            qDebug() << "   inWallet=" + QString::number(inWallet) + " inModel=" + QString::number(inModel) +
-                        " Index=" + QString::number(lowerIndex) + "-" + QString::number(upperIndex) +
-                        " showTransaction=" + QString::number(showTransaction) + " derivedStatus=" + QString::number(status);
+            TransactionTableUpdate job = queueJobs.front();
+            queueJobs.pop_front();
+            lock.unlock();
 
-            switch(status)
             {
-            case CT_NEW:
-                if(inModel)
-                {
-                    qDebug() << "TransactionTablePriv::updateWallet : Warning: Got CT_NEW, but transaction is already in model";
-                    break;
-                }
+                LOCK2(cs_main, wallet->cs_wallet);
 
-                if(!inWallet)
+                switch(job.type)
                 {
-                    qDebug() << "TransactionTablePriv::updateWallet : Warning: Got CT_NEW, but transaction is not in wallet";
-                    break;
-                }
+                case TransactionTableUpdate::LOAD_PAGE:
+                    for(int i = 0; i < TRANSACTION_PAGE_SIZE && !vToLoad.empty(); i++)
+                    {
+                        // Gone from the wallet since, or not yet to be shown
+                        std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(vToLoad.back());
+                        vToLoad.pop_back();
 
-                if(showTransaction)
-                {
-                    // Added -- insert at the right position
-                    QList<TransactionRecord> toInsert = TransactionRecord::decomposeTransaction(wallet, mi->second);
+                        if(mi != wallet->mapWallet.end() && TransactionRecord::showTransaction(mi->second))
+                            job.records.append(decompose(mi->second));
+                    }
 
-                    if(!toInsert.isEmpty())
+                    job.fLast = vToLoad.empty();
+                    break;
+
+                case TransactionTableUpdate::UPDATE_TX:
                     {
-                        parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex+toInsert.size()-1);
-                        int insert_idx = lowerIndex;
+                        std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(job.hash);
+                        job.inWallet = mi != wallet->mapWallet.end();
+                        job.showTransaction = job.inWallet && TransactionRecord::showTransaction(mi->second);
+
+                        if(job.showTransaction)
+                            job.records = decompose(mi->second);
+                    }
+                    break;
 
-                        foreach(const TransactionRecord &rec, toInsert)
-                        {
-                            cachedWallet.insert(insert_idx, rec);
-                            insert_idx += 1;
-                        }
+                case TransactionTableUpdate::REFRESH_STATUS:
+                    for(QList<TransactionRecord>::iterator it = job.records.begin(); it != job.records.end(); ++it)
+                    {
+                        std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(it->hash);
 
-                        parent->endInsertRows();
+                        if(mi != wallet->mapWallet.end())
+                            it->updateStatus(mi->second);
                     }
+                    break;
                 }
+            }
+
+            lock.lock();
+
+            if(fShutdown)
+                return;
+
+            queueResults.push_back(job);
+            lock.unlock();
+            condResults.notify_one();
+
+            QMetaObject::invokeMethod(parent, "applyUpdates", Qt::QueuedConnection);
+        }
+    }
+
+    // Records of a transaction, with their status filled in
+    QList<TransactionRecord> decompose(const CWalletTx &wtx)
+    {
+        QList<TransactionRecord> records = TransactionRecord::decomposeTransaction(wallet, wtx);
+
+        for(QList<TransactionRecord>::iterator it = records.begin(); it != records.end(); ++it)
+            it->updateStatus(wtx);
+
+        return records;
+    }
+
+    void applyUpdates()
+    {
+        std::deque<TransactionTableUpdate> queue;
+        {
+            boost::lock_guard<boost::mutex> lock(csUpdates);
+            queue.swap(queueResults);
+        }
+
+        for(std::deque<TransactionTableUpdate>::iterator it = queue.begin(); it != queue.end(); ++it)
+        {
+            switch(it->type)
+            {
+            case TransactionTableUpdate::LOAD_PAGE:
+                fPagePending = false;
+                fLoadedAll = it->fLast;
+                appendRecords(it->records);
+
+                // A page with nothing to show inserts no rows, so the view would not ask for the next one
+                if(it->records.isEmpty() && !fLoadedAll)
+                    requestPage();
 
                 emit parent->updated();
                 break;
 
-            case CT_DELETED:
-                if(!inModel)
-                {
-                    qDebug() << "TransactionTablePriv::updateWallet : Warning: Got CT_DELETED, but transaction is not in model";
-                    break;
-                }
-                // Removed -- remove entire transaction from table
-                parent->beginRemoveRows(QModelIndex(), lowerIndex, upperIndex-1);
-                cachedWallet.erase(lower, upper);
-                parent->endRemoveRows();
+            case TransactionTableUpdate::UPDATE_TX:
+                updateWallet(*it);
+                break;
 
-                emit parent->updated();
+            case TransactionTableUpdate::REFRESH_STATUS:
+                updateStatus(it->records);
                 break;
+            }
+        }
+    }
+
+    // Append the records of transactions not in the model yet
+    void appendRecords(const QList<TransactionRecord> &records)
+    {
+        QList<TransactionRecord> toInsert;
+
+        foreach(const TransactionRecord &rec, records)
+        {
+            if(!mapRows.count(rec.hash))
+                toInsert.append(rec);
+        }
+
+        if(toInsert.isEmpty())
+            return;
+
+        parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size() + toInsert.size() - 1);
+
+        foreach(const TransactionRecord &rec, toInsert)
+        {
+            mapRows.insert(std::make_pair(rec.hash, cachedWallet.size()));
+            cachedWallet.append(rec);
+        }
 
-            case CT_UPDATED:
-                // Miscellaneous updates -- nothing to do, status update will take care of this, and is only computed for
-                // visible transactions.
+        parent->endInsertRows();
+    }
+
+    // Number of records of the transaction starting at row
+    int recordCount(int row, const uint256 &hash)
+    {
+        int end = row;
+
+        while(end < cachedWallet.size() && cachedWallet[end].hash == hash)
+            end++;
+
+        return end - row;
+    }
+
+    // Update our model of the wallet incrementally, to synchronize our model of the wallet
+    // with that of the core. Called with transaction that was added, removed or changed.
+    void updateWallet(const TransactionTableUpdate &update)
+    {
+        int status = update.status;
+        qDebug() << "TransactionTablePriv::updateWallet : " + QString::fromStdString(update.hash.ToString()) + " " +
+                    QString::number(status);
+
+        std::map<uint256, int>::iterator mi = mapRows.find(update.hash);
+        bool inModel = mi != mapRows.end();
+        int lowerIndex = inModel ? mi->second : cachedWallet.size();
+        int upperIndex = inModel ? lowerIndex + recordCount(lowerIndex, update.hash) : lowerIndex;
+
+        if(status == CT_UPDATED)
+        {
+            if(update.showTransaction && !inModel)
+                status = CT_NEW; /* Not in model, but want to show, treat as new */
+
+            if(!update.showTransaction && inModel)
+                status = CT_DELETED; /* In model, but want to hide, treat as deleted */
+        }
+
+        qDebug() << "   inWallet=" + QString::number(update.inWallet) + " inModel=" + QString::number(inModel) +
+                    " Index=" + QString::number(lowerIndex) + "-" + QString::number(upperIndex) +
+                    " showTransaction=" + QString::number(update.showTransaction) + " derivedStatus=" + QString::number(status);
+
+        switch(status)
+        {
+        case CT_NEW:
+            if(inModel)
+            {
+                qDebug() << "TransactionTablePriv::updateWallet : Warning: Got CT_NEW, but transaction is already in model";
+                break;
+            }
+
+            if(!update.inWallet)
+            {
+                qDebug() << "TransactionTablePriv::updateWallet : Warning: Got CT_NEW, but transaction is not in wallet";
+                break;
+            }
+
+            // Added -- where in the model does not matter, the view sorts the rows
+            if(update.showTransaction)
+            {
+                int first = cachedWallet.size();
+                appendRecords(update.records);
+
+                // Unlike rows of a loaded page, these are news
+                if(cachedWallet.size() > first)
+                    emit parent->newTransaction(QModelIndex(), first, cachedWallet.size() - 1);
+            }
+
+            emit parent->updated();
+            break;
+
+        case CT_DELETED:
+            if(!inModel)
+            {
+                qDebug() << "TransactionTablePriv::updateWallet : Warning: Got CT_DELETED, but transaction is not in model";
                 break;
             }
+
+            // Removed -- remove entire transaction from table
+            parent->beginRemoveRows(QModelIndex(), lowerIndex, upperIndex-1);
+            cachedWallet.erase(cachedWallet.begin() + lowerIndex, cachedWallet.begin() + upperIndex);
+            mapRows.erase(mi);
+
+            for(std::map<uint256, int>::iterator it = mapRows.begin(); it != mapRows.end(); ++it)
+            {
+                if(it->second > lowerIndex)
+                    it->second -= upperIndex - lowerIndex;
+            }
+
+            parent->endRemoveRows();
+
+            emit parent->updated();
+            break;
+
+        case CT_UPDATED:
+            // Miscellaneous updates -- the records came with a fresh status
+            updateStatus(update.records);
+            break;
+        }
+    }
+
+    // Take the status of records worked out on the loader thread, for transactions whose records are unchanged
+    void updateStatus(const QList<TransactionRecord> &records)
+    {
+        for(int i = 0; i < records.size(); )
+        {
+            const uint256 &hash = records[i].hash;
+            int count = 1;
+
+            while(i + count < records.size() && records[i + count].hash == hash)
+                count++;
+
+            std::map<uint256, int>::iterator mi = mapRows.find(hash);
+
+            if(mi != mapRows.end() && recordCount(mi->second, hash) == count)
+            {
+                for(int j = 0; j < count; j++)
+                {
+                    cachedWallet[mi->second + j].status = records[i + j].status;
+                    cachedWallet[mi->second + j].orderPos = records[i + j].orderPos;
+                }
+
+                emit parent->dataChanged(parent->index(mi->second, 0),
+                                         parent->index(mi->second + count - 1, TransactionTableModel::Amount));
+            }
+
+            i += count;
+        }
+    }
+
+    // New blocks only change the status of records that are not fully confirmed yet. Those deeper down just count
+    // up confirmations, which are refreshed when shown, unless a reorganization took away the blocks they are in.
+    void updateConfirmations()
+    {
+        TransactionTableUpdate job(TransactionTableUpdate::REFRESH_STATUS);
+        CChainSnapshotRef snapshot = GetChainSnapshot();
+
+        // Lowest block of the tip seen last time that is no longer in the main chain
+        int nDisconnectedHeight = std::numeric_limits<int>::max();
+
+        for(const CBlockIndex *pindex = pindexLastTip; pindex && snapshot->GetAncestor(pindex->nHeight) != pindex;
+            pindex = pindex->pprev)
+            nDisconnectedHeight = pindex->nHeight;
+
+        pindexLastTip = snapshot->pindexBest;
+
+        for(int row = 0; row < cachedWallet.size(); )
+        {
+            const uint256 &hash = cachedWallet[row].hash;
+            int count = recordCount(row, hash);
+            bool fNearTip = false;
+
+            for(int j = row; j < row + count; j++)
+            {
+                const TransactionStatus &status = cachedWallet[j].status;
+                fNearTip |= status.status != TransactionStatus::Confirmed ||
+                            (status.depth > 0 && status.cur_num_blocks - status.depth + 1 >= nDisconnectedHeight);
+            }
+
+            if(fNearTip)
+            {
+                for(int j = row; j < row + count; j++)
+                    job.records.append(cachedWallet[j]);
+            }
+
+            row += count;
         }
+
+        if(!job.records.isEmpty())
+            post(job);
     }
 
     int size()
@@ -187,33 +489,32 @@ public:
     TransactionRecord *index(int idx)
     {
         if(idx >= 0 && idx < cachedWallet.size())
+            return &cachedWallet[idx];
+        else
+            return 0;
+    }
+
+    // Bring the confirmations of a record that is being shown up to date
+    void refreshStatus(TransactionRecord *rec)
+    {
+        // Get required locks upfront. This avoids the GUI from getting
+        // stuck if the core is holding the locks for a longer time - for
+        // example, during a wallet rescan.
+        //
+        // If a status update is needed (blocks came in since last check),
+        //  update the status of this transaction from the wallet. Otherwise,
+        // simply re-use the cached status.
+        TRY_LOCK(cs_main, lockMain);
+        if(lockMain)
         {
-            TransactionRecord *rec = &cachedWallet[idx];
-
-            // Get required locks upfront. This avoids the GUI from getting
-            // stuck if the core is holding the locks for a longer time - for
-            // example, during a wallet rescan.
-            //
-            // If a status update is needed (blocks came in since last check),
-            //  update the status of this transaction from the wallet. Otherwise,
-            // simply re-use the cached status.
-            TRY_LOCK(cs_main, lockMain);
-            if(lockMain)
+            TRY_LOCK(wallet->cs_wallet, lockWallet);
+            if(lockWallet && rec->statusUpdateNeeded())
             {
-                TRY_LOCK(wallet->cs_wallet, lockWallet);
-                if(lockWallet && rec->statusUpdateNeeded())
-                {
-                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
+                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
 
-                    if(mi != wallet->mapWallet.end())
-                        rec->updateStatus(mi->second);
-                }
+                if(mi != wallet->mapWallet.end())
+                    rec->updateStatus(mi->second);
             }
-            return rec;
-        }
-        else
-        {
-            return 0;
         }
     }
 
@@ -232,8 +533,7 @@ public:
 };
 
 TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *parent):
-        QAbstractTableModel(parent), lowerIndex(0), upperIndex(0), fetchedRows(0),
-        wallet(wallet), walletModel(parent), priv(new TransactionTablePriv(wallet, this))
+        QAbstractTableModel(parent), wallet(wallet), walletModel(parent), priv(new TransactionTablePriv(wallet, this))
 {
     columns << QString() << tr("Date") << tr("Type") << tr("Address") << tr("Amount");
     priv->refreshWallet();
@@ -242,22 +542,47 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *paren
 
 TransactionTableModel::~TransactionTableModel()
 {
+    priv->stop();
     delete priv;
 }
 
 void TransactionTableModel::updateTransaction(const QString &hash, int status)
 {
-    uint256 updated;
-    updated.SetHex(hash.toStdString());
-    priv->updateWallet(updated, status);
+    TransactionTableUpdate job(TransactionTableUpdate::UPDATE_TX);
+    job.hash.SetHex(hash.toStdString());
+    job.status = status;
+    priv->post(job);
 }
 
 void TransactionTableModel::updateConfirmations()
 {
     // Blocks came in since last poll. Invalidate status (number of confirmations)
-    // and (possibly) description for all rows.
-    updateCells(Status);
-    updateCells(ToAddress);
+    // and (possibly) description of the rows it can still change.
+    priv->updateConfirmations();
+}
+
+void TransactionTableModel::applyUpdates()
+{
+    priv->applyUpdates();
+}
+
+void TransactionTableModel::loadAll()
+{
+    priv->loadAll();
+}
+
+bool TransactionTableModel::canFetchMore(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent);
+    return priv->canFetchMore();
+}
+
+void TransactionTableModel::fetchMore(const QModelIndex &parent)
+{
+    Q_UNUSED(parent);
+
+    if(priv->canFetchMore())
+        priv->requestPage();
 }
 
 int TransactionTableModel::rowCount(const QModelIndex &parent) const
@@ -329,13 +654,13 @@ QString TransactionTableModel::formatTxDate(const TransactionRecord *wtx) const
 
 void TransactionTableModel::updateCells(enum ColumnIndex column)
 {
-    int lower = lowerIndex * MAX_TRANSACTIONS_PER_TICK;
-    int upper = upperIndex * (MAX_TRANSACTIONS_PER_TICK + 1);
+    if(priv->size() == 0)
+        return;
 
     // Loop is a workaround for the following bug, https://bugreports.qt.io/browse/QTBUG-58580
     // It's probably best to keep it as-is in order to cover as many QT versions as possible.
     // for (int i = lower; i < upper; i++)
-    emit dataChanged(index(lower, column), index(upper, column));
+    emit dataChanged(index(0, column), index(priv->size() - 1, column));
 }
 
 // Look up address in address book, if found return label (address)
@@ -551,6 +876,7 @@ QVariant TransactionTableModel::data(const QModelIndex &index, int role) const
         }
         break;
     case Qt::ToolTipRole:
+        priv->refreshStatus(rec);
         return formatTooltip(rec);
     case Qt::TextAlignmentRole:
         return column_alignments[index.column()];
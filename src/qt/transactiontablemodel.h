@@ -20,6 +20,9 @@ class WalletModel;
 #define MAX_TRANSACTIONS_PER_TICK 1000
 #endif
 
+// Number of wallet transactions the model decomposes into records each time it fetches more of the wallet
+static const int TRANSACTION_PAGE_SIZE = 1000;
+
 // UI model for the transaction table of a wallet.
 class TransactionTableModel : public QAbstractTableModel
 {
@@ -58,14 +61,14 @@ public:
     QVariant data(const QModelIndex &index, int role) const;
     QVariant headerData(int section, Qt::Orientation orientation, int role) const;
     QModelIndex index(int row, int column, const QModelIndex & parent = QModelIndex()) const;
+    bool canFetchMore(const QModelIndex &parent) const;
+    void fetchMore(const QModelIndex &parent);
 
     int getWalletSize() const;
+    // Load the pages not scrolled to yet, for what has to go over the whole wallet. Blocks until they are in.
+    void loadAll();
 
 private:
-    int lowerIndex;
-    int upperIndex;
-    int fetchedRows;
-
     CWallet* wallet;
     WalletModel *walletModel;
     QStringList columns;
@@ -85,12 +88,18 @@ private:
 
 signals:
     void updated();
+    // Rows inserted for a transaction that just came in, as opposed to rows of a page loaded from the wallet
+    void newTransaction(const QModelIndex &parent, int start, int end);
 
 public slots:
     void updateTransaction(const QString &hash, int status);
     void updateConfirmations();
     void updateDisplayUnit();
 
+private slots:
+    // Take in what the loader thread has finished
+    void applyUpdates();
+
     friend class TransactionTablePriv;
 };
 
@@ -33,6 +33,7 @@
 #include <QLabel>
 #include <QDateTimeEdit>
 #include <QStyledItemDelegate>
+#include <QApplication>
 
 extern CWallet* pwalletMain;
 
@@ -224,6 +225,9 @@ void TransactionView::chooseDate(int idx)
     QDate current = QDate::currentDate();
     dateRangeWidget->setVisible(false);
 
+    if(dateWidget->itemData(idx).toInt() != All)
+        loadAllTransactions();
+
     switch(dateWidget->itemData(idx).toInt())
     {
     case All:
@@ -268,6 +272,10 @@ void TransactionView::chooseDate(int idx)
 #else
 void TransactionView::chooseRangeSelection(int aMin, int aMax)
 {
+    // Beyond the first tick the range reaches transactions that may not be loaded yet
+    if(aMax > 1)
+        loadAllTransactions();
+
     transactionProxyModel->setRange(aMin, aMax);
 }
 
@@ -289,6 +297,9 @@ void TransactionView::chooseType(int idx)
     if(!transactionProxyModel)
         return;
 
+    if(typeWidget->itemData(idx).toUInt() != TransactionFilterProxy::ALL_TYPES)
+        loadAllTransactions();
+
     transactionProxyModel->setTypeFilter(typeWidget->itemData(idx).toInt());
 }
 
@@ -297,6 +308,9 @@ void TransactionView::changedPrefix(const QString &prefix)
     if(!transactionProxyModel)
         return;
 
+    if(!prefix.isEmpty())
+        loadAllTransactions();
+
     transactionProxyModel->setAddressPrefix(prefix);
 }
 
@@ -308,11 +322,27 @@ void TransactionView::changedAmount(const QString &amount)
     qint64 amount_parsed = 0;
 
     if(BitcoinUnits::parse(model->getOptionsModel()->getDisplayUnit(), amount, &amount_parsed))
+    {
+        if(amount_parsed > 0)
+            loadAllTransactions();
+
         transactionProxyModel->setMinAmount(amount_parsed);
+    }
     else
         transactionProxyModel->setMinAmount(0);
 }
 
+// Filters and the export go over the whole wallet, not only the pages scrolled through so far
+void TransactionView::loadAllTransactions()
+{
+    if(!model)
+        return;
+
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    model->getTransactionTableModel()->loadAll();
+    QApplication::restoreOverrideCursor();
+}
+
 void TransactionView::exportClicked()
 {
     // CSV is currently the only supported format
@@ -324,6 +354,7 @@ void TransactionView::exportClicked()
     if (filename.isNull())
         return;
 
+    loadAllTransactions();
     CSVModelWriter writer(filename);
 
     // name, column, role
@@ -476,6 +507,7 @@ void TransactionView::dateRangeChanged()
     if(!transactionProxyModel)
         return;
 
+    loadAllTransactions();
     transactionProxyModel->setDateRange(QDateTime(dateFrom->date()),
                                         QDateTime(dateTo->date()).addDays(1));
 }
@@ -65,6 +65,7 @@ private:
     QDateTimeEdit *dateTo;
 
     void calculateRange();
+    void loadAllTransactions();
 
 #ifdef USE_OLDSTYLE_DATE_SELECTION
     QWidget *createDateRangeWidget();
@@ -109,6 +109,7 @@ static qint64 cachedUnconfirmedBalance = 0;
 static qint64 cachedImmatureBalance = 0;
 static qint64 cachedAnonymizedBalance = 0;
 static int cachedNumBlocks = 0;
+static uint256 cachedBestHash = 0;
 static int cachedTxLocks = 0;
 
 void ThreadCheckBalanceChanged(WalletModel *walletModel)
@@ -139,9 +140,13 @@ void ThreadCheckBalanceChanged(WalletModel *walletModel)
 
 void WalletModel::pollBalanceChanged()
 {
-    if(nBestHeight != cachedNumBlocks && !IsInitialBlockDownload())
+    // A reorganization may replace the tip without changing the height
+    CChainSnapshotRef snapshot = GetChainSnapshot();
+
+    if((snapshot->nHeight != cachedNumBlocks || snapshot->hashBest != cachedBestHash) && !IsInitialBlockDownload())
     {
-        cachedNumBlocks = nBestHeight;
+        cachedNumBlocks = snapshot->nHeight;
+        cachedBestHash = snapshot->hashBest;
 
         // Balance and number of transactions might have changed
         signalCheckBalanceChanged(this);
@@ -224,6 +229,9 @@ WalletModel::SendCoinsReturn WalletModel::sendCoins(const QList<SendCoinsRecipie
     {
         LOCK2(cs_main, wallet->cs_wallet);
 
+        // Spend from what the wallet knows of the latest blocks
+        SyncWithWalletQueue();
+
         // Sendmany
         std::vector<std::pair<CScript, int64_t> > vecSend;
         foreach(const SendCoinsRecipient &rcp, recipients)
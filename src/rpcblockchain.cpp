@@ -20,10 +20,10 @@ double GetDifficulty(const CBlockIndex* blockindex)
     // minimum difficulty = 1.0.
     if (blockindex == NULL)
     {
-        if (pindexBest == NULL)
+        blockindex = GetChainSnapshot()->pindexLastPoW;
+
+        if (blockindex == NULL)
             return 1.0;
-        else
-            blockindex = GetLastBlockIndex(pindexBest, false);
     }
 
     int nShift = (blockindex->nBits >> 24) & 0xff;
@@ -47,26 +47,10 @@ double GetDifficulty(const CBlockIndex* blockindex)
 
 double GetPoWMHashPS()
 {
-    int nPoWInterval = 72;
-    int64_t nTargetSpacingWorkMin = 30, nTargetSpacingWork = 30;
-
-    CBlockIndex* pindex = pindexGenesisBlock;
-    CBlockIndex* pindexPrevWork = pindexGenesisBlock;
-
-    while (pindex)
-    {
-        if (pindex->IsProofOfWork())
-        {
-            int64_t nActualSpacingWork = pindex->GetBlockTime() - pindexPrevWork->GetBlockTime();
-            nTargetSpacingWork = ((nPoWInterval - 1) * nTargetSpacingWork + nActualSpacingWork + nActualSpacingWork) / (nPoWInterval + 1);
-            nTargetSpacingWork = max(nTargetSpacingWork, nTargetSpacingWorkMin);
-            pindexPrevWork = pindex;
-        }
-
-        pindex = pindex->pnext;
-    }
+    // The spacing average is kept up to date by PublishChainSnapshot()
+    CChainSnapshotRef snapshot = GetChainSnapshot();
 
-    return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
+    return GetDifficulty(snapshot->pindexLastPoW) * 4294.967296 / snapshot->nTargetSpacingWork;
 }
 
 double GetPoSKernelPS()
@@ -75,8 +59,9 @@ double GetPoSKernelPS()
     double dStakeKernelsTriedAvg = 0;
     int nStakesHandled = 0, nStakesTime = 0;
 
-    CBlockIndex* pindex = pindexBest;;
-    CBlockIndex* pindexPrevStake = NULL;
+    CChainSnapshotRef snapshot = GetChainSnapshot();
+    const CBlockIndex* pindex = snapshot->pindexBest;
+    const CBlockIndex* pindexPrevStake = NULL;
 
     while (pindex && nStakesHandled < nPoSInterval)
     {
@@ -99,42 +84,47 @@ double GetPoSKernelPS()
     if (nStakesTime)
         result = dStakeKernelsTriedAvg / nStakesTime;
 
-    if (IsProtocolV2(nBestHeight))
+    if (IsProtocolV2(snapshot->nHeight))
         result *= STAKE_TIMESTAMP_MASK + 1;
 
     return result;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+// Transactions are written one at a time, so a large block with their details is never held as one tree
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    CChainSnapshotRef snapshot = GetChainSnapshot();
+    bool fInMainChain = snapshot->GetAncestor(blockindex->nHeight) == blockindex;
+    writer.BeginObject();
+    writer.Pair("hash", block.GetHash().GetHex());
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (blockindex->IsInMainChain())
-        confirmations = nBestHeight - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-    result.push_back(Pair("time", (int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0')));
-    result.push_back(Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0')));
+    if (fInMainChain)
+        confirmations = snapshot->nHeight - blockindex->nHeight + 1;
+    writer.Pair("confirmations", confirmations);
+    writer.Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Pair("height", blockindex->nHeight);
+    writer.Pair("version", block.nVersion);
+    writer.Pair("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.Pair("mint", ValueFromAmount(blockindex->nMint));
+    writer.Pair("time", (int64_t)block.GetBlockTime());
+    writer.Pair("nonce", (uint64_t)block.nNonce);
+    writer.Pair("bits", strprintf("%08x", block.nBits));
+    writer.Pair("difficulty", GetDifficulty(blockindex));
+    writer.Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0'));
+    writer.Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0'));
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->hashProof.GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016x", blockindex->nStakeModifier)));
-    Array txinfo;
+        writer.Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
+    if (fInMainChain && blockindex->nHeight < snapshot->nHeight)
+        writer.Pair("nextblockhash", snapshot->GetAncestor(blockindex->nHeight + 1)->GetBlockHash().GetHex());
+
+    writer.Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+    writer.Pair("proofhash", blockindex->hashProof.GetHex());
+    writer.Pair("entropybit", (int)blockindex->GetStakeEntropyBit());
+    writer.Pair("modifier", strprintf("%016x", blockindex->nStakeModifier));
+    writer.Key("tx");
+    writer.BeginArray();
+
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
@@ -144,18 +134,18 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
             entry.push_back(Pair("txid", tx.GetHash().GetHex()));
             TxToJSON(tx, 0, entry);
 
-            txinfo.push_back(entry);
+            writer.Write(entry);
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            writer.Write(tx.GetHash().GetHex());
     }
 
-    result.push_back(Pair("tx", txinfo));
+    writer.EndArray();
 
     if (block.IsProofOfStake())
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
+        writer.Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
 
-    return result;
+    writer.EndObject();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -165,7 +155,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best block in the longest block chain.");
 
-    return hashBestChain.GetHex();
+    return GetChainSnapshot()->hashBest.GetHex();
 }
 
 Value getblockcount(const Array& params, bool fHelp)
@@ -175,7 +165,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainSnapshot()->nHeight;
 }
 
 
@@ -186,28 +176,158 @@ Value getdifficulty(const Array& params, bool fHelp)
             "getdifficulty\n"
             "Returns the difficulty as a multiple of the minimum difficulty.");
 
+    CChainSnapshotRef snapshot = GetChainSnapshot();
+
     Object obj;
-    obj.push_back(Pair("proof-of-work",        GetDifficulty()));
-    obj.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("proof-of-work",        GetDifficulty(snapshot->pindexLastPoW)));
+    obj.push_back(Pair("proof-of-stake",       GetDifficulty(snapshot->pindexLastPoS)));
     return obj;
 }
 
 
-Value getrawmempool(const Array& params, bool fHelp)
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& writer)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "If [verbose] is true, returns an object for each transaction with its fee, size, entry time and\n"
+            "height, current priority, pooled dependencies and ancestor/descendant package totals.");
+
+    bool fVerbose = false;
 
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    // Each entry is looked up on its own, so the pool is not locked while the reply is being sent
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    if (!fVerbose)
+    {
+        writer.BeginArray();
+
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            writer.Write(hash.ToString());
+
+        writer.EndArray();
+        return;
+    }
+
+    int nHeight = GetChainSnapshot()->nHeight;
+    writer.BeginObject();
+
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+    {
+        Object info;
+        {
+            LOCK(mempool.cs);
+            CTxMemPool::txiter mi = mempool.mapTx.find(hash);
+
+            // Gone since the hashes were taken
+            if (mi == mempool.mapTx.end())
+                continue;
+
+            const CTxMemPoolEntry& e = *mi;
+            info.push_back(Pair("size", (int)e.nTxSize));
+            info.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+            info.push_back(Pair("time", e.nTime));
+            info.push_back(Pair("height", e.nHeight));
+            info.push_back(Pair("currentpriority", e.GetPriority(nHeight)));
+            info.push_back(Pair("ancestorcount", e.nCountWithAncestors));
+            info.push_back(Pair("ancestorsize", e.nSizeWithAncestors));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(e.nFeesWithAncestors)));
+            info.push_back(Pair("descendantcount", e.nCountWithDescendants));
+            info.push_back(Pair("descendantsize", e.nSizeWithDescendants));
+            info.push_back(Pair("descendantfees", ValueFromAmount(e.nFeesWithDescendants)));
+
+            Array depends;
+            BOOST_FOREACH(const uint256& hashParent, e.setParents)
+                depends.push_back(hashParent.ToString());
+
+            info.push_back(Pair("depends", depends));
+        }
+
+        writer.Pair(hash.ToString(), info);
+    }
+
+    writer.EndObject();
+}
+
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the number of transactions in the memory pool, their total size in bytes, the memory\n"
+            "used by the pool and the -maxmempool limit it is trimmed to, the fee per kB a transaction has to pay\n"
+            "after others were evicted, and the number and size of the orphan transactions waiting for their\n"
+            "parents. While mempool.dat is being loaded, \"loaded\" is false and \"loadprogress\" tells how many\n"
+            "of its transactions were read and accepted so far.");
+
+    Object obj;
+    obj.push_back(Pair("size", (uint64_t)mempool.size()));
+    obj.push_back(Pair("bytes", mempool.GetTotalTxSize()));
+    obj.push_back(Pair("usage", (uint64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool", GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000));
+    int64_t nMinFee = mempool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(nMinFee)));
+    obj.push_back(Pair("orphans", (uint64_t)orphanpool.size()));
+    obj.push_back(Pair("orphanbytes", orphanpool.GetTotalBytes()));
+
+    CMempoolLoadProgress progress = GetMempoolLoadProgress();
+    obj.push_back(Pair("loaded", !progress.fLoading));
+
+    if (progress.fLoading || progress.fLoaded)
+    {
+        Object load;
+        load.push_back(Pair("total", progress.nTotal));
+        load.push_back(Pair("read", progress.nRead));
+        load.push_back(Pair("accepted", progress.nAccepted));
+        load.push_back(Pair("failed", progress.nFailed));
+        load.push_back(Pair("expired", progress.nExpired));
+        obj.push_back(Pair("loadprogress", load));
+    }
 
-    return a;
+    return obj;
+}
+
+Value estimatefee(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatefee <nblocks>\n"
+            "Returns the fee per kilobyte that transactions recently needed to confirm within <nblocks> blocks,\n"
+            "or -1 if not enough transactions were seen yet. <nblocks> is between 1 and " +
+            itostr(MAX_BLOCK_CONFIRMS) + ".");
+
+    int nBlocks = params[0].get_int();
+
+    if (nBlocks < 1 || nBlocks > (int)MAX_BLOCK_CONFIRMS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "nblocks out of range");
+
+    double dFeePerKb = mempool.EstimateFee(nBlocks);
+
+    if (dFeePerKb < 0)
+        return -1.0;
+
+    return ValueFromAmount((int64_t)dFeePerKb);
+}
+
+Value estimatepriority(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatepriority <nblocks>\n"
+            "Returns the priority that transactions paying less than the relay fee recently needed to confirm\n"
+            "within <nblocks> blocks, or -1 if not enough transactions were seen yet.");
+
+    int nBlocks = params[0].get_int();
+
+    if (nBlocks < 1 || nBlocks > (int)MAX_BLOCK_CONFIRMS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "nblocks out of range");
+
+    return mempool.EstimatePriority(nBlocks);
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -218,14 +338,15 @@ Value getblockhash(const Array& params, bool fHelp)
             "Returns hash of block in best-block-chain at <index>.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    const CBlockIndex* pblockindex = GetChainSnapshot()->GetAncestor(nHeight);
+
+    if (!pblockindex)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     return pblockindex->phashBlock->GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+void getblock(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -236,14 +357,15 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
+    CBlockIndex* pblockindex = LookupBlockIndex(hash);
+
+    if (!pblockindex)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
 }
 
 Value getblockbynumber(const Array& params, bool fHelp)
@@ -255,20 +377,17 @@ Value getblockbynumber(const Array& params, bool fHelp)
             "Returns details of a block with given block-number.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    const CBlockIndex* pblockindex = GetChainSnapshot()->GetAncestor(nHeight);
+
+    if (!pblockindex)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    CJSONValueWriter writer;
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+    return std::move(writer.GetValue());
 }
 
 // ppcoin: get information of sync-checkpoint
@@ -98,7 +98,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     Value valReply;
 
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
 
     const Object& reply = valReply.get_obj();
@@ -133,6 +133,12 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblockbynumber", 0 },
     { "getblockbynumber", 1 },
     { "getblockhash", 0 },
+    { "getrawmempool", 0 },
+    { "estimatefee", 0 },
+    { "estimatepriority", 0 },
+    { "benchaccept", 1 },
+    { "benchjson", 1 },
+    { "getpeerstats", 0 },
     { "move", 2 },
     { "move", 3 },
     { "sendfrom", 2 },
@@ -176,6 +182,10 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "rescanblockchain", 0},
     { "rescanblockchain", 1},
     { "rescanblockchain", 2},
+    { "benchcoinselection", 0 },
+    { "benchcoinselection", 1 },
+    { "benchwalletdb", 0 },
+    { "benchderive", 0 },
 };
 
 class CRPCConvertTable
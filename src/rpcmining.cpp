@@ -97,20 +97,22 @@ Value getmininginfo(const Array& params, bool fHelp)
 
     uint64_t nWeight = 0;
     Object obj, diff, weight;
+    CChainSnapshotRef snapshot = GetChainSnapshot();
 
+    // Takes only the wallet lock unless the weight has to be worked out again
     if (pwalletMain)
         nWeight = pwalletMain->GetStakeWeight();
 
-    obj.push_back(Pair("blocks", (int) nBestHeight));
+    obj.push_back(Pair("blocks", snapshot->nHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t) nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t) nLastBlockTx));
 
-    diff.push_back(Pair("proof-of-work", GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work", GetDifficulty(snapshot->pindexLastPoW)));
+    diff.push_back(Pair("proof-of-stake", GetDifficulty(snapshot->pindexLastPoS)));
     diff.push_back(Pair("search-interval", (int) nLastCoinStakeSearchInterval));
     obj.push_back(Pair("difficulty", diff));
 
-    obj.push_back(Pair("blockvalue", (uint64_t) GetProofOfWorkReward(pindexBest->nHeight, 0)));
+    obj.push_back(Pair("blockvalue", (uint64_t) GetProofOfWorkReward(snapshot->nHeight, 0)));
     obj.push_back(Pair("netmhashps", GetPoWMHashPS()));
     obj.push_back(Pair("netstakeweight", GetPoSKernelPS()));
     obj.push_back(Pair("errors", GetWarnings("statusbar")));
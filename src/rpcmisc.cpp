@@ -20,9 +20,13 @@
 #endif
 
 #include <stdint.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
 
 #include <boost/assign/list_of.hpp>
 #include "json/json_spirit_utils.h"
+#include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_value.h"
 
 using namespace std;
@@ -38,6 +42,7 @@ Value getinfo(const Array& params, bool fHelp)
 
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
+    CChainSnapshotRef snapshot = GetChainSnapshot();
 
     Object obj, diff;
     obj.push_back(Pair("version",       FormatFullVersion()));
@@ -47,22 +52,28 @@ Value getinfo(const Array& params, bool fHelp)
 #ifdef ENABLE_WALLET
     if (pwalletMain)
     {
+        // The balances as last worked out, so that getinfo does not wait for cs_main
+        CWallet::Balances balances = pwalletMain->GetCachedBalances();
+        LOCK(pwalletMain->cs_wallet);
         obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
-        obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
-        obj.push_back(Pair("newmint",       ValueFromAmount(pwalletMain->GetNewMint())));
-        obj.push_back(Pair("stake",         ValueFromAmount(pwalletMain->GetStake())));
+        obj.push_back(Pair("balance",       ValueFromAmount(balances.balance)));
+        obj.push_back(Pair("newmint",       ValueFromAmount(balances.immatureBalance)));
+        obj.push_back(Pair("stake",         ValueFromAmount(balances.stake)));
     }
 #endif
 
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blocks",        snapshot->nHeight));
     obj.push_back(Pair("timeoffset",    (int64_t)GetTimeOffset()));
-    obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->nMoneySupply)));
-    obj.push_back(Pair("connections",   (int)vNodes.size()));
+    obj.push_back(Pair("moneysupply",   ValueFromAmount(snapshot->nMoneySupply)));
+    {
+        LOCK(cs_vNodes);
+        obj.push_back(Pair("connections", (int)vNodes.size()));
+    }
     obj.push_back(Pair("proxy",         (proxy.IsValid() ? proxy.ToStringIPPort() : string())));
     obj.push_back(Pair("ip",            GetLocalAddress(NULL).ToStringIP()));
 
-    diff.push_back(Pair("proof-of-work",  GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work",  GetDifficulty(snapshot->pindexLastPoW)));
+    diff.push_back(Pair("proof-of-stake", GetDifficulty(snapshot->pindexLastPoS)));
     obj.push_back(Pair("difficulty",    diff));
 
     obj.push_back(Pair("testnet",       TestNet()));
@@ -70,6 +81,7 @@ Value getinfo(const Array& params, bool fHelp)
 #ifdef ENABLE_WALLET
     if (pwalletMain)
     {
+        LOCK(pwalletMain->cs_wallet);
         obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
         obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     }
@@ -298,3 +310,160 @@ Value spork(const Array& params, bool fHelp)
                         "<name> is the corresponding spork name, or 'show' to show all current spork settings"
                         "<value> is a epoch datetime to enable or disable spork" + HelpRequiringPassphrase());
 }
+
+// Counts what is written to it and throws it away
+class CCountingBuf : public std::streambuf
+{
+public:
+    size_t nCount;
+
+    CCountingBuf() : nCount(0) { }
+
+protected:
+    int overflow(int c) { nCount++; return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) { nCount += n; return n; }
+};
+
+// An entry shaped like one of listtransactions
+static void WriteBenchEntry(CJSONWriter& writer, int i)
+{
+    writer.BeginObject();
+    writer.Pair("account", "");
+    writer.Pair("address", "SbenchmarkaddressXXXXXXXXXXXXXXXXX");
+    writer.Pair("category", i % 2 ? "send" : "receive");
+    writer.Pair("amount", ValueFromAmount((i + 1) * COIN / 100));
+    writer.Pair("confirmations", i);
+    writer.Pair("blockhash", uint256(i).GetHex());
+    writer.Pair("txid", uint256(i + 1).GetHex());
+    writer.Pair("time", (int64_t)1500000000 + i);
+    writer.EndObject();
+}
+
+// The synthetic result, or that of a real call made through the RPC table
+static void WriteBenchResult(CJSONWriter& writer, const string& strMethod, const Array& params, int nEntries)
+{
+    if (!strMethod.empty())
+    {
+        tableRPC.execute(strMethod, params, writer);
+        return;
+    }
+
+    writer.BeginArray();
+
+    for (int i = 0; i < nEntries; i++)
+        WriteBenchEntry(writer, i);
+
+    writer.EndArray();
+}
+
+// Peak resident size of the process in kB, or 0 where it is not known
+static long GetPeakRSS()
+{
+#ifndef WIN32
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+Value benchjson(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "benchjson [entries=10000]\n"
+            "benchjson <method> [params]\n"
+            "Serializes a result twice, once streamed and once built as a tree and then written out, and reports\n"
+            "the time each took and how far it raised the peak resident size of the process. The streamed pass\n"
+            "runs first, since the peak never goes down. The text is then parsed back with json_spirit's reader\n"
+            "and with ReadJSON(), timing each.\n"
+            "Given a number, the result is a synthetic array of [entries] listtransactions entries. Given the name\n"
+            "of an RPC method, it is the result of that method called with the JSON array [params], for example\n"
+            "benchjson listtransactions '[\"*\", 10000]'. Each pass then runs the handler itself, locks included.");
+
+    int nEntries = 10000;
+    string strMethod;
+    Array paramsMethod;
+
+    // From the command line the entry count comes as a string too
+    if (params.size() > 0 && params[0].type() == str_type && !ParseInt32(params[0].get_str(), &nEntries))
+    {
+        strMethod = params[0].get_str();
+
+        if (!tableRPC[strMethod])
+            throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+
+        if (strMethod == "benchjson")
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "benchjson can not time itself");
+
+        if (params.size() > 1)
+            paramsMethod = params[1].get_array();
+    }
+    else
+    {
+        if (params.size() > 1)
+            throw runtime_error("benchjson [entries=10000]");
+
+        if (params.size() > 0 && params[0].type() != str_type)
+            nEntries = params[0].get_int();
+
+        if (nEntries < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "entries must not be negative");
+    }
+
+    long nPeakStart = GetPeakRSS();
+    int64_t nStart = GetTimeMicros();
+    CCountingBuf buf;
+    {
+        std::ostream stream(&buf);
+        CJSONStreamWriter writer(stream);
+
+        WriteBenchResult(writer, strMethod, paramsMethod, nEntries);
+    }
+    int64_t nStreamUsec = GetTimeMicros() - nStart;
+    long nPeakStream = GetPeakRSS();
+
+    nStart = GetTimeMicros();
+    string strTree;
+    {
+        CJSONValueWriter writer;
+
+        WriteBenchResult(writer, strMethod, paramsMethod, nEntries);
+        strTree = write_string(writer.GetValue(), false);
+    }
+    int64_t nTreeUsec = GetTimeMicros() - nStart;
+    long nPeakTree = GetPeakRSS();
+
+    Value valSpirit, valRead;
+    nStart = GetTimeMicros();
+
+    if (!read_string(strTree, valSpirit))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "read_string failed");
+
+    int64_t nSpiritUsec = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+
+    if (!ReadJSON(strTree, valRead))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "ReadJSON failed");
+
+    int64_t nReadUsec = GetTimeMicros() - nStart;
+
+    Object result;
+
+    if (strMethod.empty())
+        result.push_back(Pair("entries", nEntries));
+    else
+        result.push_back(Pair("method", strMethod));
+
+    result.push_back(Pair("bytes", (int64_t)buf.nCount));
+    result.push_back(Pair("samelength", strTree.size() == buf.nCount));
+    result.push_back(Pair("streamms", nStreamUsec / 1000.0));
+    result.push_back(Pair("streampeakkb", (int64_t)(nPeakStream - nPeakStart)));
+    result.push_back(Pair("treems", nTreeUsec / 1000.0));
+    result.push_back(Pair("treepeakkb", (int64_t)(nPeakTree - nPeakStream)));
+    result.push_back(Pair("spiritparsems", nSpiritUsec / 1000.0));
+    result.push_back(Pair("parsems", nReadUsec / 1000.0));
+    result.push_back(Pair("parsedsame", valSpirit == valRead));
+    return result;
+}
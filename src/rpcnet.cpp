@@ -95,6 +95,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         obj.push_back(Pair("syncnode", stats.fSyncNode));
+        obj.push_back(Pair("memusage", (int64_t)stats.nMemoryUsage));
 
         ret.push_back(obj);
     }
@@ -102,6 +103,88 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+static Object MessageTotalsToJSON(const CMessageTypeTotals& totals)
+{
+    Object obj;
+    obj.push_back(Pair("msgsrecv", (int64_t)totals.nMsgsRecv));
+    obj.push_back(Pair("bytesrecv", (int64_t)totals.nBytesRecv));
+    obj.push_back(Pair("msgssent", (int64_t)totals.nMsgsSent));
+    obj.push_back(Pair("bytessent", (int64_t)totals.nBytesSent));
+    obj.push_back(Pair("processms", (double)totals.nProcessUsec / 1000.0));
+    return obj;
+}
+
+Value getmsgstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getmsgstats [node]\n"
+            "Returns network traffic and message processing time by message type.\n"
+            "Without [node] the totals of all peers are shown along with a histogram of ProcessMessage latency, "
+            "keyed by bucket upper bound in microseconds. With [node] (as shown in getpeerinfo \"addr\") only the "
+            "traffic with that peer is shown.");
+
+    vector<CMessageTypeTotals> vTotals(MSG_TYPE_COUNT);
+    bool fNodeWide = params.size() == 0;
+
+    if (fNodeWide)
+    {
+        for (int i = 0; i < MSG_TYPE_COUNT; i++)
+            vTotals[i] = GetMessageTypeTotals(i);
+    }
+    else
+    {
+        string strNode = params[0].get_str();
+        vector<CNodeStats> vstats;
+        CopyNodeStats(vstats);
+
+        bool fFound = false;
+        BOOST_FOREACH(const CNodeStats& stats, vstats)
+        {
+            if (stats.addrName == strNode)
+            {
+                vTotals = stats.vMessageTotals;
+                fFound = true;
+                break;
+            }
+        }
+
+        if (!fFound)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Error: Node is not connected.");
+    }
+
+    Object ret;
+
+    for (int i = 0; i < MSG_TYPE_COUNT; i++)
+    {
+        if (vTotals[i].nMsgsRecv == 0 && vTotals[i].nMsgsSent == 0)
+            continue;
+
+        Object obj = MessageTotalsToJSON(vTotals[i]);
+
+        if (fNodeWide)
+        {
+            vector<uint64_t> vLatency = GetMessageLatency(i);
+            Object latency;
+
+            for (int j = 0; j < MSG_LATENCY_BUCKETS; j++)
+            {
+                if (vLatency[j] == 0)
+                    continue;
+
+                string strBound = j == MSG_LATENCY_BUCKETS - 1 ? "inf" : strprintf("%d", (int64_t)1 << j);
+                latency.push_back(Pair(strBound, (int64_t)vLatency[j]));
+            }
+
+            obj.push_back(Pair("latency", latency));
+        }
+
+        ret.push_back(Pair(GetMessageTypeName(i), obj));
+    }
+
+    return ret;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
@@ -299,6 +382,60 @@ Value sendalert(const Array& params, bool fHelp)
     return result;
 }
 
+static bool ComparePerformance(const pair<CAddress, CAddrStats>& a, const pair<CAddress, CAddrStats>& b)
+{
+    return a.second.GetPerformanceFactor() > b.second.GetPerformanceFactor();
+}
+
+Value getpeerstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getpeerstats [count=100]\n"
+            "Returns the measured performance of known peer addresses, best first.\n"
+            "Times are in milliseconds. score is the weight (0.1 to 1) used when selecting outbound peers.");
+
+    int nCount = 100;
+
+    if (params.size() > 0)
+        nCount = params[0].get_int();
+
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+
+    vector<pair<CAddress, CAddrStats> > vStats = addrman.GetStats();
+    sort(vStats.begin(), vStats.end(), ComparePerformance);
+
+    set<CService> setConnected;
+    {
+        LOCK(cs_vNodes);
+
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (!pnode->fInbound)
+                setConnected.insert(pnode->addr);
+    }
+
+    Array ret;
+
+    for (unsigned int i = 0; i < vStats.size() && i < (unsigned int)nCount; i++)
+    {
+        const CAddrStats& stats = vStats[i].second;
+        Object obj;
+
+        obj.push_back(Pair("addr", vStats[i].first.ToStringIPPort()));
+        obj.push_back(Pair("connected", setConnected.count(vStats[i].first) > 0));
+        obj.push_back(Pair("score", stats.GetPerformanceFactor()));
+        obj.push_back(Pair("handshaketime", stats.nHandshakeUsec / 1000.0));
+        obj.push_back(Pair("pingtime", stats.nPingUsec / 1000.0));
+        obj.push_back(Pair("bytespersec", stats.nBytesPerSec));
+        obj.push_back(Pair("blocklag", stats.nBlockLagUsec / 1000.0));
+        obj.push_back(Pair("lastupdate", stats.nLastUpdate));
+        ret.push_back(obj);
+    }
+
+    return ret;
+}
+
 Value getnettotals(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 0)
@@ -7,7 +7,9 @@
 
 #include "util.h"
 
+#include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
@@ -74,29 +76,33 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time(), FormatFullVersion());
+    return HTTPReplyHeader(nStatus, keepalive, false, strMsg.size()) + strMsg;
+}
+
+string HTTPReplyHeader(int nStatus, bool keepalive, bool chunked, size_t contentLength)
+{
     const char *cStatus;
          if (nStatus == HTTP_OK) cStatus = "OK";
     else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
             "Date: %s\r\n"
             "Connection: %s\r\n"
-            "Content-Length: %u\r\n"
+            "%s"
             "Content-Type: application/json\r\n"
             "Server: Swipp-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
         cStatus,
         rfc1123Time(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion(),
-        strMsg);
+        chunked ? string("Transfer-Encoding: chunked\r\n") : strprintf("Content-Length: %u\r\n", contentLength),
+        FormatFullVersion());
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -175,6 +181,26 @@ int ReadHTTPHeaders(std::basic_istream<char>& stream, map<string, string>& mapHe
 }
 
 
+// The size at the start of a chunk, with any chunk extensions after it left out. Anything other than one to eight
+// hex digits is refused, which also keeps the size far from overflowing.
+static bool ParseHTTPChunkSize(const string& strLine, size_t& nChunkRet)
+{
+    string str = strLine.substr(0, strLine.find(';'));
+    boost::trim(str);
+
+    if (str.empty() || str.size() > 8)
+        return false;
+
+    BOOST_FOREACH(char c, str)
+    {
+        if (!isxdigit((unsigned char)c))
+            return false;
+    }
+
+    nChunkRet = strtoul(str.c_str(), NULL, 16);
+    return true;
+}
+
 int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
                     string>& mapHeadersRet, string& strMessageRet,
                     int nProto, size_t max_size)
@@ -188,24 +214,58 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        while (true)
+        {
+            string str;
+            size_t nChunk;
+            std::getline(stream, str);
+
+            if (!stream || !ParseHTTPChunkSize(str, nChunk) || nChunk > max_size - strMessageRet.size())
+                return HTTP_INTERNAL_SERVER_ERROR;
+
+            // The last chunk is empty and followed by optional trailers, which are ignored
+            if (nChunk == 0)
+            {
+                while (std::getline(stream, str) && !str.empty() && str != "\r")
+                    ;
+                break;
+            }
+
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+
+            if (!stream)
+                return HTTP_INTERNAL_SERVER_ERROR;
+
+            strMessageRet.append(vch.begin(), vch.end());
+            std::getline(stream, str);
+        }
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
         strMessageRet = string(vch.begin(), vch.end());
     }
 
-    string sConHdr = mapHeadersRet["connection"];
+    SetHTTPConnectionHeader(mapHeadersRet, nProto);
+    return HTTP_OK;
+}
+
+// Make the connection header say whether the connection stays open, HTTP/1.1 keeping it by default
+void SetHTTPConnectionHeader(map<string, string>& mapHeaders, int nProto)
+{
+    string sConHdr = mapHeaders["connection"];
 
     if ((sConHdr != "close") && (sConHdr != "keep-alive"))
     {
         if (nProto >= 1)
-            mapHeadersRet["connection"] = "keep-alive";
+            mapHeaders["connection"] = "keep-alive";
         else
-            mapHeadersRet["connection"] = "close";
+            mapHeaders["connection"] = "close";
     }
-
-    return HTTP_OK;
 }
 
 //
@@ -252,3 +312,487 @@ Object JSONRPCError(int code, const string& message)
     error.push_back(Pair("message", message));
     return error;
 }
+
+void CJSONStreamWriter::Separate()
+{
+    if (fAfterKey)
+        fAfterKey = false;
+    else if (!vEmpty.empty())
+    {
+        if (!vEmpty.back())
+            stream << ',';
+
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    Separate();
+    stream << '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    vEmpty.pop_back();
+    stream << '}';
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    Separate();
+    stream << '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    vEmpty.pop_back();
+    stream << ']';
+}
+
+void CJSONStreamWriter::Key(const string& strKey)
+{
+    Separate();
+    write_stream(Value(strKey), stream, false);
+    stream << ':';
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::Write(const Value& value)
+{
+    Separate();
+    write_stream(value, stream, false);
+}
+
+// Append to the innermost open array or object and return where the value ended up. The open ones are not
+// moved by this, as nothing is added to their parents before they are closed.
+Value* CJSONValueWriter::Add(Value&& value)
+{
+    if (vOpen.empty())
+    {
+        result = std::move(value);
+        return &result;
+    }
+
+    Value* pparent = vOpen.back();
+
+    if (pparent->type() == obj_type)
+    {
+        Object& obj = pparent->get_obj();
+        obj.push_back(json_spirit::Pair(strKey, Value::null));
+        obj.back().value_ = std::move(value);
+        return &obj.back().value_;
+    }
+
+    pparent->get_array().push_back(std::move(value));
+    return &pparent->get_array().back();
+}
+
+namespace
+{
+
+// Parses JSON text and passes it on to a CJSONWriter as it goes
+class CJSONReader
+{
+private:
+    const char* p;
+    const char* pend;
+    CJSONWriter& writer;
+
+    void SkipSpace()
+    {
+        while (p < pend && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            p++;
+    }
+
+    bool ReadString(string& str);
+    bool ReadNumber(Value& value);
+    bool ReadLiteral(const char* pszLiteral);
+
+public:
+    CJSONReader(const string& str, CJSONWriter& writerIn) :
+        p(str.data()), pend(str.data() + str.size()), writer(writerIn) { }
+
+    bool Read();
+};
+
+static int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool CJSONReader::ReadString(string& str)
+{
+    if (p == pend || *p != '"')
+        return false;
+
+    p++;
+    str.clear();
+
+    while (true)
+    {
+        // Copy up to the closing quote or the next escape, whichever comes first
+        const char* pquote = (const char*)memchr(p, '"', pend - p);
+
+        if (!pquote)
+            return false;
+
+        const char* pescape = (const char*)memchr(p, '\\', pquote - p);
+
+        if (!pescape)
+        {
+            str.append(p, pquote);
+            p = pquote + 1;
+            return true;
+        }
+
+        str.append(p, pescape);
+        p = pescape + 1;
+
+        if (p == pend)
+            return false;
+
+        switch (*p++)
+        {
+            case '"':  str += '"';  break;
+            case '\\': str += '\\'; break;
+            case '/':  str += '/';  break;
+            case 'b':  str += '\b'; break;
+            case 'f':  str += '\f'; break;
+            case 'n':  str += '\n'; break;
+            case 'r':  str += '\r'; break;
+            case 't':  str += '\t'; break;
+            case 'u':
+            {
+                if (pend - p < 4)
+                    return false;
+
+                int nChar = 0;
+
+                for (int i = 0; i < 4; i++)
+                {
+                    int nDigit = HexDigit(*p++);
+
+                    if (nDigit < 0)
+                        return false;
+
+                    nChar = (nChar << 4) | nDigit;
+                }
+
+                // Kept to one byte, as read_string() does
+                str += (char)nChar;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+}
+
+// Integers become int64_t, or uint64_t when too large for that, and anything with a fraction or exponent a double
+bool CJSONReader::ReadNumber(Value& value)
+{
+    const char* pstart = p;
+    bool fReal = false;
+
+    if (p < pend && *p == '-')
+        p++;
+
+    const char* pdigits = p;
+
+    while (p < pend && *p >= '0' && *p <= '9')
+        p++;
+
+    if (p == pdigits)
+        return false;
+
+    if (p < pend && *p == '.')
+    {
+        fReal = true;
+        pdigits = ++p;
+
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+
+        if (p == pdigits)
+            return false;
+    }
+
+    if (p < pend && (*p == 'e' || *p == 'E'))
+    {
+        fReal = true;
+
+        if (++p < pend && (*p == '+' || *p == '-'))
+            p++;
+
+        pdigits = p;
+
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+
+        if (p == pdigits)
+            return false;
+    }
+
+    string strNumber(pstart, p);
+
+    if (fReal)
+    {
+        // Not strtod(), which follows the locale the GUI may have set
+        istringstream stream(strNumber);
+        stream.imbue(std::locale::classic());
+        double dValue;
+
+        if (!(stream >> dValue))
+            return false;
+
+        value = dValue;
+        return true;
+    }
+
+    errno = 0;
+    long long nValue = strtoll(strNumber.c_str(), NULL, 10);
+
+    if (errno != ERANGE)
+    {
+        value = (int64_t)nValue;
+        return true;
+    }
+
+    if (*pstart == '-')
+        return false;
+
+    errno = 0;
+    unsigned long long nUnsigned = strtoull(strNumber.c_str(), NULL, 10);
+
+    if (errno == ERANGE)
+        return false;
+
+    value = (uint64_t)nUnsigned;
+    return true;
+}
+
+bool CJSONReader::ReadLiteral(const char* pszLiteral)
+{
+    size_t nLength = strlen(pszLiteral);
+
+    if ((size_t)(pend - p) < nLength || memcmp(p, pszLiteral, nLength) != 0)
+        return false;
+
+    p += nLength;
+    return true;
+}
+
+bool CJSONReader::Read()
+{
+    vector<char> vOpen; // '{' or '[' for each array or object not closed yet
+    string str;
+    Value value;
+
+    while (true)
+    {
+        SkipSpace();
+
+        // Each value inside an object comes after its key
+        if (!vOpen.empty() && vOpen.back() == '{')
+        {
+            if (!ReadString(str))
+                return false;
+
+            SkipSpace();
+
+            if (p == pend || *p++ != ':')
+                return false;
+
+            writer.Key(str);
+            SkipSpace();
+        }
+
+        if (p == pend)
+            return false;
+
+        if (*p == '{' || *p == '[')
+        {
+            // json_spirit values are copied and freed recursively, too deep a tree would exhaust the stack
+            if (vOpen.size() >= MAX_JSON_DEPTH)
+                return false;
+
+            char c = *p++;
+            char cClose = c == '{' ? '}' : ']';
+
+            if (c == '{')
+                writer.BeginObject();
+            else
+                writer.BeginArray();
+
+            SkipSpace();
+
+            if (p == pend || *p != cClose)
+            {
+                vOpen.push_back(c);
+                continue;
+            }
+
+            p++;
+
+            if (c == '{')
+                writer.EndObject();
+            else
+                writer.EndArray();
+        }
+        else if (*p == '"')
+        {
+            if (!ReadString(str))
+                return false;
+
+            writer.Write(str);
+        }
+        else if (*p == 't' || *p == 'f' || *p == 'n')
+        {
+            if (ReadLiteral("true"))
+                writer.Write(true);
+            else if (ReadLiteral("false"))
+                writer.Write(false);
+            else if (ReadLiteral("null"))
+                writer.Write(Value::null);
+            else
+                return false;
+        }
+        else
+        {
+            if (!ReadNumber(value))
+                return false;
+
+            writer.Write(value);
+        }
+
+        // Close what ends after this value, up to the next one
+        while (true)
+        {
+            SkipSpace();
+
+            if (vOpen.empty())
+                return p == pend;
+
+            if (p == pend)
+                return false;
+
+            if (*p == ',')
+            {
+                p++;
+                break;
+            }
+
+            if (*p != (vOpen.back() == '{' ? '}' : ']'))
+                return false;
+
+            p++;
+
+            if (vOpen.back() == '{')
+                writer.EndObject();
+            else
+                writer.EndArray();
+
+            vOpen.pop_back();
+        }
+    }
+}
+
+}
+
+bool ReadJSON(const string& str, CJSONWriter& writer)
+{
+    return CJSONReader(str, writer).Read();
+}
+
+bool ReadJSON(const string& str, Value& value)
+{
+    CJSONValueWriter writer;
+
+    if (!ReadJSON(str, writer))
+        return false;
+
+    value = std::move(writer.GetValue());
+    return true;
+}
+
+CHTTPChunkedBuf::CHTTPChunkedBuf(std::ostream& streamIn, bool fKeepAliveIn) :
+    stream(streamIn), vBuffer(HTTP_CHUNK_SIZE), fKeepAlive(fKeepAliveIn), fStarted(false)
+{
+    setp(&vBuffer[0], &vBuffer[0] + vBuffer.size());
+}
+
+void CHTTPChunkedBuf::SendChunk()
+{
+    size_t nSize = pptr() - pbase();
+
+    if (!fStarted)
+    {
+        stream << HTTPReplyHeader(HTTP_OK, fKeepAlive, true);
+        fStarted = true;
+    }
+
+    if (nSize > 0)
+    {
+        stream << strprintf("%x\r\n", nSize);
+        stream.write(pbase(), nSize);
+        stream << "\r\n" << std::flush;
+    }
+
+    setp(&vBuffer[0], &vBuffer[0] + vBuffer.size());
+}
+
+int CHTTPChunkedBuf::overflow(int c)
+{
+    SendChunk();
+
+    if (c != traits_type::eof())
+    {
+        *pptr() = c;
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+void CHTTPChunkedBuf::Finish()
+{
+    if (!fStarted)
+    {
+        // All of it fit in the buffer, send it the usual way
+        stream << HTTPReply(HTTP_OK, string(pbase(), pptr()), fKeepAlive) << std::flush;
+        return;
+    }
+
+    SendChunk();
+    stream << "0\r\n\r\n" << std::flush;
+}
+
+int CHTTPReplyBuf::overflow(int c)
+{
+    if (c != traits_type::eof())
+        strPending += traits_type::to_char_type(c);
+
+    return traits_type::not_eof(c);
+}
+
+std::streamsize CHTTPReplyBuf::xsputn(const char* s, std::streamsize n)
+{
+    strPending.append(s, n);
+    return n;
+}
+
+int CHTTPReplyBuf::sync()
+{
+    if (strPending.empty())
+        return 0;
+
+    bool fSent = fnSend(strPending);
+    strPending.clear();
+    return fSent ? 0 : -1;
+}
@@ -16,6 +16,7 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/function.hpp>
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_utils.h"
@@ -30,6 +31,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -126,10 +128,12 @@ private:
 
 std::string HTTPPost(const std::string& strMsg, const std::map<std::string,std::string>& mapRequestHeaders);
 std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive);
+std::string HTTPReplyHeader(int nStatus, bool keepalive, bool chunked, size_t contentLength = 0);
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          std::string& http_method, std::string& http_uri);
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
 int ReadHTTPHeaders(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet);
+void SetHTTPConnectionHeader(std::map<std::string, std::string>& mapHeaders, int nProto);
 int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet,
                     std::string& strMessageRet, int nProto, size_t max_size);
 std::string JSONRPCRequest(const std::string& strMethod, const json_spirit::Array& params, const json_spirit::Value& id);
@@ -137,4 +141,130 @@ json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 json_spirit::Object JSONRPCError(int code, const std::string& message);
 
+// Size of the chunks a streamed HTTP reply is sent in
+static const size_t HTTP_CHUNK_SIZE = 64 * 1024;
+
+/** Receives a JSON document piece by piece, so that a large RPC result does not have to be built as one
+ *  json_spirit tree first. Inside an object each value is preceded by its Key(). */
+class CJSONWriter
+{
+public:
+    virtual ~CJSONWriter() { }
+
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void Key(const std::string& strKey) = 0;
+    virtual void Write(const json_spirit::Value& value) = 0;
+
+    // For writers that can take the value over instead of copying it
+    virtual void Write(json_spirit::Value&& value) { Write(static_cast<const json_spirit::Value&>(value)); }
+
+    void Pair(const std::string& strKey, const json_spirit::Value& value)
+    {
+        Key(strKey);
+        Write(value);
+    }
+};
+
+/** Writes to a stream as it goes, in the same compact form as write_string() */
+class CJSONStreamWriter : public CJSONWriter
+{
+private:
+    std::ostream& stream;
+    std::vector<bool> vEmpty; // For each open array or object, whether nothing was written into it yet
+    bool fAfterKey;
+
+    void Separate();
+
+public:
+    CJSONStreamWriter(std::ostream& streamIn) : stream(streamIn), fAfterKey(false) { }
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void Write(const json_spirit::Value& value);
+    using CJSONWriter::Write;
+};
+
+/** Builds a json_spirit tree, for callers that want the result as a Value */
+class CJSONValueWriter : public CJSONWriter
+{
+private:
+    json_spirit::Value result;
+    std::vector<json_spirit::Value*> vOpen; // The open arrays and objects, each inside the one before
+    std::string strKey;
+
+    json_spirit::Value* Add(json_spirit::Value&& value);
+
+public:
+    void BeginObject() { vOpen.push_back(Add(json_spirit::Object())); }
+    void EndObject() { vOpen.pop_back(); }
+    void BeginArray() { vOpen.push_back(Add(json_spirit::Array())); }
+    void EndArray() { vOpen.pop_back(); }
+    void Key(const std::string& strKeyIn) { strKey = strKeyIn; }
+    void Write(const json_spirit::Value& value) { Add(json_spirit::Value(value)); }
+    void Write(json_spirit::Value&& value) { Add(std::move(value)); }
+
+    const json_spirit::Value& GetValue() const { return result; }
+    json_spirit::Value& GetValue() { return result; }
+};
+
+// Deepest nesting of arrays and objects ReadJSON() accepts
+static const unsigned int MAX_JSON_DEPTH = 512;
+
+/** Parse JSON text, passing it to writer as it is read. Faster than json_spirit's read_string() and giving the
+ *  same values, but stricter: only white space may follow the value, and nesting is limited to MAX_JSON_DEPTH. */
+bool ReadJSON(const std::string& str, CJSONWriter& writer);
+bool ReadJSON(const std::string& str, json_spirit::Value& value);
+
+/** Sends what is written to it as the body of an HTTP/1.1 reply with chunked transfer encoding. Nothing goes
+ *  out before the first chunk is full, so a reply that turns out small or fails early is still sent whole. */
+class CHTTPChunkedBuf : public std::streambuf
+{
+private:
+    std::ostream& stream;
+    std::vector<char> vBuffer;
+    bool fKeepAlive;
+    bool fStarted;
+
+    void SendChunk();
+
+protected:
+    int overflow(int c);
+
+public:
+    CHTTPChunkedBuf(std::ostream& streamIn, bool fKeepAliveIn);
+
+    // Whether part of the reply was sent already, so that it can no longer be replaced by an error
+    bool IsStarted() const { return fStarted; }
+
+    // Send the rest of the reply
+    void Finish();
+};
+
+/** Collects what is written to it and hands it to fnSend as one piece each time it is flushed. The RPC server
+ *  passes replies this way to its I/O thread, which sends them with asynchronous writes. */
+class CHTTPReplyBuf : public std::streambuf
+{
+public:
+    // Returns false if the piece can not be sent, which puts the stream in a failed state
+    typedef boost::function<bool(const std::string&)> SendFn;
+
+private:
+    SendFn fnSend;
+    std::string strPending;
+
+protected:
+    int overflow(int c);
+    std::streamsize xsputn(const char* s, std::streamsize n);
+    int sync();
+
+public:
+    CHTTPReplyBuf(const SendFn& fnSendIn) : fnSend(fnSendIn) { }
+};
+
 #endif
@@ -5,6 +5,9 @@
 
 #include <boost/assign/list_of.hpp>
 
+#include <atomic>
+#include <fstream>
+
 #include "base58.h"
 #include "rpcserver.h"
 #include "txdb.h"
@@ -89,13 +92,13 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-        if (mi != mapBlockIndex.end() && (*mi).second)
+        CBlockIndex* pindex = LookupBlockIndex(hashBlock);
+        if (pindex)
         {
-            CBlockIndex* pindex = (*mi).second;
-            if (pindex->IsInMainChain())
+            CChainSnapshotRef snapshot = GetChainSnapshot();
+            if (snapshot->GetAncestor(pindex->nHeight) == pindex)
             {
-                entry.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
+                entry.push_back(Pair("confirmations", 1 + snapshot->nHeight - pindex->nHeight));
                 entry.push_back(Pair("time", (int64_t)pindex->nTime));
                 entry.push_back(Pair("blocktime", (int64_t)pindex->nTime));
             }
@@ -141,7 +144,7 @@ Value getrawtransaction(const Array& params, bool fHelp)
 }
 
 #ifdef ENABLE_WALLET
-Value listunspent(const Array& params, bool fHelp)
+void listunspent(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -177,10 +180,10 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
-    Array results;
     vector<COutput> vecOutputs;
     assert(pwalletMain != NULL);
     pwalletMain->AvailableCoins(vecOutputs, false);
+    writer.BeginArray();
     BOOST_FOREACH(const COutput& out, vecOutputs)
     {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
@@ -222,10 +225,10 @@ Value listunspent(const Array& params, bool fHelp)
         }
         entry.push_back(Pair("amount",ValueFromAmount(nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        writer.Write(entry);
     }
 
-    return results;
+    writer.EndArray();
 }
 #endif
 
@@ -594,11 +597,131 @@ Value sendrawtransaction(const Array& params, bool fHelp)
     }
     RelayTransaction(tx, hashTx);
 
+    // The wallet knows of the transaction by the time this returns
+    SyncWithWalletQueue();
+
     return hashTx.GetHex();
 }
 
 
-Value searchrawtransactions(const Array &params, bool fHelp)
+// Benchmark worker: pre-check transactions until none are left
+static void PreCheckTransactions(const vector<CTransaction>* pvtx, vector<int>* pvResult, std::atomic<size_t>* pnNext)
+{
+    for (size_t i = (*pnNext)++; i < pvtx->size(); i = (*pnNext)++)
+    {
+        int nDoS;
+        (*pvResult)[i] = PreCheckTransaction((*pvtx)[i], nDoS, false);
+    }
+}
+
+Value benchaccept(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "benchaccept <file> [threads]\n"
+            "Replays the raw transactions in <file>, one hex-encoded transaction per line, into scratch memory\n"
+            "pools and reports accepts per second, once with every transaction checked in turn under cs_main and\n"
+            "once with the scripts checked on [threads] threads (default: -txverifythreads) first. The node's own\n"
+            "mempool, relay and wallets are not touched, and neither pass adds to the signature cache. Inputs\n"
+            "must be confirmed or in the node's mempool to be found.");
+
+    int nThreads = GetArg("-txverifythreads", DEFAULT_TX_VERIFY_THREADS);
+
+    if (params.size() > 1)
+        nThreads = params[1].get_int();
+
+    if (nThreads < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "threads must be at least 1");
+
+    ifstream file(params[0].get_str().c_str());
+
+    if (!file.is_open())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open " + params[0].get_str());
+
+    vector<CTransaction> vtx;
+    string strLine;
+
+    while (getline(file, strLine))
+    {
+        if (strLine.empty() || !IsHex(strLine))
+            continue;
+
+        vector<unsigned char> txData(ParseHex(strLine));
+        CDataStream ssData(txData, SER_NETWORK, PROTOCOL_VERSION);
+        CTransaction tx;
+
+        try {
+            ssData >> tx;
+        }
+        catch (std::exception &e) {
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed at transaction " + itostr(vtx.size()));
+        }
+
+        vtx.push_back(tx);
+    }
+
+    // One at a time with everything under cs_main, the way relayed transactions were accepted before
+    CTxMemPool poolSerial;
+    int nAcceptedSerial = 0;
+    int64_t nStart = GetTimeMicros();
+    {
+        LOCK(cs_main);
+
+        BOOST_FOREACH(const CTransaction& txIn, vtx)
+        {
+            CTransaction tx(txIn);
+            int nDoS;
+            TxPreCheckResult result = PreCheckTransaction(tx, nDoS, false);
+
+            if (result != TXPRECHECK_INVALID &&
+                AcceptToMemoryPool(poolSerial, tx, false, NULL, result == TXPRECHECK_VALID))
+                nAcceptedSerial++;
+        }
+    }
+    int64_t nSerialUsec = GetTimeMicros() - nStart;
+
+    // Scripts first on the worker threads, then the commit stage under cs_main
+    CTxMemPool poolPipeline;
+    vector<int> vResult(vtx.size(), TXPRECHECK_UNKNOWN);
+    std::atomic<size_t> nNext(0);
+    int nAcceptedPipeline = 0;
+    nStart = GetTimeMicros();
+    {
+        boost::thread_group workers;
+
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&PreCheckTransactions, &vtx, &vResult, &nNext));
+
+        workers.join_all();
+
+        LOCK(cs_main);
+
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            CTransaction tx(vtx[i]);
+
+            if (vResult[i] != TXPRECHECK_INVALID &&
+                AcceptToMemoryPool(poolPipeline, tx, false, NULL, vResult[i] == TXPRECHECK_VALID))
+                nAcceptedPipeline++;
+        }
+    }
+    int64_t nPipelineUsec = GetTimeMicros() - nStart;
+
+    Object result;
+    result.push_back(Pair("transactions", (int)vtx.size()));
+    result.push_back(Pair("threads", nThreads));
+    result.push_back(Pair("serialaccepted", nAcceptedSerial));
+    result.push_back(Pair("serialseconds", nSerialUsec / 1000000.0));
+    result.push_back(Pair("serialacceptspersec", nSerialUsec > 0 ? nAcceptedSerial * 1000000.0 / nSerialUsec : 0.0));
+    result.push_back(Pair("pipelineaccepted", nAcceptedPipeline));
+    result.push_back(Pair("pipelineseconds", nPipelineUsec / 1000000.0));
+    result.push_back(Pair("pipelineacceptspersec",
+                          nPipelineUsec > 0 ? nAcceptedPipeline * 1000000.0 / nPipelineUsec : 0.0));
+    return result;
+}
+
+
+void searchrawtransactions(const Array &params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 4)
         throw runtime_error(
@@ -633,7 +756,7 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     std::vector<uint256>::const_iterator it = vtxhash.begin();
     while (it != vtxhash.end() && nSkip--) it++;
 
-    Array result;
+    writer.BeginArray();
     while (it != vtxhash.end() && nCount--) {
         CTransaction tx;
         uint256 hashBlock;
@@ -642,7 +765,7 @@ Value searchrawtransactions(const Array &params, bool fHelp)
            // throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Cannot read transaction from disk");
            Object obj;
 	   obj.push_back(Pair("ERROR", "Cannot read transaction from disk"));
-	   result.push_back(obj);
+	   writer.Write(obj);
 	}
 	else
 	{
@@ -654,13 +777,13 @@ Value searchrawtransactions(const Array &params, bool fHelp)
             Object object;
             TxToJSON(tx, hashBlock, object);
             object.push_back(Pair("hex", strHex));
-            result.push_back(object);
+            writer.Write(object);
         } else {
-            result.push_back(strHex);
+            writer.Write(strHex);
         }
       
         }
         it++;
     }
-    return result;
+    writer.EndArray();
 }
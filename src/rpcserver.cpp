@@ -22,12 +22,16 @@
 #include <boost/asio/ip/v6_only.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
+#include <atomic>
 #include <list>
 
 using namespace std;
@@ -37,11 +41,125 @@ using namespace json_spirit;
 
 static std::string strRPCUserColonPass;
 
+// Requests that were read in full, waiting for one of the -rpcthreads workers
+class CRPCWorkQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<boost::function<void()> > queue;
+    size_t nMaxDepth;
+    int nActive;
+    bool fRunning;
+
+public:
+    CRPCWorkQueue(size_t nMaxDepthIn) : nMaxDepth(nMaxDepthIn), nActive(0), fRunning(true) { }
+
+    // Returns false, leaving func to the caller, if the queue is full or stopped. fForce lets in work that must
+    // not be dropped, whatever the depth.
+    bool Enqueue(const boost::function<void()>& func, bool fForce = false)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+
+        if (!fRunning || (queue.size() >= nMaxDepth && !fForce))
+            return false;
+
+        queue.push_back(func);
+        cond.notify_one();
+        return true;
+    }
+
+    void Run()
+    {
+        while (true)
+        {
+            boost::function<void()> func;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+
+                if (!fRunning)
+                    return;
+
+                func.swap(queue.front());
+                queue.pop_front();
+                nActive++;
+            }
+
+            try {
+                func();
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "rpcworker");
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nActive--;
+        }
+    }
+
+    // Wake the workers and drop what is still waiting
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+        queue.clear();
+        cond.notify_all();
+    }
+
+    size_t Depth()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    size_t MaxDepth() const { return nMaxDepth; }
+
+    int Active()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nActive;
+    }
+};
+
 // These are created by StartRPCThreads, destroyed in StopRPCThreads
 static asio::io_service* rpc_io_service = NULL;
 static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
+static CRPCWorkQueue* rpc_work_queue = NULL;
+
+// Requests refused with 503 because the work queue was full
+static std::atomic<uint64_t> nRPCRejected(0);
+
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0) { }
+};
+
+static CCriticalSection cs_mapRPCStats;
+static map<string, CRPCMethodStats> mapRPCStats;
+
+static void RecordRPCCall(const string& strMethod, int64_t nStartMicros, bool fError)
+{
+    int64_t nMicros = GetTimeMicros() - nStartMicros;
+
+    LOCK(cs_mapRPCStats);
+    CRPCMethodStats& stats = mapRPCStats[strMethod];
+    stats.nCalls++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+
+    if (fError)
+        stats.nErrors++;
+}
 
 void RPCTypeCheck(const Array& params, const list<Value_type>& typesExpected, bool fAllowNull)
 {
@@ -142,7 +260,7 @@ vector<unsigned char> ParseHexO(const Object& o, string strKey)
 string CRPCTable::help(string strCommand) const
 {
     string strRet;
-    set<rpcfn_type> setDone;
+    set<pair<rpcfn_type, rpcstreamfn_type> > setDone;
 
     for (map<string, const CRPCCommand*>::const_iterator mi = mapCommands.begin(); mi != mapCommands.end(); ++mi)
     {
@@ -163,10 +281,17 @@ string CRPCTable::help(string strCommand) const
         try
         {
             Array params;
-            rpcfn_type pfn = pcmd->actor;
 
-            if (setDone.insert(pfn).second)
-                (*pfn)(params, true);
+            if (!setDone.insert(make_pair(pcmd->actor, pcmd->streamActor)).second)
+                continue;
+
+            if (pcmd->streamActor)
+            {
+                CJSONValueWriter writer;
+                (*pcmd->streamActor)(params, true, writer);
+            }
+            else
+                (*pcmd->actor)(params, true);
         }
         catch (std::exception& e)
         {
@@ -217,114 +342,172 @@ Value stop(const Array& params, bool fHelp)
     return "Swipp server stopping";
 }
 
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+    {
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns the state of the RPC work queue and, for each method called since startup, how many calls\n"
+            "there were, how many failed and how long they took in milliseconds.");
+    }
+
+    Object queue;
+
+    if (rpc_work_queue)
+    {
+        queue.push_back(Pair("depth", (uint64_t)rpc_work_queue->Depth()));
+        queue.push_back(Pair("maxdepth", (uint64_t)rpc_work_queue->MaxDepth()));
+        queue.push_back(Pair("active", rpc_work_queue->Active()));
+    }
+
+    queue.push_back(Pair("threads", (int)GetArg("-rpcthreads", 4)));
+    queue.push_back(Pair("rejected", (uint64_t)nRPCRejected));
+
+    Object methods;
+    {
+        LOCK(cs_mapRPCStats);
+
+        BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCStats)
+        {
+            const CRPCMethodStats& stats = item.second;
+            Object method;
+            method.push_back(Pair("calls", stats.nCalls));
+            method.push_back(Pair("errors", stats.nErrors));
+            method.push_back(Pair("totalms", stats.nTotalMicros / 1000.0));
+            method.push_back(Pair("avgms", stats.nTotalMicros / 1000.0 / stats.nCalls));
+            method.push_back(Pair("maxms", stats.nMaxMicros / 1000.0));
+            methods.push_back(Pair(item.first, method));
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("workqueue", queue));
+    result.push_back(Pair("methods", methods));
+    return result;
+}
+
 static const CRPCCommand vRPCCommands[] =
-{  // name                      actor (function)         okSafeMode threadSafe reqWallet
-    { "help",                   &help,                   true,      true,      false },
-    { "stop",                   &stop,                   true,      true,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,     false },
-    { "getblockcount",          &getblockcount,          true,      false,     false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false,     false },
-    { "getpeerinfo",            &getpeerinfo,            true,      false,     false },
-    { "addnode",                &addnode,                true,      true,      false },
-    { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,      false },
-    { "ping",                   &ping,                   true,      false,     false },
-    { "getnettotals",           &getnettotals,           true,      true,      false },
-    { "getdifficulty",          &getdifficulty,          true,      false,     false },
-    { "getinfo",                &getinfo,                true,      false,     false },
-    { "getrawmempool",          &getrawmempool,          true,      false,     false },
-    { "getblock",               &getblock,               false,     false,     false },
-    { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
-    { "getblockhash",           &getblockhash,           false,     false,     false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false,     false },
-    { "createrawtransaction",   &createrawtransaction,   false,     false,     false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,     false,     false },
-    { "decodescript",           &decodescript,           false,     false,     false },
-    { "signrawtransaction",     &signrawtransaction,     false,     false,     false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false },
-    { "getcheckpoint",          &getcheckpoint,          true,      false,     false },
-    { "sendalert",              &sendalert,              false,     false,     false },
-    { "validateaddress",        &validateaddress,        true,      false,     false },
-    { "validatepubkey",         &validatepubkey,         true,      false,     false },
-    { "verifymessage",          &verifymessage,          false,     false,     false },
-    { "searchrawtransactions",  &searchrawtransactions,  false,     false,     false },
+{  // name                      actor (function)         okSafeMode threadSafe reqWallet streamActor
+    { "help",                   &help,                   true,      true,      false,     NULL },
+    { "stop",                   &stop,                   true,      true,      false,     NULL },
+    { "getrpcinfo",             &getrpcinfo,             true,      true,      false,     NULL },
+    { "getbestblockhash",       &getbestblockhash,       true,      true,      false,     NULL },
+    { "getblockcount",          &getblockcount,          true,      true,      false,     NULL },
+    { "getconnectioncount",     &getconnectioncount,     true,      true,      false,     NULL },
+    { "getpeerinfo",            &getpeerinfo,            true,      false,     false,     NULL },
+    { "addnode",                &addnode,                true,      true,      false,     NULL },
+    { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,      false,     NULL },
+    { "ping",                   &ping,                   true,      false,     false,     NULL },
+    { "getnettotals",           &getnettotals,           true,      true,      false,     NULL },
+    { "getpeerstats",           &getpeerstats,           true,      true,      false,     NULL },
+    { "getmsgstats",            &getmsgstats,            true,      true,      false,     NULL },
+    { "getdifficulty",          &getdifficulty,          true,      true,      false,     NULL },
+    { "getinfo",                &getinfo,                true,      true,      false,     NULL },
+    { "getrawmempool",          NULL,                    true,      true,      false,     &getrawmempool },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      true,      false,     NULL },
+    { "estimatefee",            &estimatefee,            true,      true,      false,     NULL },
+    { "estimatepriority",       &estimatepriority,       true,      true,      false,     NULL },
+    { "getblock",               NULL,                    false,     true,      false,     &getblock },
+    { "getblockbynumber",       &getblockbynumber,       false,     true,      false,     NULL },
+    { "getblockhash",           &getblockhash,           false,     true,      false,     NULL },
+    { "getrawtransaction",      &getrawtransaction,      false,     true,      false,     NULL },
+    { "createrawtransaction",   &createrawtransaction,   false,     false,     false,     NULL },
+    { "decoderawtransaction",   &decoderawtransaction,   false,     false,     false,     NULL },
+    { "decodescript",           &decodescript,           false,     false,     false,     NULL },
+    { "signrawtransaction",     &signrawtransaction,     false,     false,     false,     NULL },
+    { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false,     NULL },
+    { "benchaccept",            &benchaccept,            false,     false,     false,     NULL },
+    { "benchjson",              &benchjson,              false,     true,      false,     NULL },
+    { "getcheckpoint",          &getcheckpoint,          true,      false,     false,     NULL },
+    { "sendalert",              &sendalert,              false,     false,     false,     NULL },
+    { "validateaddress",        &validateaddress,        true,      false,     false,     NULL },
+    { "validatepubkey",         &validatepubkey,         true,      false,     false,     NULL },
+    { "verifymessage",          &verifymessage,          false,     false,     false,     NULL },
+    { "searchrawtransactions",  NULL,                    false,     true,      false,     &searchrawtransactions },
 
     /* Dark features */
-    { "darksend",               &darksend,               false,     false,     true },
-    { "spork",                  &spork,                  true,      false,     false },
-    { "masternode",             &masternode,             true,      false,     true },
+    { "darksend",               &darksend,               false,     false,     true,     NULL },
+    { "spork",                  &spork,                  true,      false,     false,     NULL },
+    { "masternode",             &masternode,             true,      false,     true,     NULL },
 
 #ifdef ENABLE_WALLET
-    { "getmininginfo",          &getmininginfo,          true,      false,     false },
-    { "getstakinginfo",         &getstakinginfo,         true,      false,     false },
-    { "getnewaddress",          &getnewaddress,          true,      false,     true },
-    { "getnewpubkey",           &getnewpubkey,           true,      false,     true },
-    { "getaccountaddress",      &getaccountaddress,      true,      false,     true },
-    { "setaccount",             &setaccount,             true,      false,     true },
-    { "getaccount",             &getaccount,             false,     false,     true },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,     true },
-    { "sendtoaddress",          &sendtoaddress,          false,     false,     true },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,     true },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,     true },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,     true },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,     true },
-    { "backupwallet",           &backupwallet,           true,      false,     true },
-    { "keypoolrefill",          &keypoolrefill,          true,      false,     true },
-    { "walletpassphrase",       &walletpassphrase,       true,      false,     true },
-    { "walletpassphrasechange", &walletpassphrasechange, false,     false,     true },
-    { "walletlock",             &walletlock,             true,      false,     true },
-    { "encryptwallet",          &encryptwallet,          false,     false,     true },
-    { "getbalance",             &getbalance,             false,     false,     true },
-    { "move",                   &movecmd,                false,     false,     true },
-    { "sendfrom",               &sendfrom,               false,     false,     true },
-    { "sendmany",               &sendmany,               false,     false,     true },
-    { "addmultisigaddress",     &addmultisigaddress,     false,     false,     true },
-    { "addredeemscript",        &addredeemscript,        false,     false,     true },
-    { "gettransaction",         &gettransaction,         false,     false,     true },
-    { "listtransactions",       &listtransactions,       false,     false,     true },
-    { "listaddressgroupings",   &listaddressgroupings,   false,     false,     true },
-    { "signmessage",            &signmessage,            false,     false,     true },
-    { "getwork",                &getwork,                true,      false,     true },
-    { "getworkex",              &getworkex,              true,      false,     true },
-    { "listaccounts",           &listaccounts,           false,     false,     true },
-    { "getblocktemplate",       &getblocktemplate,       true,      false,     false },
-    { "submitblock",            &submitblock,            false,     false,     false },
-    { "listsinceblock",         &listsinceblock,         false,     false,     true },
-    { "dumpprivkey",            &dumpprivkey,            false,     false,     true },
-    { "dumpwallet",             &dumpwallet,             true,      false,     true },
-    { "importprivkey",          &importprivkey,          false,     false,     true },
-    { "importwallet",           &importwallet,           false,     false,     true },
-    { "listunspent",            &listunspent,            false,     false,     true },
-    { "settxfee",               &settxfee,               false,     false,     true },
-    { "getsubsidy",             &getsubsidy,             true,      true,      false },
-    { "getstakesubsidy",        &getstakesubsidy,        true,      true,      false },
-    { "reservebalance",         &reservebalance,         false,     true,      true },
-    { "checkwallet",            &checkwallet,            false,     true,      true },
-    { "repairwallet",           &repairwallet,           false,     true,      true },
-    { "resendtx",               &resendtx,               false,     true,      true },
-    { "makekeypair",            &makekeypair,            false,     true,      false },
-    { "checkkernel",            &checkkernel,            true,      false,     true },
-    { "getnewstealthaddress",   &getnewstealthaddress,   false,     false,     true},
-    { "liststealthaddresses",   &liststealthaddresses,   false,     false,     true},
-    { "importstealthaddress",   &importstealthaddress,   false,     false,     true},
-    { "sendtostealthaddress",   &sendtostealthaddress,   false,     false,     true},
-    { "smsgenable",             &smsgenable,             false,     false,     false },
-    { "smsgdisable",            &smsgdisable,            false,     false,     false },
-    { "smsglocalkeys",          &smsglocalkeys,          false,     false,     false },
-    { "smsgoptions",            &smsgoptions,            false,     false,     false },
-    { "smsgscanchain",          &smsgscanchain,          false,     false,     false },
-    { "smsgscanbuckets",        &smsgscanbuckets,        false,     false,     false },
-    { "smsgaddkey",             &smsgaddkey,             false,     false,     false },
-    { "smsggetpubkey",          &smsggetpubkey,          false,     false,     false },
-    { "smsgsend",               &smsgsend,               false,     false,     false },
-    { "smsgsendanon",           &smsgsendanon,           false,     false,     false },
-    { "smsginbox",              &smsginbox,              false,     false,     false },
-    { "smsgoutbox",             &smsgoutbox,             false,     false,     false },
-    { "smsgbuckets",            &smsgbuckets,            false,     false,     false },
+    { "getmininginfo",          &getmininginfo,          true,      true,      false,     NULL },
+    { "getstakinginfo",         &getstakinginfo,         true,      false,     false,     NULL },
+    { "getnewaddress",          &getnewaddress,          true,      false,     true,     NULL },
+    { "getnewpubkey",           &getnewpubkey,           true,      false,     true,     NULL },
+    { "getaccountaddress",      &getaccountaddress,      true,      false,     true,     NULL },
+    { "setaccount",             &setaccount,             true,      false,     true,     NULL },
+    { "getaccount",             &getaccount,             false,     false,     true,     NULL },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,     true,     NULL },
+    { "sendtoaddress",          &sendtoaddress,          false,     false,     true,     NULL },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,     true,     NULL },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,     true,     NULL },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,     true,     NULL },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,     true,     NULL },
+    { "backupwallet",           &backupwallet,           true,      false,     true,     NULL },
+    { "keypoolrefill",          &keypoolrefill,          true,      false,     true,     NULL },
+    { "walletpassphrase",       &walletpassphrase,       true,      true,      true,     NULL },
+    { "walletpassphrasechange", &walletpassphrasechange, false,     false,     true,     NULL },
+    { "walletlock",             &walletlock,             true,      false,     true,     NULL },
+    { "encryptwallet",          &encryptwallet,          false,     false,     true,     NULL },
+    { "getwalletinfo",          &getwalletinfo,          false,     false,     true,     NULL },
+    { "getbalance",             &getbalance,             false,     false,     true,     NULL },
+    { "move",                   &movecmd,                false,     false,     true,     NULL },
+    { "sendfrom",               &sendfrom,               false,     false,     true,     NULL },
+    { "sendmany",               &sendmany,               false,     false,     true,     NULL },
+    { "addmultisigaddress",     &addmultisigaddress,     false,     false,     true,     NULL },
+    { "addredeemscript",        &addredeemscript,        false,     false,     true,     NULL },
+    { "gettransaction",         &gettransaction,         false,     false,     true,     NULL },
+    { "listtransactions",       NULL,                    false,     false,     true,     &listtransactions },
+    { "listaddressgroupings",   &listaddressgroupings,   false,     false,     true,     NULL },
+    { "signmessage",            &signmessage,            false,     false,     true,     NULL },
+    { "getwork",                &getwork,                true,      false,     true,     NULL },
+    { "getworkex",              &getworkex,              true,      false,     true,     NULL },
+    { "listaccounts",           &listaccounts,           false,     false,     true,     NULL },
+    { "getblocktemplate",       &getblocktemplate,       true,      false,     false,     NULL },
+    { "submitblock",            &submitblock,            false,     false,     false,     NULL },
+    { "listsinceblock",         &listsinceblock,         false,     false,     true,     NULL },
+    { "dumpprivkey",            &dumpprivkey,            false,     false,     true,     NULL },
+    { "dumpwallet",             &dumpwallet,             true,      false,     true,     NULL },
+    { "importprivkey",          &importprivkey,          false,     false,     true,     NULL },
+    { "importwallet",           &importwallet,           false,     false,     true,     NULL },
+    { "listunspent",            NULL,                    false,     false,     true,     &listunspent },
+    { "settxfee",               &settxfee,               false,     false,     true,     NULL },
+    { "getsubsidy",             &getsubsidy,             true,      true,      false,     NULL },
+    { "getstakesubsidy",        &getstakesubsidy,        true,      true,      false,     NULL },
+    { "reservebalance",         &reservebalance,         false,     true,      true,     NULL },
+    { "checkwallet",            &checkwallet,            false,     true,      true,     NULL },
+    { "repairwallet",           &repairwallet,           false,     true,      true,     NULL },
+    { "resendtx",               &resendtx,               false,     true,      true,     NULL },
+    { "makekeypair",            &makekeypair,            false,     true,      false,     NULL },
+    { "checkkernel",            &checkkernel,            true,      false,     true,     NULL },
+    { "getnewstealthaddress",   &getnewstealthaddress,   false,     false,     true,     NULL },
+    { "liststealthaddresses",   &liststealthaddresses,   false,     false,     true,     NULL },
+    { "importstealthaddress",   &importstealthaddress,   false,     false,     true,     NULL },
+    { "sendtostealthaddress",   &sendtostealthaddress,   false,     false,     true,     NULL },
+    { "smsgenable",             &smsgenable,             false,     false,     false,     NULL },
+    { "smsgdisable",            &smsgdisable,            false,     false,     false,     NULL },
+    { "smsglocalkeys",          &smsglocalkeys,          false,     false,     false,     NULL },
+    { "smsgoptions",            &smsgoptions,            false,     false,     false,     NULL },
+    { "smsgscanchain",          &smsgscanchain,          false,     false,     false,     NULL },
+    { "smsgscanbuckets",        &smsgscanbuckets,        false,     false,     false,     NULL },
+    { "smsgaddkey",             &smsgaddkey,             false,     false,     false,     NULL },
+    { "smsggetpubkey",          &smsggetpubkey,          false,     false,     false,     NULL },
+    { "smsgsend",               &smsgsend,               false,     false,     false,     NULL },
+    { "smsgsendanon",           &smsgsendanon,           false,     false,     false,     NULL },
+    { "smsginbox",              &smsginbox,              false,     false,     false,     NULL },
+    { "smsgoutbox",             &smsgoutbox,             false,     false,     false,     NULL },
+    { "smsgbuckets",            &smsgbuckets,            false,     false,     false,     NULL },
 
     /* Rescanning of wallet transactions */
-    { "scanforalltxns",         &scanforalltxns,         false,     false,     true},
-    { "scanforstealthtxns",     &scanforstealthtxns,     false,     false,     true},
-    { "rescanblockchain",       &rescanblockchain,       false,     false,     true}
+    { "scanforalltxns",         &scanforalltxns,         false,     false,     true,     NULL },
+    { "scanforstealthtxns",     &scanforstealthtxns,     false,     false,     true,     NULL },
+    { "rescanblockchain",       &rescanblockchain,       false,     false,     true,     NULL },
+
+    { "benchcoinselection",     &benchcoinselection,     false,     true,      false,     NULL },
+    { "benchwalletdb",          &benchwalletdb,          false,     true,      false,     NULL },
+    { "benchderive",            &benchderive,            false,     true,      true,     NULL }
 #endif
 };
 
@@ -363,7 +546,7 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+void ErrorReply(std::ostream& stream, const Object& objError, const Value& id, bool fKeepAlive)
 {
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
@@ -374,7 +557,7 @@ void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
         nStatus = HTTP_NOT_FOUND;
 
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    stream << HTTPReply(nStatus, strReply, fKeepAlive) << std::flush;
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -400,23 +583,45 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
+// A request as read from the connection
+struct HTTPRequest
+{
+    int nProto;
+    string strMethod;
+    string strURI;
+    map<string, string> mapHeaders;
+    size_t nContentLength;
+    string strBody;
+
+    HTTPRequest() : nProto(0), nContentLength(0) { }
+};
+
 class AcceptedConnection
 {
 public:
     virtual ~AcceptedConnection() {}
-    virtual std::iostream& stream() = 0;
+    virtual std::ostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    HTTPRequest request;
 };
 
+// Connections are read asynchronously on the I/O thread and only handed to a worker once a whole request is in.
+// A connection is either waiting for a request or being served, never both, so only one thread uses it at a time.
+// Replies are sent with asynchronous writes on the I/O thread too. A worker writing a reply only waits while the
+// piece before is still on its way, so a slow client holds up no more than the request it made.
 template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class AcceptedConnectionImpl : public AcceptedConnection,
+                               public boost::enable_shared_from_this< AcceptedConnectionImpl<Protocol> >
 {
 public:
-    AcceptedConnectionImpl(asio::io_service& io_service, ssl::context &context, bool fUseSSL) :
-        sslStream(io_service, context), _d(sslStream, fUseSSL), _stream(_d) { }
+    AcceptedConnectionImpl(asio::io_service& io_service, ssl::context &context, bool fUseSSLIn) :
+        sslStream(io_service, context), readBuf(MAX_SIZE + HTTP_CHUNK_SIZE), idleTimer(io_service),
+        fUseSSL(fUseSSLIn), fWaiting(false), fWriting(false), fWriteFailed(false),
+        replyBuf(boost::bind(&AcceptedConnectionImpl::Write, this, _1)), _stream(&replyBuf) { }
 
-    virtual std::iostream& stream()
+    virtual std::ostream& stream()
     {
         return _stream;
     }
@@ -428,18 +633,103 @@ public:
 
     virtual void close()
     {
-        _stream.close();
+        boost::system::error_code ignored;
+        sslStream.lowest_layer().close(ignored);
+    }
+
+    // Queue a piece of the reply for the I/O thread, first waiting for the one before to be sent
+    bool Write(const std::string& strData)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWrite);
+        int64_t nDeadline = GetTime() + GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT);
+
+        while (fWriting && !fWriteFailed)
+        {
+            // The I/O thread is gone once the server stops, so do not wait for it then
+            if (ShutdownRequested() || GetTime() >= nDeadline)
+                fWriteFailed = true;
+            else
+                condWrite.timed_wait(lock, posix_time::milliseconds(200));
+        }
+
+        if (fWriteFailed)
+            return false;
+
+        fWriting = true;
+        rpc_io_service->post(boost::bind(&AcceptedConnectionImpl::StartWrite, this->shared_from_this(),
+                                         boost::make_shared<std::string>(strData)));
+        return true;
+    }
+
+    // Run fn once everything written so far is sent. Called on the I/O thread.
+    void AfterWrite(const boost::function<void()>& fn)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexWrite);
+
+            if (fWriting)
+            {
+                fnAfterWrite = fn;
+                return;
+            }
+        }
+
+        fn();
     }
 
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
+    asio::streambuf readBuf;   // What was received and not parsed yet, pipelined requests included
+    deadline_timer idleTimer;  // Closes the connection if the client keeps it waiting too long
+    bool fUseSSL;
+    bool fWaiting;             // Waiting for the client, which idleTimer may cut short
+
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    boost::mutex mutexWrite;
+    boost::condition_variable condWrite;
+    bool fWriting;                        // A piece of the reply is being sent
+    bool fWriteFailed;                    // The client is gone or too slow, nothing more is sent
+    boost::function<void()> fnAfterWrite; // What to do once the piece being sent is out
+
+    CHTTPReplyBuf replyBuf;
+    std::ostream _stream;
+
+    void StartWrite(boost::shared_ptr<std::string> pstrData)
+    {
+        boost::function<void(const boost::system::error_code&, size_t)> handler =
+            boost::bind(&AcceptedConnectionImpl::WriteDone, this->shared_from_this(), pstrData,
+                        boost::asio::placeholders::error);
+
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(*pstrData), handler);
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(*pstrData), handler);
+    }
+
+    void WriteDone(boost::shared_ptr<std::string> pstrData, const boost::system::error_code& error)
+    {
+        boost::function<void()> fnNext;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexWrite);
+            fWriting = false;
+
+            // Once a write failed the connection is not used again, and goes when the last handler holding it does
+            if (error)
+                fWriteFailed = true;
+            else
+                fnNext.swap(fnAfterWrite);
+
+            fnAfterWrite.clear();
+            condWrite.notify_all();
+        }
+
+        if (fnNext)
+            fnNext();
+    }
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+static bool ServiceRequest(AcceptedConnection *conn);
 
 #if BOOST_VERSION < 106600
 #define BASIC_SOCKET_ACCEPTOR_RETURN template <typename Protocol, typename SocketAcceptorService>
@@ -452,14 +742,17 @@ void ServiceConnection(AcceptedConnection *conn);
 // Forward declaration required for RPCListen
 BASIC_SOCKET_ACCEPTOR_RETURN
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<BASIC_SOCKET_ACCEPTOR_TEMPLATE> > acceptor,
-                             ssl::context& context, bool fUseSSL, AcceptedConnection* conn, const boost::system::error_code& error);
+                             ssl::context& context, bool fUseSSL,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
+                             const boost::system::error_code& error);
 
 // Sets up I/O resources to accept and handle a new connection.
 BASIC_SOCKET_ACCEPTOR_RETURN static void RPCListen(boost::shared_ptr< basic_socket_acceptor<BASIC_SOCKET_ACCEPTOR_TEMPLATE> > acceptor,
                                                    ssl::context& context, const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(
+        new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
         conn->sslStream.lowest_layer(),
@@ -469,38 +762,225 @@ BASIC_SOCKET_ACCEPTOR_RETURN static void RPCListen(boost::shared_ptr< basic_sock
     );
 }
 
+typedef asio::buffers_iterator<asio::streambuf::const_buffers_type> RPCBufIterator;
+
+// Finds the empty line ending the headers. Lines may end in a bare LF, as ReadHTTPHeaders() allows.
+static std::pair<RPCBufIterator, bool> MatchHeadersEnd(RPCBufIterator begin, RPCBufIterator end)
+{
+    for (RPCBufIterator it = begin; it != end; ++it)
+    {
+        if (*it != '\n')
+            continue;
+
+        RPCBufIterator next = it + 1;
+
+        if (next != end && *next == '\r')
+            ++next;
+
+        if (next != end && *next == '\n')
+            return std::make_pair(next + 1, true);
+    }
+
+    // A match starting in the last two bytes may still be completed by what comes next
+    return std::make_pair(end - begin > 2 ? end - 2 : begin, false);
+}
+
+// Cut the wait for the client short, unless what it was waiting for has come in the meantime
+template <typename Protocol>
+static void RPCIdleTimeout(boost::weak_ptr< AcceptedConnectionImpl<Protocol> > connWeak,
+                           const boost::system::error_code& error)
+{
+    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn = connWeak.lock();
+
+    if (error || !conn || !conn->fWaiting)
+        return;
+
+    boost::system::error_code ignored;
+    conn->sslStream.lowest_layer().close(ignored);
+}
+
+template <typename Protocol>
+static void RPCWaitFor(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn)
+{
+    conn->fWaiting = true;
+    conn->idleTimer.expires_from_now(posix_time::seconds(GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT)));
+    conn->idleTimer.async_wait(boost::bind(&RPCIdleTimeout<Protocol>,
+                                           boost::weak_ptr< AcceptedConnectionImpl<Protocol> >(conn),
+                                           boost::asio::placeholders::error));
+}
+
+template <typename Protocol>
+static void RPCDoneWaiting(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn)
+{
+    conn->fWaiting = false;
+    conn->idleTimer.cancel();
+}
+
+template <typename Protocol>
+static void RPCReadHeaders(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn);
+
+// Send a reply from the I/O thread, and read the next request once it is out if the connection is kept open.
+// Nothing else is being sent while the connection is read, so this never waits.
+template <typename Protocol>
+static void RPCReply(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn, const std::string& strReply,
+                     bool fKeepAlive)
+{
+    if (conn->Write(strReply) && fKeepAlive)
+        conn->AfterWrite(boost::bind(&RPCReadHeaders<Protocol>, conn));
+}
+
+// Runs on a worker: serve the request, then go back to reading the connection if it is kept open. A connection
+// that is not is closed when the reply is out and the last handler holding it goes.
+template <typename Protocol>
+static void RPCServeRequest(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn)
+{
+    if (ServiceRequest(conn.get()))
+    {
+        boost::function<void()> fnNext = boost::bind(&RPCReadHeaders<Protocol>, conn);
+        rpc_io_service->post(boost::bind(&AcceptedConnectionImpl<Protocol>::AfterWrite, conn, fnNext));
+    }
+}
+
+template <typename Protocol>
+static void RPCReadBodyHandler(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
+                               const boost::system::error_code& error)
+{
+    RPCDoneWaiting(conn);
+
+    // Dropping the last reference to the connection closes it
+    if (error)
+        return;
+
+    HTTPRequest& request = conn->request;
+    asio::streambuf::const_buffers_type data = conn->readBuf.data();
+    request.strBody.assign(asio::buffers_begin(data), asio::buffers_begin(data) + request.nContentLength);
+    conn->readBuf.consume(request.nContentLength);
+
+    if (rpc_work_queue->Enqueue(boost::bind(&RPCServeRequest<Protocol>, conn)))
+        return;
+
+    // Better to turn the client away than to let requests pile up without bound
+    nRPCRejected++;
+    LogPrint("rpc", "RPC work queue full, refusing request from %s\n", conn->peer_address_to_string());
+
+    bool fKeepAlive = request.mapHeaders["connection"] == "keep-alive";
+    RPCReply(conn, HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", fKeepAlive), fKeepAlive);
+}
+
+template <typename Protocol>
+static void RPCReadHeadersHandler(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
+                                  const boost::system::error_code& error)
+{
+    RPCDoneWaiting(conn);
+
+    if (error)
+        return;
+
+    HTTPRequest& request = conn->request;
+    request = HTTPRequest();
+
+    std::istream stream(&conn->readBuf);
+
+    if (!ReadHTTPRequestLine(stream, request.nProto, request.strMethod, request.strURI))
+        return;
+
+    int nLen = ReadHTTPHeaders(stream, request.mapHeaders);
+    SetHTTPConnectionHeader(request.mapHeaders, request.nProto);
+
+    // Request bodies are expected with a length, as HTTPPost() sends them
+    if (nLen < 0 || (size_t)nLen > MAX_SIZE || request.mapHeaders.count("transfer-encoding"))
+    {
+        RPCReply(conn, HTTPReply(HTTP_BAD_REQUEST, "", false), false);
+        return;
+    }
+
+    request.nContentLength = nLen;
+
+    if (conn->readBuf.size() >= request.nContentLength)
+    {
+        RPCReadBodyHandler(conn, boost::system::error_code());
+        return;
+    }
+
+    RPCWaitFor(conn);
+
+    size_t nMissing = request.nContentLength - conn->readBuf.size();
+    boost::function<void(const boost::system::error_code&, size_t)> handler =
+        boost::bind(&RPCReadBodyHandler<Protocol>, conn, boost::asio::placeholders::error);
+
+    if (conn->fUseSSL)
+        asio::async_read(conn->sslStream, conn->readBuf, asio::transfer_exactly(nMissing), handler);
+    else
+        asio::async_read(conn->sslStream.next_layer(), conn->readBuf, asio::transfer_exactly(nMissing), handler);
+}
+
+// Read the next request. Requests the client sent without waiting for replies are already in readBuf, and are
+// served one after another in the order they came.
+template <typename Protocol>
+static void RPCReadHeaders(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn)
+{
+    RPCWaitFor(conn);
+
+    boost::function<void(const boost::system::error_code&, size_t)> handler =
+        boost::bind(&RPCReadHeadersHandler<Protocol>, conn, boost::asio::placeholders::error);
+
+    if (conn->fUseSSL)
+        asio::async_read_until(conn->sslStream, conn->readBuf, MatchHeadersEnd, handler);
+    else
+        asio::async_read_until(conn->sslStream.next_layer(), conn->readBuf, MatchHeadersEnd, handler);
+}
+
+template <typename Protocol>
+static void RPCHandshakeHandler(boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
+                                const boost::system::error_code& error)
+{
+    RPCDoneWaiting(conn);
+
+    if (error)
+        return;
+
+    RPCReadHeaders(conn);
+}
+
 // Accept and handle incoming connection.
 BASIC_SOCKET_ACCEPTOR_RETURN
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<BASIC_SOCKET_ACCEPTOR_TEMPLATE> > acceptor,
-                      ssl::context& context, const bool fUseSSL, AcceptedConnection* conn,
+                      ssl::context& context, const bool fUseSSL,
+                      boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                       const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
+    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
 
     // TODO: Actually handle errors
     if (error)
-        delete conn;
+        return;
+
     // Restrict callers by IP.  It is important to
     // do this before starting client thread, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
+            RPCReply(conn, HTTPReply(HTTP_FORBIDDEN, "", false), false);
 
-        delete conn;
+        return;
     }
-    else
+
+    // The handshake is done here, before any request is read, so that it does not hold up a worker either
+    if (fUseSSL)
     {
-        ServiceConnection(conn);
-        conn->close();
-        delete conn;
+        RPCWaitFor(conn);
+        conn->sslStream.async_handshake(ssl::stream_base::server,
+                                        boost::bind(&RPCHandshakeHandler<Protocol>, conn,
+                                                    boost::asio::placeholders::error));
     }
+    else
+        RPCReadHeaders(conn);
 }
 
 void StartRPCThreads()
@@ -643,10 +1123,14 @@ void StartRPCThreads()
         return;
     }
 
+    rpc_work_queue = new CRPCWorkQueue(std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORK_QUEUE), 1));
     rpc_worker_group = new boost::thread_group();
 
+    // A single thread does all the reading, which never blocks, and the workers only run requests
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+        rpc_worker_group->create_thread(boost::bind(&CRPCWorkQueue::Run, rpc_work_queue));
 }
 
 void StopRPCThreads()
@@ -657,22 +1141,30 @@ void StopRPCThreads()
     deadlineTimers.clear();
     rpc_io_service->stop();
 
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Stop();
+
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
 
     delete rpc_worker_group;
     rpc_worker_group = NULL;
-    
-    delete rpc_ssl_context;
-    rpc_ssl_context = NULL;
 
+    delete rpc_work_queue;
+    rpc_work_queue = NULL;
+
+    // Connections still waiting for a request go with the handlers holding them
     delete rpc_io_service;
     rpc_io_service = NULL;
+
+    delete rpc_ssl_context;
+    rpc_ssl_context = NULL;
 }
 
+// Timers fire on the I/O thread, which must not wait for locks, so what they run is left to a worker
 void RPCRunHandler(const boost::system::error_code& err, boost::function<void(void)> func)
 {
-    if (!err)
+    if (!err && !rpc_work_queue->Enqueue(func, true))
         func();
 }
 
@@ -756,102 +1248,217 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+// A run of consecutive thread safe batch entries, worked through by any RPC thread that is free
+struct CBatchRun
+{
+    const Array* pvReq;
+    vector<Object>* pvResult;
+    size_t nEnd;
+    std::atomic<size_t> nNext;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    size_t nDone;
+};
+
+static void ExecBatchRun(boost::shared_ptr<CBatchRun> run)
 {
-    Array ret;
+    size_t nCompleted = 0;
 
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    for (size_t i; (i = run->nNext++) < run->nEnd; nCompleted++)
+        (*run->pvResult)[i] = JSONRPCExecOne((*run->pvReq)[i]);
 
-    return write_string(Value(ret), false) + "\n";
+    if (nCompleted > 0)
+    {
+        boost::unique_lock<boost::mutex> lock(run->mutex);
+        run->nDone += nCompleted;
+        run->cond.notify_all();
+    }
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+static bool IsThreadSafeRequest(const Value& req)
 {
-    bool fRun = true;
+    if (req.type() != obj_type)
+        return false;
 
-    while (fRun)
-    {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+    const Value& valMethod = find_value(req.get_obj(), "method");
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+    if (valMethod.type() != str_type)
+        return false;
+
+    const CRPCCommand* pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->threadSafe;
+}
+
+// Entries that take cs_main run one at a time in their place, so that they see what came before them. Those in
+// between that do not are shared out among the RPC workers, with this one taking its part so that a full work
+// queue cannot hold the batch up.
+static string JSONRPCExecBatch(const Array& vReq)
+{
+    vector<Object> vResult(vReq.size());
+    int nThreads = GetArg("-rpcthreads", 4);
+    size_t nBegin = 0;
+
+    while (nBegin < vReq.size())
+    {
+        size_t nEnd = nBegin;
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto, MAX_SIZE);
+        while (nEnd < vReq.size() && IsThreadSafeRequest(vReq[nEnd]))
+            nEnd++;
 
-        if (strURI != "/")
+        if (nEnd - nBegin < 2)
         {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
+            vResult[nBegin] = JSONRPCExecOne(vReq[nBegin]);
+            nBegin++;
+            continue;
         }
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+        boost::shared_ptr<CBatchRun> run(new CBatchRun());
+        run->pvReq = &vReq;
+        run->pvResult = &vResult;
+        run->nEnd = nEnd;
+        run->nNext = nBegin;
+        run->nDone = 0;
+
+        for (size_t i = 1; i < std::min((size_t)nThreads, nEnd - nBegin); i++)
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            if (!rpc_work_queue->Enqueue(boost::bind(&ExecBatchRun, run)))
+                break;
         }
-        if (!HTTPAuthorized(mapHeaders))
+
+        ExecBatchRun(run);
+
         {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords. If this results in a DoS the user
-               really shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
+            boost::unique_lock<boost::mutex> lock(run->mutex);
 
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            while (run->nDone < nEnd - nBegin)
+                run->cond.wait(lock);
         }
 
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        nBegin = nEnd;
+    }
 
-        JSONRequest jreq;
+    Array ret(vResult.begin(), vResult.end());
+    return write_string(Value(ret), false) + "\n";
+}
 
-        try
-        {
-            // Parse request
-            Value valRequest;
+// Write the reply to a single request, as JSONRPCReply() would
+static void WriteJSONRPCReply(std::ostream& stream, const JSONRequest& jreq)
+{
+    CJSONStreamWriter writer(stream);
+
+    writer.BeginObject();
+    writer.Key("result");
+    tableRPC.execute(jreq.strMethod, jreq.params, writer);
+    writer.Pair("error", Value::null);
+    writer.Pair("id", jreq.id);
+    writer.EndObject();
+    stream << "\n";
+}
 
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+// Answer the request read from conn, returning whether the connection stays open
+static bool ServiceRequest(AcceptedConnection *conn)
+{
+    int nProto = conn->request.nProto;
+    map<string, string>& mapHeaders = conn->request.mapHeaders;
+    const string& strRequest = conn->request.strBody;
+    const string& strURI = conn->request.strURI;
+    bool fRun = true;
 
-            string strReply;
+    if (strURI != "/")
+    {
+        conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
+        return false;
+    }
 
-            // Singleton request
-            if (valRequest.type() == obj_type)
-            {
-                jreq.parse(valRequest);
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
+        /* Deter brute-forcing short passwords. If this results in a DoS the user
+           really shouldn't have their RPC port exposed. */
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
-            }
-            else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
+    if (mapHeaders["connection"] == "close")
+        fRun = false;
+
+    JSONRequest jreq;
+    boost::scoped_ptr<CHTTPChunkedBuf> pChunkedBuf;
+
+    try
+    {
+        // Parse request
+        Value valRequest;
+
+        if (!ReadJSON(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        // Singleton request
+        if (valRequest.type() == obj_type)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            jreq.parse(valRequest);
+
+            // The result is written as it is produced. Calls running without cs_main send it in chunks
+            // straight to the client, others into a buffer that is sent once the locks are released.
+            const CRPCCommand* pcmd = tableRPC[jreq.strMethod];
+
+            if (nProto >= 1 && pcmd && pcmd->threadSafe)
+            {
+                pChunkedBuf.reset(new CHTTPChunkedBuf(conn->stream(), fRun));
+                std::ostream streamReply(pChunkedBuf.get());
+                WriteJSONRPCReply(streamReply, jreq);
+                pChunkedBuf->Finish();
+            }
+            else
+            {
+                std::ostringstream streamReply;
+                WriteJSONRPCReply(streamReply, jreq);
+                conn->stream() << HTTPReply(HTTP_OK, streamReply.str(), fRun) << std::flush;
+            }
         }
+        else if (valRequest.type() == array_type)
+            conn->stream() << HTTPReply(HTTP_OK, JSONRPCExecBatch(valRequest.get_array()), fRun) << std::flush;
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    }
+    catch (Object& objError)
+    {
+        // Once part of a reply is out, the client can only be told by closing the connection
+        if (pChunkedBuf && pChunkedBuf->IsStarted())
+            return false;
+
+        ErrorReply(conn->stream(), objError, jreq.id, fRun);
     }
+    catch (std::exception& e)
+    {
+        if (pChunkedBuf && pChunkedBuf->IsStarted())
+            return false;
+
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, fRun);
+    }
+
+    return fRun;
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+static void RunCommand(const CRPCCommand* pcmd, const Array& params, CJSONWriter& writer)
+{
+    if (pcmd->streamActor)
+        pcmd->streamActor(params, false, writer);
+    else
+        writer.Write(pcmd->actor(params, false));
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -870,39 +1477,59 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     if (strWarning != "" && !GetBoolArg("-disablesafemode", false) && !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    int64_t nStart = GetTimeMicros();
+
+#ifdef ENABLE_WALLET
+    // Wallet calls see the wallet as of the blocks and transactions accepted so far. No lock may be held here.
+    if (pcmd->reqWallet)
+        SyncWithWalletQueue();
+#endif
+
     try
     {
         // Execute
-        Value result;
         {
             if (pcmd->threadSafe)
-                result = pcmd->actor(params, false);
+                RunCommand(pcmd, params, writer);
 #ifdef ENABLE_WALLET
             else if (!pwalletMain)
             {
                 LOCK(cs_main);
-                result = pcmd->actor(params, false);
+                RunCommand(pcmd, params, writer);
             }
             else
             {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
+                RunCommand(pcmd, params, writer);
             }
 #else
             else
             {
                 LOCK(cs_main);
-                result = pcmd->actor(params, false);
+                RunCommand(pcmd, params, writer);
             }
 #endif
         }
-
-        return result;
     }
     catch (std::exception& e)
     {
+        RecordRPCCall(strMethod, nStart, true);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+    catch (...)
+    {
+        RecordRPCCall(strMethod, nStart, true);
+        throw;
+    }
+
+    RecordRPCCall(strMethod, nStart, false);
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    CJSONValueWriter writer;
+    execute(strMethod, params, writer);
+    return std::move(writer.GetValue());
 }
 
 const CRPCTable tableRPC;
@@ -15,6 +15,11 @@
 
 class CBlockIndex;
 
+/** Default for -rpcworkqueue, how many requests may wait for an RPC thread before more are refused */
+static const int DEFAULT_RPC_WORK_QUEUE = 64;
+/** Default for -rpcservertimeout, in seconds */
+static const int DEFAULT_RPC_SERVER_TIMEOUT = 30;
+
 void StartRPCThreads();
 void StopRPCThreads();
 
@@ -41,6 +46,9 @@ void RPCRunLater(const std::string& name, boost::function<void(void)> func, int6
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
 
+// Handlers of calls with large results write them piece by piece instead of returning a Value
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+
 class CRPCCommand
 {
 public:
@@ -49,6 +57,7 @@ public:
     bool okSafeMode;
     bool threadSafe;
     bool reqWallet;
+    rpcstreamfn_type streamActor; // Used instead of actor if set
 };
 
 /**
@@ -64,6 +73,12 @@ public:
     const CRPCCommand* operator[](std::string name) const;
     std::string help(std::string name) const;
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing its result to writer. Calls that are not threadSafe run with cs_main held,
+     * so their results should not be written straight to a slow client.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -93,6 +108,8 @@ extern json_spirit::Value ping(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addnode(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddednodeinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnettotals(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getpeerstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmsgstats(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value dumpwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importwallet(const json_spirit::Array& params, bool fHelp);
@@ -121,6 +138,7 @@ extern json_spirit::Value signmessage(const json_spirit::Array& params, bool fHe
 extern json_spirit::Value verifymessage(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getwalletinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getbalance(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value movecmd(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendfrom(const json_spirit::Array& params, bool fHelp);
@@ -129,7 +147,7 @@ extern json_spirit::Value addmultisigaddress(const json_spirit::Array& params, b
 extern json_spirit::Value addredeemscript(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void listtransactions(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -151,22 +169,27 @@ extern json_spirit::Value validatepubkey(const json_spirit::Array& params, bool
 extern json_spirit::Value getnewpubkey(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
-extern json_spirit::Value searchrawtransactions(const json_spirit::Array& params, bool fHelp);
+extern void searchrawtransactions(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 
-extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decodescript(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value signrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendrawtransaction(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchaccept(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchjson(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value estimatefee(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value estimatepriority(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
 
@@ -196,5 +219,8 @@ extern json_spirit::Value smsgbuckets(const json_spirit::Array& params, bool fHe
 extern json_spirit::Value scanforalltxns(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value scanforstealthtxns(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value rescanblockchain(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchcoinselection(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchwalletdb(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchderive(const json_spirit::Array& params, bool fHelp);
 
 #endif
@@ -94,9 +94,6 @@ static std::tuple<string, CPubKey> genKey(const Array& params)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     CPubKey newKey;
 
     // Generate a new key that is added to wallet
@@ -531,6 +528,37 @@ int64_t GetAccountBalance(const string& strAccount, int nMinDepth)
     return GetAccountBalance(walletdb, strAccount, nMinDepth);
 }
 
+Value getwalletinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+    {
+        throw runtime_error(
+            "getwalletinfo\n"
+            "Returns an object containing various wallet state info, among which an estimate of the memory its\n"
+            "transactions take and how many of them had their merkle branch, supporting transactions and order\n"
+            "form dropped from memory, which deep transactions only keep on disk.");
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    int nTrimmed;
+    size_t nTxUsage = pwalletMain->GetTxMemoryUsage(nTrimmed);
+
+    Object obj;
+    obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
+    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
+    obj.push_back(Pair("txcount",       (int)pwalletMain->mapWallet.size()));
+    obj.push_back(Pair("txtrimmed",     nTrimmed));
+    obj.push_back(Pair("txmemoryusage", (uint64_t)nTxUsage));
+    obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
+    obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+
+    if (pwalletMain->IsCrypted())
+        obj.push_back(Pair("unlocked_until", (int64_t)nWalletUnlockTime));
+
+    return obj;
+}
+
 Value getbalance(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -1146,7 +1174,21 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+// The entries of one wallet transaction or accounting entry, in the order listtransactions used to collect them
+static void ListTxItem(const CWallet::TxItems::value_type& item, const string& strAccount, Array& ret)
+{
+    CWalletTx *const pwtx = item.second.first;
+
+    if (pwtx != 0)
+        ListTransactions(*pwtx, strAccount, 0, true, ret);
+
+    CAccountingEntry *const pacentry = item.second.second;
+
+    if (pacentry != 0)
+        AcentryToJSON(*pacentry, strAccount, ret);
+}
+
+void listtransactions(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
     {
@@ -1174,46 +1216,42 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    Array ret;
     std::list<CAccountingEntry> acentries;
     CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
 
-    // Iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
-    {
-        CWalletTx *const pwtx = (*it).second.first;
-
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
+    // Find the items holding the newest nFrom + nCount entries, remembering only where each one's entries start
+    std::vector<std::pair<CWallet::TxItems::reverse_iterator, int> > vItems;
+    int nEntries = 0;
 
-        CAccountingEntry *const pacentry = (*it).second.second;
+    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend() && nEntries < nFrom + nCount; ++it)
+    {
+        Array entries;
+        ListTxItem(*it, strAccount, entries);
 
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+        if (!entries.empty())
+            vItems.push_back(make_pair(it, nEntries));
 
-        if ((int)ret.size() >= (nCount+nFrom))
-            break;
+        nEntries += entries.size();
     }
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
+    // Write oldest to newest, listing one item at a time again rather than holding all of them
+    writer.BeginArray();
 
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
+    for (int i = vItems.size() - 1; i >= 0; i--)
+    {
+        Array entries;
+        ListTxItem(*vItems[i].first, strAccount, entries);
 
-    if (last != ret.end())
-        ret.erase(last, ret.end());
+        for (int j = entries.size() - 1; j >= 0; j--)
+        {
+            int nEntry = vItems[i].second + j;
 
-    if (first != ret.begin())
-        ret.erase(ret.begin(), first);
+            if (nEntry >= nFrom && nEntry < nFrom + nCount)
+                writer.Write(std::move(entries[j]));
+        }
+    }
 
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
-    return ret;
+    writer.EndArray();
 }
 
 Value listaccounts(const Array& params, bool fHelp)
@@ -1501,7 +1539,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "Stores the wallet decryption key in memory for <timeout> seconds.");
     }
 
-    pwalletMain->TopUpKeyPool();
+    pwalletMain->RequestKeyPoolRefill();
     int64_t nSleepTime = params[1].get_int64();
 
     LOCK(cs_nWalletUnlockTime);
@@ -2138,3 +2176,241 @@ Value rescanblockchain(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value benchcoinselection(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "benchcoinselection [utxos=10000] [runs=10]\n"
+            "Builds a synthetic wallet of [utxos] coins, mostly small with some large ones, and pays [runs] random\n"
+            "amounts from it. Reports the time taken to sort the coins once and the average and worst time of a\n"
+            "selection from the sorted coins, against the average of one that sorts them again as it used to for\n"
+            "every fee pass. Also reports how many selections needed no change and the inputs they used.");
+
+    int nUTXOs = params.size() > 0 ? params[0].get_int() : 10000;
+    int nRuns = params.size() > 1 ? params[1].get_int() : 10;
+
+    if (nUTXOs <= 0 || nUTXOs > 10000000 || nRuns <= 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "utxos must be between 1 and 10000000 and runs positive");
+
+    // Outputs are grouped a hundred to a transaction to keep the wallet small
+    const int nPerTx = 100;
+    vector<CWalletTx> vTx((nUTXOs + nPerTx - 1) / nPerTx);
+    vector<COutput> vCoins;
+    vCoins.reserve(nUTXOs);
+    seed_insecure_rand();
+
+    for (int i = 0; i < nUTXOs; i++)
+    {
+        CWalletTx& wtx = vTx[i / nPerTx];
+        int64_t nValue = insecure_rand() % 10 ? CENT / 10 + insecure_rand() % (10 * COIN) : COIN * (1 + insecure_rand() % 1000);
+
+        wtx.nTime = 0;
+        wtx.vout.push_back(CTxOut(nValue, CScript()));
+        vCoins.push_back(COutput(&wtx, wtx.vout.size() - 1, 10, true));
+    }
+
+    CWallet wallet;
+    int64_t nStart = GetTimeMicros();
+    CWallet::SortCoinsForSelection(vCoins);
+    int64_t nSortUsec = GetTimeMicros() - nStart;
+
+    int64_t nSortedUsec = 0, nMaxSortedUsec = 0, nResortUsec = 0;
+    int nChangeless = 0, nFailed = 0, nInputs = 0;
+
+    for (int i = 0; i < nRuns; i++)
+    {
+        int64_t nTarget = COIN + insecure_rand() % (100 * COIN);
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64_t nValueIn = 0;
+
+        nStart = GetTimeMicros();
+        bool fFound = wallet.SelectCoinsMinConfSorted(nTarget, std::numeric_limits<unsigned int>::max(), 1, 1, vCoins,
+                                                      setCoins, nValueIn);
+        int64_t nUsec = GetTimeMicros() - nStart;
+
+        nSortedUsec += nUsec;
+        nMaxSortedUsec = max(nMaxSortedUsec, nUsec);
+
+        if (!fFound)
+            nFailed++;
+        else if (nValueIn - nTarget <= CWallet::GetChangeCost())
+        {
+            nChangeless++;
+            nInputs += setCoins.size();
+        }
+
+        nStart = GetTimeMicros();
+        wallet.SelectCoinsMinConf(nTarget, std::numeric_limits<unsigned int>::max(), 1, 1, vCoins, setCoins, nValueIn);
+        nResortUsec += GetTimeMicros() - nStart;
+    }
+
+    Object result;
+    result.push_back(Pair("utxos", nUTXOs));
+    result.push_back(Pair("runs", nRuns));
+    result.push_back(Pair("sortms", nSortUsec / 1000.0));
+    result.push_back(Pair("selectavgms", nSortedUsec / 1000.0 / nRuns));
+    result.push_back(Pair("selectmaxms", nMaxSortedUsec / 1000.0));
+    result.push_back(Pair("resortavgms", nResortUsec / 1000.0 / nRuns));
+    result.push_back(Pair("changeless", nChangeless));
+    result.push_back(Pair("changelessavginputs", nChangeless ? (double)nInputs / nChangeless : 0.0));
+    result.push_back(Pair("failed", nFailed));
+    return result;
+}
+
+Value benchwalletdb(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchwalletdb [txs=10000]\n"
+            "Writes [txs] synthetic transactions to a scratch wallet in Berkeley DB and to one in a log store, a\n"
+            "thousand to a database transaction. Reports for each the time taken to write them, to flush them as the\n"
+            "wallet flushing thread does, to load the whole wallet and to read a thousand of them back one by one.\n"
+            "The scratch wallets are removed afterwards.");
+
+    int nTxs = params.size() > 0 ? params[0].get_int() : 10000;
+
+    if (nTxs <= 0 || nTxs > 1000000)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "txs must be between 1 and 1000000");
+
+    vector<CWalletTx> vTx(nTxs);
+
+    for (int i = 0; i < nTxs; i++)
+    {
+        CWalletTx& wtx = vTx[i];
+        wtx.nTime = i;
+        wtx.nOrderPos = i;
+        wtx.vin.push_back(CTxIn(COutPoint(uint256(i + 1), 0)));
+        wtx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    }
+
+    const char* pszStores[] = { "bdb", "log" };
+    Object result;
+    result.push_back(Pair("txs", nTxs));
+    seed_insecure_rand();
+
+    for (int i = 0; i < 2; i++)
+    {
+        string strStore = pszStores[i];
+        string strFile = strprintf("benchwalletdb-%s.dat", strStore);
+        bitdb.RemoveDb(strFile);
+
+        if (strStore == "log" && !bitdb.OpenLogStore(strFile, true))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot create a scratch log store");
+
+        Object store;
+        int64_t nStart = GetTimeMicros();
+
+        {
+            CWalletDB walletdb(strFile, "cr+");
+
+            for (int n = 0; n < nTxs; n++)
+            {
+                if (n % 1000 == 0)
+                    walletdb.TxnBegin();
+
+                walletdb.WriteTx(vTx[n].GetHash(), vTx[n]);
+
+                if (n % 1000 == 999 || n == nTxs - 1)
+                    walletdb.TxnCommit();
+            }
+        }
+
+        store.push_back(Pair("writems", (GetTimeMicros() - nStart) / 1000.0));
+        nStart = GetTimeMicros();
+
+        if (strStore == "log")
+            bitdb.SyncLogStore(strFile);
+        else
+        {
+            LOCK(bitdb.cs_db);
+            bitdb.CloseDb(strFile);
+            bitdb.CheckpointLSN(strFile);
+        }
+
+        store.push_back(Pair("flushms", (GetTimeMicros() - nStart) / 1000.0));
+        nStart = GetTimeMicros();
+
+        {
+            CWallet wallet;
+            CWalletDB walletdb(strFile, "r+");
+
+            if (walletdb.LoadWallet(&wallet) != DB_LOAD_OK || (int)wallet.mapWallet.size() != nTxs)
+                throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot load the scratch wallet back");
+        }
+
+        store.push_back(Pair("loadms", (GetTimeMicros() - nStart) / 1000.0));
+        nStart = GetTimeMicros();
+
+        {
+            CWalletDB walletdb(strFile, "r");
+            CWalletTx wtx;
+
+            for (int n = 0; n < 1000; n++)
+                walletdb.ReadTx(vTx[insecure_rand() % nTxs].GetHash(), wtx);
+        }
+
+        store.push_back(Pair("read1000ms", (GetTimeMicros() - nStart) / 1000.0));
+
+        {
+            LOCK(bitdb.cs_db);
+            bitdb.RemoveDb(strFile);
+            bitdb.mapFileUseCount.erase(strFile);
+        }
+
+        result.push_back(Pair(strStore, store));
+    }
+
+    return result;
+}
+
+Value benchderive(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchderive [method]\n"
+            "Times deriving the wallet key from a passphrase with derivation [method], 0 for sha512 as new wallets\n"
+            "are encrypted with, or 1 for scrypt+sha512. Reports the rounds that take the calibration target on this\n"
+            "machine, and how long the master keys of the wallet take to derive, which is what unlocking costs.");
+
+    unsigned int nMethod = params.size() > 0 ? params[0].get_int() : nDerivationMethodIndex;
+
+    if (nMethod > 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "method must be 0 or 1");
+
+    SecureString strPassphrase;
+    strPassphrase = "benchderive";
+    vector<unsigned char> vchSalt(WALLET_CRYPTO_SALT_SIZE, 0);
+
+    Object result;
+    result.push_back(Pair("method", (int)nMethod));
+    result.push_back(Pair("targetms", WALLET_DERIVE_TARGET_MS));
+    result.push_back(Pair("iterations", (int64_t)CalibrateDeriveIterations(strPassphrase, vchSalt, nMethod,
+                                                                           WALLET_DERIVE_TARGET_MS)));
+
+    CWallet::MasterKeyMap mapMasterKeys;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        mapMasterKeys = pwalletMain->mapMasterKeys;
+    }
+
+    // What unlocking costs with the rounds the wallet was encrypted with
+    Array masterKeys;
+
+    BOOST_FOREACH(const CWallet::MasterKeyMap::value_type& pMasterKey, mapMasterKeys)
+    {
+        CCrypter crypter;
+        int64_t nStart = GetTimeMicros();
+        crypter.SetKeyFromPassphrase(strPassphrase, pMasterKey.second.vchSalt, pMasterKey.second.nDeriveIterations,
+                                     pMasterKey.second.nDerivationMethod);
+
+        Object masterKey;
+        masterKey.push_back(Pair("method", (int)pMasterKey.second.nDerivationMethod));
+        masterKey.push_back(Pair("iterations", (int64_t)pMasterKey.second.nDeriveIterations));
+        masterKey.push_back(Pair("unlockms", (GetTimeMicros() - nStart) / 1000.0));
+        masterKeys.push_back(masterKey);
+    }
+
+    result.push_back(Pair("masterkeys", masterKeys));
+    return result;
+}
@@ -793,7 +793,13 @@ struct ser_streamplaceholder
     int nVersion;
 };
 
-typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+typedef std::vector<char, optional_zero_after_free_allocator<char> > CSerializeData;
+
+// Allocator for buffers that only ever hold public data (network payloads) and need no cleanse
+inline CSerializeData::allocator_type PublicDataAllocator()
+{
+    return CSerializeData::allocator_type(false);
+}
 
 class CSizeComputer
 {
@@ -856,6 +862,11 @@ public:
         Init(nTypeIn, nVersionIn);
     }
 
+    CDataStream(int nTypeIn, int nVersionIn, const allocator_type& alloc) : vch(alloc)
+    {
+        Init(nTypeIn, nVersionIn);
+    }
+
     CDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn, int nVersionIn) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
@@ -1112,6 +1123,18 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange the underlying buffer with data, used to recycle allocations between messages
+    void SwapBuffer(CSerializeData &data)
+    {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
+    size_type capacity() const
+    {
+        return vch.capacity();
+    }
 };
 
 // RAII wrapper for FILE*.
@@ -9,6 +9,7 @@
 
 #include "threadsafety.h"
 
+#include <boost/function.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -169,6 +170,75 @@ public:
     }
 };
 
+// A background thread that is woken up to do some work. While no thread runs, those waking it do the work themselves.
+class CBackgroundWorker
+{
+private:
+    boost::condition_variable condition;
+    boost::mutex mutex;
+    bool fWanted;
+    bool fRunning;
+
+public:
+    CBackgroundWorker() : fWanted(false), fRunning(false) { }
+
+    // Returns false if there is no thread to wake, leaving the work to the caller
+    bool Wake()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+
+            if (!fRunning)
+                return false;
+
+            fWanted = true;
+        }
+
+        condition.notify_one();
+        return true;
+    }
+
+    // Does the work on this thread every time it is woken, until the thread is interrupted or the work throws
+    void Run(const boost::function<void()>& fnWork, bool fWantedAtStart = false)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fRunning = true;
+            fWanted |= fWantedAtStart;
+        }
+
+        try
+        {
+            while (true)
+            {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+
+                    while (!fWanted)
+                        condition.wait(lock);
+
+                    fWanted = false;
+                }
+
+                fnWork();
+            }
+        }
+        catch (...)
+        {
+            // Whatever ends the thread, the work is done by those waking it from now on
+            Stop();
+            throw;
+        }
+    }
+
+    // Have the work done by those waking the thread from now on, even if it still runs
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+    }
+};
+
 class CSemaphoreGrant
 {
 private:
@@ -0,0 +1,54 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+static uint256 RandomHash(int n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Last 100 entries, 1% false positive rate
+    CRollingBloomFilter rb(100, 0.01, 0);
+
+    for (int i = 0; i < 399; i++)
+        rb.insert(RandomHash(i));
+
+    // The most recent 100 entries must always be found
+    for (int i = 299; i < 399; i++)
+        BOOST_CHECK(rb.contains(RandomHash(i)));
+
+    // Entries never inserted should only rarely match
+    unsigned int nHits = 0;
+
+    for (int i = 10000; i < 20000; i++)
+        if (rb.contains(RandomHash(i)))
+            ++nHits;
+
+    BOOST_CHECK(nHits < 300);
+
+    rb.clear();
+
+    for (int i = 299; i < 399; i++)
+        BOOST_CHECK(!rb.contains(RandomHash(i)));
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_inv)
+{
+    CRollingBloomFilter rb(1000, 0.000001, 0);
+    uint256 hash = RandomHash(1);
+
+    // A transaction and its lock request share a hash but are different inventory
+    rb.insert(CInv(MSG_TX, hash));
+    BOOST_CHECK(rb.contains(CInv(MSG_TX, hash)));
+    BOOST_CHECK(!rb.contains(CInv(MSG_TXLOCK_REQUEST, hash)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
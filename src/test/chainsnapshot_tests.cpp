@@ -0,0 +1,114 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(chainsnapshot_tests)
+
+// A published snapshot may point at these at any time, so like real block indexes they are never freed
+static vector<CBlockIndex*> vBlocks;
+
+static CBlockIndex* Extend(CBlockIndex* pindexPrev, int nCount)
+{
+    CBlockIndex* pindex = pindexPrev;
+
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlockIndex* pindexNew = new CBlockIndex();
+        pindexNew->pprev = pindex;
+        pindexNew->nHeight = pindex ? pindex->nHeight + 1 : 0;
+        pindexNew->nTime = 1000000 + pindexNew->nHeight * 60;
+
+        if (pindex)
+            pindex->pnext = pindexNew;
+
+        vBlocks.push_back(pindexNew);
+        pindex = pindexNew;
+    }
+
+    return pindex;
+}
+
+static void SetTip(CBlockIndex* pindex, const uint256& hash)
+{
+    pindexBest = pindex;
+    nBestHeight = pindex->nHeight;
+    hashBestChain = hash;
+    PublishChainSnapshot();
+}
+
+static const CBlockIndex* WalkBack(const CBlockIndex* pindex, int nHeight)
+{
+    while (pindex->nHeight > nHeight)
+        pindex = pindex->pprev;
+
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_ancestors)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexBestOld = pindexBest;
+    int nBestHeightOld = nBestHeight;
+    uint256 hashBestChainOld = hashBestChain;
+
+    CBlockIndex* pindexTip = Extend(NULL, 2501);
+    SetTip(pindexTip, uint256(1));
+
+    CChainSnapshotRef snapshot = GetChainSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->nHeight, 2500);
+    BOOST_CHECK(snapshot->pindexBest == pindexTip);
+    BOOST_CHECK(snapshot->hashBest == uint256(1));
+    BOOST_CHECK(snapshot->pindexLastPoW == pindexTip);
+    BOOST_CHECK_EQUAL(snapshot->vMilestones.size(), 3U);
+
+    // Around the milestones and at both ends
+    int vHeights[] = { 0, 1, 999, 1000, 1001, 1999, 2000, 2001, 2499, 2500 };
+
+    BOOST_FOREACH(int nHeight, vHeights)
+        BOOST_CHECK(snapshot->GetAncestor(nHeight) == WalkBack(pindexTip, nHeight));
+
+    BOOST_CHECK(snapshot->GetAncestor(-1) == NULL);
+    BOOST_CHECK(snapshot->GetAncestor(2501) == NULL);
+
+    // Reorganize to a longer branch forking off at 1500, unlinking the old one as Reorganize() does
+    CBlockIndex* pindexFork = const_cast<CBlockIndex*>(WalkBack(pindexTip, 1500));
+
+    for (CBlockIndex* pindex = pindexTip; pindex != pindexFork; pindex = pindex->pprev)
+        pindex->pprev->pnext = NULL;
+
+    CBlockIndex* pindexNewTip = Extend(pindexFork, 1200);
+    SetTip(pindexNewTip, uint256(2));
+
+    CChainSnapshotRef snapshotNew = GetChainSnapshot();
+    BOOST_CHECK_EQUAL(snapshotNew->nHeight, 2700);
+    BOOST_CHECK(snapshotNew->pindexBest == pindexNewTip);
+    BOOST_CHECK_EQUAL(snapshotNew->vMilestones.size(), 3U);
+
+    for (int nHeight = 0; nHeight <= 2700; nHeight += 97)
+        BOOST_CHECK(snapshotNew->GetAncestor(nHeight) == WalkBack(pindexNewTip, nHeight));
+
+    BOOST_CHECK(snapshotNew->GetAncestor(2000) != WalkBack(pindexTip, 2000));
+    BOOST_CHECK(snapshotNew->GetAncestor(1500) == pindexFork);
+
+    // The snapshot published before is left as it was
+    BOOST_CHECK_EQUAL(snapshot->nHeight, 2500);
+    BOOST_CHECK(snapshot->GetAncestor(2000) == WalkBack(pindexTip, 2000));
+
+    // Extending the tip carries the snapshot over and only adds what is new
+    CBlockIndex* pindexLongTip = Extend(pindexNewTip, 500);
+    SetTip(pindexLongTip, uint256(3));
+
+    CChainSnapshotRef snapshotLong = GetChainSnapshot();
+    BOOST_CHECK_EQUAL(snapshotLong->nHeight, 3200);
+    BOOST_CHECK_EQUAL(snapshotLong->vMilestones.size(), 4U);
+    BOOST_CHECK(snapshotLong->GetAncestor(3000) == WalkBack(pindexLongTip, 3000));
+    BOOST_CHECK(snapshotLong->GetAncestor(2100) == WalkBack(pindexNewTip, 2100));
+
+    pindexBest = pindexBestOld;
+    nBestHeight = nBestHeightOld;
+    hashBestChain = hashBestChainOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,120 @@
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(coinage_tests)
+
+static const int64_t COINAGE_DAY = 24 * 60 * 60;
+
+// Writes the block to disk and indexes its transactions and position, as connecting it would
+static CBlockIndex* StoreBlock(CTxDB& txdb, CBlock& block, map<uint256, CTxIndex>& mapTxIndex)
+{
+    unsigned int nFile = 0;
+    unsigned int nBlockPos = 0;
+    BOOST_REQUIRE(block.WriteToDisk(nFile, nBlockPos));
+
+    CBlockIndex* pindex = new CBlockIndex(nFile, nBlockPos, block);
+    AddBlockIndexPos(pindex);
+
+    unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) -
+                          (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        CTxIndex txindex(CDiskTxPos(nFile, nBlockPos, nTxPos), tx.vout.size());
+        BOOST_REQUIRE(txdb.UpdateTxIndex(tx.GetHash(), txindex));
+        mapTxIndex[tx.GetHash()] = txindex;
+        nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+
+    return pindex;
+}
+
+static CTransaction PayTo(unsigned int nTime, int64_t nValue, const COutPoint& prevout)
+{
+    CTransaction tx;
+    tx.nTime = nTime;
+    tx.vin.push_back(CTxIn(prevout));
+    tx.vout.push_back(CTxOut(nValue, CScript() << OP_TRUE));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(coinage_overloads_agree)
+{
+    // Block files and the transaction database go to a directory of their own
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+
+    {
+        CTxDB txdb("cr+");
+        map<uint256, CTxIndex> mapTxIndex;
+        unsigned int nTimeOld = 1500000000;
+        unsigned int nTimeNew = nTimeOld + 60 * COINAGE_DAY;
+
+        CBlock blockOld;
+        blockOld.nTime = nTimeOld;
+        blockOld.vtx.push_back(PayTo(nTimeOld, 10 * COIN, COutPoint(uint256(1), 0)));
+        blockOld.vtx.push_back(PayTo(nTimeOld, 4 * COIN, COutPoint(uint256(2), 0)));
+        CBlockIndex* pindexOld = StoreBlock(txdb, blockOld, mapTxIndex);
+
+        // The spending transaction is in the same block as one of its inputs
+        CBlock blockNew;
+        blockNew.nTime = nTimeNew;
+        blockNew.vtx.push_back(PayTo(nTimeNew, 7 * COIN, COutPoint(uint256(3), 0)));
+
+        CTransaction tx;
+        tx.nTime = nTimeNew;
+        tx.vin.push_back(CTxIn(COutPoint(blockOld.vtx[0].GetHash(), 0)));
+        tx.vin.push_back(CTxIn(COutPoint(blockOld.vtx[1].GetHash(), 0)));
+        tx.vin.push_back(CTxIn(COutPoint(blockNew.vtx[0].GetHash(), 0)));
+        tx.vin.push_back(CTxIn(COutPoint(uint256(4), 0))); // Not indexed at all
+        tx.vout.push_back(CTxOut(21 * COIN, CScript() << OP_TRUE));
+        blockNew.vtx.push_back(tx);
+        CBlockIndex* pindexNew = StoreBlock(txdb, blockNew, mapTxIndex);
+
+        // The inputs as ConnectBlock() fetches them
+        MapPrevTx inputs;
+
+        for (int i = 0; i < 3; i++)
+        {
+            const uint256& hashPrev = tx.vin[i].prevout.hash;
+            const CTransaction& txPrev = i < 2 ? blockOld.vtx[i] : blockNew.vtx[0];
+            inputs[hashPrev] = make_pair(mapTxIndex[hashPrev], txPrev);
+        }
+
+        uint64_t nCoinAgeFetched = 0;
+        uint64_t nCoinAgeRead = 0;
+        BOOST_CHECK(tx.GetCoinAge(inputs, nCoinAgeFetched));
+        BOOST_CHECK(tx.GetCoinAge(txdb, nCoinAgeRead));
+
+        // Only the 14 coins of the old block are of age, the input from the same block is not
+        BOOST_CHECK_EQUAL(nCoinAgeFetched, 14U * 60);
+        BOOST_CHECK_EQUAL(nCoinAgeRead, nCoinAgeFetched);
+
+        // An input older than the transaction is refused by both
+        CTransaction txEarly = tx;
+        txEarly.nTime = nTimeOld - 1;
+        BOOST_CHECK(!txEarly.GetCoinAge(inputs, nCoinAgeFetched));
+        BOOST_CHECK(!txEarly.GetCoinAge(txdb, nCoinAgeRead));
+
+        txdb.Close();
+
+        // Their block file goes with the directory, later suites must not find them by position
+        RemoveBlockIndexPos(pindexOld);
+        RemoveBlockIndexPos(pindexNew);
+        delete pindexOld;
+        delete pindexNew;
+    }
+
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    boost::filesystem::remove_all(pathTemp);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,305 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction spending output 0 of each of vParents, with nValue telling otherwise equal ones apart
+static CTransaction MakeTx(const vector<CTransaction>& vParents, int64_t nValue)
+{
+    CTransaction tx;
+    tx.nTime = 1;
+
+    BOOST_FOREACH(const CTransaction& parent, vParents)
+        tx.vin.push_back(CTxIn(COutPoint(parent.GetHash(), 0)));
+
+    if (vParents.empty())
+        tx.vin.push_back(CTxIn(COutPoint(uint256(nValue), 0)));
+
+    tx.vout.push_back(CTxOut(nValue, CScript() << OP_TRUE));
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx, int64_t nFee, unsigned int nSize, int64_t nTime = 0)
+{
+    BOOST_CHECK(pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, nSize, 0, nTime, 1)));
+}
+
+static const CTxMemPoolEntry& Entry(const CTxMemPool& pool, const CTransaction& tx)
+{
+    return *pool.mapTx.find(tx.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(package_state)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(vector<CTransaction>(), 1);
+    CTransaction txChild = MakeTx(vector<CTransaction>(1, txParent), 2);
+    CTransaction txGrandChild = MakeTx(vector<CTransaction>(1, txChild), 3);
+
+    AddTx(pool, txParent, 1000, 100);
+    AddTx(pool, txChild, 2000, 200);
+    AddTx(pool, txGrandChild, 4000, 400);
+
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).nCountWithDescendants, 3U);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).nSizeWithDescendants, 700U);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).nFeesWithDescendants, 7000);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).nFeesWithAncestors, 7000);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 700U);
+
+    // The best package, ordered by ancestor fee rate, is the whole chain
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().begin()->hash == txGrandChild.GetHash());
+
+    // Taking the middle out splits the chain in two
+    pool.remove(txChild);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).nCountWithDescendants, 1U);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).nCountWithAncestors, 1U);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).nSizeWithAncestors, 400U);
+
+    // Putting it back, as a reorganization does, links both sides again
+    AddTx(pool, txChild, 2000, 200);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).nCountWithDescendants, 3U);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild).nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild).nCountWithDescendants, 2U);
+
+    pool.remove(txParent, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+    BOOST_CHECK(pool.mapNextTx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(resurrected_parent)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(vector<CTransaction>(), 5000);
+    CTransaction txChild = MakeTx(vector<CTransaction>(1, txParent), 4000);
+
+    // The child entered while its parent was confirmed at height 100
+    CTxMemPoolEntry entry(txChild, 1000, 200, 0, 0, 105);
+    entry.AddChainInput(0, 5000, 100);
+    BOOST_CHECK(pool.addUnchecked(txChild.GetHash(), entry));
+    BOOST_CHECK_CLOSE(Entry(pool, txChild).GetPriority(110), 5000.0 * 11 / 200, 0.01);
+
+    // A reorganization puts the parent back, so the child spends nothing confirmed any more
+    AddTx(pool, txParent, 1000, 100);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild).GetPriority(110), 0);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild).nCountWithAncestors, 2U);
+
+    // Mined again on the new branch, it counts from the height of that block
+    pool.removeForBlock(vector<CTransaction>(1, txParent), 120);
+    BOOST_CHECK(!pool.exists(txParent.GetHash()));
+    BOOST_CHECK_CLOSE(Entry(pool, txChild).GetPriority(130), 5000.0 * 11 / 200, 0.01);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild).nCountWithAncestors, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(trim_and_expire)
+{
+    CTxMemPool pool;
+
+    CTransaction txCheap = MakeTx(vector<CTransaction>(), 1);
+    CTransaction txRich = MakeTx(vector<CTransaction>(), 2);
+    CTransaction txCheapParent = MakeTx(vector<CTransaction>(), 3);
+    CTransaction txRichChild = MakeTx(vector<CTransaction>(1, txCheapParent), 4);
+
+    AddTx(pool, txCheap, 100, 1000, 10);
+    AddTx(pool, txRich, 50000, 1000, 20);
+    AddTx(pool, txCheapParent, 0, 1000, 30);
+    AddTx(pool, txRichChild, 90000, 1000, 40);
+
+    // The child pays for its parent, so the lone cheap transaction is the first to go
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.DynamicMemoryUsage() - 1), 1);
+    BOOST_CHECK(!pool.exists(txCheap.GetHash()));
+    BOOST_CHECK(pool.exists(txCheapParent.GetHash()));
+
+    BOOST_CHECK_EQUAL(pool.Expire(25), 1);
+    BOOST_CHECK(!pool.exists(txRich.GetHash()));
+
+    // Expiring a parent takes its descendants along
+    BOOST_CHECK_EQUAL(pool.Expire(35), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(package_limits)
+{
+    CTxMemPool pool;
+    vector<CTransaction> vChain(1, MakeTx(vector<CTransaction>(), 1));
+    AddTx(pool, vChain[0], 1000, 100);
+
+    for (int i = 1; i < 4; i++)
+    {
+        vChain.push_back(MakeTx(vector<CTransaction>(1, vChain.back()), 1 + i));
+        AddTx(pool, vChain.back(), 1000, 100);
+    }
+
+    CTransaction txNext = MakeTx(vector<CTransaction>(1, vChain.back()), 10);
+    string strReason;
+
+    // Four pooled ancestors make five with the new one
+    BOOST_CHECK(pool.CheckPackageLimits(txNext, 100, 5, 1000, 5, 1000, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, 100, 4, 1000, 5, 1000, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, 100, 5, 499, 5, 1000, strReason));
+
+    // The root already has four descendants counting itself
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, 100, 5, 1000, 4, 1000, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, 100, 5, 1000, 5, 499, strReason));
+
+    // Nothing pooled, nothing to limit
+    BOOST_CHECK(pool.CheckPackageLimits(MakeTx(vector<CTransaction>(), 11), 100, 1, 100, 1, 100, strReason));
+}
+
+BOOST_AUTO_TEST_CASE(rolling_min_fee)
+{
+    CTxMemPool pool;
+    SetMockTime(1000000);
+
+    CTransaction txCheap = MakeTx(vector<CTransaction>(), 1);
+    CTransaction txRich = MakeTx(vector<CTransaction>(), 2);
+    AddTx(pool, txCheap, 50000, 1000);
+    AddTx(pool, txRich, 90000, 1000);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), 0);
+
+    // Evicting the cheap one raises the minimum above what it paid, and tells which one went
+    vector<uint256> vEvicted;
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.DynamicMemoryUsage() - 1, &vEvicted), 1);
+    BOOST_CHECK_EQUAL(vEvicted.size(), 1U);
+    BOOST_CHECK(vEvicted[0] == txCheap.GetHash());
+    BOOST_CHECK_CLOSE(pool.GetMinFee(1000000), 50000.0 + MIN_RELAY_TX_FEE, 0.01);
+
+    // It only comes down once a block has been seen, halving every half-life, faster while the pool is near empty
+    SetMockTime(1000000 + ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_CLOSE(pool.GetMinFee(1000000), 50000.0 + MIN_RELAY_TX_FEE, 0.01);
+
+    pool.removeForBlock(vector<CTransaction>(), 1);
+    SetMockTime(1000000 + ROLLING_FEE_HALFLIFE * 5 / 4);
+    BOOST_CHECK_CLOSE(pool.GetMinFee(1000000), (50000.0 + MIN_RELAY_TX_FEE) / 2, 0.01);
+
+    SetMockTime(1000000 + ROLLING_FEE_HALFLIFE * 10);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(orphan_pool)
+{
+    CTxOrphanPool pool;
+    vector<CTransaction> vOrphans;
+
+    for (int i = 0; i < 8; i++)
+        vOrphans.push_back(MakeTx(vector<CTransaction>(), 100 + i));
+
+    unsigned int nSize = ::GetSerializeSize(vOrphans[0], SER_NETWORK, PROTOCOL_VERSION);
+    pool.SetMaxSize(nSize * ORPHAN_TX_PEER_SHARE * 2);
+
+    // A peer is held to its share, losing its oldest orphans first
+    BOOST_CHECK(pool.Add(vOrphans[0], 1, 1000));
+    BOOST_CHECK(pool.Add(vOrphans[1], 1, 1001));
+    BOOST_CHECK(pool.Add(vOrphans[2], 1, 1002));
+    BOOST_CHECK(!pool.exists(vOrphans[0].GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetPeerBytes(1), 2U * nSize);
+
+    // Others can still add theirs
+    BOOST_CHECK(pool.Add(vOrphans[3], 2, 1003));
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.GetTotalBytes(), 3U * nSize);
+
+    // Dependents are found through the outpoint index
+    CTransaction txParent = MakeTx(vector<CTransaction>(), 200);
+    CTransaction txChild = MakeTx(vector<CTransaction>(1, txParent), 201);
+    BOOST_CHECK(pool.Add(txChild, 3, 1004));
+
+    vector<uint256> vDependents;
+    pool.GetDependents(vector<uint256>(1, txParent.GetHash()), vDependents);
+    BOOST_CHECK_EQUAL(vDependents.size(), 1U);
+    BOOST_CHECK(vDependents[0] == txChild.GetHash());
+
+    BOOST_CHECK(pool.Erase(txChild.GetHash()));
+    BOOST_CHECK(!pool.Erase(txChild.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetPeerBytes(3), 0U);
+
+    // Orphans expire ORPHAN_TX_EXPIRE_TIME after they were added
+    BOOST_CHECK_EQUAL(pool.Expire(1001 + ORPHAN_TX_EXPIRE_TIME), 1);
+    BOOST_CHECK_EQUAL(pool.Expire(1003 + ORPHAN_TX_EXPIRE_TIME), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalBytes(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(fee_estimates)
+{
+    CFeeEstimator estimator;
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(1), -1);
+
+    CTransaction txHigh = MakeTx(vector<CTransaction>(), 1);
+    CTransaction txLow = MakeTx(vector<CTransaction>(), 2);
+
+    // Paying 100000 per kB confirms in the next block, 20000 per kB takes five
+    for (int nHeight = 10; nHeight < 60; nHeight++)
+    {
+        vector<CTxMemPoolEntry> vEntries;
+
+        for (int i = 0; i < 10; i++)
+        {
+            vEntries.push_back(CTxMemPoolEntry(txHigh, 100000, 1000, 0, 0, nHeight - 1));
+            vEntries.push_back(CTxMemPoolEntry(txLow, 20000, 1000, 0, 0, nHeight - 5));
+        }
+
+        vector<const CTxMemPoolEntry*> vpEntries;
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries)
+            vpEntries.push_back(&entry);
+
+        estimator.ProcessBlock(nHeight, vpEntries);
+    }
+
+    BOOST_CHECK_CLOSE(estimator.EstimateFee(1), 100000, 0.01);
+    BOOST_CHECK_CLOSE(estimator.EstimateFee(4), 100000, 0.01);
+    BOOST_CHECK_CLOSE(estimator.EstimateFee(5), 20000, 0.01);
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(MAX_BLOCK_CONFIRMS + 1), -1);
+    BOOST_CHECK_EQUAL(estimator.EstimatePriority(1), -1);
+
+    // A lone transaction paying a lot is no basis for an estimate
+    CFeeEstimator estimatorSparse;
+    vector<CTxMemPoolEntry> vOutlier(1, CTxMemPoolEntry(txHigh, 10000000, 1000, 0, 0, 9));
+    estimatorSparse.ProcessBlock(10, vector<const CTxMemPoolEntry*>(1, &vOutlier[0]));
+    BOOST_CHECK_EQUAL(estimatorSparse.EstimateFee(1), -1);
+}
+
+BOOST_AUTO_TEST_CASE(dump_order)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(vector<CTransaction>(), 1);
+    CTransaction txChild = MakeTx(vector<CTransaction>(1, txParent), 2);
+    CTransaction txOther = MakeTx(vector<CTransaction>(), 3);
+
+    // Entry times alone would put the child first
+    AddTx(pool, txParent, 1000, 100, 30);
+    AddTx(pool, txChild, 2000, 200, 10);
+    AddTx(pool, txOther, 3000, 300, 20);
+
+    CAutoFile file = CAutoFile(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(pool.Dump(file));
+    rewind(file);
+
+    uint64_t nVersion, nCount;
+    file >> nVersion >> nCount;
+    BOOST_CHECK_EQUAL(nVersion, MEMPOOL_DUMP_VERSION);
+    BOOST_CHECK_EQUAL(nCount, 3U);
+
+    vector<CMempoolDumpEntry> vEntries(3);
+    file >> vEntries[0] >> vEntries[1] >> vEntries[2];
+
+    BOOST_CHECK(vEntries[0].tx.GetHash() == txOther.GetHash());
+    BOOST_CHECK(vEntries[1].tx.GetHash() == txParent.GetHash());
+    BOOST_CHECK(vEntries[2].tx.GetHash() == txChild.GetHash());
+    BOOST_CHECK_EQUAL(vEntries[2].nTime, 10U);
+    BOOST_CHECK_EQUAL(vEntries[2].nFee, 2000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
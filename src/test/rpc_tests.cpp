@@ -0,0 +1,232 @@
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "rpcprotocol.h"
+#include "util.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+BOOST_AUTO_TEST_SUITE(rpc_tests)
+
+static void WriteSample(CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Pair("name", "a \"quoted\"\nline");
+    writer.Key("empty");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("list");
+    writer.BeginArray();
+    writer.Write(1);
+    writer.Write(2.5);
+    writer.BeginObject();
+    writer.Pair("flag", true);
+    writer.Pair("none", Value::null);
+    writer.EndObject();
+    writer.Write(Array());
+    writer.EndArray();
+    writer.Pair("last", (int64_t)1 << 40);
+    writer.EndObject();
+}
+
+BOOST_AUTO_TEST_CASE(stream_writer)
+{
+    // Streaming gives the same text as building the tree and writing it out
+    CJSONValueWriter valueWriter;
+    WriteSample(valueWriter);
+
+    ostringstream stream;
+    CJSONStreamWriter streamWriter(stream);
+    WriteSample(streamWriter);
+
+    BOOST_CHECK_EQUAL(stream.str(), write_string(valueWriter.GetValue(), false));
+}
+
+BOOST_AUTO_TEST_CASE(chunked_reply)
+{
+    // A small reply still goes out whole, with its length
+    ostringstream streamSmall;
+    {
+        CHTTPChunkedBuf buf(streamSmall, true);
+        ostream stream(&buf);
+        stream << "{}";
+        BOOST_CHECK(!buf.IsStarted());
+        buf.Finish();
+    }
+    BOOST_CHECK(streamSmall.str().find("Content-Length: 2\r\n") != string::npos);
+
+    // A large one is sent in chunks as it is written
+    ostringstream streamLarge;
+    {
+        CHTTPChunkedBuf buf(streamLarge, true);
+        ostream stream(&buf);
+        stream << string(HTTP_CHUNK_SIZE + 10, 'x');
+        BOOST_CHECK(buf.IsStarted());
+        buf.Finish();
+    }
+
+    string strReply = streamLarge.str();
+    BOOST_CHECK(strReply.find("Transfer-Encoding: chunked\r\n") != string::npos);
+    BOOST_CHECK(strReply.find(strprintf("\r\n\r\n%x\r\n", (unsigned int)HTTP_CHUNK_SIZE)) != string::npos);
+    BOOST_CHECK(strReply.find("\r\na\r\nxxxxxxxxxx\r\n0\r\n\r\n") != string::npos);
+}
+
+static int ReadChunked(const string& strBody, string& strMessage, size_t nMaxSize = 1000)
+{
+    istringstream stream("Transfer-Encoding: chunked\r\n\r\n" + strBody);
+    map<string, string> mapHeaders;
+    return ReadHTTPMessage(stream, mapHeaders, strMessage, 1, nMaxSize);
+}
+
+BOOST_AUTO_TEST_CASE(read_chunked)
+{
+    string strMessage;
+
+    // Chunks are put together, extensions and trailers are skipped
+    BOOST_CHECK_EQUAL(ReadChunked("5\r\nhello\r\n1;ext=1\r\n \r\nA\r\n0123456789\r\n0\r\nX-Trailer: 1\r\n\r\n",
+                                  strMessage), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, "hello 0123456789");
+
+    // What a chunked reply from the server looks like reads back the same
+    ostringstream streamReply;
+    {
+        CHTTPChunkedBuf buf(streamReply, true);
+        ostream stream(&buf);
+        stream << string(HTTP_CHUNK_SIZE + 10, 'x');
+        buf.Finish();
+    }
+
+    istringstream streamIn(streamReply.str());
+    int nProto;
+    BOOST_CHECK_EQUAL(ReadHTTPStatus(streamIn, nProto), HTTP_OK);
+    map<string, string> mapHeaders;
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(streamIn, mapHeaders, strMessage, nProto, MAX_SIZE), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, string(HTTP_CHUNK_SIZE + 10, 'x'));
+
+    // Sizes that overflow, go over the limit, or are not hex at all are refused
+    const char* vstrInvalid[] = {
+        "ffffffffffffffff\r\nx\r\n0\r\n\r\n",
+        "fffffffff\r\nx\r\n0\r\n\r\n",
+        "3e9\r\nx\r\n0\r\n\r\n",
+        "-1\r\nx\r\n0\r\n\r\n",
+        "0x5\r\nhello\r\n0\r\n\r\n",
+        "\r\nhello\r\n0\r\n\r\n",
+        "zz\r\n0\r\n\r\n",
+        "5\r\nhel",
+        "",
+    };
+
+    BOOST_FOREACH(const char* pszInvalid, vstrInvalid)
+        BOOST_CHECK_MESSAGE(ReadChunked(pszInvalid, strMessage) == HTTP_INTERNAL_SERVER_ERROR, pszInvalid);
+
+    // The limit counts all chunks together
+    BOOST_CHECK_EQUAL(ReadChunked("200\r\n" + string(0x200, 'x') + "\r\n200\r\n" + string(0x200, 'x') +
+                                  "\r\n0\r\n\r\n", strMessage), HTTP_INTERNAL_SERVER_ERROR);
+}
+
+// Stands in for the I/O thread, keeping each piece it is handed
+static bool SendPiece(vector<string>* pvPieces, bool fOk, const string& strPiece)
+{
+    if (fOk)
+        pvPieces->push_back(strPiece);
+
+    return fOk;
+}
+
+BOOST_AUTO_TEST_CASE(reply_pieces)
+{
+    // A reply is handed over once, when it is flushed
+    vector<string> vPieces;
+    {
+        CHTTPReplyBuf buf(boost::bind(&SendPiece, &vPieces, true, _1));
+        ostream stream(&buf);
+        stream << HTTPReply(HTTP_OK, "{}", true);
+        BOOST_CHECK(vPieces.empty());
+        stream << std::flush;
+    }
+
+    BOOST_CHECK_EQUAL(vPieces.size(), 1U);
+    BOOST_CHECK_EQUAL(vPieces[0], HTTPReply(HTTP_OK, "{}", true));
+
+    // A chunked reply goes out a chunk at a time, the header with the first one
+    vPieces.clear();
+    string strSent;
+    {
+        CHTTPReplyBuf buf(boost::bind(&SendPiece, &vPieces, true, _1));
+        ostream stream(&buf);
+        CHTTPChunkedBuf bufChunked(stream, false);
+        ostream streamChunked(&bufChunked);
+        streamChunked << string(2 * HTTP_CHUNK_SIZE + 10, 'x');
+        bufChunked.Finish();
+    }
+
+    BOOST_CHECK_EQUAL(vPieces.size(), 4U);
+    BOOST_CHECK_EQUAL(vPieces[0].find(HTTPReplyHeader(HTTP_OK, false, true)), 0U);
+    BOOST_CHECK_EQUAL(vPieces.back(), "0\r\n\r\n");
+
+    BOOST_FOREACH(const string& strPiece, vPieces)
+        strSent += strPiece;
+
+    istringstream streamIn(strSent);
+    int nProto;
+    string strMessage;
+    map<string, string> mapHeaders;
+    BOOST_CHECK_EQUAL(ReadHTTPStatus(streamIn, nProto), HTTP_OK);
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(streamIn, mapHeaders, strMessage, nProto, MAX_SIZE), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, string(2 * HTTP_CHUNK_SIZE + 10, 'x'));
+
+    // A piece that can not be sent fails the stream, so the rest of the reply is not produced for nothing
+    vPieces.clear();
+    {
+        CHTTPReplyBuf buf(boost::bind(&SendPiece, &vPieces, false, _1));
+        ostream stream(&buf);
+        stream << "data" << std::flush;
+        BOOST_CHECK(stream.bad());
+    }
+
+    BOOST_CHECK(vPieces.empty());
+}
+
+BOOST_AUTO_TEST_CASE(read_json)
+{
+    // Gives what json_spirit's reader does
+    const char* vstrValid[] = {
+        "{\"method\":\"getblock\",\"params\":[\"00ff\",true],\"id\":1}",
+        " [ 1 , -2 , 2.5 , 1e3 , 18446744073709551615 , \"\\t\\\"\\u0041\\/\" , null , false , { } , [ ] ] \n",
+        "{\"a\":{\"b\":[[{}]],\"c\":\"\"},\"d\":-0.125}",
+        "\"alone\"",
+        "42",
+    };
+
+    BOOST_FOREACH(const char* pszValid, vstrValid)
+    {
+        Value valSpirit, valRead;
+        BOOST_CHECK(read_string(string(pszValid), valSpirit));
+        BOOST_CHECK_MESSAGE(ReadJSON(pszValid, valRead), pszValid);
+        BOOST_CHECK_EQUAL(write_string(valRead, false), write_string(valSpirit, false));
+    }
+
+    Value value;
+    BOOST_CHECK(ReadJSON("[1,9223372036854775808]", value));
+    BOOST_CHECK(value.get_array()[0].type() == int_type && value.get_array()[1].get_uint64() == 9223372036854775808ULL);
+
+    const char* vstrInvalid[] = {
+        "", "{", "[1,]", "{\"a\"}", "{\"a\":1,}", "[1 2]", "\"open", "tru", "-", "1.", "[\"\\q\"]",
+        "18446744073709551616", "-9223372036854775809", "{} x",
+    };
+
+    BOOST_FOREACH(const char* pszInvalid, vstrInvalid)
+        BOOST_CHECK_MESSAGE(!ReadJSON(pszInvalid, value), pszInvalid);
+
+    // Nesting is limited, as the values it gives are freed recursively
+    BOOST_CHECK(ReadJSON(string(MAX_JSON_DEPTH, '[') + string(MAX_JSON_DEPTH, ']'), value));
+    BOOST_CHECK(!ReadJSON(string(MAX_JSON_DEPTH + 1, '[') + string(MAX_JSON_DEPTH + 1, ']'), value));
+    BOOST_CHECK(!ReadJSON(string(100000, '[') + string(100000, ']'), value));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -42,4 +42,33 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(swap_buffer)
+{
+    CDataStream ss(SER_NETWORK, 0, PublicDataAllocator());
+    ss.reserve(4096);
+    ss << 0x12345678;
+
+    int n;
+    ss >> n;
+    BOOST_CHECK(n == 0x12345678);
+    BOOST_CHECK(ss.empty());
+
+    // A consumed stream keeps its allocation, which can be handed to a new stream
+    CSerializeData spare(PublicDataAllocator());
+    ss.SwapBuffer(spare);
+    BOOST_CHECK(spare.capacity() >= 4096);
+    BOOST_CHECK(!spare.get_allocator().fZero);
+
+    CDataStream ssNext(SER_NETWORK, 0, PublicDataAllocator());
+    ssNext.SwapBuffer(spare);
+    BOOST_CHECK(ssNext.empty());
+    BOOST_CHECK(ssNext.capacity() >= 4096);
+
+    // Streams built without an explicit allocator still cleanse on free
+    CDataStream ssSecret(SER_DISK, 0);
+    CSerializeData secret;
+    ssSecret.SwapBuffer(secret);
+    BOOST_CHECK(secret.get_allocator().fZero);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -248,6 +248,41 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
+        // a set of coins going over the target by less than a change output is worth takes no change at all,
+        // where otherwise the next bigger coin would have been used
+        empty_wallet();
+        add_coin(4 * CENT);
+        add_coin(5 * CENT + CWallet::GetChangeCost() / 2);
+        add_coin(20 * CENT);
+
+        BOOST_CHECK( wallet.SelectCoinsMinConf(9 * CENT, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 9 * CENT + CWallet::GetChangeCost() / 2);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+        // change costs what one more output and the input spending it later add at the wallet's fee rate
+        int64_t nTransactionFeeOld = nTransactionFee;
+        nTransactionFee = CENT;
+        BOOST_CHECK_EQUAL(CWallet::GetChangeCost(), CENT * (CHANGE_OUTPUT_SIZE + CHANGE_SPEND_INPUT_SIZE) / 1000);
+        nTransactionFee = nTransactionFeeOld;
+
+        // with no changeless set the knapsack still picks the closest subset of the smaller coins...
+        empty_wallet();
+        add_coin(6 * CENT);
+        add_coin(7 * CENT);
+        add_coin(8 * CENT);
+        add_coin(30 * CENT);
+
+        BOOST_CHECK( wallet.SelectCoinsMinConf(12 * CENT, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 13 * CENT);   // 6 + 7
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+        // ...unless the next bigger coin comes as close
+        add_coin(13 * CENT);
+
+        BOOST_CHECK( wallet.SelectCoinsMinConf(12 * CENT, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 13 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+
         // test randomness
         {
             empty_wallet();
@@ -292,4 +327,450 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_fee_cap)
+{
+    CTransaction tx;
+    int64_t nTransactionFeeOld = nTransactionFee;
+
+    // A fee set far too high is held to -maxtxfee
+    nTransactionFee = 10 * COIN;
+    BOOST_CHECK_EQUAL(CWallet::GetMinimumFee(tx, 1000, 2), nMaxTxFee);
+
+    // but never below what relaying takes
+    int64_t nMaxTxFeeOld = nMaxTxFee;
+    nMaxTxFee = 0;
+    BOOST_CHECK_EQUAL(CWallet::GetMinimumFee(tx, 1000, 2), GetMinFee(tx, 1, GMF_SEND, 1000));
+
+    nMaxTxFee = nMaxTxFeeOld;
+    nTransactionFee = nTransactionFeeOld;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_coin_index)
+{
+    CWallet keywallet;
+    LOCK(keywallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    keywallet.AddKeyPubKey(key, key.GetPubKey());
+
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    CTransaction tx;
+    tx.vout.resize(3);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = 7 * COIN;
+    tx.vout[1].scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    tx.vout[2].nValue = 3 * COIN;
+    tx.vout[2].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    uint256 hash = tx.GetHash();
+    CWalletTx& wtx = keywallet.mapWallet[hash];
+    wtx = CWalletTx(&keywallet, tx);
+
+    // Only what pays us is indexed
+    keywallet.UpdateWalletCoins(hash, wtx);
+    BOOST_CHECK_EQUAL(keywallet.mapWalletCoins.size(), 2U);
+    BOOST_CHECK(!keywallet.mapWalletCoins.count(COutPoint(hash, 1)));
+    BOOST_CHECK(keywallet.setWalletCoinsByValue.begin()->second == COutPoint(hash, 2));
+    BOOST_CHECK_EQUAL(keywallet.setWalletCoinsByAddress.size(), 2U);
+    BOOST_CHECK(keywallet.setWalletCoinsByAddress.begin()->first == CTxDestination(key.GetPubKey().GetID()));
+
+    // Spending takes a coin out, and undoing the spend puts it back
+    wtx.MarkSpent(0);
+    keywallet.UpdateWalletCoin(hash, wtx, 0);
+    BOOST_CHECK_EQUAL(keywallet.mapWalletCoins.size(), 1U);
+    BOOST_CHECK_EQUAL(keywallet.setWalletCoinsByValue.size(), 1U);
+    BOOST_CHECK_EQUAL(keywallet.setWalletCoinsByAddress.size(), 1U);
+
+    wtx.MarkUnspent(0);
+    keywallet.UpdateWalletCoin(hash, wtx, 0);
+    BOOST_CHECK_EQUAL(keywallet.mapWalletCoins.size(), 2U);
+    BOOST_CHECK_EQUAL(keywallet.mapWalletCoins.find(COutPoint(hash, 0))->second.nValue, 5 * COIN);
+
+    // A rebuild finds the same coins
+    keywallet.RebuildWalletCoins();
+    BOOST_CHECK_EQUAL(keywallet.mapWalletCoins.size(), 2U);
+    BOOST_CHECK_EQUAL(keywallet.setWalletCoinsByValue.size(), 2U);
+
+    keywallet.EraseWalletCoins(hash, wtx);
+    BOOST_CHECK(keywallet.mapWalletCoins.empty());
+    BOOST_CHECK(keywallet.setWalletCoinsByValue.empty());
+    BOOST_CHECK(keywallet.setWalletCoinsByAddress.empty());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_stake_weight_cache)
+{
+    CWallet keywallet;
+    LOCK2(cs_main, keywallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    keywallet.AddKeyPubKey(key, key.GetPubKey());
+
+    CTransaction tx;
+    tx.nTime = GetTime() - 60;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    uint256 hash = tx.GetHash();
+    CWalletTx& wtx = keywallet.mapWallet[hash];
+    wtx = CWalletTx(&keywallet, tx);
+    keywallet.UpdateWalletCoins(hash, wtx);
+
+    // An unconfirmed coin has no weight yet, and the answer holds until it is old enough to stake
+    BOOST_CHECK_EQUAL(keywallet.GetStakeWeight(), 0U);
+    BOOST_CHECK(!keywallet.fStakeWeightDirty);
+    BOOST_CHECK_EQUAL(keywallet.nStakeWeightExpires, (int64_t)tx.nTime + nStakeMinAge + 1);
+
+    // Any change to the coins has it worked out again
+    wtx.MarkSpent(0);
+    keywallet.UpdateWalletCoin(hash, wtx, 0);
+    BOOST_CHECK(keywallet.fStakeWeightDirty);
+    BOOST_CHECK_EQUAL(keywallet.GetStakeWeight(), 0U);
+    BOOST_CHECK_EQUAL(keywallet.nStakeWeightExpires, std::numeric_limits<int64_t>::max());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_log_store)
+{
+    const string strFile = "logstore_test.dat";
+    bitdb.RemoveDb(strFile);
+    BOOST_CHECK(bitdb.OpenLogStore(strFile, true));
+    BOOST_CHECK(bitdb.IsLogStore(strFile));
+
+    CWalletTx wtx;
+    wtx.nOrderPos = 0;
+    wtx.vin.push_back(CTxIn(COutPoint(uint256(1), 0)));
+    wtx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    uint256 hash = wtx.GetHash();
+
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        BOOST_CHECK(walletdb.WriteTx(hash, wtx));
+
+        CWalletTx wtxRead;
+        BOOST_CHECK(walletdb.ReadTx(hash, wtxRead));
+        BOOST_CHECK(wtxRead.GetHash() == hash);
+
+        // A transaction sees its own writes, and none of them are left once it is aborted
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.EraseTx(hash));
+        BOOST_CHECK(!walletdb.ReadTx(hash, wtxRead));
+        BOOST_CHECK(walletdb.WriteOrderPosNext(7));
+        BOOST_CHECK(walletdb.TxnAbort());
+        BOOST_CHECK(walletdb.ReadTx(hash, wtxRead));
+
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WriteOrderPosNext(1));
+        BOOST_CHECK(walletdb.TxnCommit());
+
+        // Accounting entries are found by seeking the cursor to them
+        CAccountingEntry acentry;
+        acentry.strAccount = "a";
+        acentry.nOrderPos = 1;
+        acentry.nCreditDebit = 3 * COIN;
+        BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+        acentry.nCreditDebit = 4 * COIN;
+        BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+        acentry.strAccount = "b";
+        BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+        BOOST_CHECK_EQUAL(walletdb.GetAccountCreditDebit("a"), 7 * COIN);
+    }
+
+    {
+        CWallet loadwallet;
+        CWalletDB walletdb(strFile, "r+");
+        BOOST_CHECK(walletdb.LoadWallet(&loadwallet) == DB_LOAD_OK);
+        BOOST_CHECK_EQUAL(loadwallet.mapWallet.size(), 1U);
+        BOOST_CHECK(loadwallet.mapWallet.count(hash));
+        BOOST_CHECK_EQUAL(loadwallet.nOrderPosNext, 1);
+    }
+
+    BOOST_CHECK(bitdb.RemoveDb(strFile));
+    BOOST_CHECK(!bitdb.IsLogStore(strFile));
+}
+
+// The walk GetInputDarksendRounds() used to make on every call, which the cached one must agree with
+static int WalkDarksendRounds(const CWallet& keywallet, const COutPoint& outpoint, int nRounds)
+{
+    if (nRounds >= DARKSEND_ROUNDS_LIMIT)
+        return nRounds;
+
+    map<uint256, CWalletTx>::const_iterator it = keywallet.mapWallet.find(outpoint.hash);
+
+    if (it == keywallet.mapWallet.end())
+        return nRounds - 1;
+
+    const CWalletTx& wtx = (*it).second;
+
+    if (outpoint.n >= wtx.vout.size())
+        return -4;
+
+    if (wtx.vout[outpoint.n].nValue == DARKSEND_FEE)
+        return -3;
+
+    if (nRounds == 0 && !keywallet.IsDenominatedAmount(wtx.vout[outpoint.n].nValue))
+        return -2;
+
+    bool fFound = false;
+
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        fFound = keywallet.IsDenominatedAmount(txout.nValue);
+
+        if (fFound)
+            break;
+    }
+
+    if (!fFound)
+        return nRounds - 1;
+
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+    {
+        if (keywallet.IsMine(txin))
+        {
+            int n = WalkDarksendRounds(keywallet, txin.prevout, nRounds + 1);
+
+            if (n != -3)
+                return n;
+        }
+    }
+
+    return nRounds - 1;
+}
+
+static uint256 AddDarksendTx(CWallet& keywallet, const COutPoint& prevout, int64_t nValue, const CKey& key)
+{
+    static int nLockTime;
+    CTransaction tx;
+    tx.nLockTime = nLockTime++;
+    tx.vin.push_back(CTxIn(prevout));
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = DARKSEND_FEE;
+    tx.vout[1].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    uint256 hash = tx.GetHash();
+    keywallet.mapWallet[hash] = CWalletTx(&keywallet, tx);
+    keywallet.ClearDarksendRounds();
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_darksend_rounds)
+{
+    CWallet keywallet;
+    LOCK(keywallet.cs_wallet);
+
+    vector<int64_t> vDenominationsOld = darkSendDenominations;
+    darkSendDenominations.clear();
+    darkSendDenominations.push_back((1 * COIN) + 1000);
+    const int64_t nDenom = darkSendDenominations[0];
+
+    CKey key;
+    key.MakeNewKey(true);
+    keywallet.AddKeyPubKey(key, key.GetPubKey());
+
+    // A chain of mixes longer than the round limit, each spending the one before
+    vector<COutPoint> vOutPoints;
+    COutPoint prevout(GetRandHash(), 0);
+
+    for (int i = 0; i < DARKSEND_ROUNDS_LIMIT + 5; i++)
+    {
+        prevout = COutPoint(AddDarksendTx(keywallet, prevout, nDenom, key), 0);
+        vOutPoints.push_back(prevout);
+    }
+
+    // Asked for from the newest down, the walks from the top reach the limit and leave little cached; from the
+    // oldest up, each walk finds the one before in the cache
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        for (unsigned int i = 0; i < vOutPoints.size(); i++)
+        {
+            const COutPoint& outpoint = vOutPoints[nPass == 0 ? vOutPoints.size() - 1 - i : i];
+            BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpoint), WalkDarksendRounds(keywallet, outpoint, 0));
+        }
+
+        keywallet.ClearDarksendRounds();
+    }
+
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(vOutPoints.back()), DARKSEND_ROUNDS_LIMIT);
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(vOutPoints[5]), 4);
+
+    // Fees, outputs that are not denominated and outputs that do not exist
+    COutPoint outpointFee(vOutPoints[3].hash, 1);
+    COutPoint outpointMissing(vOutPoints[3].hash, 2);
+    COutPoint outpointPlain(AddDarksendTx(keywallet, vOutPoints[3], 5 * COIN, key), 0);
+
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointFee), -3);
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointMissing), -4);
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointPlain), -2);
+
+    // A mix whose input pays a key the wallet does not have yet ends the chain, until the key is imported
+    CKey keyImported;
+    keyImported.MakeNewKey(true);
+    COutPoint outpointImported(AddDarksendTx(keywallet, vOutPoints[8], nDenom, keyImported), 0);
+    COutPoint outpointTop(AddDarksendTx(keywallet, outpointImported, nDenom, key), 0);
+
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointTop), -1);
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointTop), WalkDarksendRounds(keywallet, outpointTop, 0));
+
+    keywallet.AddKeyPubKey(keyImported, keyImported.GetPubKey());
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointTop), WalkDarksendRounds(keywallet, outpointTop, 0));
+    BOOST_CHECK_EQUAL(keywallet.GetInputDarksendRounds(outpointTop), 9);
+
+    // A key made by the wallet itself leaves what is cached alone
+    keywallet.GetInputDarksendRounds(vOutPoints[10]);
+    BOOST_CHECK(!keywallet.mapDarksendRounds.empty());
+    keywallet.GenerateNewKey();
+    BOOST_CHECK(!keywallet.mapDarksendRounds.empty());
+
+    darkSendDenominations = vDenominationsOld;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_tx_trim)
+{
+    const string strFile = "trim_test.dat";
+    bitdb.RemoveDb(strFile);
+    BOOST_CHECK(bitdb.OpenLogStore(strFile, true));
+
+    CWalletTx wtx;
+    wtx.nOrderPos = 0;
+    wtx.vin.push_back(CTxIn(COutPoint(uint256(1), 0)));
+    wtx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    wtx.vMerkleBranch.assign(12, uint256(2));
+    wtx.vOrderForm.push_back(make_pair(string("Message"), string(100, 'm')));
+    uint256 hash = wtx.GetHash();
+
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        BOOST_CHECK(walletdb.WriteTx(hash, wtx));
+
+        // Nothing goes before the merkle branch was checked
+        BOOST_CHECK(!wtx.TrimSupportingData());
+
+        size_t nUsage = wtx.DynamicMemoryUsage();
+        wtx.fMerkleVerified = true;
+        BOOST_CHECK(wtx.TrimSupportingData());
+        BOOST_CHECK(wtx.vMerkleBranch.empty() && wtx.vOrderForm.empty());
+        BOOST_CHECK(wtx.DynamicMemoryUsage() < nUsage);
+        BOOST_CHECK(wtx.GetHash() == hash);
+
+        // Writing a trimmed transaction keeps the full one on disk
+        wtx.MarkSpent(0);
+        BOOST_CHECK(walletdb.WriteTx(hash, wtx));
+
+        CWalletTx wtxRead;
+        BOOST_CHECK(walletdb.ReadTx(hash, wtxRead));
+        BOOST_CHECK_EQUAL(wtxRead.vMerkleBranch.size(), 12U);
+        BOOST_CHECK_EQUAL(wtxRead.vOrderForm.size(), 1U);
+        BOOST_CHECK(wtxRead.IsSpent(0));
+
+        BOOST_CHECK(wtx.LoadSupportingData(walletdb));
+        BOOST_CHECK(!wtx.fSupportTrimmed);
+        BOOST_CHECK(wtx.vMerkleBranch == wtxRead.vMerkleBranch);
+        BOOST_CHECK(wtx.DynamicMemoryUsage() >= nUsage);
+    }
+
+    BOOST_CHECK(bitdb.RemoveDb(strFile));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_keypool_topup)
+{
+    const string strFile = "keypool_test.dat";
+    bitdb.RemoveDb(strFile);
+    BOOST_CHECK(bitdb.OpenLogStore(strFile, true));
+
+    {
+        CWallet keywallet(strFile);
+
+        // More keys than threads, and more than a batch, so each thread makes some and several batches are written
+        BOOST_CHECK(keywallet.TopUpKeyPool(KEYPOOL_BATCH_SIZE + 10));
+        {
+            LOCK(keywallet.cs_wallet);
+            BOOST_CHECK_EQUAL(keywallet.GetKeyPoolSize(), KEYPOOL_BATCH_SIZE + 11);
+        }
+
+        set<CKeyID> setKeys;
+        keywallet.GetAllReserveKeys(setKeys);
+        BOOST_CHECK_EQUAL(setKeys.size(), KEYPOOL_BATCH_SIZE + 11);
+
+        CPubKey pubkey;
+        BOOST_CHECK(keywallet.GetKeyFromPool(pubkey));
+        BOOST_CHECK(keywallet.HaveKey(pubkey.GetID()));
+        BOOST_CHECK(setKeys.count(pubkey.GetID()));
+    }
+
+    {
+        // Every key made it to disk along with its pool entry
+        CWallet loadwallet;
+        CWalletDB walletdb(strFile, "r+");
+        BOOST_CHECK(walletdb.LoadWallet(&loadwallet) == DB_LOAD_OK);
+
+        LOCK(loadwallet.cs_wallet);
+        BOOST_CHECK_EQUAL(loadwallet.GetKeyPoolSize(), KEYPOOL_BATCH_SIZE + 10);
+    }
+
+    BOOST_CHECK(bitdb.RemoveDb(strFile));
+}
+
+// Gives the tests the master key side of the key store
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+    CryptedKeyMap& GetCryptedKeys() { return mapCryptedKeys; }
+};
+
+BOOST_AUTO_TEST_CASE(wallet_unlock_sample)
+{
+    CTestCryptoKeyStore keystore;
+    vector<CKeyID> vKeyIDs;
+
+    for (int i = 0; i < 40; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKeyPubKey(key, key.GetPubKey());
+    }
+
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE, 1);
+    CKeyingMaterial vWrongKey(WALLET_CRYPTO_KEY_SIZE, 2);
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.LockKeyStore());
+
+    BOOST_FOREACH(const CryptedKeyMap::value_type& item, keystore.GetCryptedKeys())
+        vKeyIDs.push_back(item.first);
+
+    // Swap the secrets of two keys the sample of 16 out of 40 steps over
+    swap(keystore.GetCryptedKeys()[vKeyIDs[1]].second, keystore.GetCryptedKeys()[vKeyIDs[3]].second);
+
+    BOOST_CHECK(!keystore.Unlock(vWrongKey));
+    BOOST_CHECK(keystore.IsLocked());
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+
+    // They are caught when used, the others are fine
+    CKey key;
+    BOOST_CHECK(!keystore.GetKey(vKeyIDs[1], key));
+    BOOST_CHECK(!keystore.GetKey(vKeyIDs[3], key));
+    BOOST_CHECK(keystore.GetKey(vKeyIDs[5], key));
+    BOOST_CHECK(key.GetPubKey().GetID() == vKeyIDs[5]);
+    BOOST_CHECK(keystore.GetKey(vKeyIDs[5], key));
+
+    // A damaged key that falls into the sample fails the unlock
+    BOOST_CHECK(keystore.LockKeyStore());
+    swap(keystore.GetCryptedKeys()[vKeyIDs[0]].second, keystore.GetCryptedKeys()[vKeyIDs[2]].second);
+    BOOST_CHECK(!keystore.Unlock(vMasterKey));
+
+    // Derivation is never calibrated below the minimum
+    SecureString strPassphrase;
+    strPassphrase = "passphrase";
+    vector<unsigned char> vchSalt(WALLET_CRYPTO_SALT_SIZE, 0);
+    BOOST_CHECK(CalibrateDeriveIterations(strPassphrase, vchSalt, 0, 0) == WALLET_MIN_DERIVE_ITERATIONS);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
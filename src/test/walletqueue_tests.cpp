@@ -0,0 +1,132 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(walletqueue_tests)
+
+// Records the transactions it is handed, from whichever thread hands them over
+class CRecordingWallet : public CWalletInterface
+{
+public:
+    boost::mutex mutex;
+    vector<uint256> vHashes;
+    int nSlow; // Calls still to be drawn out, so that others find them under way
+
+    CRecordingWallet() : nSlow(0) { }
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect)
+    {
+        bool fSlow = false;
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+
+            if (nSlow > 0)
+            {
+                nSlow--;
+                fSlow = true;
+            }
+        }
+
+        if (fSlow)
+            MilliSleep(20);
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        vHashes.push_back(tx.GetHash());
+    }
+
+    void EraseFromWallet(const uint256& hash) { }
+    void SetBestChain(const CBlockLocator& locator) { }
+    void UpdatedTransaction(const uint256& hash) { }
+    void Inventory(const uint256& hash) { }
+    void ResendWalletTransactions(bool fForce) { }
+};
+
+static void CheckHandedOver(CRecordingWallet& wallet, const vector<uint256>& vExpected)
+{
+    boost::lock_guard<boost::mutex> lock(wallet.mutex);
+    BOOST_CHECK_EQUAL(wallet.vHashes.size(), vExpected.size());
+    BOOST_CHECK(wallet.vHashes == vExpected);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_queue_order)
+{
+    CRecordingWallet wallet;
+    RegisterWallet(&wallet);
+
+    boost::thread_group threadGroup;
+    StartWalletNotifyThread(threadGroup);
+
+    vector<uint256> vExpected;
+
+    {
+        boost::lock_guard<boost::mutex> lock(wallet.mutex);
+        wallet.nSlow = 5;
+    }
+
+    // Loose transactions and blocks, more than are queued before those queueing hand them over themselves, so that
+    // the wallet thread and this one both take from the queue
+    for (int i = 0; i < (int)MAX_WALLET_QUEUE + 200; i++)
+    {
+        if (i % 100 == 50)
+        {
+            CBlock block;
+
+            for (int j = 0; j < 3; j++)
+            {
+                CTransaction tx;
+                tx.nLockTime = 1000000 + i * 10 + j;
+                block.vtx.push_back(tx);
+                vExpected.push_back(tx.GetHash());
+            }
+
+            SyncBlockWithWallets(block);
+        }
+        else
+        {
+            CTransaction tx;
+            tx.nLockTime = i;
+            SyncWithWallets(tx);
+            vExpected.push_back(tx.GetHash());
+        }
+    }
+
+    // Once the barrier returns, everything queued before it was handed over, in the order it was queued
+    SyncWithWalletQueue();
+    CheckHandedOver(wallet, vExpected);
+
+    // Also when the last one is still being handed over by the wallet thread
+    {
+        boost::lock_guard<boost::mutex> lock(wallet.mutex);
+        wallet.nSlow = 1;
+    }
+
+    CTransaction txLast;
+    txLast.nLockTime = 2000000;
+    SyncWithWallets(txLast);
+    vExpected.push_back(txLast.GetHash());
+    MilliSleep(5);
+
+    SyncWithWalletQueue();
+    CheckHandedOver(wallet, vExpected);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    // Without the thread, notifications are handed over right away
+    FlushWalletNotifications();
+
+    CTransaction txDirect;
+    txDirect.nLockTime = 3000000;
+    SyncWithWallets(txDirect);
+    vExpected.push_back(txDirect.GetHash());
+    CheckHandedOver(wallet, vExpected);
+
+    UnregisterWallet(&wallet);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -422,29 +422,60 @@ bool CTransaction::CheckTransaction() const
 
 bool CTransaction::GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const
 {
-    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
     nCoinAge = 0;
 
     if (IsCoinBase())
         return true;
 
+    MapPrevTx inputs;
+
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
+        if (inputs.count(txin.prevout.hash))
+            continue;
+
         // First try finding the previous transaction in database
         CTransaction txPrev;
         CTxIndex txindex;
 
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        if (txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+            inputs[txin.prevout.hash] = std::make_pair(txindex, txPrev);
+    }
+
+    return GetCoinAge(inputs, nCoinAge);
+}
+
+// The same, for inputs that were already fetched, as ConnectBlock() has them. The time of the block holding each
+// previous transaction comes from the block index, so no block is read. Inputs from the block being connected are
+// younger than nStakeMinAge and do not count, as before when they could not be found in the database yet.
+bool CTransaction::GetCoinAge(const MapPrevTx& inputs, uint64_t& nCoinAge) const
+{
+    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
+    nCoinAge = 0;
+
+    if (IsCoinBase())
+        return true;
+
+    BOOST_FOREACH(const CTxIn& txin, vin)
+    {
+        MapPrevTx::const_iterator mi = inputs.find(txin.prevout.hash);
+
+        if (mi == inputs.end())
             continue;  // Previous transaction not in main chain
+
+        const CTxIndex& txindex = mi->second.first;
+        const CTransaction& txPrev = mi->second.second;
+
+        if (txin.prevout.n >= txPrev.vout.size())
+            continue;
         if (nTime < txPrev.nTime)
             return false;  // Transaction timestamp violation
 
-        // Read block header
-        CBlock block;
+        CBlockIndex* pindex = LookupBlockIndexByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
 
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            return false; // Unable to read block of previous transaction
-        if (block.GetBlockTime() + nStakeMinAge > nTime)
+        if (!pindex)
+            continue;  // Previous transaction not in a block yet
+        if (pindex->GetBlockTime() + nStakeMinAge > nTime)
             continue; // Only count coins meeting min age requirement
 
         int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
@@ -477,27 +508,23 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
 }
 
 // Return transaction in tx. If it was found inside a block, its hash is placed in hashBlock
+// Does not need cs_main: the mempool has its own lock, and the transaction index and block files are only read
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
-    {
-        LOCK(cs_main);
-        {
-            if (mempool.lookup(hash, tx))
-                return true;
-        }
+    if (mempool.lookup(hash, tx))
+        return true;
 
-        CTxDB txdb("r");
-        CTxIndex txindex;
+    CTxDB txdb("r");
+    CTxIndex txindex;
 
-        if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
-        {
-            CBlock block;
+    if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
+    {
+        CBlock block;
 
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
+        if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            hashBlock = block.GetHash();
 
-            return true;
-        }
+        return true;
     }
 
     return false;
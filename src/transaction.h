@@ -218,6 +218,7 @@ public:
 
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: Get transaction coin age
+    bool GetCoinAge(const MapPrevTx& inputs, uint64_t& nCoinAge) const;
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
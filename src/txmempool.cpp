@@ -4,13 +4,271 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
-#include "core.h"
+#include "main.h" // For CTransaction, which txmempool.h needs complete
 #include "txmempool.h"
-#include "main.h" // For CTransaction
 
 using namespace std;
 
-CTxMemPool::CTxMemPool() { }
+// A mapTx node carries three pointers for each of its five ordered indexes
+static const size_t MAPTX_NODE_OVERHEAD = 5 * 3 * sizeof(void*);
+
+size_t GetTxUsage(const CTransaction& tx)
+{
+    size_t nUsage = tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry() :
+    nFee(0), nTxSize(0), nSigOps(0), nTime(0), nHeight(0), nUsageSize(0), dChainInputValue(0), dChainInputHeight(0),
+    nCountWithAncestors(0), nSizeWithAncestors(0), nFeesWithAncestors(0),
+    nCountWithDescendants(0), nSizeWithDescendants(0), nFeesWithDescendants(0) { }
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, unsigned int nTxSizeIn,
+                                 unsigned int nSigOpsIn, int64_t nTimeIn, int nHeightIn) :
+    tx(txIn), nFee(nFeeIn), nTxSize(nTxSizeIn), nSigOps(nSigOpsIn), nTime(nTimeIn), nHeight(nHeightIn),
+    dChainInputValue(0), dChainInputHeight(0)
+{
+    hash = tx.GetHash();
+    vChainInputHeight.assign(tx.vin.size(), -1);
+    nUsageSize = sizeof(CTxMemPoolEntry) + MAPTX_NODE_OVERHEAD + GetTxUsage(tx) +
+                 vChainInputHeight.capacity() * sizeof(int);
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+void CTxMemPoolEntry::AddChainInput(unsigned int nIn, int64_t nValue, int nHeight) const
+{
+    if (nIn >= vChainInputHeight.size() || vChainInputHeight[nIn] >= 0)
+        return;
+
+    vChainInputHeight[nIn] = nHeight;
+    dChainInputValue += nValue;
+    dChainInputHeight += (double)nValue * nHeight;
+}
+
+void CTxMemPoolEntry::RemoveChainInput(unsigned int nIn, int64_t nValue) const
+{
+    if (nIn >= vChainInputHeight.size() || vChainInputHeight[nIn] < 0)
+        return;
+
+    dChainInputValue -= nValue;
+    dChainInputHeight -= (double)nValue * vChainInputHeight[nIn];
+    vChainInputHeight[nIn] = -1;
+}
+
+double CTxMemPoolEntry::GetPriority(int nTipHeight) const
+{
+    // An input confirmed at height h has 1 + nTipHeight - h confirmations
+    if (nTxSize == 0)
+        return 0;
+
+    return (dChainInputValue * (nTipHeight + 1) - dChainInputHeight) / nTxSize;
+}
+
+double CTxMemPoolEntry::GetFeePerKb() const
+{
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K.
+    if (nTxSize == 0)
+        return 0;
+
+    return double(nFee) / (double(nTxSize) / 1000.0);
+}
+
+double CTxMemPoolEntry::GetAncestorFeePerKb() const
+{
+    if (nSizeWithAncestors == 0)
+        return 0;
+
+    return double(nFeesWithAncestors) / (double(nSizeWithAncestors) / 1000.0);
+}
+
+double CTxMemPoolEntry::GetDescendantScore() const
+{
+    if (nSizeWithDescendants == 0)
+        return GetFeePerKb();
+
+    return max(GetFeePerKb(), double(nFeesWithDescendants) / (double(nSizeWithDescendants) / 1000.0));
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nCount, int64_t nSize, int64_t nFees)
+{
+    nCountWithAncestors += nCount;
+    nSizeWithAncestors += nSize;
+    nFeesWithAncestors += nFees;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nCount, int64_t nSize, int64_t nFees)
+{
+    nCountWithDescendants += nCount;
+    nSizeWithDescendants += nSize;
+    nFeesWithDescendants += nFees;
+}
+
+void CBucketStats::Initialize(double dMin, double dMax, double dSpacing)
+{
+    vBuckets.clear();
+
+    for (double dBoundary = dMin; dBoundary <= dMax; dBoundary *= dSpacing)
+        vBuckets.push_back(dBoundary);
+
+    // Everything above dMax
+    vBuckets.push_back(1e99);
+
+    vTxCount.assign(vBuckets.size(), 0);
+    vValueSum.assign(vBuckets.size(), 0);
+    vConfirmed.assign(MAX_BLOCK_CONFIRMS, vector<double>(vBuckets.size(), 0));
+}
+
+void CBucketStats::Record(int nBlocksToConfirm, double dValue)
+{
+    if (nBlocksToConfirm < 1)
+        return;
+
+    unsigned int nBucket = lower_bound(vBuckets.begin(), vBuckets.end(), dValue) - vBuckets.begin();
+
+    vTxCount[nBucket] += 1;
+    vValueSum[nBucket] += dValue;
+
+    for (unsigned int i = nBlocksToConfirm - 1; i < vConfirmed.size(); i++)
+        vConfirmed[i][nBucket] += 1;
+}
+
+void CBucketStats::Decay()
+{
+    for (unsigned int j = 0; j < vBuckets.size(); j++)
+    {
+        vTxCount[j] *= FEE_ESTIMATE_DECAY;
+        vValueSum[j] *= FEE_ESTIMATE_DECAY;
+
+        for (unsigned int i = 0; i < vConfirmed.size(); i++)
+            vConfirmed[i][j] *= FEE_ESTIMATE_DECAY;
+    }
+}
+
+double CBucketStats::Estimate(int nBlocks) const
+{
+    if (nBlocks < 1 || nBlocks > (int)vConfirmed.size())
+        return -1;
+
+    const vector<double>& vConfirmedInTime = vConfirmed[nBlocks - 1];
+    double dTxCount = 0, dConfirmed = 0, dValueSum = 0;
+    double dEstimate = -1;
+
+    // From the highest bucket down, group buckets until there are enough transactions to judge. Stop at
+    // the first group where too many of them took longer than nBlocks.
+    for (int j = vBuckets.size() - 1; j >= 0; j--)
+    {
+        dTxCount += vTxCount[j];
+        dConfirmed += vConfirmedInTime[j];
+        dValueSum += vValueSum[j];
+
+        if (dTxCount < FEE_ESTIMATE_SUFFICIENT_TXS)
+            continue;
+
+        if (dConfirmed / dTxCount < FEE_ESTIMATE_MIN_SUCCESS)
+            break;
+
+        dEstimate = dValueSum / dTxCount;
+        dTxCount = dConfirmed = dValueSum = 0;
+    }
+
+    return dEstimate;
+}
+
+bool CBucketStats::IsValid() const
+{
+    if (vBuckets.empty() || vTxCount.size() != vBuckets.size() || vValueSum.size() != vBuckets.size() ||
+        vConfirmed.size() != MAX_BLOCK_CONFIRMS)
+        return false;
+
+    BOOST_FOREACH(const vector<double>& v, vConfirmed)
+    {
+        if (v.size() != vBuckets.size())
+            return false;
+    }
+
+    return true;
+}
+
+CFeeEstimator::CFeeEstimator() : nBestSeenHeight(0)
+{
+    feeStats.Initialize(MIN_RELAY_TX_FEE, 1e10, 1.1);
+    priStats.Initialize(1e6, 1e16, 2);
+}
+
+void CFeeEstimator::ProcessBlock(int nBlockHeight, const std::vector<const CTxMemPoolEntry*>& vEntries)
+{
+    // Blocks connected again after a reorganization were counted already
+    if (nBlockHeight <= nBestSeenHeight)
+        return;
+
+    nBestSeenHeight = nBlockHeight;
+    feeStats.Decay();
+    priStats.Decay();
+
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, vEntries)
+    {
+        int nBlocksToConfirm = nBlockHeight - pentry->nHeight;
+        double dFeePerKb = pentry->GetFeePerKb();
+
+        // Transactions paying less than the relay fee got in for their priority
+        if (dFeePerKb < MIN_RELAY_TX_FEE)
+            priStats.Record(nBlocksToConfirm, pentry->GetPriority(nBlockHeight - 1));
+        else
+            feeStats.Record(nBlocksToConfirm, dFeePerKb);
+    }
+}
+
+double CFeeEstimator::EstimateFee(int nBlocks) const
+{
+    return feeStats.Estimate(nBlocks);
+}
+
+double CFeeEstimator::EstimatePriority(int nBlocks) const
+{
+    return priStats.Estimate(nBlocks);
+}
+
+void CFeeEstimator::Write(CAutoFile& fileout) const
+{
+    fileout << nBestSeenHeight;
+    fileout << feeStats;
+    fileout << priStats;
+}
+
+void CFeeEstimator::Read(CAutoFile& filein)
+{
+    int nFileBestSeenHeight;
+    CBucketStats fileFeeStats, filePriStats;
+
+    filein >> nFileBestSeenHeight;
+    filein >> fileFeeStats;
+    filein >> filePriStats;
+
+    if (!fileFeeStats.IsValid() || !filePriStats.IsValid())
+        throw runtime_error("CFeeEstimator::Read() : corrupt estimates");
+
+    // A different bucket layout is not an error, the estimates just start over
+    if (fileFeeStats.vBuckets == feeStats.vBuckets && filePriStats.vBuckets == priStats.vBuckets)
+    {
+        nBestSeenHeight = nFileBestSeenHeight;
+        feeStats = fileFeeStats;
+        priStats = filePriStats;
+    }
+}
+
+CTxMemPool::CTxMemPool() : nTransactionsUpdated(0), nTotalTxSize(0), nCachedInnerUsage(0),
+    dRollingMinimumFeeRate(0), nLastRollingFeeUpdate(0), fBlockSinceLastRollingFeeBump(false) { }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
 {
@@ -24,23 +282,220 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPool::CalculateAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    txiter it = mapTx.find(hash);
+
+    if (it == mapTx.end())
+        return;
+
+    vector<uint256> vWork(it->setParents.begin(), it->setParents.end());
+
+    while (!vWork.empty())
+    {
+        uint256 hashParent = vWork.back();
+        vWork.pop_back();
+
+        if (!setAncestors.insert(hashParent).second)
+            continue;
+
+        txiter itParent = mapTx.find(hashParent);
+        vWork.insert(vWork.end(), itParent->setParents.begin(), itParent->setParents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    txiter it = mapTx.find(hash);
+
+    if (it == mapTx.end())
+        return;
+
+    vector<uint256> vWork(it->setChildren.begin(), it->setChildren.end());
+
+    while (!vWork.empty())
+    {
+        uint256 hashChild = vWork.back();
+        vWork.pop_back();
+
+        if (!setDescendants.insert(hashChild).second)
+            continue;
+
+        txiter itChild = mapTx.find(hashChild);
+        vWork.insert(vWork.end(), itChild->setChildren.begin(), itChild->setChildren.end());
+    }
+}
+
+void CTxMemPool::RecalculatePackageState(const uint256& hash)
+{
+    // Recount both package totals of one entry from scratch, for when links change in the middle of a chain
+    txiter it = mapTx.find(hash);
+    set<uint256> setAncestors, setDescendants;
+    CalculateAncestors(hash, setAncestors);
+    CalculateDescendants(hash, setDescendants);
+
+    int64_t nCount = 1, nSize = it->nTxSize, nFees = it->nFee;
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        txiter itAncestor = mapTx.find(hashAncestor);
+        nCount++;
+        nSize += itAncestor->nTxSize;
+        nFees += itAncestor->nFee;
+    }
+
+    mapTx.modify(it, update_ancestor_state(nCount - it->nCountWithAncestors, nSize - it->nSizeWithAncestors,
+                                           nFees - it->nFeesWithAncestors));
+
+    nCount = 1, nSize = it->nTxSize, nFees = it->nFee;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        txiter itDescendant = mapTx.find(hashDescendant);
+        nCount++;
+        nSize += itDescendant->nTxSize;
+        nFees += itDescendant->nFee;
+    }
+
+    mapTx.modify(it, update_descendant_state(nCount - it->nCountWithDescendants, nSize - it->nSizeWithDescendants,
+                                             nFees - it->nFeesWithDescendants));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        pair<txiter, bool> ret = mapTx.insert(entry);
+
+        if (!ret.second)
+            return false;
+
+        txiter newit = ret.first;
+        const CTransaction& tx = newit->tx;
+
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+
+        newit->setParents.clear();
+        newit->setChildren.clear();
+
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            txiter itParent = mapTx.find(txin.prevout.hash);
+
+            if (itParent != mapTx.end())
+            {
+                newit->setParents.insert(txin.prevout.hash);
+                itParent->setChildren.insert(hash);
+            }
+        }
+
+        // Transactions resurrected by a reorganization can already have children in the pool. What those
+        // spend from it is no longer confirmed, so it stops counting towards their priority.
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+
+            if (it != mapNextTx.end())
+            {
+                uint256 hashChild = it->second.ptx->GetHash();
+                txiter itChild = mapTx.find(hashChild);
+                newit->setChildren.insert(hashChild);
+                itChild->setParents.insert(hash);
+                itChild->RemoveChainInput(it->second.n, tx.vout[i].nValue);
+            }
+        }
+
+        set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+
+        if (newit->setChildren.empty())
+        {
+            int64_t nCount = 0, nSize = 0, nFees = 0;
+
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                txiter itAncestor = mapTx.find(hashAncestor);
+                nCount++;
+                nSize += itAncestor->nTxSize;
+                nFees += itAncestor->nFee;
+                mapTx.modify(itAncestor, update_descendant_state(1, newit->nTxSize, newit->nFee));
+            }
+
+            mapTx.modify(newit, update_ancestor_state(nCount, nSize, nFees));
+        }
+        else
+        {
+            set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
 
+            RecalculatePackageState(hash);
+
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                RecalculatePackageState(hashAncestor);
+
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                RecalculatePackageState(hashDescendant);
+        }
+
+        nTotalTxSize += newit->nTxSize;
+        nCachedInnerUsage += newit->nUsageSize;
         nTransactionsUpdated++;
     }
 
     return true;
 }
 
+void CTxMemPool::removeUnchecked(const CTransaction &tx)
+{
+    // Remove a single pooled transaction and keep the package totals of its relatives in step
+    uint256 hash = tx.GetHash();
+    txiter it = mapTx.find(hash);
+
+    set<uint256> setAncestors, setDescendants;
+    CalculateAncestors(hash, setAncestors);
+    CalculateDescendants(hash, setDescendants);
+
+    // Taking a transaction out of the middle of a chain also separates its ancestors from its descendants
+    bool fMiddle = !setAncestors.empty() && !setDescendants.empty();
+
+    if (!fMiddle)
+    {
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            mapTx.modify(mapTx.find(hashAncestor), update_descendant_state(-1, -(int64_t)it->nTxSize, -it->nFee));
+
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            mapTx.modify(mapTx.find(hashDescendant), update_ancestor_state(-1, -(int64_t)it->nTxSize, -it->nFee));
+    }
+
+    BOOST_FOREACH(const uint256& hashParent, it->setParents)
+        mapTx.find(hashParent)->setChildren.erase(hash);
+
+    BOOST_FOREACH(const uint256& hashChild, it->setChildren)
+        mapTx.find(hashChild)->setParents.erase(hash);
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapNextTx.erase(txin.prevout);
+
+    nTotalTxSize -= it->nTxSize;
+    nCachedInnerUsage -= it->nUsageSize;
+
+    // tx may refer to the entry itself, it must not be used from here on
+    mapTx.erase(it);
+
+    if (fMiddle)
+    {
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            RecalculatePackageState(hashAncestor);
+
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            RecalculatePackageState(hashDescendant);
+    }
+
+    nTransactionsUpdated++;
+}
+
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
@@ -61,11 +516,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                 }
             }
 
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            removeUnchecked(tx);
         }
     }
 
@@ -93,11 +544,307 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, int nBlockHeight)
+{
+    // Remove the transactions of a newly connected block. Their outputs are confirmed now,
+    // which counts towards the priority of the pooled transactions spending them.
+    LOCK(cs);
+
+    // How long the pooled ones among them waited goes into the fee estimates
+    vector<const CTxMemPoolEntry*> vEntries;
+
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        txiter it = mapTx.find(tx.GetHash());
+
+        if (it != mapTx.end())
+            vEntries.push_back(&*it);
+    }
+
+    feeEstimator.ProcessBlock(nBlockHeight, vEntries);
+    nLastRollingFeeUpdate = GetTime();
+    fBlockSinceLastRollingFeeBump = true;
+
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        uint256 hash = tx.GetHash();
+
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+
+            if (it != mapNextTx.end())
+                mapTx.find(it->second.ptx->GetHash())->AddChainInput(it->second.n, tx.vout[i].nValue, nBlockHeight);
+        }
+
+        remove(tx);
+    }
+}
+
+int CTxMemPool::TrimToSize(size_t nSizeLimit, std::vector<uint256>* pvRemoved)
+{
+    LOCK(cs);
+    int nRemoved = 0;
+
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        // The package paying the least per byte goes first, taking its descendants along
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        LogPrint("mempool", "TrimToSize : evicting %s and %u descendants (%.0f per kB)\n", it->hash.ToString(),
+                 it->nCountWithDescendants - 1, it->GetDescendantScore());
+
+        // What comes in next has to pay more than what went out
+        TrackPackageRemoved(it->GetDescendantScore() + MIN_RELAY_TX_FEE);
+
+        if (pvRemoved)
+        {
+            set<uint256> setDescendants;
+            CalculateDescendants(it->hash, setDescendants);
+            pvRemoved->push_back(it->hash);
+            pvRemoved->insert(pvRemoved->end(), setDescendants.begin(), setDescendants.end());
+        }
+
+        nRemoved += it->nCountWithDescendants;
+        remove(it->tx, true);
+    }
+
+    return nRemoved;
+}
+
+void CTxMemPool::TrackPackageRemoved(double dFeePerKb)
+{
+    AssertLockHeld(cs);
+
+    if (dFeePerKb > dRollingMinimumFeeRate)
+    {
+        dRollingMinimumFeeRate = dFeePerKb;
+        fBlockSinceLastRollingFeeBump = false;
+    }
+}
+
+double CTxMemPool::GetMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+
+    if (!fBlockSinceLastRollingFeeBump || dRollingMinimumFeeRate == 0)
+        return dRollingMinimumFeeRate;
+
+    int64_t nNow = GetTime();
+
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinimumFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+
+    return max(dRollingMinimumFeeRate, (double)MIN_RELAY_TX_FEE);
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, unsigned int nTxSize, uint64_t nLimitAncestors,
+                                    uint64_t nLimitAncestorSize, uint64_t nLimitDescendants,
+                                    uint64_t nLimitDescendantSize, std::string& strReason) const
+{
+    LOCK(cs);
+    set<uint256> setAncestors;
+    vector<uint256> vWork;
+    uint64_t nCount = 1, nSize = nTxSize;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mapTx.count(txin.prevout.hash))
+            vWork.push_back(txin.prevout.hash);
+    }
+
+    while (!vWork.empty())
+    {
+        uint256 hashAncestor = vWork.back();
+        vWork.pop_back();
+
+        if (!setAncestors.insert(hashAncestor).second)
+            continue;
+
+        txiter it = mapTx.find(hashAncestor);
+        nCount++;
+        nSize += it->nTxSize;
+
+        if (nCount > nLimitAncestors)
+        {
+            strReason = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestors);
+            return false;
+        }
+
+        if (nSize > nLimitAncestorSize)
+        {
+            strReason = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+            return false;
+        }
+
+        if (it->nCountWithDescendants + 1 > nLimitDescendants)
+        {
+            strReason = strprintf("too many descendants for tx %s [limit: %u]", hashAncestor.ToString(),
+                                  nLimitDescendants);
+            return false;
+        }
+
+        if (it->nSizeWithDescendants + nTxSize > nLimitDescendantSize)
+        {
+            strReason = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hashAncestor.ToString(),
+                                  nLimitDescendantSize);
+            return false;
+        }
+
+        vWork.insert(vWork.end(), it->setParents.begin(), it->setParents.end());
+    }
+
+    return true;
+}
+
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    int nRemoved = 0;
+
+    while (!mapTx.empty())
+    {
+        indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+
+        if (it->nTime >= nTime)
+            break;
+
+        LogPrint("mempool", "Expire : removing %s, in the pool since %d\n", it->hash.ToString(), it->nTime);
+
+        nRemoved += it->nCountWithDescendants;
+        remove(it->tx, true);
+    }
+
+    return nRemoved;
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+
+    // Each mapNextTx entry also stands for the parent and child links of at most one pooled parent
+    return nCachedInnerUsage +
+           mapNextTx.size() * (sizeof(std::pair<const COutPoint, CInPoint>) + TREE_NODE_OVERHEAD) +
+           mapNextTx.size() * 2 * (sizeof(uint256) + TREE_NODE_OVERHEAD);
+}
+
+double CTxMemPool::EstimateFee(int nBlocks) const
+{
+    LOCK(cs);
+    return feeEstimator.EstimateFee(nBlocks);
+}
+
+double CTxMemPool::EstimatePriority(int nBlocks) const
+{
+    LOCK(cs);
+    return feeEstimator.EstimatePriority(nBlocks);
+}
+
+bool CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
+{
+    try
+    {
+        LOCK(cs);
+        fileout << CLIENT_VERSION;
+        feeEstimator.Write(fileout);
+    }
+    catch (std::exception &e)
+    {
+        LogPrintf("CTxMemPool::WriteFeeEstimates() : unable to write fee estimates (%s)\n", e.what());
+        return false;
+    }
+
+    return true;
+}
+
+bool CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
+{
+    try
+    {
+        int nVersionThatWrote;
+        filein >> nVersionThatWrote;
+
+        LOCK(cs);
+        feeEstimator.Read(filein);
+    }
+    catch (std::exception &e)
+    {
+        LogPrintf("CTxMemPool::ReadFeeEstimates() : unable to read fee estimates (%s)\n", e.what());
+        return false;
+    }
+
+    return true;
+}
+
+// A transaction always has more ancestors in the pool than any of its parents
+static bool CompareEntryForDump(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)
+{
+    if (a->nCountWithAncestors != b->nCountWithAncestors)
+        return a->nCountWithAncestors < b->nCountWithAncestors;
+
+    return CompareTxMemPoolEntryByEntryTime()(*a, *b);
+}
+
+bool CTxMemPool::Dump(CAutoFile& fileout) const
+{
+    std::vector<CMempoolDumpEntry> vEntries;
+    {
+        LOCK(cs);
+        std::vector<const CTxMemPoolEntry*> vSorted;
+        vSorted.reserve(mapTx.size());
+
+        for (indexed_transaction_set::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+            vSorted.push_back(&*mi);
+
+        std::sort(vSorted.begin(), vSorted.end(), CompareEntryForDump);
+        vEntries.reserve(vSorted.size());
+
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vSorted)
+            vEntries.push_back(CMempoolDumpEntry(pentry->tx, pentry->nTime, pentry->nFee));
+    }
+
+    // The pool is not locked while writing
+    try
+    {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+
+        BOOST_FOREACH(const CMempoolDumpEntry& entry, vEntries)
+            fileout << entry;
+    }
+    catch (std::exception &e)
+    {
+        LogPrintf("CTxMemPool::Dump() : unable to write mempool (%s)\n", e.what());
+        return false;
+    }
+
+    return true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    nTotalTxSize = 0;
+    nCachedInnerUsage = 0;
 
     ++nTransactionsUpdated;
 }
@@ -109,18 +856,221 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     vtxid.reserve(mapTx.size());
 
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->hash);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    txiter i = mapTx.find(hash);
 
     if (i == mapTx.end())
         return false;
 
-    result = i->second;
+    result = i->tx;
+    return true;
+}
+
+CTxOrphanPool::CTxOrphanPool() : nTotalBytes(0), nMaxBytes(DEFAULT_MAX_ORPHAN_TX_SIZE * 1000) { }
+
+void CTxOrphanPool::SetMaxSize(uint64_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+}
+
+void CTxOrphanPool::EraseUnchecked(std::map<uint256, COrphanTx>::iterator it)
+{
+    const uint256& hash = it->first;
+    const COrphanTx& orphan = it->second;
+
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphansByPrev.find(txin.prevout);
+
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+
+        itPrev->second.erase(hash);
+
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    setByExpiry.erase(make_pair(orphan.nTimeExpire, hash));
+
+    map<NodeId, set<pair<int64_t, uint256> > >::iterator itPeer = mapByPeer.find(orphan.nPeer);
+    itPeer->second.erase(make_pair(orphan.nTimeExpire, hash));
+
+    if (itPeer->second.empty())
+    {
+        mapByPeer.erase(itPeer);
+        mapPeerBytes.erase(orphan.nPeer);
+    }
+    else
+        mapPeerBytes[orphan.nPeer] -= orphan.nSize;
+
+    nTotalBytes -= orphan.nSize;
+    mapOrphans.erase(it);
+}
+
+int CTxOrphanPool::EvictFromPeer(NodeId nPeer, uint64_t nLimit)
+{
+    int nEvicted = 0;
+
+    while (mapPeerBytes.count(nPeer) && mapPeerBytes[nPeer] > nLimit)
+    {
+        uint256 hash = mapByPeer[nPeer].begin()->second;
+        EraseUnchecked(mapOrphans.find(hash));
+        nEvicted++;
+    }
+
+    return nEvicted;
+}
+
+bool CTxOrphanPool::Add(const CTransaction& tx, NodeId nPeer, int64_t nNow)
+{
+    uint256 hash = tx.GetHash();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Ignore big transactions, to avoid a send-big-orphans memory exhaustion attack. If a peer has a
+    // legitimate large transaction with a missing parent then we assume it will rebroadcast it later,
+    // after the parent transaction(s) have been mined or received.
+    if (nSize > MAX_ORPHAN_TX_SIZE)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString());
+        return false;
+    }
+
+    LOCK(cs);
+
+    if (mapOrphans.count(hash))
+        return false;
+
+    Expire(nNow);
+
+    COrphanTx& orphan = mapOrphans[hash];
+    orphan.tx = tx;
+    orphan.nPeer = nPeer;
+    orphan.nTimeExpire = nNow + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = nSize;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapOrphansByPrev[txin.prevout].insert(hash);
+
+    setByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
+    mapByPeer[nPeer].insert(make_pair(orphan.nTimeExpire, hash));
+    mapPeerBytes[nPeer] += nSize;
+    nTotalBytes += nSize;
+
+    int nEvicted = EvictFromPeer(nPeer, nMaxBytes / ORPHAN_TX_PEER_SHARE);
+
+    while (nTotalBytes > nMaxBytes)
+    {
+        NodeId nLargest = mapPeerBytes.begin()->first;
+
+        for (map<NodeId, uint64_t>::iterator it = mapPeerBytes.begin(); it != mapPeerBytes.end(); ++it)
+        {
+            if (it->second > mapPeerBytes[nLargest])
+                nLargest = it->first;
+        }
+
+        EraseUnchecked(mapOrphans.find(mapByPeer[nLargest].begin()->second));
+        nEvicted++;
+    }
+
+    if (nEvicted > 0)
+        LogPrint("mempool", "orphan pool full, evicted %d tx\n", nEvicted);
+
+    LogPrint("mempool", "stored orphan tx %s from peer=%d (mapsz %u, %u bytes)\n", hash.ToString(), nPeer,
+             mapOrphans.size(), nTotalBytes);
+
+    return mapOrphans.count(hash) != 0;
+}
+
+bool CTxOrphanPool::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, COrphanTx>::iterator it = mapOrphans.find(hash);
+
+    if (it == mapOrphans.end())
+        return false;
+
+    EraseUnchecked(it);
     return true;
 }
+
+int CTxOrphanPool::Expire(int64_t nNow)
+{
+    LOCK(cs);
+    int nExpired = 0;
+
+    while (!setByExpiry.empty() && setByExpiry.begin()->first <= nNow)
+    {
+        EraseUnchecked(mapOrphans.find(setByExpiry.begin()->second));
+        nExpired++;
+    }
+
+    if (nExpired > 0)
+        LogPrint("mempool", "expired %d orphan tx\n", nExpired);
+
+    return nExpired;
+}
+
+void CTxOrphanPool::GetDependents(const std::vector<uint256>& vParents, std::vector<uint256>& vOrphansRet) const
+{
+    LOCK(cs);
+    set<uint256> setSeen;
+
+    BOOST_FOREACH(const uint256& hashParent, vParents)
+    {
+        // The index is ordered by outpoint, so all outputs of a parent are next to each other
+        for (map<COutPoint, set<uint256> >::const_iterator it = mapOrphansByPrev.lower_bound(COutPoint(hashParent, 0));
+             it != mapOrphansByPrev.end() && it->first.hash == hashParent; ++it)
+        {
+            BOOST_FOREACH(const uint256& hashOrphan, it->second)
+            {
+                if (setSeen.insert(hashOrphan).second)
+                    vOrphansRet.push_back(hashOrphan);
+            }
+        }
+    }
+}
+
+bool CTxOrphanPool::Get(const uint256& hash, CTransaction& txRet) const
+{
+    LOCK(cs);
+    map<uint256, COrphanTx>::const_iterator it = mapOrphans.find(hash);
+
+    if (it == mapOrphans.end())
+        return false;
+
+    txRet = it->second.tx;
+    return true;
+}
+
+bool CTxOrphanPool::exists(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) != 0;
+}
+
+unsigned long CTxOrphanPool::size() const
+{
+    LOCK(cs);
+    return mapOrphans.size();
+}
+
+uint64_t CTxOrphanPool::GetTotalBytes() const
+{
+    LOCK(cs);
+    return nTotalBytes;
+}
+
+uint64_t CTxOrphanPool::GetPeerBytes(NodeId nPeer) const
+{
+    LOCK(cs);
+    map<NodeId, uint64_t>::const_iterator it = mapPeerBytes.find(nPeer);
+    return it == mapPeerBytes.end() ? 0 : it->second;
+}
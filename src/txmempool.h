@@ -8,6 +8,293 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "net.h"
+#include "transaction.h"
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+/** Default for -maxmempool, maximum memory usage of the pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which a transaction that did not confirm is dropped */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -limitancestorcount, most pooled ancestors a transaction may have, counting itself */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, most kilobytes a transaction and its pooled ancestors may add up to */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, most pooled descendants a transaction may have, counting itself */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, most kilobytes a transaction and its pooled descendants may add up to */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Seconds in which the minimum fee raised by evictions halves, once a block has come in since */
+static const int64_t ROLLING_FEE_HALFLIFE = 12 * 60 * 60;
+/** File in the data directory the fee estimates are kept in across restarts */
+static const char FEE_ESTIMATES_FILENAME[] = "fee_estimates.dat";
+/** Fee and priority estimates are made for confirmation within 1 to this many blocks */
+static const unsigned int MAX_BLOCK_CONFIRMS = 25;
+/** Weight each block's observations keep per block that follows */
+static const double FEE_ESTIMATE_DECAY = 0.998;
+/** Share of the transactions in a bucket that must have confirmed in time for the estimate to use it */
+static const double FEE_ESTIMATE_MIN_SUCCESS = 0.85;
+/** Decayed number of transactions a group of buckets needs before it is judged, so that a few outliers
+ *  cannot decide an estimate on their own */
+static const double FEE_ESTIMATE_SUFFICIENT_TXS = 10;
+/** Default for -maxorphantx, maximum size of the orphan transaction pool in kilobytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 5000;
+/** A single peer may fill at most this fraction (1/n) of the orphan pool */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 4;
+/** Larger orphans are not kept, the peer can send them again once their parents are known */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Seconds an orphan is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** File in the data directory the pooled transactions are kept in across restarts */
+static const char MEMPOOL_FILENAME[] = "mempool.dat";
+/** Version of the mempool.dat format */
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Rough heap overhead of a node of a std::map or std::set */
+static const size_t TREE_NODE_OVERHEAD = 4 * sizeof(void*);
+
+/** Estimated heap usage of the inputs and outputs of a transaction */
+size_t GetTxUsage(const CTransaction& tx);
+
+/** A pooled transaction along with data computed once when it entered the pool, so that block templates
+ *  can be assembled without reading its inputs from disk again. The fields marked mutable below are not
+ *  part of any index key; the package totals are, and only change through CTxMemPool::mapTx.modify(). */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    uint256 hash;
+    int64_t nFee;                 // Fee paid by the transaction
+    unsigned int nTxSize;         // Serialized size
+    unsigned int nSigOps;         // Legacy and P2SH sigops
+    int64_t nTime;                // Time the transaction entered the pool
+    int nHeight;                  // Best chain height when it entered the pool
+    size_t nUsageSize;            // Estimated heap usage of the transaction and this entry
+
+    mutable double dChainInputValue;      // Sum of the inputs that spend confirmed outputs
+    mutable double dChainInputHeight;     // The same inputs, each weighted by the height of its block
+    mutable std::vector<int> vChainInputHeight; // Block height of each input counted above, -1 for the others
+    mutable std::set<uint256> setParents; // Pooled transactions that this one spends
+    mutable std::set<uint256> setChildren; // Pooled transactions spending this one
+
+    // This transaction and all its pooled ancestors
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+
+    // This transaction and all its pooled descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, unsigned int nTxSizeIn, unsigned int nSigOpsIn,
+                    int64_t nTimeIn, int nHeightIn);
+
+    // Count input nIn, of nValue, as confirmed at nHeight, or no longer once its parent is back in the pool
+    void AddChainInput(unsigned int nIn, int64_t nValue, int nHeight) const;
+    void RemoveChainInput(unsigned int nIn, int64_t nValue) const;
+
+    // sum(valuein * age) / txsize for a block built on top of nTipHeight
+    double GetPriority(int nTipHeight) const;
+    double GetFeePerKb() const;
+
+    // Fee rate of the transaction together with its unconfirmed ancestors, used to fill blocks
+    double GetAncestorFeePerKb() const;
+
+    // The better of the transaction's own fee rate and that of it with its descendants, used for eviction
+    double GetDescendantScore() const;
+
+    void UpdateAncestorState(int64_t nCount, int64_t nSize, int64_t nFees);
+    void UpdateDescendantState(int64_t nCount, int64_t nSize, int64_t nFees);
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t nCountIn, int64_t nSizeIn, int64_t nFeesIn) :
+        nCount(nCountIn), nSize(nSizeIn), nFees(nFeesIn) { }
+
+    void operator()(CTxMemPoolEntry& entry) { entry.UpdateAncestorState(nCount, nSize, nFees); }
+
+private:
+    int64_t nCount;
+    int64_t nSize;
+    int64_t nFees;
+};
+
+struct update_descendant_state
+{
+    update_descendant_state(int64_t nCountIn, int64_t nSizeIn, int64_t nFeesIn) :
+        nCount(nCountIn), nSize(nSizeIn), nFees(nFeesIn) { }
+
+    void operator()(CTxMemPoolEntry& entry) { entry.UpdateDescendantState(nCount, nSize, nFees); }
+
+private:
+    int64_t nCount;
+    int64_t nSize;
+    int64_t nFees;
+};
+
+// Ties are broken by hash so that every ordering is strict
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = a.GetFeePerKb(), f2 = b.GetFeePerKb();
+        return f1 == f2 ? a.hash < b.hash : f1 < f2;
+    }
+};
+
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.nTime == b.nTime ? a.hash < b.hash : a.nTime < b.nTime;
+    }
+};
+
+// Best package first
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = a.GetAncestorFeePerKb(), f2 = b.GetAncestorFeePerKb();
+        return f1 == f2 ? a.hash < b.hash : f1 > f2;
+    }
+};
+
+// Cheapest package, the first to be evicted, first
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = a.GetDescendantScore(), f2 = b.GetDescendantScore();
+        return f1 == f2 ? a.hash < b.hash : f1 < f2;
+    }
+};
+
+// Index tags
+struct fee_rate {};
+struct entry_time {};
+struct ancestor_score {};
+struct descendant_score {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        // Sorted by txid
+        boost::multi_index::ordered_unique<
+            boost::multi_index::member<CTxMemPoolEntry, uint256, &CTxMemPoolEntry::hash>
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<fee_rate>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByFeeRate
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<entry_time>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByEntryTime
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByAncestorScore
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<descendant_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByDescendantScore
+        >
+    >
+> indexed_transaction_set;
+
+/** Confirmation statistics for one kind of bucket, fee rate or priority. vConfirmed[n][b] counts the
+ *  transactions of bucket b that confirmed within n + 1 blocks of entering the pool. All counts decay by
+ *  FEE_ESTIMATE_DECAY per block, so the estimates follow changes in demand. */
+class CBucketStats
+{
+public:
+    std::vector<double> vBuckets; // Upper bound of each bucket
+    std::vector<double> vTxCount;
+    std::vector<double> vValueSum; // Sum of the fee rates or priorities seen in each bucket
+    std::vector<std::vector<double> > vConfirmed;
+
+    void Initialize(double dMin, double dMax, double dSpacing);
+    void Record(int nBlocksToConfirm, double dValue);
+    void Decay();
+
+    // The lowest value for which at least FEE_ESTIMATE_MIN_SUCCESS of the transactions confirmed within
+    // nBlocks, or -1 if there is not enough data
+    double Estimate(int nBlocks) const;
+
+    // Checks that the stats read from disk match the bucket layout they were written with
+    bool IsValid() const;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vBuckets);
+        READWRITE(vTxCount);
+        READWRITE(vValueSum);
+        READWRITE(vConfirmed);
+    )
+};
+
+/** Tracks how many blocks pooled transactions take to confirm, by fee rate and by priority, from the
+ *  height at which they entered the pool and the height of the block that included them. */
+class CFeeEstimator
+{
+private:
+    CBucketStats feeStats;
+    CBucketStats priStats;
+    int nBestSeenHeight;
+
+public:
+    CFeeEstimator();
+
+    void ProcessBlock(int nBlockHeight, const std::vector<const CTxMemPoolEntry*>& vEntries);
+
+    // Fee per kilobyte, in satoshis, or -1 if not enough is known
+    double EstimateFee(int nBlocks) const;
+    double EstimatePriority(int nBlocks) const;
+
+    void Write(CAutoFile& fileout) const;
+    void Read(CAutoFile& filein);
+};
+
+/** A transaction as written to mempool.dat, with the time it entered the pool and the fee it paid */
+class CMempoolDumpEntry
+{
+public:
+    CTransaction tx;
+    uint64_t nTime;
+    uint64_t nFee;
+
+    CMempoolDumpEntry()
+    {
+        nTime = 0;
+        nFee = 0;
+    }
+
+    CMempoolDumpEntry(const CTransaction& txIn, uint64_t nTimeIn, uint64_t nFeeIn) :
+        tx(txIn), nTime(nTimeIn), nFee(nFeeIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(tx);
+        READWRITE(VARINT(nTime));
+        READWRITE(VARINT(nFee));
+    )
+};
 
 // CTxMemPool stores valid-according-to-the-current-best-chain
 // transactions that may be included in the next block
@@ -16,22 +303,77 @@ class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    CFeeEstimator feeEstimator;
+    uint64_t nTotalTxSize;      // Sum of the serialized sizes of all pooled transactions
+    uint64_t nCachedInnerUsage; // Sum of the entries' nUsageSize
+
+    // Fee per kilobyte new transactions must pay after evictions, see GetMinFee()
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+    mutable bool fBlockSinceLastRollingFeeBump;
+
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void RecalculatePackageState(const uint256& hash);
+    void removeUnchecked(const CTransaction &tx);
+    void TrackPackageRemoved(double dFeePerKb);
 
 public:
+    typedef indexed_transaction_set::iterator txiter;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
+    void removeForBlock(const std::vector<CTransaction>& vtx, int nBlockHeight);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    // Evict the packages with the lowest descendant score until memory usage is at most nSizeLimit bytes.
+    // Returns the number of transactions removed, and appends their hashes to pvRemoved if given.
+    int TrimToSize(size_t nSizeLimit, std::vector<uint256>* pvRemoved = NULL);
+
+    // Whether tx, of nTxSize bytes, can join the pool without it or any of its pooled ancestors going over the
+    // ancestor and descendant limits. The walk stops at the first limit passed, so it costs no more than the
+    // limits allow, however long the chain.
+    bool CheckPackageLimits(const CTransaction& tx, unsigned int nTxSize, uint64_t nLimitAncestors,
+                            uint64_t nLimitAncestorSize, uint64_t nLimitDescendants, uint64_t nLimitDescendantSize,
+                            std::string& strReason) const;
+
+    // Fee per kilobyte a transaction must pay to enter a pool that had to evict others. It starts at what
+    // the evicted packages paid and halves every ROLLING_FEE_HALFLIFE once a block has come in, faster while
+    // the pool is well below nSizeLimit. Zero when nothing was evicted lately.
+    double GetMinFee(size_t nSizeLimit) const;
+
+    // Remove transactions that entered the pool before nTime, along with their descendants.
+    // Returns the number of transactions removed.
+    int Expire(int64_t nTime);
+
+    size_t DynamicMemoryUsage() const;
+
+    // Estimates for confirmation within nBlocks, see CFeeEstimator
+    double EstimateFee(int nBlocks) const;
+    double EstimatePriority(int nBlocks) const;
+    bool WriteFeeEstimates(CAutoFile& fileout) const;
+    bool ReadFeeEstimates(CAutoFile& filein);
+
+    // Write the version, the number of transactions and a CMempoolDumpEntry for each, parents before
+    // their children so that they can be accepted again in file order
+    bool Dump(CAutoFile& fileout) const;
+
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     unsigned long size() const
     {
         LOCK(cs);
@@ -47,4 +389,51 @@ public:
     bool lookup(uint256 hash, CTransaction& result) const;
 };
 
+/** Transactions spending outputs that are not known yet, kept until their parents arrive. The pool is
+ *  limited in bytes, and every peer to a share of it, so that one peer cannot push out the orphans of
+ *  the others. Orphans expire after ORPHAN_TX_EXPIRE_TIME. */
+class CTxOrphanPool
+{
+private:
+    struct COrphanTx
+    {
+        CTransaction tx;
+        NodeId nPeer;
+        int64_t nTimeExpire;
+        unsigned int nSize;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, COrphanTx> mapOrphans;
+    std::map<COutPoint, std::set<uint256> > mapOrphansByPrev;
+    std::set<std::pair<int64_t, uint256> > setByExpiry;
+    std::map<NodeId, std::set<std::pair<int64_t, uint256> > > mapByPeer; // Each peer's orphans, oldest first
+    std::map<NodeId, uint64_t> mapPeerBytes;
+    uint64_t nTotalBytes;
+    uint64_t nMaxBytes;
+
+    void EraseUnchecked(std::map<uint256, COrphanTx>::iterator it);
+    int EvictFromPeer(NodeId nPeer, uint64_t nLimit);
+
+public:
+    CTxOrphanPool();
+
+    void SetMaxSize(uint64_t nMaxBytesIn);
+
+    // Store tx received from nPeer. Expired orphans go first, then the oldest ones of nPeer if it is over
+    // its share, then those of the peer holding the most bytes if the pool is over its size limit.
+    bool Add(const CTransaction& tx, NodeId nPeer, int64_t nNow);
+    bool Erase(const uint256& hash);
+    int Expire(int64_t nNow);
+
+    // Append the hashes of orphans spending outputs of any of vParents, each at most once
+    void GetDependents(const std::vector<uint256>& vParents, std::vector<uint256>& vOrphansRet) const;
+
+    bool Get(const uint256& hash, CTransaction& txRet) const;
+    bool exists(const uint256& hash) const;
+    unsigned long size() const;
+    uint64_t GetTotalBytes() const;
+    uint64_t GetPeerBytes(NodeId nPeer) const;
+};
+
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -34,6 +34,8 @@ using namespace std;
 
 // Settings
 int64_t nTransactionFee = MIN_TX_FEE;
+unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
+int64_t nMaxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
 
@@ -47,15 +49,6 @@ static uint64_t CoinWeightCost(const COutput &out)
     return bnCoinDayWeight.getuint64();
 }
 
-struct CompareValueOnly
-{
-    bool operator()(const pair<int64_t, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<int64_t, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 CPubKey CWallet::GenerateNewKey()
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
@@ -77,7 +70,14 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
+    // A key just made is in no transaction the wallet holds, so the darksend rounds are kept out of reach of
+    // AddKeyPubKey() and put back after
+    map<COutPoint, int> mapRounds;
+    mapRounds.swap(mapDarksendRounds);
+    bool fAdded = AddKeyPubKey(secret, pubkey);
+    mapRounds.swap(mapDarksendRounds);
+
+    if (!fAdded)
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
     return pubkey;
 }
@@ -88,6 +88,9 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
 
+    // Inputs already in the wallet may turn out to be ours, which the darksend rounds follow
+    ClearDarksendRounds();
+
     if (!fFileBacked)
         return true;
 
@@ -101,6 +104,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    {
+        LOCK(cs_wallet);
+        ClearDarksendRounds();
+    }
     if (!fFileBacked)
         return true;
     {
@@ -132,6 +139,10 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        ClearDarksendRounds();
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -209,23 +220,30 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool anonymizeOnly
     CCrypter crypter;
     CKeyingMaterial vMasterKey;
 
+    // Deriving the key from the passphrase is what takes the time, so the wallet is not held meanwhile
+    MasterKeyMap mapMasterKeysCopy;
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(const MasterKeyMap::value_type& pMasterKey, mapMasterKeys)
+        mapMasterKeysCopy = mapMasterKeys;
+    }
+
+    BOOST_FOREACH(const MasterKeyMap::value_type& pMasterKey, mapMasterKeysCopy)
+    {
+        if(!crypter.SetKeyFromPassphrase(strWalletPassphraseFinal, pMasterKey.second.vchSalt,
+           pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod))
+            return false;
+        if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
+            return false;
+
         {
-            if(!crypter.SetKeyFromPassphrase(strWalletPassphraseFinal, pMasterKey.second.vchSalt,
-               pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod))
-                return false;
-            if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
-                return false;
+            LOCK(cs_wallet);
             if (!CCryptoKeyStore::Unlock(vMasterKey))
                 return false;
 
-            break;
+            fWalletUnlockAnonymizeOnly = anonymizeOnly;
         }
 
-        fWalletUnlockAnonymizeOnly = anonymizeOnly;
-        UnlockStealthAddresses(vMasterKey);
+        RequestUnlockWork();
         return true;
     }
     return false;
@@ -255,19 +273,9 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
             if (CCryptoKeyStore::Unlock(vMasterKey) && UnlockStealthAddresses(vMasterKey))
             {
-                int64_t nStartTime = GetTimeMillis();
-                crypter.SetKeyFromPassphrase(strNewWalletPassphrase, pMasterKey.second.vchSalt,
-                                             pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod);
-                pMasterKey.second.nDeriveIterations = pMasterKey.second.nDeriveIterations * (100 / ((double)(GetTimeMillis() - nStartTime)));
-
-                nStartTime = GetTimeMillis();
-                crypter.SetKeyFromPassphrase(strNewWalletPassphrase, pMasterKey.second.vchSalt,
-                                             pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod);
-                pMasterKey.second.nDeriveIterations = (pMasterKey.second.nDeriveIterations + pMasterKey.second.nDeriveIterations *
-                                                       100 / ((double)(GetTimeMillis() - nStartTime))) / 2;
-
-                if (pMasterKey.second.nDeriveIterations < 25000)
-                    pMasterKey.second.nDeriveIterations = 25000;
+                pMasterKey.second.nDeriveIterations = CalibrateDeriveIterations(strNewWalletPassphrase, pMasterKey.second.vchSalt,
+                                                                                pMasterKey.second.nDerivationMethod,
+                                                                                WALLET_DERIVE_TARGET_MS);
 
                 LogPrintf("Wallet passphrase changed to an nDeriveIterations of %i\n", pMasterKey.second.nDeriveIterations);
 
@@ -295,6 +303,17 @@ void CWallet::SetBestChain(const CBlockLocator& loc)
 {
     CWalletDB walletdb(strWalletFile);
     walletdb.WriteBestBlock(loc);
+
+    LOCK2(cs_main, cs_wallet);
+
+    if (fDarksendRoundsDirty)
+    {
+        hashDarksendRoundsTxs = GetWalletTxsHash();
+        walletdb.WriteDarksendRounds(hashDarksendRoundsTxs, mapDarksendRounds);
+        fDarksendRoundsDirty = false;
+    }
+
+    TrimTransactions();
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -356,16 +375,8 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     RAND_bytes(&kMasterKey.vchSalt[0], WALLET_CRYPTO_SALT_SIZE);
 
     CCrypter crypter;
-    int64_t nStartTime = GetTimeMillis();
-    crypter.SetKeyFromPassphrase(strWalletPassphrase, kMasterKey.vchSalt, 25000, kMasterKey.nDerivationMethod);
-    kMasterKey.nDeriveIterations = 2500000 / ((double)(GetTimeMillis() - nStartTime));
-
-    nStartTime = GetTimeMillis();
-    crypter.SetKeyFromPassphrase(strWalletPassphrase, kMasterKey.vchSalt, kMasterKey.nDeriveIterations, kMasterKey.nDerivationMethod);
-    kMasterKey.nDeriveIterations = (kMasterKey.nDeriveIterations + kMasterKey.nDeriveIterations * 100 / ((double)(GetTimeMillis() - nStartTime))) / 2;
-
-    if (kMasterKey.nDeriveIterations < 25000)
-        kMasterKey.nDeriveIterations = 25000;
+    kMasterKey.nDeriveIterations = CalibrateDeriveIterations(strWalletPassphrase, kMasterKey.vchSalt, kMasterKey.nDerivationMethod,
+                                                             WALLET_DERIVE_TARGET_MS);
 
     LogPrintf("Encrypting Wallet with an nDeriveIterations of %i\n", kMasterKey.nDeriveIterations);
 
@@ -512,6 +523,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     LogPrintf("WalletUpdateSpent found spent coin %s BC %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateWalletCoin(txin.prevout.hash, wtx, txin.prevout.n);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -529,6 +541,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                 {
                     wtx.MarkUnspent(&txout - &tx.vout[0]);
                     wtx.WriteToDisk();
+                    UpdateWalletCoin(hash, wtx, &txout - &tx.vout[0]);
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
@@ -561,7 +574,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         if (fInsertedNew)
         {
             wtx.nTimeReceived = GetAdjustedTime();
-            wtx.nOrderPos = IncOrderPosNext();
+            wtx.nOrderPos = IncOrderPosNext(pwalletdbBatch);
+            ClearDarksendRounds();
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -627,6 +641,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                 fUpdated = true;
             }
 
+            // A trimmed branch would always compare as changed
+            if (wtxIn.nIndex != -1)
+                wtx.LoadSupportingData();
+
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
             {
                 wtx.vMerkleBranch = wtxIn.vMerkleBranch;
@@ -651,6 +669,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             if (!wtx.WriteToDisk())
                 return false;
 
+        UpdateWalletCoins(hash, wtx);
+
         if (!fHaveGUI)
         {
             // If default receiving address gets used, replace it with a new one
@@ -665,6 +685,13 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         CPubKey newDefaultKey;
 
+                        // The key pool writes through a handle of its own, which must not wait on the open batch
+                        if (pwalletdbBatch)
+                        {
+                            pwalletdbBatch->TxnCommit();
+                            pwalletdbBatch->TxnBegin();
+                        }
+
                         if (GetKeyFromPool(newDefaultKey))
                         {
                             SetDefaultKey(newDefaultKey);
@@ -743,19 +770,333 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
     AddToWalletIfInvolvingMe(tx, pblock, true);
 }
 
+// The writes for all the transactions of a block go to the wallet file in one DB transaction, rather than being
+// committed one by one
+void CWallet::SyncBlock(const CBlock& block, bool fConnect)
+{
+    if (!fFileBacked)
+    {
+        CWalletInterface::SyncBlock(block, fConnect);
+        return;
+    }
+
+    LOCK(cs_wallet); // pwalletdbBatch
+    CWalletDB walletdb(strWalletFile);
+    bool fBatch = walletdb.TxnBegin();
+    pwalletdbBatch = fBatch ? &walletdb : NULL;
+
+    try
+    {
+        CWalletInterface::SyncBlock(block, fConnect);
+    }
+    catch (...)
+    {
+        pwalletdbBatch = NULL;
+
+        if (fBatch)
+            walletdb.TxnAbort();
+
+        throw;
+    }
+
+    pwalletdbBatch = NULL;
+
+    if (fBatch && !walletdb.TxnCommit())
+        LogPrintf("SyncBlock : failed to commit the wallet writes of block %s\n", block.GetHash().ToString());
+}
+
 void CWallet::EraseFromWallet(const uint256 &hash)
 {
     if (!fFileBacked)
         return;
     {
         LOCK(cs_wallet);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
 
-        if (mapWallet.erase(hash))
+        if (mi != mapWallet.end())
+        {
+            EraseWalletCoins(hash, mi->second);
+            mapWallet.erase(mi);
+            ClearDarksendRounds();
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
 
+int CWalletCoin::GetDepthInMainChain() const
+{
+    if (pindexBlock && pindexBlock->IsInMainChain())
+        return pindexBest->nHeight - pindexBlock->nHeight + 1;
+
+    CBlockIndex* pindex = NULL;
+    int nDepth = pwtx->GetDepthInMainChain(pindex);
+    pindexBlock = nDepth > 0 ? pindex : NULL;
+
+    return nDepth;
+}
+
+// Same as CMerkleTx::GetBlocksToMaturity() > 0, for a depth already known
+bool CWalletCoin::IsImmature(int nDepth) const
+{
+    return (pwtx->IsCoinBase() || pwtx->IsCoinStake()) && nDepth < nCoinbaseMaturity + 1;
+}
+
+// Bring the UTXO index in line with output n of wtx, which must be the copy held in mapWallet
+void CWallet::UpdateWalletCoin(const uint256& hash, const CWalletTx& wtx, unsigned int n)
+{
+    AssertLockHeld(cs_wallet);
+    fStakeWeightDirty = true;
+    fBalancesDirty = true;
+
+    COutPoint outpoint(hash, n);
+    map<COutPoint, CWalletCoin>::iterator mi = mapWalletCoins.find(outpoint);
+
+    if (mi != mapWalletCoins.end())
+    {
+        CWalletCoin& coin = (*mi).second;
+
+        if (!wtx.IsSpent(n))
+        {
+            // The block it is in may have changed
+            coin.pwtx = &wtx;
+            coin.pindexBlock = NULL;
+            return;
+        }
+
+        setWalletCoinsByValue.erase(make_pair(coin.nValue, outpoint));
+        setWalletCoinsByAddress.erase(make_pair(coin.address, outpoint));
+        mapWalletCoins.erase(mi);
+
+        return;
+    }
+
+    if (wtx.IsSpent(n) || !IsMine(wtx.vout[n]))
+        return;
+
+    const CTxOut& txout = wtx.vout[n];
+    CTxDestination address;
+    bool fHasAddress = ExtractDestination(txout.scriptPubKey, address);
+
+    if (!fHasAddress)
+        address = CNoDestination();
+
+    mapWalletCoins.insert(make_pair(outpoint, CWalletCoin(&wtx, n, txout.nValue, IsDenominatedAmount(txout.nValue), address)));
+    setWalletCoinsByValue.insert(make_pair(txout.nValue, outpoint));
+
+    // CNoDestination does not order, so only coins with an address go in here
+    if (fHasAddress)
+        setWalletCoinsByAddress.insert(make_pair(address, outpoint));
+}
+
+void CWallet::UpdateWalletCoins(const uint256& hash, const CWalletTx& wtx)
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        UpdateWalletCoin(hash, wtx, i);
+}
+
+void CWallet::EraseWalletCoins(const uint256& hash, const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    fStakeWeightDirty = true;
+    fBalancesDirty = true;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        COutPoint outpoint(hash, i);
+        map<COutPoint, CWalletCoin>::iterator mi = mapWalletCoins.find(outpoint);
+
+        if (mi == mapWalletCoins.end())
+            continue;
+
+        setWalletCoinsByValue.erase(make_pair((*mi).second.nValue, outpoint));
+        setWalletCoinsByAddress.erase(make_pair((*mi).second.address, outpoint));
+        mapWalletCoins.erase(mi);
+    }
+}
+
+void CWallet::RebuildWalletCoins()
+{
+    AssertLockHeld(cs_wallet);
+
+    mapWalletCoins.clear();
+    setWalletCoinsByValue.clear();
+    setWalletCoinsByAddress.clear();
+    fStakeWeightDirty = true;
+    fBalancesDirty = true;
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateWalletCoins((*it).first, (*it).second);
+}
+
+// Rounds of an output counted from itself, capped at DARKSEND_ROUNDS_LIMIT, or -4/-3 as for GetInputDarksendRounds().
+// Outputs found nDepth rounds back are only followed up to the limit, so what is worked out below one that reaches
+// it is not the whole answer and is not kept.
+int CWallet::CalcDarksendRounds(const COutPoint& outpoint, int nDepth, bool& fExact) const
+{
+    map<COutPoint, int>::const_iterator mi = mapDarksendRounds.find(outpoint);
+
+    if (mi != mapDarksendRounds.end())
+        return (*mi).second;
+
+    if (nDepth >= DARKSEND_ROUNDS_LIMIT)
+    {
+        fExact = false;
+        return DARKSEND_ROUNDS_LIMIT;
+    }
+
+    int nRounds = -1;
+    bool fExactHere = true;
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+
+    if (it != mapWallet.end())
+    {
+        const CWalletTx& wtx = (*it).second;
+        bool fDenominated = false;
+
+        if (outpoint.n >= wtx.vout.size())
+            nRounds = -4;
+        else if (wtx.vout[outpoint.n].nValue == DARKSEND_FEE)
+            nRounds = -3;
+        else
+        {
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                fDenominated = IsDenominatedAmount(txout.nValue);
+
+                if (fDenominated)
+                    break;
+            }
+        }
+
+        // Follow the first of my inputs that did not pay a fee
+        if (fDenominated)
+        {
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            {
+                if (!IsMine(txin))
+                    continue;
+
+                int n = CalcDarksendRounds(txin.prevout, nDepth + 1, fExactHere);
+
+                if (n == -3)
+                    continue;
+
+                nRounds = n == -4 ? n : std::min(n + 1, DARKSEND_ROUNDS_LIMIT);
+                break;
+            }
+        }
+    }
+
+    if (fExactHere || nDepth == 0)
+    {
+        mapDarksendRounds[outpoint] = nRounds;
+        fDarksendRoundsDirty = true;
+    }
+
+    if (!fExactHere)
+        fExact = false;
+
+    return nRounds;
+}
+
+// Recursively determine the rounds of a given output (How deep is the darksend chain for a given input)
+int CWallet::GetInputDarksendRounds(const COutPoint& outpoint, int nRounds) const
+{
+    if (nRounds >= DARKSEND_ROUNDS_LIMIT)
+        return nRounds;
+
+    LOCK(cs_wallet);
+
+    // Make sure the final output is non-denominate
+    if (nRounds == 0)
+    {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+
+        if (it != mapWallet.end() && outpoint.n < (*it).second.vout.size())
+        {
+            int64_t nValue = (*it).second.vout[outpoint.n].nValue;
+
+            if (nValue != DARKSEND_FEE && !IsDenominatedAmount(nValue))
+                return -2;
+        }
+    }
+
+    bool fExact = true;
+    int n = CalcDarksendRounds(outpoint, nRounds, fExact);
+
+    if (n < -1)
+        return n;
+
+    return std::min(nRounds + n, DARKSEND_ROUNDS_LIMIT);
+}
+
+void CWallet::ClearDarksendRounds()
+{
+    AssertLockHeld(cs_wallet);
+
+    if (mapDarksendRounds.empty())
+        return;
+
+    mapDarksendRounds.clear();
+    fDarksendRoundsDirty = true;
+}
+
+// Identifies the set of transactions the saved darksend rounds were worked out from
+uint256 CWallet::GetWalletTxsHash() const
+{
+    AssertLockHeld(cs_wallet);
+    CHashWriter ss(SER_GETHASH, 0);
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        ss << (*it).first;
+
+    return ss.GetHash();
+}
+
+int CWallet::TrimTransactions()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fFileBacked)
+        return 0;
+
+    int nTrimmed = 0;
+
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        CWalletTx& wtx = (*it).second;
+
+        // The depth check verifies the merkle branch first if it was not already
+        if (!wtx.fSupportTrimmed && wtx.GetDepthInMainChain() >= WALLET_TX_TRIM_DEPTH && wtx.TrimSupportingData())
+            nTrimmed++;
+    }
+
+    if (nTrimmed > 0)
+        LogPrint("wallet", "TrimTransactions() : trimmed %d transactions\n", nTrimmed);
+
+    return nTrimmed;
+}
+
+size_t CWallet::GetTxMemoryUsage(int& nTrimmedRet) const
+{
+    AssertLockHeld(cs_wallet);
+
+    size_t nUsage = 0;
+    nTrimmedRet = 0;
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        nUsage += sizeof(*it) + TREE_NODE_OVERHEAD + (*it).second.DynamicMemoryUsage();
+
+        if ((*it).second.fSupportTrimmed)
+            nTrimmedRet++;
+    }
+
+    return nUsage;
+}
+
 
 bool CWallet::IsMine(const CTxIn &txin) const
 {
@@ -1059,9 +1400,73 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 
 bool CWalletTx::WriteToDisk()
 {
+    if (pwallet->pwalletdbBatch)
+        return pwallet->pwalletdbBatch->WriteTx(GetHash(), *this);
+
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Only once the merkle branch was checked against the main chain can it go, the depth is then found from the block
+// index alone. Swapping with empty vectors gives their memory back, which clear() would not.
+bool CWalletTx::TrimSupportingData()
+{
+    if (fSupportTrimmed || !fMerkleVerified)
+        return false;
+
+    std::vector<uint256>().swap(vMerkleBranch);
+    std::vector<CMerkleTx>().swap(vtxPrev);
+    std::vector<std::pair<std::string, std::string> >().swap(vOrderForm);
+    fSupportTrimmed = true;
+
+    return true;
+}
+
+bool CWalletTx::LoadSupportingData(CWalletDB& walletdb)
+{
+    if (!fSupportTrimmed)
+        return true;
+
+    CWalletTx wtxDisk;
+
+    if (!walletdb.ReadTx(GetHash(), wtxDisk))
+        return error("CWalletTx::LoadSupportingData() : could not read %s", GetHash().ToString());
+
+    vMerkleBranch.swap(wtxDisk.vMerkleBranch);
+    vtxPrev.swap(wtxDisk.vtxPrev);
+    vOrderForm.swap(wtxDisk.vOrderForm);
+    fSupportTrimmed = false;
+
+    return true;
+}
+
+bool CWalletTx::LoadSupportingData()
+{
+    if (!fSupportTrimmed)
+        return true;
+
+    CWalletDB walletdb(pwallet->strWalletFile, "r");
+    return LoadSupportingData(walletdb);
+}
+
+size_t CWalletTx::DynamicMemoryUsage() const
+{
+    size_t nUsage = GetTxUsage(*this) + vMerkleBranch.capacity() * sizeof(uint256) +
+                    vtxPrev.capacity() * sizeof(CMerkleTx) + vfSpent.capacity() + strFromAccount.capacity();
+
+    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+        nUsage += GetTxUsage(tx) + tx.vMerkleBranch.capacity() * sizeof(uint256);
+
+    BOOST_FOREACH(const PAIRTYPE(const std::string, std::string)& item, mapValue)
+        nUsage += sizeof(item) + TREE_NODE_OVERHEAD + item.first.capacity() + item.second.capacity();
+
+    nUsage += vOrderForm.capacity() * sizeof(std::pair<std::string, std::string>);
+
+    BOOST_FOREACH(const PAIRTYPE(std::string, std::string)& item, vOrderForm)
+        nUsage += item.first.capacity() + item.second.capacity();
+
+    return nUsage;
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
@@ -1139,6 +1544,7 @@ void CWallet::ReacceptWalletTransactions()
                     if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
                     {
                         wtx.MarkSpent(i);
+                        UpdateWalletCoin(item.first, wtx, i);
                         fUpdated = true;
                         vMissingTx.push_back(txindex.vSpent[i]);
                     }
@@ -1170,6 +1576,9 @@ void CWallet::ReacceptWalletTransactions()
 
 void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
 {
+    if (!LoadSupportingData())
+        return;
+
     BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
     {
         if (!(tx.IsCoinBase() || tx.IsCoinStake()))
@@ -1258,6 +1667,34 @@ void CWallet::ResendWalletTransactions(bool fForce)
     }
 }
 
+CWallet::Balances CWallet::GetCachedBalances() const
+{
+    bool fComputed;
+
+    {
+        LOCK(cs_wallet);
+
+        if (!fBalancesDirty && hashBalancesBlock == GetChainSnapshot()->hashBest)
+            return cachedBalances;
+
+        fComputed = fBalancesComputed;
+    }
+
+    // Only balances that were worked out before can stand in while cs_main is busy
+    CCriticalBlock lockMain(cs_main, "cs_main", __FILE__, __LINE__, fComputed);
+    LOCK(cs_wallet);
+
+    if (lockMain)
+    {
+        cachedBalances = GetBalances();
+        hashBalancesBlock = GetChainSnapshot()->hashBest;
+        fBalancesDirty = false;
+        fBalancesComputed = true;
+    }
+
+    return cachedBalances;
+}
+
 int64_t CWallet::GetBalance() const
 {
     int64_t nTotal = 0;
@@ -1304,7 +1741,7 @@ CWallet::Balances CWallet::GetBalances() const
                     if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin))
                         continue;
 
-                    int rounds = GetInputDarksendRounds(vin);
+                    int rounds = GetInputDarksendRounds(vin.prevout);
 
                     if(rounds >= nDarksendRounds)
                         balances.anonymizedBalance += pcoin->vout[i].nValue;
@@ -1369,7 +1806,7 @@ CAmount CWallet::GetAnonymizedBalance() const
                     if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin))
                         continue;
 
-                    int rounds = GetInputDarksendRounds(vin);
+                    int rounds = GetInputDarksendRounds(vin.prevout);
 
                     if(rounds >= nDarksendRounds)
                         nTotal += pcoin->vout[i].nValue;
@@ -1411,7 +1848,7 @@ double CWallet::GetAverageAnonymizedRounds() const
                     if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin))
                         continue;
 
-                    int rounds = GetInputDarksendRounds(vin);
+                    int rounds = GetInputDarksendRounds(vin.prevout);
                     fTotal += (float)rounds;
                     fCount += 1;
                 }
@@ -1454,7 +1891,7 @@ CAmount CWallet::GetNormalizedAnonymizedBalance() const
                     if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin))
                         continue;
 
-                    int rounds = GetInputDarksendRounds(vin);
+                    int rounds = GetInputDarksendRounds(vin.prevout);
                     nTotal += pcoin->vout[i].nValue * rounds / nDarksendRounds;
                 }
             }
@@ -1554,193 +1991,166 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     {
         LOCK2(cs_main, cs_wallet);
 
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        int64_t nMasternodeCollateral = getMasternodeCollateralForBlock(pindexBest->nHeight);
+
+        // Only our unspent outputs are in the index, in the same order as a walk over mapWallet finds them
+        for (map<COutPoint, CWalletCoin>::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const COutPoint& outpoint = (*it).first;
+            const CWalletCoin& coin = (*it).second;
 
-            if (!IsFinalTx(*pcoin))
+            if (coin.nValue <= 0)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
+            if (coin_type == ONLY_DENOMINATED && !coin.fDenominated)
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            if (coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN)
+            {
+                // Do not use collateral amounts
+                if (coin.fDenominated || IsCollateralAmount(coin.nValue))
+                    continue;
+
+                // Do not use MN funds
+                if (coin_type == ONLY_NONDENOMINATED_NOTMN && coin.nValue == nMasternodeCollateral)
+                    continue;
+            }
+
+            if (IsLockedCoin(outpoint.hash, outpoint.n))
                 continue;
 
-            if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
+            if (coinControl && coinControl->HasSelected() && !coinControl->IsSelected(outpoint.hash, outpoint.n))
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
+            int nDepth = coin.GetDepthInMainChain();
 
+            // Confirmed and final is all IsTrusted() asks of these
             if (nDepth <= 0) // TODO: Coincontrol fix / ignore 0 confirm ?
                 continue;
 
-           /* for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth)); */
-
             // Do not use IX for inputs that have less then 6 blockchain confirmations
             if (useIX && nDepth < 6)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                bool found = false;
-                if(coin_type == ONLY_DENOMINATED)
-                {
-                    //TODO: Should make this a vector
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                }
-                else if(coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN)
-                {
-                    found = true;
-
-                    // Do not use collateral amounts?
-                    if (IsCollateralAmount(pcoin->vout[i].nValue))
-                        continue;
-
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-
-                    if(found && coin_type == ONLY_NONDENOMINATED_NOTMN)
-                        found = pcoin->vout[i].nValue != getMasternodeCollateralForBlock(pindexBest->nHeight); // Do not use MN funds
-                }
-                else
-                    found = true;
-
-                if(!found)
-                    continue;
-
-                //isminetype mine = IsMine(pcoin->vout[i]);
-                bool mine = IsMine(pcoin->vout[i]);
-
-                /* if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
-                if (!(IsSpent(wtxid, i)) && mine && */
+            if (coin.IsImmature(nDepth) || !IsFinalTx(*coin.pwtx))
+                continue;
 
-                if (!(pcoin->IsSpent(i)) && mine && !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth, mine));
-            }
+            vCoins.push_back(COutput(coin.pwtx, outpoint.n, nDepth, true));
         }
     }
 }
 
+// Outputs we cannot sign for were offered here too, but no masternode can be started with those, so this is now
+// the same as AvailableCoins()
 void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl,
                                AvailableCoinsType coin_type, bool useIX) const
+{
+    AvailableCoins(vCoins, fOnlyConfirmed, coinControl, coin_type, useIX);
+}
+
+// Coins come smallest first, dust below -mininput skipped without being looked at
+void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
 
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!IsFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+        set<pair<int64_t, COutPoint> >::const_iterator it =
+            setWalletCoinsByValue.lower_bound(make_pair(nMinimumInputValue, COutPoint(uint256(0), 0)));
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain();
+        for (; it != setWalletCoinsByValue.end(); ++it)
+        {
+            const CWalletCoin& coin = mapWalletCoins.find((*it).second)->second;
 
-            if (nDepth <= 0) // TODO: Coincontrol fix / ignore 0 confirm ?
+            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+            if (coin.pwtx->nTime + nStakeMinAge > nSpendTime)
                 continue;
 
-            /* for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth)); */
+            int nDepth = coin.GetDepthInMainChain();
 
-            // Do not use IX for inputs that have less then 6 blockchain confirmations
-            if (useIX && nDepth < 6)
+            if (nDepth < 1 || coin.IsImmature(nDepth))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                bool found = false;
-                if(coin_type == ONLY_DENOMINATED)
-                {
-                    //TODO: Should make this a vector
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                }
-                else if(coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN)
-                {
-                    found = true;
-
-                    if (IsCollateralAmount(pcoin->vout[i].nValue))
-                        continue; // Do not use collateral amounts
-
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-
-                    if(found && coin_type == ONLY_NONDENOMINATED_NOTMN)
-                        found = (pcoin->vout[i].nValue != getMasternodeCollateralForBlock(pindexBest->nHeight)); // Do not use MN funds
-                }
-                else
-                    found = true;
-
-                if(!found)
-                    continue;
-
-                //isminetype mine = IsMine(pcoin->vout[i]);
-                bool mine = IsMine(pcoin->vout[i]);
-
-                /* if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
-                if (!(IsSpent(wtxid, i)) && mine && */
-
-                if (!(pcoin->IsSpent(i)) && !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth, mine));
-            }
+            vCoins.push_back(COutput(coin.pwtx, coin.n, nDepth, true));
         }
     }
 }
 
-void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
+// Depth first search for coins adding up to between nTargetValue and nTargetValue + nMaxExcess, so that no change
+// output is needed. vValue must be sorted largest first and add up to nTotalLower. A branch is cut as soon as it goes
+// over or cannot reach the target with the coins left, and the search gives up after nMaxTries steps. Of the sets
+// found, the one closest to the target wins.
+static bool SelectCoinsBnB(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower,
+                           int64_t nTargetValue, int64_t nMaxExcess, vector<char>& vfBest, int64_t& nBest,
+                           int nMaxTries = COIN_SELECTION_BNB_TRIES)
 {
-    vCoins.clear();
+    vector<char> vfIncluded(vValue.size(), false);
+    int64_t nBestExcess = nMaxExcess + 1;
+    int64_t nTotal = 0;
+    int64_t nLeft = nTotalLower; // Coins not yet included or left out
+    size_t i = 0;
+
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        bool fBacktrack = false;
+
+        if (nTotal + nLeft < nTargetValue || nTotal > nTargetValue + nMaxExcess)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            if (nTotal - nTargetValue < nBestExcess)
+            {
+                nBestExcess = nTotal - nTargetValue;
+                nBest = nTotal;
+                vfBest = vfIncluded;
 
-    {
-        LOCK2(cs_main, cs_wallet);
+                if (nBestExcess == 0)
+                    break;
+            }
 
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            // Back up to the last coin included and go on without it
+            while (i > 0 && !vfIncluded[i - 1])
+            {
+                i--;
+                nLeft += vValue[i].first;
+            }
 
-            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
-            if (pcoin->nTime + nStakeMinAge > nSpendTime)
-                continue;
+            if (i == 0)
+                break; // Nothing left to try
 
-            if (pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
 
-            int nDepth = pcoin->GetDepthInMainChain();
+            continue;
+        }
 
-            if (nDepth < 1)
-                continue;
+        nLeft -= vValue[i].first;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, nDepth, true));
+        // Taking a coin in place of an equal one just left out only finds sets already tried
+        if (i == 0 || vfIncluded[i - 1] || vValue[i].first != vValue[i - 1].first)
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
         }
+
+        i++;
     }
+
+    return nBestExcess <= nMaxExcess;
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
-                                  vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
+// Random search for the coins adding up closest to nTargetValue, given up on after the iterations or at nDeadline
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower,
+                                  int64_t nTargetValue, vector<char>& vfBest, int64_t& nBest, int64_t nDeadline,
+                                  int iterations = 1000)
 {
     vector<char> vfIncluded;
     vfBest.assign(vValue.size(), true);
@@ -1750,6 +2160,10 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
+        // A pass is a walk over all the coins, so with a large wallet the budget runs out long before the iterations
+        if (nRep > 0 && GetTimeMicros() > nDeadline)
+            break;
+
         vfIncluded.assign(vValue.size(), false);
         int64_t nTotal = 0;
         bool fReachedTarget = false;
@@ -2113,42 +2527,51 @@ bool CWallet::SelectCoinsMinConfByCoinAge(int64_t nTargetValue, unsigned int nSp
     return true;
 }
 
-// TODO: Find appropriate place for this sort function
-// Move denoms down
-bool less_then_denom (const COutput& out1, const COutput& out2)
+struct CompareCoinValueDesc
 {
-    const CWalletTx *pcoin1 = out1.tx;
-    const CWalletTx *pcoin2 = out2.tx;
-    bool found1 = false;
-    bool found2 = false;
-
-    BOOST_FOREACH(int64_t d, darkSendDenominations) // Loop through predefined denoms
+    bool operator()(const COutput& t1, const COutput& t2) const
     {
-        if(pcoin1->vout[out1.i].nValue == d) found1 = true;
-        if(pcoin2->vout[out2.i].nValue == d) found2 = true;
+        return t1.tx->vout[t1.i].nValue > t2.tx->vout[t2.i].nValue;
     }
+};
+
+// Largest first, equal coins in random order. The shuffle serves privacy, as it makes which of equal coins gets
+// spent unpredictable.
+void CWallet::SortCoinsForSelection(vector<COutput>& vCoins)
+{
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    stable_sort(vCoins.begin(), vCoins.end(), CompareCoinValueDesc());
+}
 
-    return (!found1 && found2);
+// What making a change output and spending it later adds in fees, at the rate the wallet pays per kB
+int64_t CWallet::GetChangeCost()
+{
+    return max(nTransactionFee, MIN_TX_FEE) * (CHANGE_OUTPUT_SIZE + CHANGE_SPEND_INPUT_SIZE) / 1000;
 }
 
 bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs,
                                  vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+{
+    SortCoinsForSelection(vCoins);
+
+    return SelectCoinsMinConfSorted(nTargetValue, nSpendTime, nConfMine, nConfTheirs, vCoins, setCoinsRet, nValueRet);
+}
+
+// vCoins as sorted by SortCoinsForSelection(), which callers trying several targets need only do once
+bool CWallet::SelectCoinsMinConfSorted(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs,
+                                       const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet,
+                                       int64_t& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
+    // List of values less than target, largest first as vCoins is
     pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<int64_t>::max();
     coinLowestLarger.second.first = NULL;
     vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
     int64_t nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
-
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++)
     {
@@ -2158,7 +2581,7 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         vValue.clear();
         nTotalLower = 0;
 
-        BOOST_FOREACH(COutput output, vCoins)
+        BOOST_FOREACH(const COutput& output, vCoins)
         {
             const CWalletTx *pcoin = output.tx;
 
@@ -2216,16 +2639,32 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
             return true;
         }
 
-        // Solve subset sum by stochastic approximation
-        sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-
         vector<char> vfBest;
         int64_t nBest;
 
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        // Coins adding up to the target, or to so little more that it can go to the fee, need no change output
+        if (SelectCoinsBnB(vValue, nTotalLower, nTargetValue, GetChangeCost(), vfBest, nBest))
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+            {
+                if (vfBest[i])
+                {
+                    setCoinsRet.insert(vValue[i].second);
+                    nValueRet += vValue[i].first;
+                }
+            }
+
+            LogPrint("selectcoins", "SelectCoins() changeless: %d coins, total %s\n", setCoinsRet.size(), FormatMoney(nBest));
+            return true;
+        }
+
+        // Solve subset sum by stochastic approximation
+        int64_t nDeadline = GetTimeMicros() + COIN_SELECTION_TIME_BUDGET;
+
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nDeadline, 1000);
 
         if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nDeadline, 1000);
 
         // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
         // or the next bigger coin is closer), return the bigger coin
@@ -2266,7 +2705,16 @@ bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pai
 {
     vector<COutput> vCoins;
     AvailableCoins(vCoins, true, coinControl);
+    SortCoinsForSelection(vCoins);
 
+    return SelectCoins(nTargetValue, nSpendTime, vCoins, setCoinsRet, nValueRet, coinControl, coin_type, useIX);
+}
+
+// vCoins as found by AvailableCoins() and sorted by SortCoinsForSelection()
+bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, const vector<COutput>& vCoins,
+                          set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet,
+                          const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
+{
     // If we're doing only denominated, we need to round up to the nearest 1 Swipp
     if(coin_type == ONLY_DENOMINATED)
     {
@@ -2281,7 +2729,7 @@ bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pai
                    nValueRet + out.tx->vout[out.i].nValue < nTargetValue + (0.1*COIN)+100  && added <= 100)
                 {
                         CTxIn vin = CTxIn(out.tx->GetHash(),out.i);
-                        int rounds = GetInputDarksendRounds(vin);
+                        int rounds = GetInputDarksendRounds(vin.prevout);
 
                         // Make sure it's actually anonymized
                         if(rounds < nDarksendRounds)
@@ -2312,13 +2760,16 @@ bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pai
         return (nValueRet >= nTargetValue);
     }
 
-    boost::function<bool (const CWallet*, int64_t, unsigned int, int, int, std::vector<COutput>,
-                    std::set<std::pair<const CWalletTx*,unsigned int> >&, int64_t&)> f =
-        fMinimizeCoinAge ? &CWallet::SelectCoinsMinConfByCoinAge : &CWallet::SelectCoinsMinConf;
+    if (fMinimizeCoinAge)
+    {
+        return (SelectCoinsMinConfByCoinAge(nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
+                SelectCoinsMinConfByCoinAge(nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
+                SelectCoinsMinConfByCoinAge(nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
+    }
 
-    return (f(this, nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
-            f(this, nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            f(this, nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
+    return (SelectCoinsMinConfSorted(nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConfSorted(nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConfSorted(nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
 }
 
 // Select some coins without random shuffle or best subset approximation
@@ -2423,7 +2874,7 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, int64_t nValueMin, int64_t
             // bit 3 - . 1 Swipp+1
 
             CTxIn vin = CTxIn(out.tx->GetHash(),out.i);
-            int rounds = GetInputDarksendRounds(vin);
+            int rounds = GetInputDarksendRounds(vin.prevout);
 
             if(rounds >= nDarksendRoundsMax)
                 continue;
@@ -2508,7 +2959,7 @@ bool CWallet::SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<
         if(nValueRet + out.tx->vout[out.i].nValue <= nValueMax)
         {
             CTxIn vin = CTxIn(out.tx->GetHash(),out.i);
-            int rounds = GetInputDarksendRounds(vin);
+            int rounds = GetInputDarksendRounds(vin.prevout);
 
             if(rounds >= nDarksendRoundsMax)
                 continue;
@@ -2559,39 +3010,17 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
 {
     int64_t nTotal = 0;
     {
-        LOCK(cs_wallet);
-
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-            {
-                int nDepth = pcoin->GetDepthInMainChain();
-
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                {
-                    //isminetype mine = IsMine(pcoin->vout[i]);
-                    bool mine = IsMine(pcoin->vout[i]);
-                    //COutput out = COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO);
-                    COutput out = COutput(pcoin, i, nDepth, mine);
-                    CTxIn vin = CTxIn(out.tx->GetHash(), out.i);
-
-                    if(out.tx->vout[out.i].nValue != nInputAmount)
-                        continue;
-
-                    if(!IsDenominatedAmount(pcoin->vout[i].nValue))
-                        continue;
+        LOCK2(cs_main, cs_wallet);
 
-                    //if(IsSpent(out.tx->GetHash(), i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin))
-                    //    continue;
+        set<pair<int64_t, COutPoint> >::const_iterator it =
+            setWalletCoinsByValue.lower_bound(make_pair(nInputAmount, COutPoint(uint256(0), 0)));
 
-                    if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin))
-                        continue;
+        for (; it != setWalletCoinsByValue.end() && (*it).first == nInputAmount; ++it)
+        {
+            const CWalletCoin& coin = mapWalletCoins.find((*it).second)->second;
 
-                    nTotal++;
-                }
-            }
+            if (coin.fDenominated && coin.pwtx->IsTrusted())
+                nTotal++;
         }
     }
 
@@ -2710,6 +3139,21 @@ bool CWallet::ConvertList(std::vector<CTxIn> vCoins, std::vector<int64_t>& vecAm
 }
 
 
+int64_t CWallet::GetMinimumFee(const CTransaction& tx, unsigned int nTxBytes, unsigned int nConfirmTarget)
+{
+    int64_t nFeeRequired = GetMinFee(tx, 1, GMF_SEND, nTxBytes);
+    int64_t nFeeNeeded = max(nTransactionFee * (1 + (int64_t)nTxBytes / 1000), nFeeRequired);
+
+    // Without enough history the static fees are all there is to go by
+    double dFeePerKb = mempool.EstimateFee(nConfirmTarget);
+
+    if (dFeePerKb > 0)
+        nFeeNeeded = max(nFeeNeeded, (int64_t)min(dFeePerKb * nTxBytes / 1000, (double)MAX_MONEY));
+
+    // A runaway estimate is held to -maxtxfee, but what it takes to be relayed is always paid
+    return max(min(nFeeNeeded, nMaxTxFee), nFeeRequired);
+}
+
 bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey,
                                 int64_t& nFeeRet, int32_t& nChangePos, std::string& strFailReason, const CCoinControl* coinControl,
                                 AvailableCoinsType coin_type, bool useIX)
@@ -2738,11 +3182,17 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
         {
             nFeeRet = nTransactionFee;
 
+            // The coins to choose from are found and sorted once, however many passes the fee takes
+            vector<COutput> vCoins;
+            AvailableCoins(vCoins, true, coinControl);
+            SortCoinsForSelection(vCoins);
+
             while (true)
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
                 wtxNew.fFromMe = true;
+                nChangePos = -1;
 
                 int64_t nTotalValue = nValue + nFeeRet;
                 double dPriority = 0;
@@ -2755,7 +3205,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64_t nValueIn = 0;
 
-                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(nTotalValue, wtxNew.nTime, vCoins, setCoins, nValueIn, coinControl))
                 {
                     if(coin_type == ALL_COINS)
                         strFailReason = _("Insufficient funds.");
@@ -2789,6 +3239,14 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
 
                 int64_t nChange = nValueIn - nValue - nFeeRet;
 
+                // Change not worth spending goes to the fee, which is what lets coin selection settle for a
+                // changeless set of coins adding up to a little more than it was asked for
+                if (nChange > 0 && nChange <= GetChangeCost())
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                }
+
                 if (nChange > 0)
                 {
                     // Fill a vout to ourself
@@ -2831,7 +3289,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                         }
                     }
 
-                    wtxNew.vout.insert(position, CTxOut(nChange, scriptChange));
+                    position = wtxNew.vout.insert(position, CTxOut(nChange, scriptChange));
                     nChangePos = std::distance(wtxNew.vout.begin(), position);
                 }
                 else
@@ -2856,13 +3314,34 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
 
                 dPriority /= nBytes;
 
-                // Check that enough fee is included
-                int64_t nPayFee = nTransactionFee * (1 + (int64_t)nBytes / 1000);
-                int64_t nMinFee = GetMinFee(wtxNew, 1, GMF_SEND, nBytes);
+                // Check that enough fee is included. The size is only known once the coins are chosen. What the
+                // fee for it lacks is taken from the change when that leaves change worth keeping, so the coins
+                // need choosing again only when there is none.
+                int64_t nFeeNeeded = GetMinimumFee(wtxNew, nBytes, nTxConfirmTarget);
+
+                if (nFeeRet < nFeeNeeded && nChangePos >= 0 &&
+                    wtxNew.vout[nChangePos].nValue - (nFeeNeeded - nFeeRet) > GetChangeCost())
+                {
+                    wtxNew.vout[nChangePos].nValue -= nFeeNeeded - nFeeRet;
+                    nFeeRet = nFeeNeeded;
+                    nIn = 0;
+
+                    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                        if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                            return false;
+
+                    // Signatures can come out a byte longer
+                    nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
 
-                if (nFeeRet < max(nPayFee, nMinFee))
+                    if (nBytes >= MAX_STANDARD_TX_SIZE)
+                        return false;
+
+                    nFeeNeeded = GetMinimumFee(wtxNew, nBytes, nTxConfirmTarget);
+                }
+
+                if (nFeeRet < nFeeNeeded)
                 {
-                    nFeeRet = max(nPayFee, nMinFee);
+                    nFeeRet = nFeeNeeded;
                     continue;
                 }
 
@@ -3640,39 +4119,65 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
 uint64_t CWallet::GetStakeWeight() const
 {
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
+    int64_t nCurrentTime = GetTime();
+    bool fComputed;
 
-    if (nBalance <= nReserveBalance)
-        return 0;
+    {
+        LOCK(cs_wallet);
 
-    vector<const CWalletTx*> vwtxPrev;
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    int64_t nValueIn = 0;
+        if (!fStakeWeightDirty && hashStakeWeightBlock == GetChainSnapshot()->hashBest &&
+            nStakeWeightReserve == nReserveBalance && nCurrentTime < nStakeWeightExpires)
+            return nStakeWeightCached;
 
-    if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-        return 0;
+        fComputed = fStakeWeightComputed;
+    }
 
-    if (setCoins.empty())
-        return 0;
+    // Only a weight that was worked out before can stand in while cs_main is busy
+    CCriticalBlock lockMain(cs_main, "cs_main", __FILE__, __LINE__, fComputed);
+    LOCK(cs_wallet);
+
+    if (!lockMain)
+        return nStakeWeightCached;
 
     uint64_t nWeight = 0;
-    int64_t nCurrentTime = GetTime();
-    CTxDB txdb("r");
 
-    LOCK2(cs_main, cs_wallet);
+    // Choose coins to use
+    int64_t nBalance = GetBalance();
 
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    if (nBalance > nReserveBalance)
     {
-        CTxIndex txindex;
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64_t nValueIn = 0;
 
-        if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-            continue;
+        // Selected coins are at least one block deep, so they are known to be in the main chain
+        if (SelectCoinsForStaking(nBalance - nReserveBalance, nCurrentTime, setCoins, nValueIn))
+        {
+            BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+            {
+                if (nCurrentTime - pcoin.first->nTime > nStakeMinAge)
+                    nWeight += pcoin.first->vout[pcoin.second].nValue;
+            }
+        }
+    }
+
+    // The weight can next change without anything else happening when a coin gets old enough to stake
+    int64_t nExpires = std::numeric_limits<int64_t>::max();
+
+    for (map<COutPoint, CWalletCoin>::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
+    {
+        int64_t nMatures = (int64_t)(*it).second.pwtx->nTime + nStakeMinAge + 1;
 
-        if (nCurrentTime - pcoin.first->nTime > nStakeMinAge)
-            nWeight += pcoin.first->vout[pcoin.second].nValue;
+        if (nMatures > nCurrentTime && nMatures < nExpires)
+            nExpires = nMatures;
     }
 
+    nStakeWeightCached = nWeight;
+    hashStakeWeightBlock = GetChainSnapshot()->hashBest;
+    nStakeWeightReserve = nReserveBalance;
+    nStakeWeightExpires = nExpires;
+    fStakeWeightDirty = false;
+    fStakeWeightComputed = true;
+
     return nWeight;
 }
 
@@ -3987,6 +4492,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateWalletCoin(txin.prevout.hash, coin, txin.prevout.n);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -4259,6 +4765,17 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (nLoadWalletRet != DB_LOAD_OK)
         return nLoadWalletRet;
 
+    {
+        LOCK(cs_wallet);
+        RebuildWalletCoins();
+
+        // Saved darksend rounds only hold for the transactions they were worked out from
+        if (!mapDarksendRounds.empty() && hashDarksendRoundsTxs != GetWalletTxsHash())
+            mapDarksendRounds.clear();
+
+        fDarksendRoundsDirty = false;
+    }
+
     fFirstRunRet = !vchDefaultKey.IsValid();
     return DB_LOAD_OK;
 }
@@ -4326,56 +4843,211 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
+        TopUpKeyPool();
+        LogPrintf("CWallet::NewKeyPool wrote %u new keys\n", setKeyPool.size());
+    }
+
+    return true;
+}
 
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i + 1;
+// Makes every nStride-th of the keys from nStart on. Drawing a valid secret and working out its public key, which is
+// what takes the time, does not touch the wallet, so this runs on several threads at once without cs_wallet.
+static void MakeNewKeys(vector<pair<CKey, CPubKey> >* pvKeys, size_t nStart, size_t nStride, bool fCompressed)
+{
+    for (size_t i = nStart; i < pvKeys->size(); i += nStride)
+    {
+        CKey& secret = (*pvKeys)[i].first;
+        secret.MakeNewKey(fCompressed);
+        (*pvKeys)[i].second = secret.GetPubKey();
+    }
+}
+
+// Adds keys made by MakeNewKeys() to the wallet and to the key pool, until it holds nTargetSize keys, all written in
+// one database transaction
+void CWallet::AddKeysToPool(const vector<pair<CKey, CPubKey> >& vKeys, unsigned int nTargetSize)
+{
+    AssertLockHeld(cs_wallet);
+
+    if (vKeys.empty())
+        return;
 
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+    // Compressed public keys were introduced in version 0.6.0
+    if (vKeys[0].first.IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CWalletDB walletdb(strWalletFile);
+
+    if (!walletdb.TxnBegin())
+        throw runtime_error("TopUpKeyPool() : could not begin writing generated keys");
+
+    // AddCryptedKey() writes encrypted keys through pwalletdbEncryption
+    CWalletDB* pwalletdbPrev = pwalletdbEncryption;
+    pwalletdbEncryption = &walletdb;
+
+    int64_t nCreationTime = GetTime();
+    int64_t nIndex = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+    vector<int64_t> vIndexes;
+    bool fWritten = true;
+
+    for (unsigned int i = 0; i < vKeys.size() && setKeyPool.size() + vIndexes.size() < nTargetSize; i++)
+    {
+        const CKey& secret = vKeys[i].first;
+        const CPubKey& pubkey = vKeys[i].second;
+
+        mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
+
+        if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey) ||
+            (!IsCrypted() && !walletdb.WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()])) ||
+            !walletdb.WritePool(nIndex, CKeyPool(pubkey)))
+        {
+            fWritten = false;
+            break;
         }
 
-        LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
+        vIndexes.push_back(nIndex++);
     }
 
-    return true;
+    pwalletdbEncryption = pwalletdbPrev;
+
+    if (!fWritten)
+        walletdb.TxnAbort();
+
+    if (!fWritten || !walletdb.TxnCommit())
+        throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+
+    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+        nTimeFirstKey = nCreationTime;
+
+    setKeyPool.insert(vIndexes.begin(), vIndexes.end());
+
+    if (!vIndexes.empty())
+        LogPrintf("keypool added keys %d to %d, size=%u\n", vIndexes.front(), vIndexes.back(), setKeyPool.size());
 }
 
+// New keys are made a batch at a time, on -keypoolthreads threads, and cs_wallet is only held to write each batch
+// unless the caller holds it already
 bool CWallet::TopUpKeyPool(unsigned int nSize)
 {
+    unsigned int nTargetSize;
+
+    if (nSize > 0)
+        nTargetSize = nSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
+
+    size_t nThreads = max((int64_t)1, GetArg("-keypoolthreads", DEFAULT_KEYPOOL_THREADS));
+
+    while (true)
     {
-        LOCK(cs_wallet);
+        unsigned int nMissing;
+        bool fCompressed;
 
-        if (IsLocked())
-            return false;
+        {
+            LOCK(cs_wallet);
 
-        CWalletDB walletdb(strWalletFile);
+            if (IsLocked())
+                return false;
 
-        // Top up key pool
-        unsigned int nTargetSize;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                return true;
 
-        if (nSize > 0)
-            nTargetSize = nSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
+            nMissing = min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_BATCH_SIZE);
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+        }
+
+        RandAddSeedPerfmon();
+        vector<pair<CKey, CPubKey> > vKeys(nMissing);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
+            // The workers use vKeys, so they must be joined before it goes away
+            boost::this_thread::disable_interruption di;
+            boost::thread_group workers;
+
+            for (size_t i = 1; i < nThreads && i < vKeys.size(); i++)
+                workers.create_thread(boost::bind(&MakeNewKeys, &vKeys, i, nThreads, fCompressed));
+
+            MakeNewKeys(&vKeys, 0, nThreads, fCompressed);
+            workers.join_all();
+        }
 
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
+        {
+            LOCK(cs_wallet);
 
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
+            // The wallet may have been locked while the keys were made
+            if (IsLocked())
+                return false;
 
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            AddKeysToPool(vKeys, nTargetSize + 1);
         }
     }
+}
 
-    return true;
+static CBackgroundWorker workerKeyPoolRefill;
+
+// Have the key pool topped up in the background, or right away if there is no thread to do it
+void CWallet::RequestKeyPoolRefill()
+{
+    if (!workerKeyPoolRefill.Wake())
+        TopUpKeyPool();
+}
+
+static void KeyPoolRefillWork(CWallet* pwallet)
+{
+    // A failed top up is tried again on the next request, it must not take the thread down
+    try
+    {
+        pwallet->TopUpKeyPool();
+    }
+    catch (std::exception& e)
+    {
+        PrintExceptionContinue(&e, "ThreadKeyPoolRefill()");
+    }
+}
+
+// Keeps the key pool of the wallet topped up, so that those taking keys from it only wait when it ran dry.
+// Started through TraceThread, which names the thread.
+void ThreadKeyPoolRefill(CWallet* pwallet)
+{
+    workerKeyPoolRefill.Run(boost::bind(&KeyPoolRefillWork, pwallet), true);
+}
+
+static CBackgroundWorker workerUnlockWork;
+
+// What the wallet only does once unlocked, which is left to the unlock thread when there is one
+void CWallet::ProcessUnlockWork()
+{
+    {
+        LOCK(cs_wallet);
+        CKeyingMaterial vMasterKeyCopy;
+        {
+            LOCK(cs_KeyStore);
+            vMasterKeyCopy = vMasterKey;
+        }
+
+        // Locked again in the meantime
+        if (vMasterKeyCopy.empty())
+            return;
+
+        UnlockStealthAddresses(vMasterKeyCopy);
+    }
+
+    // Messages that came in while the wallet was locked
+    if (this == pwalletMain)
+        SecureMsgWalletUnlocked();
+}
+
+// Have stealth keys and messages that wait for the wallet to be unlocked seen to in the background
+void CWallet::RequestUnlockWork()
+{
+    if (!workerUnlockWork.Wake())
+        ProcessUnlockWork();
+}
+
+// Does the work that waits for the wallet to be unlocked, so that unlocking does not wait for it.
+// Started through TraceThread, which names the thread.
+void ThreadUnlockWork(CWallet* pwallet)
+{
+    workerUnlockWork.Run(boost::bind(&CWallet::ProcessUnlockWork, pwallet));
 }
 
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
@@ -4387,7 +5059,13 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
         LOCK(cs_wallet);
 
         if (!IsLocked())
-            TopUpKeyPool();
+        {
+            // Only a dry pool has to be topped up before going on, the rest can be done in the background
+            if (setKeyPool.empty())
+                TopUpKeyPool(1);
+
+            RequestKeyPoolRefill();
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -4488,45 +5166,32 @@ int64_t CWallet::GetOldestKeyPoolTime()
     return keypool.nTime;
 }
 
+// Addresses whose coins are all spent are left out, which callers reading the map with [] see as a zero balance
 std::map<CTxDestination, int64_t> CWallet::GetAddressBalances()
 {
     map<CTxDestination, int64_t> balances;
 
     {
-        LOCK(cs_wallet);
+        LOCK2(cs_main, cs_wallet);
 
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        for (set<pair<CTxDestination, COutPoint> >::const_iterator it = setWalletCoinsByAddress.begin();
+             it != setWalletCoinsByAddress.end(); ++it)
         {
-            CWalletTx *pcoin = &walletEntry.second;
+            const CWalletCoin& coin = mapWalletCoins.find((*it).second)->second;
+            const CWalletTx *pcoin = coin.pwtx;
 
             if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
                 continue;
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            int nDepth = coin.GetDepthInMainChain();
 
-            int nDepth = pcoin->GetDepthInMainChain();
+            if (coin.IsImmature(nDepth))
+                continue;
 
             if (nDepth < (pcoin->IsFromMe() ? 0 : 1))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
-
-                int64_t n = pcoin->IsSpent(i) ? 0 : pcoin->vout[i].nValue;
-
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-
-                balances[addr] += n;
-            }
+            balances[(*it).first] += coin.nValue;
         }
     }
 
@@ -4675,6 +5340,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateWalletCoin(pcoin->GetHash(), *pcoin, n);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -4689,6 +5355,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateWalletCoin(pcoin->GetHash(), *pcoin, n);
                 }
             }
         }
@@ -4716,6 +5383,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateWalletCoin(txin.prevout.hash, prev, txin.prevout.n);
             }
         }
     }
@@ -24,8 +24,29 @@
 #include "ui_interface.h"
 #include "util.h"
 
+/** Default for -txconfirmtarget, blocks within which sent transactions should confirm */
+static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
+/** Default for -maxtxfee, most the wallet pays in fees for one transaction beyond what relaying requires */
+static const int64_t DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
+/** Steps the search for a changeless set of coins takes before it gives up */
+static const int COIN_SELECTION_BNB_TRIES = 100000;
+/** Time in microseconds the random coin selection may take when no changeless set was found */
+static const int64_t COIN_SELECTION_TIME_BUDGET = 250000;
+/** Serialized size of a change output paying to a key hash */
+static const unsigned int CHANGE_OUTPUT_SIZE = 34;
+/** Serialized size of a signed input spending a key hash output, as spending the change later takes */
+static const unsigned int CHANGE_SPEND_INPUT_SIZE = 148;
+/** Depth from which wallet transactions keep only what is needed in memory, the rest staying on disk */
+static const int WALLET_TX_TRIM_DEPTH = 500;
+/** Keys the key pool is topped up by at a time, each batch written in one database transaction */
+static const unsigned int KEYPOOL_BATCH_SIZE = 1000;
+/** Default for -keypoolthreads, threads new keys for the key pool are made on */
+static const int DEFAULT_KEYPOOL_THREADS = 4;
+
 // Settings
 extern int64_t nTransactionFee;
+extern unsigned int nTxConfirmTarget;
+extern int64_t nMaxTxFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fWalletUnlockStakingOnly;
@@ -93,6 +114,28 @@ public:
     )
 };
 
+// An unspent output of ours, as kept in the wallet's UTXO index. What is costly to work out for every output on every
+// coin selection (ownership, which needs a script parse, and the spent flags of all past transactions) is done once,
+// when the transaction comes in or changes.
+class CWalletCoin
+{
+public:
+    const CWalletTx* pwtx;
+    unsigned int n;
+    int64_t nValue;
+    bool fDenominated;
+    CTxDestination address; // CNoDestination if the script pays no single address
+
+    // The block confirming it, found on first use. Its height gives the depth without a merkle branch check.
+    mutable CBlockIndex* pindexBlock;
+
+    CWalletCoin(const CWalletTx* pwtxIn, unsigned int nIn, int64_t nValueIn, bool fDenominatedIn, const CTxDestination& addressIn) :
+        pwtx(pwtxIn), n(nIn), nValue(nValueIn), fDenominated(fDenominatedIn), address(addressIn), pindexBlock(NULL) { }
+
+    int GetDepthInMainChain() const;
+    bool IsImmature(int nDepth) const;
+};
+
 // A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
 // and provides the ability to create new transactions.
 class CWallet : public CCryptoKeyStore, public CWalletInterface
@@ -109,6 +152,13 @@ private:
                      std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet,
                      const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
 
+    bool SelectCoins(CAmount nTargetValue, unsigned int nSpendTime, const std::vector<COutput>& vCoins,
+                     std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet,
+                     const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
+
+    int CalcDarksendRounds(const COutPoint& outpoint, int nDepth, bool& fExact) const;
+    void AddKeysToPool(const std::vector<std::pair<CKey, CPubKey> >& vKeys, unsigned int nTargetSize);
+
     CWalletDB *pwalletdbEncryption;
     int nWalletVersion; // Current wallet version: clients below this version are not able to load the wallet
     int nWalletMaxVersion; // Maximum wallet format version: specifies to what version this wallet may be upgraded
@@ -144,6 +194,7 @@ public:
     bool fFileBacked;
     bool fWalletUnlockAnonymizeOnly;
     std::string strWalletFile;
+    CWalletDB *pwalletdbBatch; // Open wallet DB transaction the writes of a block go to, while SyncBlock() runs
 
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
@@ -180,10 +231,21 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
         nLastFilteredHeight = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fDarksendRoundsDirty = false;
+        nStakeWeightCached = 0;
+        nStakeWeightReserve = 0;
+        nStakeWeightExpires = 0;
+        fStakeWeightDirty = true;
+        fStakeWeightComputed = false;
+        Balances balancesNull = { 0, 0, 0, 0, 0 };
+        cachedBalances = balancesNull;
+        fBalancesDirty = true;
+        fBalancesComputed = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -195,6 +257,46 @@ public:
     std::set<COutPoint> setLockedCoins;
     int64_t nTimeFirstKey;
 
+    // UTXO index over mapWallet: our unspent outputs by outpoint, by value and by address (those with one only).
+    // Kept up to date as transactions are added, marked spent or erased, and rebuilt when the wallet is loaded.
+    std::map<COutPoint, CWalletCoin> mapWalletCoins;
+    std::set<std::pair<int64_t, COutPoint> > setWalletCoinsByValue;
+    std::set<std::pair<CTxDestination, COutPoint> > setWalletCoinsByAddress;
+
+    void UpdateWalletCoin(const uint256& hash, const CWalletTx& wtx, unsigned int n);
+    void UpdateWalletCoins(const uint256& hash, const CWalletTx& wtx);
+    void EraseWalletCoins(const uint256& hash, const CWalletTx& wtx);
+    void RebuildWalletCoins();
+
+    // Stake weight as GetStakeWeight() last worked it out, a cache rather than a running sum: it is worked out over
+    // all the wallet coins again once the wallet coins, the best block or the reserve balance change, or at
+    // nStakeWeightExpires, when the next coin comes of stake age. It is only worked out again while cs_main is free,
+    // until then the last weight stands. The first time, it waits for cs_main.
+    mutable uint64_t nStakeWeightCached;
+    mutable uint256 hashStakeWeightBlock;
+    mutable int64_t nStakeWeightReserve;
+    mutable int64_t nStakeWeightExpires;
+    mutable bool fStakeWeightDirty;
+    mutable bool fStakeWeightComputed;
+
+    // Darksend rounds of outputs, as GetInputDarksendRounds() works them out, keyed by outpoint. The rounds only
+    // depend on which transactions and keys the wallet holds, so they are dropped whenever a transaction is added
+    // or erased, or a key or script is added that was not just made. They are saved with the wallet along with a
+    // hash of its transaction ids, which tells whether they still hold on load.
+    mutable std::map<COutPoint, int> mapDarksendRounds;
+    mutable bool fDarksendRoundsDirty;
+    uint256 hashDarksendRoundsTxs;
+
+    int GetInputDarksendRounds(const COutPoint& outpoint, int nRounds = 0) const;
+    void ClearDarksendRounds();
+    uint256 GetWalletTxsHash() const;
+
+    // Deep transactions no longer need their merkle branch, supporting transactions or order form in memory, as
+    // their depth is known without them. These are dropped and read back from disk on the rare occasions they are
+    // needed again.
+    int TrimTransactions();
+    size_t GetTxMemoryUsage(int& nTrimmedRet) const;
+
     // Check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
@@ -210,6 +312,13 @@ public:
                             std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet,
                             int64_t& nValueRet) const;
 
+    bool SelectCoinsMinConfSorted(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs,
+                                  const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet,
+                                  int64_t& nValueRet) const;
+
+    static void SortCoinsForSelection(std::vector<COutput>& vCoins);
+    static int64_t GetChangeCost();
+
     bool SelectCoinsMinConfByCoinAge(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs,
                                      std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet,
                                      int64_t& nValueRet) const;
@@ -269,6 +378,7 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
+    void SyncBlock(const CBlock& block, bool fConnect = true);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
@@ -285,6 +395,15 @@ public:
         int64_t stake;
     };
 
+    // Balances as GetBalances() last worked them out, for callers that should not wait for cs_main. They are
+    // worked out again once the wallet coins or the best block changed and cs_main is free. The first time, they
+    // wait for cs_main, so that a wallet with funds is never reported empty.
+    mutable Balances cachedBalances;
+    mutable uint256 hashBalancesBlock;
+    mutable bool fBalancesDirty;
+    mutable bool fBalancesComputed;
+    Balances GetCachedBalances() const;
+
     int64_t GetBalance() const;
     int64_t GetBalanceNoLocks() const;
     Balances GetBalances() const;
@@ -298,6 +417,9 @@ public:
     CAmount GetNormalizedAnonymizedBalance() const;
     CAmount GetDenominatedBalance(bool onlyDenom=true, bool onlyUnconfirmed=false) const;
 
+    // The fee for a transaction of nTxBytes to confirm within nConfirmTarget blocks, and at least -paytxfee
+    static int64_t GetMinimumFee(const CTransaction& tx, unsigned int nTxBytes, unsigned int nConfirmTarget);
+
     bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey,
                            int64_t& nFeeRet, int32_t& nChangePos, std::string& strFailReason, const CCoinControl *coinControl=NULL,
                            AvailableCoinsType coin_type=ALL_COINS, bool useIX=false);
@@ -316,6 +438,8 @@ public:
     bool NewStealthAddress(std::string& sError, std::string& sLabel, CStealthAddress& sxAddr);
     bool AddStealthAddress(CStealthAddress& sxAddr);
     bool UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn);
+    void RequestUnlockWork();
+    void ProcessUnlockWork();
     bool UpdateStealthAddress(std::string &addr, std::string &label, bool addIfNotExist);
     
     bool CreateStealthTransaction(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr,
@@ -336,6 +460,7 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int nSize = 0);
+    void RequestKeyPoolRefill();
     int64_t AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
@@ -574,6 +699,7 @@ public:
     mutable int64_t nCreditCached;
     mutable int64_t nAvailableCreditCached;
     mutable int64_t nChangeCached;
+    bool fSupportTrimmed; // vMerkleBranch, vtxPrev and vOrderForm were dropped, only the copy on disk has them
 
     CWalletTx()
     {
@@ -616,6 +742,7 @@ public:
         nAvailableCreditCached = 0;
         nChangeCached = 0;
         nOrderPos = -1;
+        fSupportTrimmed = false;
     }
 
     IMPLEMENT_SERIALIZE
@@ -906,6 +1033,13 @@ public:
     }
 
     bool WriteToDisk();
+
+    // Only what proves or relays a deep transaction can go from memory. Its inputs and outputs stay, as the wallet,
+    // RPC and GUI code use a CWalletTx as the CTransaction it is, and GetHash() is worked out from them each time.
+    bool TrimSupportingData();
+    bool LoadSupportingData(CWalletDB& walletdb);
+    bool LoadSupportingData();
+    size_t DynamicMemoryUsage() const;
     int64_t GetTxTime() const;
     int GetRequestCount() const;
 
@@ -1094,4 +1228,7 @@ private:
     std::vector<char> _ssExtra;
 };
 
+void ThreadKeyPoolRefill(CWallet* pwallet);
+void ThreadUnlockWork(CWallet* pwallet);
+
 #endif
@@ -34,9 +34,26 @@ bool CWalletDB::EraseName(const string& strAddress)
     return Erase(make_pair(string("name"), strAddress));
 }
 
+bool CWalletDB::ReadTx(uint256 hash, CWalletTx& wtx)
+{
+    return Read(std::make_pair(std::string("tx"), hash), wtx);
+}
+
 bool CWalletDB::WriteTx(uint256 hash, const CWalletTx& wtx)
 {
     nWalletDBUpdated++;
+
+    // The copy on disk keeps what was trimmed from memory
+    if (wtx.fSupportTrimmed)
+    {
+        CWalletTx wtxFull(wtx);
+
+        if (!wtxFull.LoadSupportingData(*this))
+            return false;
+
+        return Write(std::make_pair(std::string("tx"), hash), wtxFull);
+    }
+
     return Write(std::make_pair(std::string("tx"), hash), wtx);
 }
 
@@ -183,6 +200,12 @@ bool CWalletDB::WriteMinVersion(int nVersion)
     return Write(std::string("minversion"), nVersion);
 }
 
+bool CWalletDB::WriteDarksendRounds(const uint256& hashTxs, const std::map<COutPoint, int>& mapRounds)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("dsrounds"), make_pair(hashTxs, mapRounds));
+}
+
 bool CWalletDB::ReadAccount(const string& strAccount, CAccount& account)
 {
     account.SetNull();
@@ -219,9 +242,9 @@ int64_t CWalletDB::GetAccountCreditDebit(const string& strAccount)
 void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountingEntry>& entries)
 {
     bool fAllAccounts = (strAccount == "*");
-    Dbc* pcursor = GetCursor();
+    CDBCursor cursor;
 
-    if (!pcursor)
+    if (!GetCursor(cursor))
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
 
     unsigned int fFlags = DB_SET_RANGE;
@@ -235,14 +258,14 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             ssKey << boost::make_tuple(string("acentry"), (fAllAccounts? string("") : strAccount), uint64_t(0));
 
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        int ret = ReadAtCursor(cursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
 
         if (ret == DB_NOTFOUND)
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            cursor.close();
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -265,7 +288,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    cursor.close();
 }
 
 DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
@@ -630,6 +653,11 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             ssValue >> pwallet->nOrderPosNext;
         }
+        else if (strType == "dsrounds")
+        {
+            ssValue >> pwallet->hashDarksendRoundsTxs;
+            ssValue >> pwallet->mapDarksendRounds;
+        }
         else if (strType == "adrenaline")
         {
             std::string sAlias;
@@ -673,9 +701,9 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor cursor;
 
-        if (!pcursor)
+        if (!GetCursor(cursor))
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
@@ -686,7 +714,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            int ret = ReadAtCursor(cursor, ssKey, ssValue);
 
             if (ret == DB_NOTFOUND)
                 break;
@@ -719,7 +747,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
 
-        pcursor->close();
+        cursor.close();
     }
     catch (boost::thread_interrupted)
     {
@@ -816,10 +844,16 @@ void ThreadFlushWalletDB(const string& strFile)
 
                         int64_t nStart = GetTimeMillis();
 
-                        // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
-                        bitdb.mapFileUseCount.erase(mi++);
+                        // Flush wallet.dat so it's self contained. The log store is self contained already
+                        // and only has its writes synced to disk, all in one go.
+                        if (bitdb.IsLogStore(strFile))
+                            bitdb.SyncLogStore(strFile);
+                        else
+                        {
+                            bitdb.CloseDb(strFile);
+                            bitdb.CheckpointLSN(strFile);
+                            bitdb.mapFileUseCount.erase(mi++);
+                        }
                         LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
                     }
                 }
@@ -828,6 +862,42 @@ void ThreadFlushWalletDB(const string& strFile)
     }
 }
 
+// A log store is a directory, backed up as a copy of that directory
+static bool BackupLogStore(const string& strFile, const string& strDest)
+{
+    filesystem::path pathSrc = bitdb.GetLogStorePath(strFile);
+    filesystem::path pathDest(strDest);
+
+    if (filesystem::is_directory(pathDest))
+        pathDest /= pathSrc.filename();
+
+    try
+    {
+        filesystem::create_directories(pathDest);
+
+        for (filesystem::directory_iterator it(pathSrc); it != filesystem::directory_iterator(); ++it)
+        {
+            if (filesystem::is_regular_file(it->status()) && it->path().filename() != "LOCK")
+            {
+#if BOOST_VERSION >= 104000
+                filesystem::copy_file(it->path(), pathDest / it->path().filename(),
+                                      filesystem::copy_option::overwrite_if_exists);
+#else
+                filesystem::copy_file(it->path(), pathDest / it->path().filename());
+#endif
+            }
+        }
+
+        LogPrintf("copied %s to %s\n", pathSrc.string(), pathDest.string());
+        return true;
+    }
+    catch(const filesystem::filesystem_error &e)
+    {
+        LogPrintf("error copying %s to %s - %s\n", pathSrc.string(), pathDest.string(), e.what());
+        return false;
+    }
+}
+
 bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
@@ -838,11 +908,16 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0)
             {
+                bool fLogStore = bitdb.IsLogStore(wallet.strWalletFile);
+
                 // Flush log data to the dat file
                 bitdb.CloseDb(wallet.strWalletFile);
                 bitdb.CheckpointLSN(wallet.strWalletFile);
                 bitdb.mapFileUseCount.erase(wallet.strWalletFile);
 
+                if (fLogStore)
+                    return BackupLogStore(wallet.strWalletFile, strDest);
+
                 // Copy wallet.dat
                 filesystem::path pathSrc = GetDataDir() / wallet.strWalletFile;
                 filesystem::path pathDest(strDest);
@@ -128,6 +128,7 @@ public:
     bool WriteName(const std::string& strAddress, const std::string& strName);
     bool EraseName(const std::string& strAddress);
 
+    bool ReadTx(uint256 hash, CWalletTx& wtx);
     bool WriteTx(uint256 hash, const CWalletTx& wtx);
     bool EraseTx(uint256 hash);
 
@@ -158,6 +159,8 @@ public:
 
     bool WriteMinVersion(int nVersion);
 
+    bool WriteDarksendRounds(const uint256& hashTxs, const std::map<COutPoint, int>& mapRounds);
+
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
 
@@ -494,6 +494,21 @@ contains(USE_QRCODE, 1) {
     FORMS += src/qt/forms/qrcodedialog.ui
 }
 
+# use: qmake "BITCOIN_QT_TEST=1"
+# builds the Qt unit tests (swipp-qt_test) in place of the wallet
+contains(BITCOIN_QT_TEST, 1) {
+    SOURCES += src/qt/test/test_main.cpp \
+        src/qt/test/uritests.cpp \
+        src/qt/test/transactiontablemodeltests.cpp
+    HEADERS += src/qt/test/uritests.h \
+        src/qt/test/transactiontablemodeltests.h
+    DEPENDPATH += src/qt/test
+    QT += testlib
+    TARGET = swipp-qt_test
+    DEFINES += BITCOIN_QT_TEST
+    macx: CONFIG -= app_bundle
+}
+
 CODECFORTR = UTF-8
 
 # for lrelease/lupdate
@@ -572,7 +587,7 @@ macx:OBJECTIVE_SOURCES += src/qt/macdockiconhandler.mm src/qt/macnotificationhan
 macx:LIBS += -framework Foundation -framework ApplicationServices -framework AppKit -framework CoreServices
 macx:DEFINES += MAC_OSX MSG_NOSIGNAL=0
 macx:ICON = src/qt/res/icons/swipp.icns
-macx:TARGET = "Swipp-Qt"
+macx:!contains(BITCOIN_QT_TEST, 1):TARGET = "Swipp-Qt"
 macx:QMAKE_CFLAGS_THREAD += -pthread
 macx:QMAKE_LFLAGS_THREAD += -pthread
 macx:QMAKE_CXXFLAGS_THREAD += -pthread